@@ -0,0 +1,443 @@
+#ifndef FRAMEDSOCKET_H
+#define FRAMEDSOCKET_H
+
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+
+namespace Common {
+
+enum class DecodeStatus : std::uint8_t {
+	Complete = 0,
+	Incomplete = 1,
+	Malformed = 2
+};
+
+/**
+ * @brief A decoded frame, both views point into the receive buffer
+ *
+ * Only valid for the duration of the callback it is passed to.
+ */
+struct Frame
+{
+	/// The frame as it was received, including codec header and trailer
+	std::string_view mFrame;
+	/// What was passed to the codec when encoding
+	std::string_view mPayload;
+};
+
+/*
+ * Codecs are plain structs with static members, used as template argument so decoding is inlined:
+ *
+ *   static constexpr std::size_t MaxOverhead;       // Bytes added on top of the payload when encoding
+ *   static constexpr std::size_t MaxPayloadSize;
+ *   static DecodeStatus Decode(const char* data, std::size_t len, Frame& frame) noexcept;
+ *   static std::size_t Encode(char* out, const char* payload, std::size_t len) noexcept;
+ *
+ * Decode() looks at the start of @p data only, Encode() writes at most len + MaxOverhead bytes.
+ */
+
+/**
+ * @brief Payload preceded by its length as a big endian @p LengthType
+ */
+template<typename LengthType>
+struct LengthPrefixCodec
+{
+	static_assert(std::is_unsigned_v<LengthType>, "Length prefix has to be an unsigned integer");
+
+	static constexpr std::size_t MaxOverhead = sizeof(LengthType);
+	static constexpr std::size_t MaxPayloadSize = std::numeric_limits<LengthType>::max();
+
+	static DecodeStatus Decode(const char* data, std::size_t len, Frame& frame) noexcept
+	{
+		if(len < sizeof(LengthType))
+		{
+			return DecodeStatus::Incomplete;
+		}
+
+		std::size_t payloadLen = 0;
+		for(std::size_t i = 0; i < sizeof(LengthType); ++i)
+		{
+			payloadLen = (payloadLen << 8) | static_cast<std::uint8_t>(data[i]);
+		}
+
+		if(len - sizeof(LengthType) < payloadLen)
+		{
+			return DecodeStatus::Incomplete;
+		}
+
+		frame.mFrame = std::string_view(data, sizeof(LengthType) + payloadLen);
+		frame.mPayload = std::string_view(data + sizeof(LengthType), payloadLen);
+		return DecodeStatus::Complete;
+	}
+
+	static std::size_t Encode(char* out, const char* payload, std::size_t len) noexcept
+	{
+		for(std::size_t i = 0; i < sizeof(LengthType); ++i)
+		{
+			out[i] = static_cast<char>(len >> (8 * (sizeof(LengthType) - 1 - i)));
+		}
+		std::memcpy(out + sizeof(LengthType), payload, len);
+		return sizeof(LengthType) + len;
+	}
+};
+
+/**
+ * @brief Payload terminated by @p Delimiter, e.g. line based protocols
+ *
+ * The payload itself must not contain the delimiter, this is not checked when encoding.
+ */
+template<char Delimiter>
+struct DelimiterCodec
+{
+	static constexpr std::size_t MaxOverhead = 1;
+	static constexpr std::size_t MaxPayloadSize = std::numeric_limits<std::size_t>::max() - 1;
+
+	static DecodeStatus Decode(const char* data, std::size_t len, Frame& frame) noexcept
+	{
+		const auto end = static_cast<const char*>(std::memchr(data, Delimiter, len));
+		if(end == nullptr)
+		{
+			return DecodeStatus::Incomplete;
+		}
+
+		const std::size_t payloadLen = end - data;
+		frame.mFrame = std::string_view(data, payloadLen + 1);
+		frame.mPayload = std::string_view(data, payloadLen);
+		return DecodeStatus::Complete;
+	}
+
+	static std::size_t Encode(char* out, const char* payload, std::size_t len) noexcept
+	{
+		std::memcpy(out, payload, len);
+		out[len] = Delimiter;
+		return len + 1;
+	}
+};
+
+/**
+ * @brief Splits a byte stream into frames
+ *
+ * Frames that are completely contained in the data passed to Feed() are delivered as views into that data
+ * without copying, only a trailing partial frame is copied into the internal buffer.
+ */
+template<typename Codec>
+class FrameReader
+{
+public:
+	static constexpr std::size_t DefaultMaxFrameSize = 16 * 1024 * 1024;
+
+	/**
+	 * @brief Limit how much is buffered for a single incomplete frame
+	 */
+	void SetMaxFrameSize(std::size_t size) noexcept
+	{
+		mMaxFrameSize = size;
+	}
+
+	/**
+	 * @brief Decode all complete frames in the buffered and new data
+	 *
+	 * @p onFrame is called as bool(const Frame&), returning false stops decoding and drops the remaining data.
+	 *
+	 * @return Malformed when the codec rejected the data or a frame exceeds the maximum frame size.
+	 */
+	template<typename Callback>
+	DecodeStatus Feed(const char* data, std::size_t len, Callback&& onFrame)
+	{
+		if(mBuffer.empty())
+		{
+			const auto consumed = DecodeFrames(data, len, onFrame);
+			if(consumed.second != DecodeStatus::Incomplete)
+			{
+				return consumed.second;
+			}
+			mBuffer.assign(data + consumed.first, data + len);
+		}
+		else
+		{
+			mBuffer.insert(std::end(mBuffer), data, data + len);
+			const auto consumed = DecodeFrames(mBuffer.data(), mBuffer.size(), onFrame);
+			if(consumed.second != DecodeStatus::Incomplete)
+			{
+				mBuffer.clear();
+				return consumed.second;
+			}
+			mBuffer.erase(std::begin(mBuffer), std::begin(mBuffer) + consumed.first);
+		}
+
+		if(mBuffer.size() > mMaxFrameSize)
+		{
+			mBuffer.clear();
+			return DecodeStatus::Malformed;
+		}
+		return DecodeStatus::Incomplete;
+	}
+
+	std::size_t GetBufferedSize() const noexcept
+	{
+		return mBuffer.size();
+	}
+
+	void Clear() noexcept
+	{
+		mBuffer.clear();
+	}
+
+private:
+	/**
+	 * @return Bytes consumed by complete frames, and Incomplete when the rest has to be buffered.
+	 */
+	template<typename Callback>
+	std::pair<std::size_t, DecodeStatus> DecodeFrames(const char* data, std::size_t len, Callback& onFrame)
+	{
+		std::size_t offset = 0;
+		Frame frame;
+		while(offset < len)
+		{
+			const auto status = Codec::Decode(data + offset, len - offset, frame);
+			if(status != DecodeStatus::Complete)
+			{
+				return {offset, status};
+			}
+			offset += frame.mFrame.size();
+			if(!onFrame(static_cast<const Frame&>(frame)))
+			{
+				return {offset, DecodeStatus::Complete};
+			}
+		}
+		return {offset, DecodeStatus::Incomplete};
+	}
+
+	std::vector<char> mBuffer;
+	std::size_t mMaxFrameSize = DefaultMaxFrameSize;
+};
+
+/**
+ * @brief Encodes outgoing frames back to back so they can be written with a single send
+ */
+template<typename Codec>
+class FrameWriter
+{
+public:
+	bool Append(const char* payload, std::size_t len)
+	{
+		if(len > Codec::MaxPayloadSize)
+		{
+			return false;
+		}
+
+		const std::size_t offset = mBuffer.size();
+		mBuffer.resize(offset + len + Codec::MaxOverhead);
+		mBuffer.resize(offset + Codec::Encode(mBuffer.data() + offset, payload, len));
+		return true;
+	}
+
+	bool Append(std::string_view payload)
+	{
+		return Append(payload.data(), payload.size());
+	}
+
+	/**
+	 * @brief Write everything appended so far to @p socket
+	 */
+	void Flush(StreamSocket& socket) noexcept
+	{
+		if(!mBuffer.empty())
+		{
+			socket.Send(mBuffer.data(), mBuffer.size());
+			mBuffer.clear();
+		}
+	}
+
+	void Clear() noexcept
+	{
+		mBuffer.clear();
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return mBuffer.empty();
+	}
+
+	std::size_t GetSize() const noexcept
+	{
+		return mBuffer.size();
+	}
+
+private:
+	std::vector<char> mBuffer;
+};
+
+template<typename Codec>
+class FramedSocket;
+
+template<typename Codec>
+class IFramedSocketHandler
+{
+public:
+	virtual void OnConnected() = 0;
+	virtual void OnDisconnect(FramedSocket<Codec>* conn) = 0;
+	virtual void OnIncomingFrame(FramedSocket<Codec>* conn, const Frame& frame) = 0;
+	virtual ~IFramedSocketHandler() {}
+};
+
+/**
+ * @brief StreamSocket delivering whole frames, e.g. FramedSocket<LengthPrefixCodec<uint32_t>>
+ *
+ * Frames passed to Send() are encoded into a send buffer that is written once per batch: after all frames of
+ * an incoming read have been handled, or on the next loop cycle when sending from elsewhere.
+ * Call Flush() to write immediately.
+ *
+ * Server side connections are owned by StreamSocketServer, use FrameReader and FrameWriter per connection there.
+ */
+template<typename Codec>
+class FramedSocket : public IStreamSocketHandler
+{
+public:
+	FramedSocket(EventLoop::EventLoop& ev, IFramedSocketHandler<Codec>* handler, const SocketOptions& options = {})
+		: mEventLoop(ev)
+		, mSocket(ev, this, options)
+		, mHandler(handler)
+		, mAlive(std::make_shared<bool>(true))
+	{
+		mLogger = spdlog::get("FramedSocket");
+		if(mLogger == nullptr)
+		{
+			auto framedSocketLogger = spdlog::stdout_color_mt("FramedSocket");
+			mLogger = spdlog::get("FramedSocket");
+		}
+	}
+
+	void Connect(const char* addr, const uint16_t port) noexcept
+	{
+		mReader.Clear();
+		mSocket.Connect(addr, port);
+	}
+
+	void ConnectUnix(const std::string& path) noexcept
+	{
+		mReader.Clear();
+		mSocket.ConnectUnix(path);
+	}
+
+	/**
+	 * @brief Queue a frame, it is written with the rest of the current batch
+	 */
+	bool Send(const char* payload, const size_t len) noexcept
+	{
+		if(!mWriter.Append(payload, len))
+		{
+			mLogger->error("Frame of {} bytes exceeds the maximum payload size of the codec", len);
+			return false;
+		}
+
+		if(!mInReceive && !mFlushScheduled)
+		{
+			mFlushScheduled = true;
+			std::weak_ptr<bool> alive = mAlive;
+			mEventLoop.SheduleForNextCycle([this, alive](){
+				if(!alive.expired())
+				{
+					mFlushScheduled = false;
+					Flush();
+				}
+			});
+		}
+		return true;
+	}
+
+	bool Send(std::string_view payload) noexcept
+	{
+		return Send(payload.data(), payload.size());
+	}
+
+	void Flush() noexcept
+	{
+		mWriter.Flush(mSocket);
+	}
+
+	void Shutdown() noexcept
+	{
+		mSocket.Shutdown();
+		mReader.Clear();
+		mWriter.Clear();
+	}
+
+	void SetMaxFrameSize(std::size_t size) noexcept
+	{
+		mReader.SetMaxFrameSize(size);
+	}
+
+	/**
+	 * @brief The underlying socket, for options and TLS
+	 */
+	StreamSocket& GetSocket() noexcept
+	{
+		return mSocket;
+	}
+
+	bool IsConnected() noexcept
+	{
+		return mSocket.IsConnected();
+	}
+
+private:
+	void OnConnected() final
+	{
+		mHandler->OnConnected();
+	}
+
+	void OnDisconnect(StreamSocket* /*conn*/) final
+	{
+		mReader.Clear();
+		mWriter.Clear();
+		mHandler->OnDisconnect(this);
+	}
+
+	void OnIncomingData(StreamSocket* /*conn*/, char* data, size_t len) final
+	{
+		mInReceive = true;
+		const auto status = mReader.Feed(data, len, [this](const Frame& frame) {
+			mHandler->OnIncomingFrame(this, frame);
+			return mSocket.IsConnected();
+		});
+		mInReceive = false;
+
+		if(status == DecodeStatus::Malformed)
+		{
+			mLogger->error("Received malformed frame, closing connection");
+			Shutdown();
+			mHandler->OnDisconnect(this);
+			return;
+		}
+
+		if(mSocket.IsConnected())
+		{
+			Flush();
+		}
+	}
+
+	EventLoop::EventLoop& mEventLoop;
+	StreamSocket mSocket;
+	IFramedSocketHandler<Codec>* mHandler;
+
+	FrameReader<Codec> mReader;
+	FrameWriter<Codec> mWriter;
+	bool mInReceive = false;
+	bool mFlushScheduled = false;
+	std::shared_ptr<bool> mAlive;
+
+	std::shared_ptr<spdlog::logger> mLogger;
+};
+
+} // namespace Common
+
+#endif // FRAMEDSOCKET_H
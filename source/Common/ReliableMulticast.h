@@ -0,0 +1,658 @@
+#ifndef RELIABLEMULTICAST_H
+#define RELIABLEMULTICAST_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <endian.h>
+
+#include "EventLoop.h"
+#include "UDPSocket.h"
+
+namespace Common {
+
+/**
+ * NACK based reliable multicast, for one sender per group and port.
+ *
+ * The sender numbers every message and keeps the last messages in a retransmit ring. Receivers deliver in
+ * sequence order, detect gaps from the sequence numbers and from heartbeats the sender multicasts while idle,
+ * and ask for the missing range with a NACK sent by unicast to the sender. Repairs are multicast, so every
+ * receiver that missed the same message gets it from one retransmission. Messages that dropped out of the ring
+ * are reported as lost and skipped.
+ *
+ * Every datagram starts with a type byte and 7 bytes padding, followed by big endian 64 bit fields:
+ * - Data: sequence, then the message
+ * - Heartbeat: first sequence still in the ring, last sequence sent
+ * - Nack: first missing sequence, count
+ */
+namespace ReliableMulticastProtocol {
+
+enum class Type : uint8_t
+{
+	Data = 1,
+	Heartbeat = 2,
+	Nack = 3
+};
+
+constexpr std::size_t HeaderSize = 16;
+constexpr std::size_t ControlSize = 24;
+/// Fits a single frame on a 1500 byte MTU
+constexpr std::size_t MaxDatagramSize = 1472;
+constexpr std::size_t MaxMessageSize = MaxDatagramSize - HeaderSize;
+
+inline void WriteField(char* out, uint64_t value) noexcept
+{
+	value = htobe64(value);
+	std::memcpy(out, &value, sizeof(value));
+}
+
+inline uint64_t ReadField(const char* in) noexcept
+{
+	uint64_t value;
+	std::memcpy(&value, in, sizeof(value));
+	return be64toh(value);
+}
+
+inline void WriteHeader(char* out, Type type, uint64_t first) noexcept
+{
+	std::memset(out, 0, 8);
+	out[0] = static_cast<char>(type);
+	WriteField(out + 8, first);
+}
+
+inline void WriteControl(char* out, Type type, uint64_t first, uint64_t second) noexcept
+{
+	WriteHeader(out, type, first);
+	WriteField(out + 16, second);
+}
+
+inline std::size_t RoundUpToPowerOfTwo(std::size_t value) noexcept
+{
+	std::size_t result = 1;
+	while(result < value)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+} // namespace ReliableMulticastProtocol
+
+class ReliableMulticastSender : public IUDPSocketHandler
+{
+public:
+	static constexpr std::size_t DefaultHistory = 4096;
+
+	/**
+	 * @brief Send to @p group on @p port, keeping the last @p history messages for retransmission
+	 *
+	 * @p history is rounded up to a power of two.
+	 */
+	ReliableMulticastSender(EventLoop::EventLoop& ev, const char* group, uint16_t port, std::size_t history = DefaultHistory)
+		: mEv(ev)
+		, mSocket(ev, this)
+		, mGroup(group, port)
+		, mCapacity(ReliableMulticastProtocol::RoundUpToPowerOfTwo(history))
+		, mHistory(mCapacity * ReliableMulticastProtocol::MaxDatagramSize)
+		, mLengths(mCapacity, 0)
+		, mRetransmitted(mCapacity)
+		, mHeartbeatTimer(HeartbeatInterval, EventLoop::EventLoop::TimerType::Repeating, [this](){ OnHeartbeatTimer(); })
+	{
+		mLogger = spdlog::get("ReliableMulticast");
+		if(mLogger == nullptr)
+		{
+			auto reliableMulticastLogger = spdlog::stdout_color_mt("ReliableMulticast");
+			mLogger = spdlog::get("ReliableMulticast");
+		}
+
+		if(!mGroup.IsValid())
+		{
+			mLogger->critical("Invalid multicast group: {}", group != nullptr ? group : "");
+			throw std::runtime_error("Invalid multicast group");
+		}
+
+		// NACKs are sent to the source address of the data, so any local port will do
+		mSocket.StartListening(nullptr, 0);
+		mEv.AddTimer(&mHeartbeatTimer);
+	}
+
+	~ReliableMulticastSender()
+	{
+		mEv.RemoveTimer(&mHeartbeatTimer);
+	}
+
+	/**
+	 * @brief For the multicast TTL, loop and interface
+	 */
+	UDPSocket& GetSocket() noexcept
+	{
+		return mSocket;
+	}
+
+	/**
+	 * @brief Multicast a message, the message is written on the next loop cycle together with others
+	 *
+	 * @return false when @p len is over ReliableMulticastProtocol::MaxMessageSize.
+	 */
+	bool Send(const char* data, std::size_t len) noexcept
+	{
+		using namespace ReliableMulticastProtocol;
+
+		if(len > MaxMessageSize)
+		{
+			mLogger->error("Message of {} bytes is over the maximum of {}", len, MaxMessageSize);
+			return false;
+		}
+
+		const uint64_t sequence = mNextSequence++;
+		const std::size_t slot = sequence & (mCapacity - 1);
+		char* out = &mHistory[slot * MaxDatagramSize];
+		WriteHeader(out, Type::Data, sequence);
+		std::memcpy(out + HeaderSize, data, len);
+		mLengths[slot] = HeaderSize + len;
+		mRetransmitted[slot] = Clock::time_point{};
+
+		mSocket.Queue(out, mLengths[slot], mGroup);
+		mSentSinceHeartbeat = true;
+		return true;
+	}
+
+	/**
+	 * @brief Sequence number the next message will get, the first message is 1
+	 */
+	uint64_t GetNextSequence() const noexcept
+	{
+		return mNextSequence;
+	}
+
+	std::size_t GetNackCount() const noexcept
+	{
+		return mNacks;
+	}
+
+	std::size_t GetRetransmitCount() const noexcept
+	{
+		return mRetransmits;
+	}
+
+	void OnIncomingDatagrams(UDPSocket* /*socket*/, Span<Datagram> datagrams) final
+	{
+		using namespace ReliableMulticastProtocol;
+
+		for(const auto& datagram : datagrams)
+		{
+			if(datagram.mLength < ControlSize || static_cast<Type>(datagram.mData[0]) != Type::Nack)
+			{
+				continue;
+			}
+			Retransmit(ReadField(datagram.mData + 8), ReadField(datagram.mData + 16));
+		}
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::milliseconds HeartbeatInterval{50};
+	/// Several receivers missing the same message NACK it at about the same time, one repair serves all of them
+	static constexpr std::chrono::milliseconds RetransmitHoldoff{5};
+
+	uint64_t GetFirstAvailable() const noexcept
+	{
+		return mNextSequence > mCapacity ? mNextSequence - mCapacity : 1;
+	}
+
+	void Retransmit(uint64_t from, uint64_t count) noexcept
+	{
+		++mNacks;
+		if(from == 0 || from >= mNextSequence)
+		{
+			return;
+		}
+		uint64_t end = from + std::min<uint64_t>(count, mCapacity);
+		end = std::min(end, mNextSequence);
+
+		const uint64_t first = GetFirstAvailable();
+		if(from < first)
+		{
+			// Part of the range is gone, the heartbeat tells receivers to skip it
+			SendHeartbeat();
+			from = first;
+		}
+
+		const auto now = Clock::now();
+		for(uint64_t sequence = from; sequence < end; ++sequence)
+		{
+			const std::size_t slot = sequence & (mCapacity - 1);
+			if(now - mRetransmitted[slot] < RetransmitHoldoff)
+			{
+				continue;
+			}
+			mRetransmitted[slot] = now;
+			mSocket.Queue(&mHistory[slot * ReliableMulticastProtocol::MaxDatagramSize], mLengths[slot], mGroup);
+			++mRetransmits;
+		}
+	}
+
+	void SendHeartbeat() noexcept
+	{
+		using namespace ReliableMulticastProtocol;
+
+		char heartbeat[ControlSize];
+		WriteControl(heartbeat, Type::Heartbeat, GetFirstAvailable(), mNextSequence - 1);
+		mSocket.Queue(heartbeat, sizeof(heartbeat), mGroup);
+	}
+
+	/**
+	 * @brief Only needed while idle, receivers notice gaps from the sequence numbers otherwise
+	 */
+	void OnHeartbeatTimer() noexcept
+	{
+		if(!mSentSinceHeartbeat)
+		{
+			SendHeartbeat();
+		}
+		mSentSinceHeartbeat = false;
+	}
+
+	EventLoop::EventLoop& mEv;
+	UDPSocket mSocket;
+	UDPEndpoint mGroup;
+	std::shared_ptr<spdlog::logger> mLogger;
+
+	std::size_t mCapacity;
+	std::vector<char> mHistory;
+	std::vector<std::size_t> mLengths;
+	std::vector<Clock::time_point> mRetransmitted;
+	uint64_t mNextSequence = 1;
+
+	EventLoop::EventLoop::Timer mHeartbeatTimer;
+	bool mSentSinceHeartbeat = false;
+
+	std::size_t mNacks = 0;
+	std::size_t mRetransmits = 0;
+};
+
+class ReliableMulticastReceiver;
+
+class IReliableMulticastHandler
+{
+public:
+	/**
+	 * @brief Called in sequence order, @p data is only valid for the duration of the call
+	 */
+	virtual void OnMessage(ReliableMulticastReceiver* receiver, uint64_t sequence, const char* data, std::size_t len) = 0;
+
+	/**
+	 * @brief Messages [@p from, @p from + @p count) are no longer available from the sender and were skipped
+	 */
+	virtual void OnLoss(ReliableMulticastReceiver* /*receiver*/, uint64_t /*from*/, uint64_t /*count*/) {}
+	virtual ~IReliableMulticastHandler() {}
+};
+
+class ReliableMulticastReceiver : public IUDPSocketHandler
+{
+public:
+	static constexpr std::size_t DefaultWindow = 4096;
+
+	/**
+	 * @brief Join @p group on @p port, buffering up to @p window messages after a gap
+	 *
+	 * A receiver joining a running stream starts at the first message or heartbeat it sees.
+	 * @p window is rounded up to a power of two.
+	 */
+	ReliableMulticastReceiver(EventLoop::EventLoop& ev, IReliableMulticastHandler* handler, const char* group,
+			uint16_t port, const char* interface = nullptr, std::size_t window = DefaultWindow)
+		: mEv(ev)
+		, mHandler(handler)
+		, mSocket(ev, this)
+		, mCapacity(ReliableMulticastProtocol::RoundUpToPowerOfTwo(window))
+		, mBuffer(mCapacity * ReliableMulticastProtocol::MaxMessageSize)
+		, mBufferedLengths(mCapacity, 0)
+		, mBufferedSequences(mCapacity, 0)
+		, mNackTimes(mCapacity)
+		, mNackTimer(NackInterval, EventLoop::EventLoop::TimerType::Repeating, [this](){ OnNackTimer(); })
+	{
+		mLogger = spdlog::get("ReliableMulticast");
+		if(mLogger == nullptr)
+		{
+			auto reliableMulticastLogger = spdlog::stdout_color_mt("ReliableMulticast");
+			mLogger = spdlog::get("ReliableMulticast");
+		}
+
+		mSocket.StartListening(nullptr, port);
+		if(!mSocket.JoinGroup(group, interface))
+		{
+			mLogger->critical("Unable to join multicast group: {}", group != nullptr ? group : "");
+			throw std::runtime_error("Unable to join multicast group");
+		}
+		mEv.AddTimer(&mNackTimer);
+	}
+
+	~ReliableMulticastReceiver()
+	{
+		mEv.RemoveTimer(&mNackTimer);
+	}
+
+	UDPSocket& GetSocket() noexcept
+	{
+		return mSocket;
+	}
+
+	/**
+	 * @brief Sequence number of the next message to deliver
+	 */
+	uint64_t GetNextSequence() const noexcept
+	{
+		return mNextSequence;
+	}
+
+	/**
+	 * @brief Messages that filled a gap
+	 */
+	std::size_t GetRecoveredCount() const noexcept
+	{
+		return mRecovered;
+	}
+
+	std::size_t GetLostCount() const noexcept
+	{
+		return mLost;
+	}
+
+	std::size_t GetNackCount() const noexcept
+	{
+		return mNacks;
+	}
+
+	std::size_t GetDuplicateCount() const noexcept
+	{
+		return mDuplicates;
+	}
+
+	void OnIncomingDatagrams(UDPSocket* /*socket*/, Span<Datagram> datagrams) final
+	{
+		using namespace ReliableMulticastProtocol;
+
+		for(const auto& datagram : datagrams)
+		{
+			if(!IsValid(datagram))
+			{
+				continue;
+			}
+
+			const UDPEndpoint source(datagram.GetSource());
+			if(!mSender.IsValid())
+			{
+				mSender = source;
+			}
+			else if(!(source == mSender))
+			{
+				continue;
+			}
+
+			switch(static_cast<Type>(datagram.mData[0]))
+			{
+				case Type::Data:
+				{
+					OnData(ReadField(datagram.mData + 8), datagram.mData + HeaderSize, datagram.mLength - HeaderSize);
+					break;
+				}
+				case Type::Heartbeat:
+				{
+					OnHeartbeat(ReadField(datagram.mData + 8), ReadField(datagram.mData + 16));
+					break;
+				}
+				default:
+					break;
+			}
+		}
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::milliseconds NackInterval{10};
+	static constexpr std::size_t MaxNacksPerInterval = 16;
+
+	/**
+	 * @brief A Data datagram whose message fits a buffer slot or a complete Heartbeat
+	 *
+	 * Checked before the first datagram picks the sender, so a stray one can't.
+	 */
+	static bool IsValid(const Datagram& datagram) noexcept
+	{
+		using namespace ReliableMulticastProtocol;
+
+		if(datagram.mLength < HeaderSize || datagram.mTruncated)
+		{
+			return false;
+		}
+		switch(static_cast<Type>(datagram.mData[0]))
+		{
+			case Type::Data:
+				// The sender starts at sequence 1
+				return datagram.mLength - HeaderSize <= MaxMessageSize && ReadField(datagram.mData + 8) != 0;
+			case Type::Heartbeat:
+				return datagram.mLength >= ControlSize;
+			default:
+				return false;
+		}
+	}
+
+	void OnData(uint64_t sequence, const char* data, std::size_t len) noexcept
+	{
+		if(!mSynced)
+		{
+			mSynced = true;
+			mNextSequence = sequence;
+			mHighestSequence = sequence - 1;
+		}
+
+		if(sequence < mNextSequence || IsBuffered(sequence))
+		{
+			++mDuplicates;
+			return;
+		}
+		if(sequence <= mHighestSequence)
+		{
+			++mRecovered;
+		}
+		if(sequence >= mNextSequence + mCapacity)
+		{
+			// Too far ahead to buffer, give up on the oldest gap
+			Skip(sequence - mCapacity + 1);
+		}
+		if(sequence > mHighestSequence)
+		{
+			if(sequence > mHighestSequence + 1)
+			{
+				SendNack(mHighestSequence + 1, sequence - mHighestSequence - 1);
+			}
+			mHighestSequence = sequence;
+		}
+
+		if(sequence == mNextSequence)
+		{
+			++mNextSequence;
+			mHandler->OnMessage(this, sequence, data, len);
+			DeliverBuffered();
+			return;
+		}
+
+		const std::size_t slot = sequence & (mCapacity - 1);
+		std::memcpy(&mBuffer[slot * ReliableMulticastProtocol::MaxMessageSize], data, len);
+		mBufferedLengths[slot] = len;
+		mBufferedSequences[slot] = sequence;
+	}
+
+	void OnHeartbeat(uint64_t first, uint64_t last) noexcept
+	{
+		if(!mSynced)
+		{
+			mSynced = true;
+			mNextSequence = last + 1;
+			mHighestSequence = last;
+			return;
+		}
+
+		if(first > mNextSequence)
+		{
+			Skip(first);
+		}
+		if(last > mHighestSequence)
+		{
+			// Lost the tail of a burst
+			SendNack(mHighestSequence + 1, last - mHighestSequence);
+			mHighestSequence = last;
+		}
+	}
+
+	bool IsBuffered(uint64_t sequence) const noexcept
+	{
+		return mBufferedSequences[sequence & (mCapacity - 1)] == sequence;
+	}
+
+	void DeliverBuffered() noexcept
+	{
+		while(IsBuffered(mNextSequence))
+		{
+			const uint64_t sequence = mNextSequence++;
+			const std::size_t slot = sequence & (mCapacity - 1);
+			mBufferedSequences[slot] = 0;
+			mHandler->OnMessage(this, sequence, &mBuffer[slot * ReliableMulticastProtocol::MaxMessageSize], mBufferedLengths[slot]);
+		}
+	}
+
+	/**
+	 * @brief Deliver what is buffered before @p until and report the rest as lost
+	 */
+	void Skip(uint64_t until) noexcept
+	{
+		uint64_t lossStart = mNextSequence;
+		uint64_t lossCount = 0;
+		while(mNextSequence < until)
+		{
+			if(!IsBuffered(mNextSequence))
+			{
+				if(mHighestSequence < mNextSequence)
+				{
+					// Nothing buffered beyond here
+					lossCount += until - mNextSequence;
+					mNextSequence = until;
+					break;
+				}
+				++lossCount;
+				++mNextSequence;
+				continue;
+			}
+
+			if(lossCount != 0)
+			{
+				ReportLoss(lossStart, lossCount);
+				lossCount = 0;
+			}
+			DeliverBuffered();
+			lossStart = mNextSequence;
+		}
+		if(lossCount != 0)
+		{
+			ReportLoss(lossStart, lossCount);
+		}
+
+		if(mHighestSequence + 1 < mNextSequence)
+		{
+			mHighestSequence = mNextSequence - 1;
+		}
+		DeliverBuffered();
+	}
+
+	void ReportLoss(uint64_t from, uint64_t count) noexcept
+	{
+		mLost += count;
+		mLogger->warn("Lost {} messages starting at sequence {}", count, from);
+		mHandler->OnLoss(this, from, count);
+	}
+
+	/**
+	 * @brief Repeat the NACK for missing messages that weren't repaired within NackInterval
+	 */
+	void OnNackTimer() noexcept
+	{
+		if(!mSynced || mNextSequence > mHighestSequence)
+		{
+			return;
+		}
+
+		const auto now = Clock::now();
+		const auto isDue = [this, &now](uint64_t sequence) {
+			return !IsBuffered(sequence) && now - mNackTimes[sequence & (mCapacity - 1)] >= NackInterval;
+		};
+
+		const uint64_t end = std::min(mHighestSequence, mNextSequence + mCapacity - 1);
+		std::size_t nacks = 0;
+		uint64_t sequence = mNextSequence;
+		while(sequence <= end && nacks < MaxNacksPerInterval)
+		{
+			if(!isDue(sequence))
+			{
+				++sequence;
+				continue;
+			}
+			const uint64_t from = sequence;
+			while(sequence <= end && isDue(sequence))
+			{
+				++sequence;
+			}
+			SendNack(from, sequence - from);
+			++nacks;
+		}
+	}
+
+	void SendNack(uint64_t from, uint64_t count) noexcept
+	{
+		using namespace ReliableMulticastProtocol;
+
+		count = std::min<uint64_t>(count, mCapacity);
+		char nack[ControlSize];
+		WriteControl(nack, Type::Nack, from, count);
+		mSocket.Send(nack, sizeof(nack), mSender);
+		++mNacks;
+
+		const auto now = Clock::now();
+		for(uint64_t sequence = from; sequence < from + count; ++sequence)
+		{
+			mNackTimes[sequence & (mCapacity - 1)] = now;
+		}
+	}
+
+	EventLoop::EventLoop& mEv;
+	IReliableMulticastHandler* mHandler;
+	UDPSocket mSocket;
+	UDPEndpoint mSender;
+	std::shared_ptr<spdlog::logger> mLogger;
+
+	std::size_t mCapacity;
+	std::vector<char> mBuffer;
+	std::vector<std::size_t> mBufferedLengths;
+	std::vector<uint64_t> mBufferedSequences;
+	/// When a missing message was last asked for, indexed like the buffer
+	std::vector<Clock::time_point> mNackTimes;
+
+	bool mSynced = false;
+	uint64_t mNextSequence = 1;
+	uint64_t mHighestSequence = 0;
+
+	EventLoop::EventLoop::Timer mNackTimer;
+
+	std::size_t mRecovered = 0;
+	std::size_t mLost = 0;
+	std::size_t mNacks = 0;
+	std::size_t mDuplicates = 0;
+};
+
+} // namespace Common
+
+#endif // RELIABLEMULTICAST_H
@@ -0,0 +1,284 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "EventLoop.h"
+
+namespace Common {
+
+struct ResolvedAddress
+{
+	sockaddr_storage mAddress;
+	socklen_t mLength;
+
+	int GetFamily() const noexcept
+	{
+		return mAddress.ss_family;
+	}
+
+	const sockaddr* Get() const noexcept
+	{
+		return reinterpret_cast<const sockaddr*>(&mAddress);
+	}
+};
+
+/**
+ * @brief Asynchronous hostname resolution
+ *
+ * getaddrinfo() blocks for as long as DNS takes, so lookups are run on the background workers of the
+ * EventLoop and the callback is called on the loop thread. The callback is never called from within Resolve().
+ *
+ * Results are kept in a process wide cache, both successful (positive) and failed (negative) lookups.
+ * getaddrinfo() doesn't expose record TTLs, so fixed TTLs are used, see SetCacheTtl().
+ *
+ * Destroying the resolver or calling Cancel() drops the callbacks of outstanding lookups.
+ */
+class Resolver
+{
+public:
+	using Addresses = std::vector<ResolvedAddress>;
+	/// Called with the addresses in getaddrinfo() order, empty when resolution failed
+	using Callback = std::function<void(const Addresses& addresses)>;
+	using Clock = std::chrono::steady_clock;
+
+	Resolver(EventLoop::EventLoop& ev)
+		: mEventLoop(ev)
+		, mAlive(std::make_shared<bool>(true))
+	{
+		mLogger = spdlog::get("Resolver");
+		if(mLogger == nullptr)
+		{
+			auto resolverLogger = spdlog::stdout_color_mt("Resolver");
+			mLogger = spdlog::get("Resolver");
+		}
+	}
+
+	/**
+	 * @brief Resolve @p host to stream socket addresses with @p port filled in
+	 *
+	 * Numeric IPv4 and IPv6 addresses (optionally in brackets) don't hit the cache or the workers,
+	 * they can be parsed upfront with ParseNumeric().
+	 */
+	void Resolve(const std::string& host, uint16_t port, Callback callback)
+	{
+		std::weak_ptr<bool> alive = mAlive;
+
+		Addresses addresses;
+		if(ParseNumeric(host, port, addresses) || LookupCache(host, port, addresses))
+		{
+			mEventLoop.SheduleForNextCycle([alive, callback, addresses](){
+				if(!alive.expired())
+				{
+					callback(addresses);
+				}
+			});
+			return;
+		}
+
+		auto result = std::make_shared<Addresses>();
+		auto logger = mLogger;
+		mEventLoop.RunInBackground(
+			[host, port, result, logger](){
+				// An earlier job may have resolved the same host in the meantime
+				if(!LookupCache(host, port, *result))
+				{
+					Lookup(host, port, *result, logger);
+				}
+			},
+			[alive, callback, result](){
+				if(!alive.expired())
+				{
+					callback(*result);
+				}
+			});
+	}
+
+	/**
+	 * @brief Drop the callbacks of all outstanding lookups
+	 */
+	void Cancel() noexcept
+	{
+		mAlive = std::make_shared<bool>(true);
+	}
+
+	/**
+	 * @brief Parse a numeric IPv4 or IPv6 address
+	 *
+	 * @return true and the address in @p addresses when @p host is numeric.
+	 */
+	static bool ParseNumeric(const std::string& host, uint16_t port, Addresses& addresses) noexcept
+	{
+		ResolvedAddress addr{};
+
+		auto v4 = reinterpret_cast<sockaddr_in*>(&addr.mAddress);
+		if(::inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1)
+		{
+			v4->sin_family = AF_INET;
+			v4->sin_port = htons(port);
+			addr.mLength = sizeof(sockaddr_in);
+			addresses.assign(1, addr);
+			return true;
+		}
+
+		std::string literal = host;
+		if(literal.size() > 2 && literal.front() == '[' && literal.back() == ']')
+		{
+			literal = literal.substr(1, literal.size() - 2);
+		}
+
+		auto v6 = reinterpret_cast<sockaddr_in6*>(&addr.mAddress);
+		if(::inet_pton(AF_INET6, literal.c_str(), &v6->sin6_addr) == 1)
+		{
+			v6->sin6_family = AF_INET6;
+			v6->sin6_port = htons(port);
+			addr.mLength = sizeof(sockaddr_in6);
+			addresses.assign(1, addr);
+			return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * @brief Set how long successful and failed lookups are cached
+	 */
+	static void SetCacheTtl(std::chrono::seconds positive, std::chrono::seconds negative) noexcept
+	{
+		std::lock_guard<std::mutex> lock(GetCache().mMutex);
+		GetCache().mPositiveTtl = positive;
+		GetCache().mNegativeTtl = negative;
+	}
+
+	static void FlushCache() noexcept
+	{
+		std::lock_guard<std::mutex> lock(GetCache().mMutex);
+		GetCache().mEntries.clear();
+	}
+
+private:
+	struct CacheEntry
+	{
+		Addresses mAddresses;
+		Clock::time_point mExpiry;
+	};
+
+	struct Cache
+	{
+		std::mutex mMutex;
+		std::unordered_map<std::string, CacheEntry> mEntries;
+		std::chrono::seconds mPositiveTtl{60};
+		std::chrono::seconds mNegativeTtl{5};
+	};
+
+	static Cache& GetCache() noexcept
+	{
+		static Cache cache;
+		return cache;
+	}
+
+	static void SetPort(Addresses& addresses, uint16_t port) noexcept
+	{
+		for(auto& addr : addresses)
+		{
+			if(addr.GetFamily() == AF_INET6)
+			{
+				reinterpret_cast<sockaddr_in6*>(&addr.mAddress)->sin6_port = htons(port);
+			}
+			else
+			{
+				reinterpret_cast<sockaddr_in*>(&addr.mAddress)->sin_port = htons(port);
+			}
+		}
+	}
+
+	/**
+	 * @return true on a cache hit, for a negative hit @p addresses is left empty.
+	 */
+	static bool LookupCache(const std::string& host, uint16_t port, Addresses& addresses)
+	{
+		auto& cache = GetCache();
+		std::lock_guard<std::mutex> lock(cache.mMutex);
+
+		const auto entry = cache.mEntries.find(host);
+		if(entry == cache.mEntries.end())
+		{
+			return false;
+		}
+		if(entry->second.mExpiry < Clock::now())
+		{
+			cache.mEntries.erase(entry);
+			return false;
+		}
+
+		addresses = entry->second.mAddresses;
+		SetPort(addresses, port);
+		return true;
+	}
+
+	/**
+	 * @brief Blocking lookup, runs on a background worker
+	 */
+	static void Lookup(const std::string& host, uint16_t port, Addresses& addresses,
+			const std::shared_ptr<spdlog::logger>& logger)
+	{
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_ADDRCONFIG;
+
+		addrinfo* result = nullptr;
+		const int ret = ::getaddrinfo(host.c_str(), nullptr, &hints, &result);
+		if(ret != 0)
+		{
+			logger->warn("Failed to resolve {}: {}", host, ::gai_strerror(ret));
+		}
+
+		for(addrinfo* info = result; info != nullptr; info = info->ai_next)
+		{
+			if(info->ai_family != AF_INET && info->ai_family != AF_INET6)
+			{
+				continue;
+			}
+
+			ResolvedAddress addr{};
+			std::memcpy(&addr.mAddress, info->ai_addr, info->ai_addrlen);
+			addr.mLength = info->ai_addrlen;
+			addresses.push_back(addr);
+		}
+
+		if(result != nullptr)
+		{
+			::freeaddrinfo(result);
+		}
+
+		auto& cache = GetCache();
+		{
+			std::lock_guard<std::mutex> lock(cache.mMutex);
+			const auto ttl = addresses.empty() ? cache.mNegativeTtl : cache.mPositiveTtl;
+			cache.mEntries[host] = CacheEntry{addresses, Clock::now() + ttl};
+		}
+
+		SetPort(addresses, port);
+	}
+
+	EventLoop::EventLoop& mEventLoop;
+	std::shared_ptr<bool> mAlive;
+
+	std::shared_ptr<spdlog::logger> mLogger;
+};
+
+} // namespace Common
+
+#endif // RESOLVER_H
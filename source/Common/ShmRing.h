@@ -0,0 +1,426 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EventLoop.h"
+#include "Common/NonCopyable.h"
+
+namespace Common {
+
+/**
+ * @brief Single producer, single consumer message ring in shared memory
+ *
+ * The ring lives in a memfd so it can be shared with another process, e.g. by passing GetMemoryFd() and
+ * GetNotifyFd() with StreamSocket::SendFiledescriptors(). One side creates the ring, the other attaches to it.
+ * Messages are length prefixed and written in place, a message is never split at the end of the ring.
+ *
+ * TryWrite() only makes a syscall when the consumer announced it is going to sleep,
+ * the eventfd is then used to wake it up. See ShmRingReader for the consumer side on the EventLoop.
+ */
+class ShmRing
+	: Common::NonCopyable<ShmRing>
+{
+	struct alignas(64) Header
+	{
+		std::uint32_t mMagic;
+		std::uint32_t mVersion;
+		std::uint64_t mCapacity;
+		alignas(64) std::atomic<std::uint64_t> mHead;
+		alignas(64) std::atomic<std::uint64_t> mTail;
+		alignas(64) std::atomic<std::uint32_t> mReaderWaiting;
+	};
+
+	static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Shared ring needs address free atomics");
+	static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "Shared ring needs address free atomics");
+
+public:
+	static constexpr std::uint32_t Magic = 0x53484d52;
+	static constexpr std::uint32_t Version = 1;
+
+	/**
+	 * @brief Create a new ring of @p capacity bytes, rounded up to a power of two
+	 */
+	explicit ShmRing(std::size_t capacity)
+	{
+		InitLogger();
+
+		mCapacity = 4096;
+		while(mCapacity < capacity)
+		{
+			mCapacity <<= 1;
+		}
+
+		mMemoryFd = ::memfd_create("commonlibs-shmring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if(mMemoryFd == -1)
+		{
+			mLogger->critical("Failed to create memfd, errno:{}", errno);
+			throw std::runtime_error("Failed to create memfd");
+		}
+
+		if(::ftruncate(mMemoryFd, sizeof(Header) + mCapacity) == -1)
+		{
+			mLogger->critical("Failed to size memfd:{}, errno:{}", mMemoryFd, errno);
+			throw std::runtime_error("Failed to size memfd");
+		}
+		::fcntl(mMemoryFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+		mNotifyFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(mNotifyFd == -1)
+		{
+			mLogger->critical("Failed to create eventfd, errno:{}", errno);
+			throw std::runtime_error("Failed to create eventfd");
+		}
+
+		Map();
+		mHeader->mMagic = Magic;
+		mHeader->mVersion = Version;
+		mHeader->mCapacity = mCapacity;
+		mHeader->mHead.store(0, std::memory_order_relaxed);
+		mHeader->mTail.store(0, std::memory_order_relaxed);
+		mHeader->mReaderWaiting.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Attach to a ring created elsewhere, takes ownership of both filedescriptors
+	 */
+	ShmRing(int memoryFd, int notifyFd)
+		: mMemoryFd(memoryFd)
+		, mNotifyFd(notifyFd)
+	{
+		InitLogger();
+
+		struct stat st{};
+		if(::fstat(mMemoryFd, &st) == -1 || static_cast<std::size_t>(st.st_size) <= sizeof(Header))
+		{
+			mLogger->critical("Invalid shared ring fd:{}", mMemoryFd);
+			throw std::runtime_error("Invalid shared ring");
+		}
+
+		mCapacity = st.st_size - sizeof(Header);
+		Map();
+		if(mHeader->mMagic != Magic || mHeader->mVersion != Version || mHeader->mCapacity != mCapacity)
+		{
+			mLogger->critical("Shared ring fd:{} has an unknown layout", mMemoryFd);
+			throw std::runtime_error("Invalid shared ring");
+		}
+		// The ring may be in use already, the head is then far past the capacity
+		mCachedTail = mHeader->mTail.load(std::memory_order_acquire);
+	}
+
+	~ShmRing()
+	{
+		if(mHeader != nullptr)
+		{
+			::munmap(mHeader, sizeof(Header) + mCapacity);
+		}
+		::close(mMemoryFd);
+		::close(mNotifyFd);
+	}
+
+	int GetMemoryFd() const noexcept
+	{
+		return mMemoryFd;
+	}
+
+	int GetNotifyFd() const noexcept
+	{
+		return mNotifyFd;
+	}
+
+	std::size_t GetCapacity() const noexcept
+	{
+		return mCapacity;
+	}
+
+	/**
+	 * @brief Largest message that can be written
+	 */
+	std::size_t GetMaxMessageSize() const noexcept
+	{
+		return mCapacity / 2 - RecordHeaderSize;
+	}
+
+	/**
+	 * @brief Producer side, copy a message into the ring
+	 *
+	 * @return false when the ring is full or the message is too large, nothing is written then.
+	 */
+	bool TryWrite(const char* data, std::size_t len) noexcept
+	{
+		if(len > GetMaxMessageSize())
+		{
+			return false;
+		}
+
+		std::uint64_t head = mHeader->mHead.load(std::memory_order_relaxed);
+		const std::size_t record = RecordSize(len);
+		const std::size_t index = head & (mCapacity - 1);
+		const std::size_t contiguous = mCapacity - index;
+		const std::size_t needed = (contiguous < record) ? contiguous + record : record;
+
+		// needed is below the capacity as a message is at most half of it
+		if(head - mCachedTail > mCapacity - needed)
+		{
+			mCachedTail = mHeader->mTail.load(std::memory_order_acquire);
+			if(head - mCachedTail > mCapacity - needed)
+			{
+				return false;
+			}
+		}
+
+		if(contiguous < record)
+		{
+			WriteLength(index, WrapMarker);
+			head += contiguous;
+		}
+
+		const std::size_t start = head & (mCapacity - 1);
+		WriteLength(start, static_cast<std::uint32_t>(len));
+		std::memcpy(mData + start + RecordHeaderSize, data, len);
+		mHeader->mHead.store(head + record, std::memory_order_release);
+
+		// Pairs with the fence in PrepareToSleep(), either we see the flag or the reader sees the new head
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(mHeader->mReaderWaiting.load(std::memory_order_relaxed) != 0 &&
+			mHeader->mReaderWaiting.exchange(0, std::memory_order_relaxed) != 0)
+		{
+			const std::uint64_t one = 1;
+			[[maybe_unused]] const auto ret = ::write(mNotifyFd, &one, sizeof(one));
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Consumer side, call @p onMessage(const char* data, std::size_t len) for every available message
+	 *
+	 * Only messages that were available at the start of the call are read, so a fast producer can't keep
+	 * the consumer in here. @p data is only valid during the callback. A record that doesn't fit the ring or
+	 * what the producer wrote breaks the ring, nothing is read from it anymore, see IsBroken().
+	 *
+	 * @return The number of messages read.
+	 */
+	template<typename Callback>
+	std::size_t Read(Callback&& onMessage)
+	{
+		if(mBroken)
+		{
+			return 0;
+		}
+
+		std::uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed);
+		const std::uint64_t head = mHeader->mHead.load(std::memory_order_acquire);
+		if(head - tail > mCapacity)
+		{
+			mLogger->critical("Shared ring fd:{} is corrupt, {} bytes written to {} bytes", mMemoryFd, head - tail,
+					mCapacity);
+			mBroken = true;
+			return 0;
+		}
+
+		std::size_t count = 0;
+		while(tail != head)
+		{
+			const std::size_t index = tail & (mCapacity - 1);
+			const std::size_t contiguous = mCapacity - index;
+			const std::uint32_t len = ReadLength(index);
+			// The producer may be another process, its lengths are checked before anything is read
+			const std::size_t record = len == WrapMarker ? contiguous : RecordSize(len);
+			if(record > contiguous || record > head - tail)
+			{
+				mLogger->critical("Shared ring fd:{} is corrupt, record of {} bytes at {} with {} bytes written",
+						mMemoryFd, len, index, head - tail);
+				mBroken = true;
+				break;
+			}
+			if(len == WrapMarker)
+			{
+				tail += contiguous;
+				continue;
+			}
+
+			onMessage(static_cast<const char*>(mData + index + RecordHeaderSize), static_cast<std::size_t>(len));
+			tail += record;
+			mHeader->mTail.store(tail, std::memory_order_release);
+			++count;
+		}
+		mHeader->mTail.store(tail, std::memory_order_release);
+		return count;
+	}
+
+	/**
+	 * @brief The consumer found a record the producer can't have written correctly, the ring is unusable
+	 */
+	bool IsBroken() const noexcept
+	{
+		return mBroken;
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return mHeader->mHead.load(std::memory_order_acquire) == mHeader->mTail.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief Consumer side, ask the producer for a wakeup through the eventfd
+	 *
+	 * @return false when messages arrived in the meantime, the consumer should read instead of sleeping.
+	 */
+	bool PrepareToSleep() noexcept
+	{
+		mHeader->mReaderWaiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return IsEmpty();
+	}
+
+	/**
+	 * @brief Consumer side, withdraw a wakeup request so the producer doesn't have to make a syscall
+	 */
+	void CancelSleep() noexcept
+	{
+		mHeader->mReaderWaiting.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr std::size_t RecordHeaderSize = sizeof(std::uint32_t);
+	static constexpr std::uint32_t WrapMarker = 0xFFFFFFFF;
+
+	static constexpr std::size_t RecordSize(std::size_t len) noexcept
+	{
+		return (RecordHeaderSize + len + 7) & ~static_cast<std::size_t>(7);
+	}
+
+	void WriteLength(std::size_t index, std::uint32_t len) noexcept
+	{
+		std::memcpy(mData + index, &len, sizeof(len));
+	}
+
+	std::uint32_t ReadLength(std::size_t index) const noexcept
+	{
+		std::uint32_t len;
+		std::memcpy(&len, mData + index, sizeof(len));
+		return len;
+	}
+
+	void InitLogger()
+	{
+		mLogger = spdlog::get("ShmRing");
+		if(mLogger == nullptr)
+		{
+			auto shmRingLogger = spdlog::stdout_color_mt("ShmRing");
+			mLogger = spdlog::get("ShmRing");
+		}
+	}
+
+	void Map()
+	{
+		void* addr = ::mmap(nullptr, sizeof(Header) + mCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, mMemoryFd, 0);
+		if(addr == MAP_FAILED)
+		{
+			mLogger->critical("Failed to map shared ring fd:{}, errno:{}", mMemoryFd, errno);
+			throw std::runtime_error("Failed to map shared ring");
+		}
+		mHeader = static_cast<Header*>(addr);
+		mData = static_cast<char*>(addr) + sizeof(Header);
+	}
+
+	int mMemoryFd = -1;
+	int mNotifyFd = -1;
+	std::size_t mCapacity = 0;
+	Header* mHeader = nullptr;
+	char* mData = nullptr;
+	// Producer side copy of the tail, only reloaded when the ring looks full
+	std::uint64_t mCachedTail = 0;
+	bool mBroken = false;
+
+	std::shared_ptr<spdlog::logger> mLogger;
+};
+
+class ShmRingReader;
+
+class IShmRingHandler
+{
+public:
+	virtual void OnIncomingMessage(ShmRingReader* reader, const char* data, size_t len) = 0;
+	virtual ~IShmRingHandler() {}
+};
+
+/**
+ * @brief Consumer of a ShmRing on the EventLoop
+ *
+ * When the loop runs hot the ring is polled every cycle and the producer never has to make a syscall.
+ * Otherwise the reader requests a wakeup before the loop goes to sleep and is woken through the eventfd.
+ */
+class ShmRingReader : public EventLoop::IFiledescriptorCallbackHandler
+					, public EventLoop::IEventLoopCallbackHandler
+{
+public:
+	ShmRingReader(EventLoop::EventLoop& ev, ShmRing& ring, IShmRingHandler* handler)
+		: mEventLoop(ev)
+		, mRing(ring)
+		, mHandler(handler)
+	{
+		mEventLoop.RegisterFiledescriptor(mRing.GetNotifyFd(), EPOLLIN, this);
+		mEventLoop.RegisterCallbackHandler(this, EventLoop::EventLoop::LatencyType::Low);
+	}
+
+	~ShmRingReader()
+	{
+		mRing.CancelSleep();
+		mEventLoop.UnregisterCallbackHandler(this);
+		mEventLoop.UnregisterFiledescriptor(mRing.GetNotifyFd());
+	}
+
+private:
+	void OnFiledescriptorRead(int fd) final
+	{
+		std::uint64_t count;
+		[[maybe_unused]] const auto ret = ::read(fd, &count, sizeof(count));
+		Drain();
+	}
+
+	void OnFiledescriptorWrite(int /*fd*/) final
+	{}
+
+	void OnEventLoopCallback() final
+	{
+		Drain();
+	}
+
+	void Drain()
+	{
+		mRing.Read([this](const char* data, std::size_t len) {
+			mHandler->OnIncomingMessage(this, data, len);
+		});
+
+		// Never empties again, a wakeup would only come back here
+		if(mRing.IsBroken() || mEventLoop.IsRunningHot())
+		{
+			mRing.CancelSleep();
+			return;
+		}
+
+		// Messages that raced with the wakeup request might not come with a wakeup, wake ourselves
+		if(!mRing.PrepareToSleep())
+		{
+			const std::uint64_t one = 1;
+			[[maybe_unused]] const auto ret = ::write(mRing.GetNotifyFd(), &one, sizeof(one));
+		}
+	}
+
+	EventLoop::EventLoop& mEventLoop;
+	ShmRing& mRing;
+	IShmRingHandler* mHandler;
+};
+
+} // namespace Common
+
+#endif // SHMRING_H
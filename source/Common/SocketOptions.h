@@ -0,0 +1,147 @@
+#ifndef SOCKETOPTIONS_H
+#define SOCKETOPTIONS_H
+
+#include <optional>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <spdlog/spdlog.h>
+
+namespace Common {
+
+/**
+ * @brief Typed set of socket tuning options
+ *
+ * Only options that have been given a value are applied, everything else is left at the kernel default.
+ * Options that don't apply to the kind of socket, e.g. TCP_NODELAY on a datagram socket, are ignored.
+ *
+ * Used by StreamSocket, StreamSocketServer (as defaults for accepted connections) and UDPSocket.
+ */
+struct SocketOptions
+{
+	std::optional<bool> mNoDelay;           ///< TCP_NODELAY, disables Nagle's algorithm
+	std::optional<bool> mCork;              ///< TCP_CORK, hold back partial frames until uncorked
+	std::optional<bool> mQuickAck;          ///< TCP_QUICKACK, re-armed after every read as the kernel clears it
+	std::optional<int> mSendBufferSize;     ///< SO_SNDBUF in bytes
+	std::optional<int> mReceiveBufferSize;  ///< SO_RCVBUF in bytes
+	std::optional<int> mBusyPoll;           ///< SO_BUSY_POLL in microseconds
+	std::optional<int> mPriority;           ///< SO_PRIORITY, 0-6 without CAP_NET_ADMIN
+	std::optional<int> mTypeOfService;      ///< IP_TOS (IPV6_TCLASS on IPv6), e.g. IPTOS_LOWDELAY or a DSCP value
+
+	/**
+	 * @brief Overwrite the fields that are set in @p other
+	 */
+	void Merge(const SocketOptions& other) noexcept
+	{
+		mNoDelay = other.mNoDelay ? other.mNoDelay : mNoDelay;
+		mCork = other.mCork ? other.mCork : mCork;
+		mQuickAck = other.mQuickAck ? other.mQuickAck : mQuickAck;
+		mSendBufferSize = other.mSendBufferSize ? other.mSendBufferSize : mSendBufferSize;
+		mReceiveBufferSize = other.mReceiveBufferSize ? other.mReceiveBufferSize : mReceiveBufferSize;
+		mBusyPoll = other.mBusyPoll ? other.mBusyPoll : mBusyPoll;
+		mPriority = other.mPriority ? other.mPriority : mPriority;
+		mTypeOfService = other.mTypeOfService ? other.mTypeOfService : mTypeOfService;
+	}
+};
+
+namespace detail {
+
+inline bool SetSocketOption(int fd, int level, int option, int value, const char* name,
+		const std::shared_ptr<spdlog::logger>& logger) noexcept
+{
+	if(::setsockopt(fd, level, option, &value, sizeof(value)) == -1)
+	{
+		logger->error("Failed to set {} to {} on fd:{}, errno:{}", name, value, fd, errno);
+		return false;
+	}
+	return true;
+}
+
+inline int GetSocketIntOption(int fd, int option) noexcept
+{
+	int value = 0;
+	socklen_t len = sizeof(value);
+	::getsockopt(fd, SOL_SOCKET, option, &value, &len);
+	return value;
+}
+
+} // namespace detail
+
+/**
+ * @brief Apply all set options to the given filedescriptor
+ *
+ * The address family and type of @p fd are looked up, TCP options are only applied to TCP sockets and
+ * IP_TOS only to IP sockets. Options that don't apply are skipped.
+ *
+ * @return false when one or more options could not be applied, failures are logged.
+ */
+inline bool ApplySocketOptions(int fd, const SocketOptions& options,
+		const std::shared_ptr<spdlog::logger>& logger) noexcept
+{
+	bool ret = true;
+
+	const int domain = detail::GetSocketIntOption(fd, SO_DOMAIN);
+	const bool ip = (domain == AF_INET || domain == AF_INET6);
+	const bool tcp = ip && (detail::GetSocketIntOption(fd, SO_TYPE) == SOCK_STREAM);
+
+	if(tcp)
+	{
+		if(options.mNoDelay)
+		{
+			ret &= detail::SetSocketOption(fd, IPPROTO_TCP, TCP_NODELAY, *options.mNoDelay, "TCP_NODELAY", logger);
+		}
+		if(options.mCork)
+		{
+			ret &= detail::SetSocketOption(fd, IPPROTO_TCP, TCP_CORK, *options.mCork, "TCP_CORK", logger);
+		}
+		if(options.mQuickAck)
+		{
+			ret &= detail::SetSocketOption(fd, IPPROTO_TCP, TCP_QUICKACK, *options.mQuickAck, "TCP_QUICKACK", logger);
+		}
+	}
+	else if(options.mNoDelay || options.mCork || options.mQuickAck)
+	{
+		logger->debug("TCP options requested on non TCP socket fd:{}, skipping", fd);
+	}
+
+	if(options.mSendBufferSize)
+	{
+		ret &= detail::SetSocketOption(fd, SOL_SOCKET, SO_SNDBUF, *options.mSendBufferSize, "SO_SNDBUF", logger);
+	}
+	if(options.mReceiveBufferSize)
+	{
+		ret &= detail::SetSocketOption(fd, SOL_SOCKET, SO_RCVBUF, *options.mReceiveBufferSize, "SO_RCVBUF", logger);
+	}
+	if(options.mBusyPoll)
+	{
+		ret &= detail::SetSocketOption(fd, SOL_SOCKET, SO_BUSY_POLL, *options.mBusyPoll, "SO_BUSY_POLL", logger);
+	}
+	if(options.mPriority)
+	{
+		ret &= detail::SetSocketOption(fd, SOL_SOCKET, SO_PRIORITY, *options.mPriority, "SO_PRIORITY", logger);
+	}
+	if(options.mTypeOfService)
+	{
+		if(domain == AF_INET6)
+		{
+			ret &= detail::SetSocketOption(fd, IPPROTO_IPV6, IPV6_TCLASS, *options.mTypeOfService, "IPV6_TCLASS", logger);
+		}
+		else if(ip)
+		{
+			ret &= detail::SetSocketOption(fd, IPPROTO_IP, IP_TOS, *options.mTypeOfService, "IP_TOS", logger);
+		}
+		else
+		{
+			logger->debug("IP_TOS requested on non IP socket fd:{}, skipping", fd);
+		}
+	}
+
+	return ret;
+}
+
+} // namespace Common
+
+#endif // SOCKETOPTIONS_H
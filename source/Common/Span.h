@@ -0,0 +1,61 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <cstddef>
+
+namespace Common {
+
+/**
+ * @brief Non owning view over contiguous elements
+ *
+ * Stand-in for std::span until the project moves to C++20.
+ */
+template<typename T>
+class Span
+{
+public:
+	constexpr Span() noexcept = default;
+
+	constexpr Span(T* data, std::size_t size) noexcept
+		: mData(data)
+		, mSize(size)
+	{}
+
+	constexpr T* data() const noexcept
+	{
+		return mData;
+	}
+
+	constexpr std::size_t size() const noexcept
+	{
+		return mSize;
+	}
+
+	constexpr bool empty() const noexcept
+	{
+		return mSize == 0;
+	}
+
+	constexpr T& operator[](std::size_t index) const noexcept
+	{
+		return mData[index];
+	}
+
+	constexpr T* begin() const noexcept
+	{
+		return mData;
+	}
+
+	constexpr T* end() const noexcept
+	{
+		return mData + mSize;
+	}
+
+private:
+	T* mData = nullptr;
+	std::size_t mSize = 0;
+};
+
+} // namespace Common
+
+#endif // SPAN_H
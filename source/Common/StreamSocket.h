@@ -1,7 +1,20 @@
 #ifndef STREAMSOCKET_H
 #define STREAMSOCKET_H
 
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
 #include "EventLoop.h"
+#include "Resolver.h"
+#include "SocketOptions.h"
+
+#ifdef COMMONLIBS_TLS
+#include "TlsContext.h"
+#endif
 
 namespace Common {
 
@@ -15,9 +28,55 @@ public:
 	virtual void OnConnected() = 0;
 	virtual void OnDisconnect(StreamSocket* conn) = 0;
 	virtual void OnIncomingData(StreamSocket* conn, char* data, size_t len) = 0;
+
+	/**
+	 * @brief Filedescriptors passed over a unix socket with SCM_RIGHTS
+	 *
+	 * Called right before OnIncomingData() for the data they were sent with.
+	 * The handler takes ownership of the filedescriptors, the default implementation closes them.
+	 */
+	virtual void OnIncomingFiledescriptors(StreamSocket* /*conn*/, const int* fds, size_t count)
+	{
+		for(size_t i = 0; i < count; ++i)
+		{
+			::close(fds[i]);
+		}
+	}
+
 	virtual ~IStreamSocketHandler() {}
 };
 
+namespace detail {
+
+/**
+ * @brief Fill a unix socket address for @p path
+ *
+ * A leading '@' selects the Linux abstract namespace, the name is then used without terminator.
+ *
+ * @return Address length to pass to bind/connect, 0 when @p path doesn't fit.
+ */
+inline socklen_t MakeUnixAddress(const std::string& path, sockaddr_un& addr) noexcept
+{
+	addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if(path.empty() || path.size() >= sizeof(addr.sun_path))
+	{
+		return 0;
+	}
+
+	std::memcpy(addr.sun_path, path.data(), path.size());
+	if(path[0] == '@')
+	{
+		addr.sun_path[0] = '\0';
+		return offsetof(sockaddr_un, sun_path) + path.size();
+	}
+
+	return offsetof(sockaddr_un, sun_path) + path.size() + 1;
+}
+
+} // namespace detail
+
 class StreamSocket : public EventLoop::IFiledescriptorCallbackHandler
 {
 public:
@@ -29,6 +88,8 @@ public:
 	StreamSocket(EventLoop::EventLoop& ev, IStreamSocketHandler* handler) noexcept
 		: mEventLoop(ev)
 		, mHandler(handler)
+		, mResolver(ev)
+		, mAttemptTimer(ConnectionAttemptDelay, EventLoop::EventLoop::TimerType::Oneshot, [this](){ StartNextAttempt(); })
 	{
 		mLogger = spdlog::get("StreamSocket");
 		if(mLogger == nullptr)
@@ -36,60 +97,131 @@ public:
 			auto streamSocketLogger = spdlog::stdout_color_mt("StreamSocket");
 			mLogger = spdlog::get("StreamSocket");
 		}
+	}
 
-		mFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	StreamSocket(EventLoop::EventLoop& ev, IStreamSocketHandler* handler, const SocketOptions& options) noexcept
+		: StreamSocket(ev, handler)
+	{
+		SetOptions(options);
 	}
 
-	StreamSocket(EventLoop::EventLoop& ev, int fd, IStreamSocketHandler* handler)
+	StreamSocket(EventLoop::EventLoop& ev, int fd, IStreamSocketHandler* handler, const SocketOptions& options = {})
 		: mEventLoop(ev)
 		, mHandler(handler)
+		, mResolver(ev)
+		, mAttemptTimer(ConnectionAttemptDelay, EventLoop::EventLoop::TimerType::Oneshot, [this](){ StartNextAttempt(); })
 		, mFd(fd)
+		, mDomain(detail::GetSocketIntOption(fd, SO_DOMAIN))
 	{
+		mLogger = spdlog::get("StreamSocket");
+		if(mLogger == nullptr)
+		{
+			auto streamSocketLogger = spdlog::stdout_color_mt("StreamSocket");
+			mLogger = spdlog::get("StreamSocket");
+		}
+
+		SetOptions(options);
 		mEventLoop.RegisterFiledescriptor(fd, EPOLLIN, this);
 		mConnected = true;
 	}
 
 	~StreamSocket()
 	{
+		CancelAttempts();
+#ifdef COMMONLIBS_TLS
+		FreeTls();
+#endif
 		if(mConnected)
 		{
 			mEventLoop.UnregisterFiledescriptor(mFd);
 		}
-		if(mFd)
+		if(mFd >= 0)
 		{
 			::close(mFd);
 		}
 	}
 
-	//void Connect(uint32_t addr, uint16_t port)
+	/**
+	 * @brief Connect to a host by IPv4/IPv6 address or hostname
+	 *
+	 * Hostnames are resolved off-loop through the Resolver. When a name resolves to multiple addresses they are
+	 * tried happy eyeballs style (RFC 8305): families are interleaved, a new attempt is started every
+	 * ConnectionAttemptDelay or as soon as the previous one fails, and the first connection to complete wins.
+	 * OnConnected() is called from the loop once the connection is usable, OnDisconnect() when every address failed.
+	 *
+	 * Calling Connect() again drops the current connection or connection attempt.
+	 */
 	void Connect(const char* addr, const uint16_t port) noexcept
 	{
-		remote.sin_addr.s_addr = ::inet_addr(addr);
-		//remote.sin_addr.s_addr = addr;
-		remote.sin_family = AF_INET;
-		remote.sin_port = htons(port);
-
-		const int ret = ::connect(mFd, (struct sockaddr *)&remote, sizeof(struct sockaddr));
+		Reset();
 
-		//TODO Handle error case
-		if((ret == -1) && (errno == EINPROGRESS))
+		Resolver::Addresses addresses;
+		if(Resolver::ParseNumeric(addr, port, addresses))
 		{
-			//mLogger->critical("Connect failed, code:{}", ret);
-			//throw std::runtime_error("Connect failed");
-			mEventLoop.RegisterFiledescriptor(mFd, EPOLLIN | EPOLLOUT, this);
+			StartConnecting(addresses);
+			return;
 		}
-		else
+
+		const std::string host = addr;
+		mResolver.Resolve(host, port, [this, host](const Resolver::Addresses& resolved){
+			if(resolved.empty())
+			{
+				mLogger->error("Unable to resolve {}", host);
+				mHandler->OnDisconnect(this);
+				return;
+			}
+			StartConnecting(resolved);
+		});
+	}
+
+	/**
+	 * @brief Connect to a unix domain stream socket
+	 *
+	 * @p path is either a filesystem path or, with a leading '@', a name in the abstract namespace.
+	 * OnConnected() is called from the loop once the connection is usable.
+	 */
+	void ConnectUnix(const std::string& path) noexcept
+	{
+		Reset();
+
+		ResolvedAddress addr{};
+		addr.mLength = detail::MakeUnixAddress(path, reinterpret_cast<sockaddr_un&>(addr.mAddress));
+		if(addr.mLength == 0)
 		{
-			mEventLoop.RegisterFiledescriptor(mFd, EPOLLIN, this);
-			mLogger->info("fd:{} connected instantly", mFd);
+			mLogger->error("Invalid unix socket path: {}", path);
+			return;
 		}
+
+		StartConnecting({addr});
 	}
 
+	/**
+	 * @brief Send @p len bytes, what the socket has no room for is kept and sent once it is writable
+	 *
+	 * Later sends queue behind kept data so the stream stays in order. A failed connection is shut down,
+	 * the read that notices it reports the disconnect.
+	 */
 	void Send(const char* data, const size_t len) noexcept
 	{
 		if(mConnected)
 		{
-			::send(mFd, data, len, MSG_DONTWAIT);
+			if(!mSendPending.empty())
+			{
+				mSendPending.insert(mSendPending.end(), data, data + len);
+				return;
+			}
+#ifdef COMMONLIBS_TLS
+			if(mSsl != nullptr && !mKernelTlsSend)
+			{
+				SendTls(data, len);
+				return;
+			}
+#endif
+			const auto written = WritePlain(data, len);
+			if(written >= 0 && static_cast<size_t>(written) < len)
+			{
+				KeepPending(data + written, len - written);
+			}
 			mSendInProgress = true;
 		}
 		else
@@ -98,16 +230,135 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Send @p count bytes of @p fileFd starting at @p offset
+	 *
+	 * Uses sendfile(), also on TLS connections when the kernel does the encryption.
+	 * Userspace TLS falls back to reading the file and encrypting it chunk by chunk, a chunk the socket wasn't ready for
+	 * is kept and counts as sent. Nothing is sent while data kept by Send() is still waiting.
+	 *
+	 * @return Number of bytes sent, -1 on error.
+	 */
+	ssize_t SendFile(int fileFd, off_t offset, const size_t count) noexcept
+	{
+		if(!mConnected)
+		{
+			mLogger->warn("Attempted sendfile on fd:{}, while not connected", mFd);
+			return -1;
+		}
+
+#ifdef COMMONLIBS_TLS
+		if(mSsl != nullptr && !mKernelTlsSend)
+		{
+			if(!mTlsEstablished)
+			{
+				mLogger->warn("Attempted sendfile on fd:{}, while TLS handshake is in progress", mFd);
+				return -1;
+			}
+
+			std::array<char, 16 * 1024> buf;
+			size_t sent = 0;
+			while(sent < count)
+			{
+				const auto len = ::pread(fileFd, buf.data(), std::min(buf.size(), count - sent), offset + sent);
+				if(len <= 0)
+				{
+					break;
+				}
+				if(!mSendPending.empty())
+				{
+					// Behind a write the socket wasn't ready for, the caller sends the rest later
+					break;
+				}
+				const auto written = WriteTls(buf.data(), len);
+				if(written < 0)
+				{
+					break;
+				}
+				if(written < len)
+				{
+					// The pending write owns the rest of the chunk now
+					KeepPending(buf.data() + written, len - written);
+				}
+				sent += len;
+			}
+			return sent;
+		}
+#endif
+
+		if(!mSendPending.empty())
+		{
+			return 0;
+		}
+		return ::sendfile(mFd, fileFd, &offset, count);
+	}
+
+	/**
+	 * @brief Send data with filedescriptors attached (SCM_RIGHTS)
+	 *
+	 * Only possible on unix domain sockets, at least one byte of data has to accompany the filedescriptors.
+	 * The filedescriptors are duplicated into the receiving process, the caller keeps ownership of @p fds.
+	 */
+	bool SendFiledescriptors(const char* data, const size_t len, const int* fds, const size_t count) noexcept
+	{
+		if(!mConnected || mDomain != AF_UNIX || len == 0 || count > MaxPassedFiledescriptors)
+		{
+			mLogger->error("Can't pass {} filedescriptors on fd:{}", count, mFd);
+			return false;
+		}
+		if(!mSendPending.empty())
+		{
+			mLogger->warn("Can't pass filedescriptors on fd:{} while earlier data is waiting", mFd);
+			return false;
+		}
+
+		iovec iov{const_cast<char*>(data), len};
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MaxPassedFiledescriptors)];
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+		const auto written = ::sendmsg(mFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(written == -1)
+		{
+			mLogger->error("Failed to pass filedescriptors on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		if(static_cast<size_t>(written) < len)
+		{
+			// The filedescriptors went with the first byte
+			KeepPending(data + written, len - written);
+		}
+
+		return true;
+	}
+
 	void Shutdown() noexcept
 	{
+		mResolver.Cancel();
+		CancelAttempts();
+#ifdef COMMONLIBS_TLS
+		FreeTls();
+#endif
+		mSendPending.clear();
 		if(mConnected)
 		{
 			mEventLoop.UnregisterFiledescriptor(mFd);
 			mConnected = false;
 		}
-		if(mFd)
+		if(mFd >= 0)
 		{
 			::close(mFd);
+			mFd = -1;
 		}
 	}
 
@@ -116,32 +367,246 @@ public:
 		return mConnected;
 	}
 
+	/**
+	 * @brief Apply socket options to this connection
+	 *
+	 * Options are applied immediately and stored, unset fields in @p options leave the current setting untouched.
+	 */
+	bool SetOptions(const SocketOptions& options) noexcept
+	{
+		mOptions.Merge(options);
+		if(mFd < 0)
+		{
+			return true;
+		}
+		return ApplySocketOptions(mFd, options, mLogger);
+	}
+
+	const SocketOptions& GetOptions() const noexcept
+	{
+		return mOptions;
+	}
+
+	/**
+	 * @brief Toggle TCP_CORK
+	 *
+	 * Cork before writing a burst of small messages and uncork afterwards to have them leave in full segments.
+	 */
+	bool SetCork(bool cork) noexcept
+	{
+		SocketOptions options;
+		options.mCork = cork;
+		return SetOptions(options);
+	}
+
+#ifdef COMMONLIBS_TLS
+	/**
+	 * @brief Run TLS on top of the next connection
+	 *
+	 * Has to be called before Connect(). OnConnected() is only called once the handshake has completed.
+	 * @p serverName is sent as SNI and, when the context verifies peers, checked against the certificate.
+	 */
+	void EnableTls(TlsContext& context, const std::string& serverName = "") noexcept
+	{
+		mTlsContext = &context;
+		mTlsServerName = serverName;
+	}
+
+	/**
+	 * @brief Whether the kernel does the symmetric crypto (kTLS) in both directions
+	 */
+	bool IsKernelTls() const noexcept
+	{
+		return mKernelTlsSend && mKernelTlsReceive;
+	}
+
+	bool IsTlsEstablished() const noexcept
+	{
+		return mTlsEstablished;
+	}
+
+	/**
+	 * @brief Start the server side TLS handshake on an accepted connection
+	 *
+	 * Used by StreamSocketServer, incoming data is only forwarded once the handshake has completed.
+	 */
+	void AcceptTls(TlsContext& context) noexcept
+	{
+		mTlsContext = &context;
+		StartTls();
+	}
+#endif
+
+	static constexpr std::size_t MaxPassedFiledescriptors = 16;
+
+	/// RFC 8305 recommended delay before racing the next address
+	static constexpr std::chrono::milliseconds ConnectionAttemptDelay{250};
+
 private:
+	/**
+	 * @brief Drop the current connection and any outstanding resolution or connection attempts
+	 */
+	void Reset() noexcept
+	{
+		mResolver.Cancel();
+		CancelAttempts();
+#ifdef COMMONLIBS_TLS
+		FreeTls();
+#endif
+		mSendPending.clear();
+
+		if(mFd >= 0)
+		{
+			if(mEventLoop.IsRegistered(mFd))
+			{
+				mEventLoop.UnregisterFiledescriptor(mFd);
+			}
+			::close(mFd);
+			mFd = -1;
+		}
+		mConnected = false;
+	}
+
+	void StartConnecting(const Resolver::Addresses& addresses) noexcept
+	{
+		mCandidates.clear();
+
+		// Interleave the address families, starting with the family getaddrinfo() preferred
+		std::vector<ResolvedAddress> preferred;
+		std::vector<ResolvedAddress> other;
+		for(const auto& addr : addresses)
+		{
+			(addr.GetFamily() == addresses.front().GetFamily() ? preferred : other).push_back(addr);
+		}
+		for(std::size_t i = 0; i < std::max(preferred.size(), other.size()); ++i)
+		{
+			if(i < preferred.size())
+			{
+				mCandidates.push_back(preferred[i]);
+			}
+			if(i < other.size())
+			{
+				mCandidates.push_back(other[i]);
+			}
+		}
+
+		mNextCandidate = 0;
+		StartNextAttempt();
+	}
+
+	/**
+	 * Completion is always handled from OnFiledescriptorWrite(), also when the connect succeeded instantly
+	 * as it tends to do for unix sockets. That way OnConnected() is never called from within Connect().
+	 */
+	void StartNextAttempt() noexcept
+	{
+		mEventLoop.RemoveTimer(&mAttemptTimer);
+
+		while(mNextCandidate < mCandidates.size())
+		{
+			const auto& addr = mCandidates[mNextCandidate++];
+
+			const int fd = ::socket(addr.GetFamily(), SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if(fd == -1)
+			{
+				mLogger->error("Failed to create socket, errno:{}", errno);
+				continue;
+			}
+			ApplySocketOptions(fd, mOptions, mLogger);
+
+			const int ret = ::connect(fd, addr.Get(), addr.mLength);
+			if((ret == -1) && (errno != EINPROGRESS))
+			{
+				mLogger->warn("Connect failed on fd:{}, errno:{}", fd, errno);
+				::close(fd);
+				continue;
+			}
+
+			if(ret == 0)
+			{
+				mLogger->info("fd:{} connected instantly", fd);
+			}
+
+			mEventLoop.RegisterFiledescriptor(fd, EPOLLOUT, this);
+			mAttempts.push_back(fd);
+
+			if(mNextCandidate < mCandidates.size())
+			{
+				mAttemptTimer.UpdateDeadline();
+				mEventLoop.AddTimer(&mAttemptTimer);
+			}
+			return;
+		}
+
+		if(mAttempts.empty())
+		{
+			mLogger->error("All connection attempts failed");
+			mHandler->OnDisconnect(this);
+		}
+	}
+
+	void CancelAttempts() noexcept
+	{
+		mEventLoop.RemoveTimer(&mAttemptTimer);
+		for(const int fd : mAttempts)
+		{
+			mEventLoop.UnregisterFiledescriptor(fd);
+			::close(fd);
+		}
+		mAttempts.clear();
+	}
 
 	void OnFiledescriptorWrite(int fd) final
 	{
+#ifdef COMMONLIBS_TLS
+		if(mSsl != nullptr && !mTlsEstablished)
+		{
+			DoHandshake();
+			return;
+		}
+#endif
+
 		if(!mConnected)
 		{
+			const auto attempt = std::find(mAttempts.begin(), mAttempts.end(), fd);
+			if(attempt == mAttempts.end())
+			{
+				return;
+			}
+			mAttempts.erase(attempt);
+
 			int err = 0;
 			socklen_t len = sizeof(int);
 			int status = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
-			if (status != -1)
+			if (status != -1 && err == 0)
 			{
-				if (err == 0)
+				CancelAttempts();
+				mFd = fd;
+				mDomain = detail::GetSocketIntOption(fd, SO_DOMAIN);
+				mEventLoop.ModifyFiledescriptor(fd, EPOLLIN | EPOLLRDHUP, this);
+				mConnected = true;
+				mLogger->info("Connection establisched on fd:{}", fd);
+#ifdef COMMONLIBS_TLS
+				if(mTlsContext != nullptr)
 				{
-					mEventLoop.ModifyFiledescriptor(fd, EPOLLIN | EPOLLRDHUP, this);
-					mConnected = true;
-					mLogger->info("Connection establisched on fd:{}", fd);
-					mHandler->OnConnected();
-				}
-				else
-				{
-					mEventLoop.UnregisterFiledescriptor(mFd);
-					mHandler->OnDisconnect(this);
-					mConnected = false;
+					StartTls();
+					return;
 				}
+#endif
+				mHandler->OnConnected();
+			}
+			else
+			{
+				mLogger->warn("Connection attempt on fd:{} failed, error:{}", fd, err);
+				mEventLoop.UnregisterFiledescriptor(fd);
+				::close(fd);
+				StartNextAttempt();
 			}
 		}
+		else if(!mSendPending.empty())
+		{
+			FlushPending();
+		}
 		else if(mSendInProgress)
 		{
 			
@@ -157,33 +622,363 @@ private:
 
 	void OnFiledescriptorRead(int fd) final
 	{
+#ifdef COMMONLIBS_TLS
+		if(mSsl != nullptr)
+		{
+			if(!mTlsEstablished)
+			{
+				DoHandshake();
+				return;
+			}
+			ReceiveTls();
+			// Also a write that wanted to read first, e.g. during a key update
+			if(mConnected && !mSendPending.empty())
+			{
+				FlushPending();
+			}
+			return;
+		}
+#endif
+
 		std::array<char, 512> readBuf = {0};
-		const auto len = ::recv(fd, readBuf.data(), sizeof(readBuf), MSG_DONTWAIT);
+		const auto len = (mDomain == AF_UNIX)
+			? ReceiveWithFiledescriptors(fd, readBuf.data(), sizeof(readBuf))
+			: ::recv(fd, readBuf.data(), sizeof(readBuf), MSG_DONTWAIT);
 
-		if(len == 0)
+		if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
 		{
-			mLogger->info("Socket has been disconnected, closing filedescriptor. fd:{}", fd);
-			mEventLoop.UnregisterFiledescriptor(mFd);
-			mHandler->OnDisconnect(this);
-			mConnected = false;
 			return;
 		}
 
+		if(len <= 0)
+		{
+			Disconnected();
+			return;
+		}
+
+		if(mOptions.mQuickAck.value_or(false))
+		{
+			detail::SetSocketOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", mLogger);
+		}
+
 		mHandler->OnIncomingData(this, readBuf.data(), len);
+
+		// A socket that is readable as well is only reported readable, don't wait for the write event
+		if(mConnected && !mSendPending.empty())
+		{
+			FlushPending();
+		}
+	}
+
+	void Disconnected() noexcept
+	{
+		mLogger->info("Socket has been disconnected, closing filedescriptor. fd:{}", mFd);
+		mEventLoop.UnregisterFiledescriptor(mFd);
+		mConnected = false;
+		mSendPending.clear();
+		mHandler->OnDisconnect(this);
+	}
+
+	/**
+	 * @brief send() until all of @p len is written or the socket buffer is full
+	 *
+	 * @return Number of bytes written, -1 when the connection failed and was shut down.
+	 */
+	ssize_t WritePlain(const char* data, const size_t len) noexcept
+	{
+		size_t written = 0;
+		while(written < len)
+		{
+			// A peer that closed the connection is noticed on the next read, not by SIGPIPE
+			const auto ret = ::send(mFd, data + written, len - written, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(ret >= 0)
+			{
+				written += ret;
+				continue;
+			}
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			mLogger->error("Send failed on fd:{}, errno:{}", mFd, errno);
+			mSendPending.clear();
+			::shutdown(mFd, SHUT_RDWR);
+			return -1;
+		}
+		return written;
+	}
+
+	/**
+	 * @brief Keep the @p len bytes the socket didn't take and send them when it is writable
+	 *
+	 * For userspace TLS these are what SSL_write() has to be retried with, the buffer may move in between as
+	 * SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER is set.
+	 */
+	void KeepPending(const char* data, const size_t len)
+	{
+		mSendPending.assign(data, data + len);
+		mEventLoop.ModifyFiledescriptor(mFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, this);
+	}
+
+	void FlushPending() noexcept
+	{
+#ifdef COMMONLIBS_TLS
+		const auto written = (mSsl != nullptr && !mKernelTlsSend)
+			? WriteTls(mSendPending.data(), mSendPending.size())
+			: WritePlain(mSendPending.data(), mSendPending.size());
+#else
+		const auto written = WritePlain(mSendPending.data(), mSendPending.size());
+#endif
+		if(written > 0)
+		{
+			mSendPending.erase(mSendPending.begin(), mSendPending.begin() + written);
+		}
+		if(mSendPending.empty())
+		{
+			mEventLoop.ModifyFiledescriptor(mFd, EPOLLIN | EPOLLRDHUP, this);
+		}
+	}
+
+#ifdef COMMONLIBS_TLS
+	void StartTls() noexcept
+	{
+		mSsl = ::SSL_new(mTlsContext->Get());
+		if(mSsl == nullptr || ::SSL_set_fd(mSsl, mFd) != 1)
+		{
+			mLogger->error("Failed to setup TLS on fd:{}: {}", mFd, TlsContext::GetErrorString());
+			Disconnected();
+			return;
+		}
+
+		if(mTlsContext->GetRole() == TlsContext::Role::Client)
+		{
+			if(!mTlsServerName.empty())
+			{
+				::SSL_set_tlsext_host_name(mSsl, mTlsServerName.c_str());
+				if(mTlsContext->IsVerifyingPeer())
+				{
+					::SSL_set1_host(mSsl, mTlsServerName.c_str());
+				}
+			}
+			::SSL_set_connect_state(mSsl);
+		}
+		else
+		{
+			::SSL_set_accept_state(mSsl);
+		}
+
+		DoHandshake();
+	}
+
+	void DoHandshake() noexcept
+	{
+		const int ret = ::SSL_do_handshake(mSsl);
+		if(ret == 1)
+		{
+			mTlsEstablished = true;
+			mKernelTlsSend = BIO_get_ktls_send(::SSL_get_wbio(mSsl));
+			mKernelTlsReceive = BIO_get_ktls_recv(::SSL_get_rbio(mSsl));
+			mEventLoop.ModifyFiledescriptor(mFd, EPOLLIN | EPOLLRDHUP, this);
+			mLogger->info("TLS established on fd:{}, {} {}, kTLS send:{} receive:{}",
+					mFd, ::SSL_get_version(mSsl), ::SSL_get_cipher_name(mSsl), mKernelTlsSend, mKernelTlsReceive);
+
+			if(mTlsContext->GetRole() == TlsContext::Role::Client)
+			{
+				mHandler->OnConnected();
+			}
+			return;
+		}
+
+		switch(::SSL_get_error(mSsl, ret))
+		{
+			case SSL_ERROR_WANT_READ:
+			{
+				mEventLoop.ModifyFiledescriptor(mFd, EPOLLIN | EPOLLRDHUP, this);
+				break;
+			}
+			case SSL_ERROR_WANT_WRITE:
+			{
+				mEventLoop.ModifyFiledescriptor(mFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, this);
+				break;
+			}
+			default:
+			{
+				mLogger->error("TLS handshake failed on fd:{}: {}", mFd, TlsContext::GetErrorString());
+				Disconnected();
+				break;
+			}
+		}
+	}
+
+	/**
+	 * With kTLS receive active SSL_read() is a plain recvmsg() that also picks up non data records.
+	 * Decrypted data can sit in the SSL buffers without the fd being readable, so drain until it blocks.
+	 */
+	void ReceiveTls() noexcept
+	{
+		std::array<char, 16 * 1024> readBuf;
+		while(mConnected)
+		{
+			const int len = ::SSL_read(mSsl, readBuf.data(), readBuf.size());
+			if(len > 0)
+			{
+				mHandler->OnIncomingData(this, readBuf.data(), len);
+				continue;
+			}
+
+			const int err = ::SSL_get_error(mSsl, len);
+			if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+			{
+				return;
+			}
+			if(err != SSL_ERROR_ZERO_RETURN)
+			{
+				mLogger->warn("TLS read failed on fd:{}: {}", mFd, TlsContext::GetErrorString());
+			}
+			Disconnected();
+			return;
+		}
+	}
+
+	void SendTls(const char* data, const size_t len) noexcept
+	{
+		if(!mTlsEstablished)
+		{
+			mLogger->warn("Attempted send on fd:{}, while TLS handshake is in progress", mFd);
+			return;
+		}
+
+		// SSL_write() has to be retried with what it didn't take, Send() queues later data behind that
+		const auto written = WriteTls(data, len);
+		if(written >= 0 && static_cast<size_t>(written) < len)
+		{
+			KeepPending(data + written, len - written);
+		}
+	}
+
+	/**
+	 * @brief SSL_write() until all of @p len is written or the socket is not ready
+	 *
+	 * A failed connection is shut down, the read that notices it reports the disconnect.
+	 *
+	 * @return Number of bytes written, -1 on error.
+	 */
+	ssize_t WriteTls(const char* data, const size_t len) noexcept
+	{
+		size_t written = 0;
+		while(written < len)
+		{
+			// Partial writes are enabled, a record at a time may be taken
+			const int ret = ::SSL_write(mSsl, data + written, static_cast<int>(len - written));
+			if(ret > 0)
+			{
+				written += ret;
+				continue;
+			}
+
+			const int err = ::SSL_get_error(mSsl, ret);
+			if(err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+			{
+				break;
+			}
+			mLogger->error("TLS send failed on fd:{}: {}", mFd, TlsContext::GetErrorString());
+			mSendPending.clear();
+			::shutdown(mFd, SHUT_RDWR);
+			return -1;
+		}
+		return written;
+	}
+
+	void FreeTls() noexcept
+	{
+		if(mSsl == nullptr)
+		{
+			return;
+		}
+
+		if(mTlsEstablished)
+		{
+			::SSL_shutdown(mSsl);
+		}
+		::SSL_free(mSsl);
+		mSsl = nullptr;
+		mTlsEstablished = false;
+		mKernelTlsSend = false;
+		mKernelTlsReceive = false;
+	}
+#endif
+
+	ssize_t ReceiveWithFiledescriptors(int fd, char* data, size_t size) noexcept
+	{
+		iovec iov{data, size};
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MaxPassedFiledescriptors)];
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		const auto len = ::recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if(len <= 0)
+		{
+			return len;
+		}
+
+		if(msg.msg_flags & MSG_CTRUNC)
+		{
+			mLogger->warn("Passed filedescriptors truncated on fd:{}", fd);
+		}
+
+		for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			{
+				std::array<int, MaxPassedFiledescriptors> fds;
+				const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				std::memcpy(fds.data(), CMSG_DATA(cmsg), count * sizeof(int));
+				mHandler->OnIncomingFiledescriptors(this, fds.data(), count);
+			}
+		}
+
+		return len;
 	}
 
 private:
 	EventLoop::EventLoop& mEventLoop;
 	IStreamSocketHandler* mHandler;
 
-	int mFd = 0;
-	struct sockaddr_in remote;
+	Resolver mResolver;
+	EventLoop::EventLoop::Timer mAttemptTimer;
+	std::vector<ResolvedAddress> mCandidates;
+	std::size_t mNextCandidate = 0;
+	std::vector<int> mAttempts;
+
+	int mFd = -1;
+	int mDomain = AF_INET;
 
 	uint32_t mAddress = 0;
 	//uint16_t mPort = 0;
 
 	bool mConnected = false;
 	bool mSendInProgress = false;
+	/// Sends wait here while the socket isn't writable
+	std::vector<char> mSendPending;
+
+	SocketOptions mOptions;
+
+#ifdef COMMONLIBS_TLS
+	TlsContext* mTlsContext = nullptr;
+	std::string mTlsServerName;
+	SSL* mSsl = nullptr;
+	bool mTlsEstablished = false;
+	bool mKernelTlsSend = false;
+	bool mKernelTlsReceive = false;
+#endif
 
 	std::shared_ptr<spdlog::logger> mLogger;
 };
@@ -198,12 +993,19 @@ public:
 class StreamSocketServer : public EventLoop::IFiledescriptorCallbackHandler
 {
 public:
+	/// Connections the kernel completes before they are accepted, a burst of clients beyond it has to retry
+	static constexpr int ListenBacklog = SOMAXCONN;
+
 	StreamSocketServer(EventLoop::EventLoop& ev, IStreamSocketServerHandler* handler)
 		: mEventLoop(ev)
 		, mHandler(handler)
 	{
-		auto streamSocketServer = spdlog::stdout_color_mt("StreamSocketServer");
 		mLogger = spdlog::get("StreamSocketServer");
+		if(mLogger == nullptr)
+		{
+			auto streamSocketServer = spdlog::stdout_color_mt("StreamSocketServer");
+			mLogger = spdlog::get("StreamSocketServer");
+		}
 
 		mFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
@@ -222,8 +1024,43 @@ public:
 		}
 
 		::close(mFd);
+
+		if(!mUnixPath.empty() && mUnixPath[0] != '@')
+		{
+			::unlink(mUnixPath.c_str());
+		}
+	}
+
+	/**
+	 * @brief Set the default options for accepted connections
+	 *
+	 * Every connection accepted after this call inherits @p options.
+	 * Buffer sizes are also applied to the listening socket, the window scale is negotiated during the handshake
+	 * and can't be grown afterwards.
+	 */
+	void SetConnectionOptions(const SocketOptions& options) noexcept
+	{
+		mConnectionOptions = options;
+		ApplyListenOptions();
 	}
 
+	const SocketOptions& GetConnectionOptions() const noexcept
+	{
+		return mConnectionOptions;
+	}
+
+#ifdef COMMONLIBS_TLS
+	/**
+	 * @brief Run TLS on every connection accepted after this call
+	 *
+	 * @p context has to be a server context with a certificate loaded and has to outlive the server.
+	 */
+	void EnableTls(TlsContext& context) noexcept
+	{
+		mTlsContext = &context;
+	}
+#endif
+
 	void BindAndListen(uint16_t port)
 	{
 		//const uint16_t port = ::atoi(port);
@@ -237,7 +1074,7 @@ public:
 			throw std::runtime_error("Unable to bind address to socket");
 		}
 
-		if(::listen(mFd, 8) == -1)
+		if(::listen(mFd, ListenBacklog) == -1)
 		{
 			mLogger->critical("Unable to open socket for listening");
 			throw std::runtime_error("Unable to open socket for listening");
@@ -248,6 +1085,48 @@ public:
 		mLogger->info("Started TCP server fd:{}, port:{}", mFd, port);
 	}
 
+	/**
+	 * @brief Listen on a unix domain socket instead of TCP
+	 *
+	 * @p path is either a filesystem path or, with a leading '@', a name in the abstract namespace.
+	 * A stale socket file left at @p path is removed first, the file is removed again on destruction.
+	 */
+	void BindAndListenUnix(const std::string& path)
+	{
+		sockaddr_un addr;
+		const socklen_t addrLen = detail::MakeUnixAddress(path, addr);
+		if(addrLen == 0)
+		{
+			mLogger->critical("Invalid unix socket path: {}", path);
+			throw std::runtime_error("Invalid unix socket path");
+		}
+
+		::close(mFd);
+		mFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		ApplyListenOptions();
+
+		if(path[0] != '@')
+		{
+			::unlink(path.c_str());
+		}
+
+		if(::bind(mFd, reinterpret_cast<struct sockaddr *>(&addr), addrLen) == -1) {
+			mLogger->critical("Unable to bind unix socket path: {}, errno:{}", path, errno);
+			throw std::runtime_error("Unable to bind address to socket");
+		}
+		mUnixPath = path;
+
+		if(::listen(mFd, ListenBacklog) == -1)
+		{
+			mLogger->critical("Unable to open socket for listening");
+			throw std::runtime_error("Unable to open socket for listening");
+		}
+
+		mEventLoop.RegisterFiledescriptor(mFd, EPOLLIN, this);
+
+		mLogger->info("Started unix server fd:{}, path:{}", mFd, path);
+	}
+
 	void Shutdown()
 	{
 		mLogger->info("Shutting down streamsocket server");
@@ -260,11 +1139,19 @@ public:
 	}
 
 private:
+	void ApplyListenOptions() noexcept
+	{
+		SocketOptions listenOptions;
+		listenOptions.mSendBufferSize = mConnectionOptions.mSendBufferSize;
+		listenOptions.mReceiveBufferSize = mConnectionOptions.mReceiveBufferSize;
+		ApplySocketOptions(mFd, listenOptions, mLogger);
+	}
+
 	void OnFiledescriptorRead(int fd) final
 	{
-		sockaddr_in remote;
-		socklen_t len = sizeof(sockaddr_in);
-		int ret = ::accept(fd, reinterpret_cast<sockaddr *>(&remote), &len);
+		sockaddr_storage remote;
+		socklen_t len = sizeof(sockaddr_storage);
+		int ret = ::accept4(fd, reinterpret_cast<sockaddr *>(&remote), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (ret == -1)
 		{
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
@@ -283,7 +1170,13 @@ private:
 			if(connHandler != nullptr)
 			{
 				//mConnections.push_back(StreamSocket(mEventLoop, ret, connHandler));
-				mConnections.push_back(std::make_unique<StreamSocket>(mEventLoop, ret, connHandler));
+				mConnections.push_back(std::make_unique<StreamSocket>(mEventLoop, ret, connHandler, mConnectionOptions));
+#ifdef COMMONLIBS_TLS
+				if(mTlsContext != nullptr)
+				{
+					mConnections.back()->AcceptTls(*mTlsContext);
+				}
+#endif
 			}
 			else
 			{
@@ -304,6 +1197,13 @@ private:
 	//std::vector<StreamSocket> mConnections;
 	std::vector<std::unique_ptr<StreamSocket>> mConnections; //TODO This is dumb, user can not access the actual connection
 
+	SocketOptions mConnectionOptions;
+	std::string mUnixPath;
+
+#ifdef COMMONLIBS_TLS
+	TlsContext* mTlsContext = nullptr;
+#endif
+
 	std::shared_ptr<spdlog::logger> mLogger;
 };
 
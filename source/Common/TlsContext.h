@@ -0,0 +1,161 @@
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <spdlog/spdlog.h>
+
+#include "Common/NonCopyable.h"
+
+namespace Common {
+
+/**
+ * @brief Shared TLS configuration for StreamSocket and StreamSocketServer
+ *
+ * Wraps an OpenSSL SSL_CTX. The handshake is always done by OpenSSL, afterwards the symmetric crypto is
+ * handed to the kernel (kTLS, TCP_ULP "tls") when both OpenSSL and the kernel support the negotiated cipher.
+ * When kTLS is unavailable the connection falls back to encrypting in userspace, see StreamSocket::IsKernelTls().
+ *
+ * Only available when building with COMMONLIBS_TLS.
+ */
+class TlsContext
+	: Common::NonCopyable<TlsContext>
+{
+public:
+	enum class Role : std::uint8_t {
+		Client = 0,
+		Server = 1
+	};
+
+	TlsContext(Role role)
+		: mRole(role)
+		, mContext(::SSL_CTX_new(role == Role::Client ? ::TLS_client_method() : ::TLS_server_method()))
+	{
+		mLogger = spdlog::get("TlsContext");
+		if(mLogger == nullptr)
+		{
+			auto tlsContextLogger = spdlog::stdout_color_mt("TlsContext");
+			mLogger = spdlog::get("TlsContext");
+		}
+
+		if(mContext == nullptr)
+		{
+			mLogger->critical("Failed to create TLS context: {}", GetErrorString());
+			throw std::runtime_error("Failed to create TLS context");
+		}
+
+		::SSL_CTX_set_min_proto_version(mContext, TLS1_2_VERSION);
+		::SSL_CTX_set_mode(mContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SetKernelOffload(true);
+	}
+
+	~TlsContext()
+	{
+		::SSL_CTX_free(mContext);
+	}
+
+	/**
+	 * @brief Load the certificate chain and private key, both PEM encoded
+	 */
+	void LoadCertificate(const std::string& certificateFile, const std::string& keyFile)
+	{
+		if(::SSL_CTX_use_certificate_chain_file(mContext, certificateFile.c_str()) != 1)
+		{
+			mLogger->critical("Unable to load certificate {}: {}", certificateFile, GetErrorString());
+			throw std::runtime_error("Unable to load certificate");
+		}
+
+		if(::SSL_CTX_use_PrivateKey_file(mContext, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+			::SSL_CTX_check_private_key(mContext) != 1)
+		{
+			mLogger->critical("Unable to load private key {}: {}", keyFile, GetErrorString());
+			throw std::runtime_error("Unable to load private key");
+		}
+	}
+
+	/**
+	 * @brief Verify the peer against @p caFile, or the system store when empty
+	 *
+	 * Clients also check the certificate against the server name passed to StreamSocket::EnableTls().
+	 */
+	void SetVerifyPeer(const std::string& caFile = "")
+	{
+		const int ret = caFile.empty()
+			? ::SSL_CTX_set_default_verify_paths(mContext)
+			: ::SSL_CTX_load_verify_locations(mContext, caFile.c_str(), nullptr);
+		if(ret != 1)
+		{
+			mLogger->critical("Unable to load verify locations: {}", GetErrorString());
+			throw std::runtime_error("Unable to load verify locations");
+		}
+
+		const int mode = (mRole == Role::Server)
+			? SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT
+			: SSL_VERIFY_PEER;
+		::SSL_CTX_set_verify(mContext, mode, nullptr);
+		mVerifyPeer = true;
+	}
+
+	/**
+	 * @brief Toggle kernel TLS offload, enabled by default
+	 */
+	void SetKernelOffload(bool enable) noexcept
+	{
+		if(enable)
+		{
+			::SSL_CTX_set_options(mContext, SSL_OP_ENABLE_KTLS);
+		}
+		else
+		{
+			::SSL_CTX_clear_options(mContext, SSL_OP_ENABLE_KTLS);
+		}
+	}
+
+	bool IsVerifyingPeer() const noexcept
+	{
+		return mVerifyPeer;
+	}
+
+	Role GetRole() const noexcept
+	{
+		return mRole;
+	}
+
+	SSL_CTX* Get() const noexcept
+	{
+		return mContext;
+	}
+
+	/**
+	 * @brief Pop and format the OpenSSL error queue of this thread
+	 */
+	static std::string GetErrorString()
+	{
+		std::string ret;
+		while(const unsigned long err = ::ERR_get_error())
+		{
+			char buf[256];
+			::ERR_error_string_n(err, buf, sizeof(buf));
+			if(!ret.empty())
+			{
+				ret += "; ";
+			}
+			ret += buf;
+		}
+		return ret.empty() ? "unknown error" : ret;
+	}
+
+private:
+	Role mRole;
+	SSL_CTX* mContext;
+	bool mVerifyPeer = false;
+
+	std::shared_ptr<spdlog::logger> mLogger;
+};
+
+} // namespace Common
+
+#endif // TLSCONTEXT_H
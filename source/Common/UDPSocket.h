@@ -1,11 +1,21 @@
 #ifndef UDPSOCKET_H
 #define UDPSOCKET_H
 
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string_view>
+#include <vector>
+
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 #include "EventLoop.h"
+#include "SocketOptions.h"
+#include "Span.h"
 
 namespace Common {
 
@@ -19,16 +29,170 @@ using namespace EventLoop;
 
 class UDPSocket;
 
-//TODO Implement interface features
+/**
+ * @brief Destination parsed once, so sending to it doesn't have to parse the address again
+ */
+class UDPEndpoint
+{
+public:
+	UDPEndpoint() = default;
+
+	UDPEndpoint(const char* addr, const uint16_t port) noexcept
+	{
+		mAddress.sin_family = AF_INET;
+		mAddress.sin_port = htons(port);
+		mValid = (addr != nullptr) && (::inet_pton(AF_INET, addr, &mAddress.sin_addr) == 1);
+	}
+
+	/**
+	 * @brief Endpoint for a received address, e.g. to reply to Datagram::GetSource()
+	 */
+	explicit UDPEndpoint(const sockaddr* addr) noexcept
+	{
+		mValid = (addr != nullptr) && (addr->sa_family == AF_INET);
+		if(mValid)
+		{
+			std::memcpy(&mAddress, addr, sizeof(mAddress));
+		}
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
+	const sockaddr* Get() const noexcept
+	{
+		return reinterpret_cast<const sockaddr*>(&mAddress);
+	}
+
+	socklen_t GetLength() const noexcept
+	{
+		return sizeof(mAddress);
+	}
+
+	bool operator==(const UDPEndpoint& rhs) const noexcept
+	{
+		return mAddress.sin_addr.s_addr == rhs.mAddress.sin_addr.s_addr && mAddress.sin_port == rhs.mAddress.sin_port;
+	}
+
+private:
+	sockaddr_in mAddress{};
+	bool mValid = false;
+};
+
+/**
+ * @brief A received datagram, points into the receive buffers of the socket
+ *
+ * Only valid for the duration of the OnIncomingDatagrams() call.
+ */
+struct Datagram
+{
+	char* mData;
+	std::size_t mLength;
+	const sockaddr_storage* mSource;
+	socklen_t mSourceLength;
+	/// The datagram didn't fit the receive buffer and was cut off, see UDPSocket::SetReceiveBuffers()
+	bool mTruncated;
+	/// Kernel receive time (CLOCK_REALTIME), zero unless enabled with UDPSocket::SetReceiveTimestamps()
+	std::chrono::nanoseconds mTimestamp;
+	/// Destination address from the IP header, zero unless enabled with UDPSocket::SetReceiveDestination()
+	in_addr mDestination;
+
+	std::string_view GetData() const noexcept
+	{
+		return std::string_view(mData, mLength);
+	}
+
+	const sockaddr* GetSource() const noexcept
+	{
+		return reinterpret_cast<const sockaddr*>(mSource);
+	}
+};
+
 class IUDPSocketHandler
 {
 public:
-	//virtual void OnConnected() = 0;
-	//virtual void OnDisconnect() = 0;
-	//virtual void OnIncomingData(char* data, size_t len) = 0;
+	/**
+	 * @brief Called with every batch of datagrams read from a listening socket
+	 */
+	virtual void OnIncomingDatagrams(UDPSocket* /*socket*/, Span<Datagram> /*datagrams*/) {}
 	virtual ~IUDPSocketHandler() {}
 };
 
+/**
+ * @brief Passes datagrams on to a handler per destination address
+ *
+ * For a single socket joined to several multicast groups, requires UDPSocket::SetReceiveDestination().
+ * Consecutive datagrams to the same destination are passed on as one span, datagrams to a destination
+ * without handler are dropped.
+ */
+class UDPDestinationDemux : public IUDPSocketHandler
+{
+public:
+	bool Add(const char* destination, IUDPSocketHandler* handler) noexcept
+	{
+		in_addr addr{};
+		if(::inet_pton(AF_INET, destination, &addr) != 1)
+		{
+			return false;
+		}
+		Remove(destination);
+		mHandlers.emplace_back(addr.s_addr, handler);
+		return true;
+	}
+
+	void Remove(const char* destination) noexcept
+	{
+		in_addr addr{};
+		if(::inet_pton(AF_INET, destination, &addr) != 1)
+		{
+			return;
+		}
+		mHandlers.erase(std::remove_if(std::begin(mHandlers), std::end(mHandlers),
+			[&addr](const auto& entry) { return entry.first == addr.s_addr; }), std::end(mHandlers));
+	}
+
+	/**
+	 * @brief Datagrams dropped because no handler was registered for their destination
+	 */
+	std::size_t GetUnmatched() const noexcept
+	{
+		return mUnmatched;
+	}
+
+	void OnIncomingDatagrams(UDPSocket* socket, Span<Datagram> datagrams) final
+	{
+		std::size_t first = 0;
+		while(first < datagrams.size())
+		{
+			const in_addr_t destination = datagrams[first].mDestination.s_addr;
+			std::size_t last = first + 1;
+			while(last < datagrams.size() && datagrams[last].mDestination.s_addr == destination)
+			{
+				++last;
+			}
+
+			// Few groups per socket, a linear search beats a map here
+			const auto it = std::find_if(std::begin(mHandlers), std::end(mHandlers),
+				[destination](const auto& entry) { return entry.first == destination; });
+			if(it != std::end(mHandlers))
+			{
+				it->second->OnIncomingDatagrams(socket, Span<Datagram>(datagrams.data() + first, last - first));
+			}
+			else
+			{
+				mUnmatched += last - first;
+			}
+			first = last;
+		}
+	}
+
+private:
+	std::vector<std::pair<in_addr_t, IUDPSocketHandler*>> mHandlers;
+	std::size_t mUnmatched = 0;
+};
+
 class UDPSocket : public EventLoop::IFiledescriptorCallbackHandler
 {
 public:
@@ -45,6 +209,39 @@ public:
 		}
 
 		fcntl(mFd, F_SETFL, O_NONBLOCK);
+		SetReceiveBuffers(DefaultReceiveBatch, DefaultReceiveBufferSize);
+		mAlive = std::make_shared<bool>(true);
+	}
+
+	~UDPSocket()
+	{
+		if(mListening)
+		{
+			mEventLoop.UnregisterFiledescriptor(mFd);
+		}
+		::close(mFd);
+	}
+
+	UDPSocket(EventLoop::EventLoop& ev, IUDPSocketHandler* handler, const SocketOptions& options) noexcept
+		: UDPSocket(ev, handler)
+	{
+		SetOptions(options);
+	}
+
+	/**
+	 * @brief Apply socket options to this socket
+	 *
+	 * TCP specific fields in @p options are ignored.
+	 */
+	bool SetOptions(const SocketOptions& options) noexcept
+	{
+		mOptions.Merge(options);
+		return ApplySocketOptions(mFd, options, mLogger);
+	}
+
+	const SocketOptions& GetOptions() const noexcept
+	{
+		return mOptions;
 	}
 
 	void SetDefaultAddress(const char* addr) noexcept
@@ -79,9 +276,189 @@ public:
 		mPort = port;
 	}
 
-	void StartListening(const char* localAddr, const uint16_t localPort) noexcept
+	/**
+	 * @brief Bind to @p localAddr and @p localPort and start receiving
+	 *
+	 * A null or empty @p localAddr binds to all interfaces.
+	 */
+	void StartListening(const char* localAddr, const uint16_t localPort)
+	{
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(localPort);
+		local.sin_addr.s_addr = INADDR_ANY;
+		if(localAddr != nullptr && *localAddr != '\0' && ::inet_pton(AF_INET, localAddr, &local.sin_addr) != 1)
+		{
+			mLogger->critical("Invalid local address: {}", localAddr);
+			throw std::runtime_error("Invalid local address");
+		}
+
+		const int reuse = 1;
+		::setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if(::bind(mFd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == -1)
+		{
+			mLogger->critical("Unable to bind UDP socket to port:{}, errno:{}", localPort, errno);
+			throw std::runtime_error("Unable to bind UDP socket");
+		}
+
+		mEventLoop.RegisterFiledescriptor(mFd, EPOLLIN, this);
+		mListening = true;
+
+		mLogger->info("Listening for datagrams on fd:{}, port:{}", mFd, localPort);
+	}
+
+	/**
+	 * @brief Set how many datagrams are read per recvmmsg() call and the buffer size for each
+	 *
+	 * All buffers are allocated upfront, receiving doesn't allocate.
+	 */
+	void SetReceiveBuffers(std::size_t count, std::size_t size) noexcept
+	{
+		mReceiveBufferSize = size;
+		mReceiveBuffer.assign(count * size, 0);
+		mReceiveAddresses.resize(count);
+		mReceiveVectors.resize(count);
+		mReceiveHeaders.resize(count);
+		mReceiveControl.resize(count);
+		// With GRO a buffer holds up to 64 coalesced datagrams, reserve so splitting doesn't allocate
+		mDatagrams.clear();
+		mDatagrams.reserve(mReceiveOffload ? count * MaxSegments : count);
+
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			mReceiveVectors[i].iov_base = mReceiveBuffer.data() + i * size;
+			mReceiveVectors[i].iov_len = size;
+		}
+	}
+
+	/**
+	 * @brief Let the kernel coalesce incoming datagrams of a flow (UDP GRO)
+	 *
+	 * Coalesced datagrams are split again before they are passed to the handler, so handlers see no difference.
+	 * Receive buffers are grown to 64KiB to fit a coalesced batch.
+	 *
+	 * @return false when the kernel doesn't support UDP_GRO.
+	 */
+	bool SetReceiveOffload(bool enable) noexcept
+	{
+		const int value = enable ? 1 : 0;
+		if(::setsockopt(mFd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == -1)
+		{
+			mLogger->warn("Failed to set UDP_GRO on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+
+		mReceiveOffload = enable;
+		SetReceiveBuffers(mReceiveHeaders.size(), enable ? std::max<std::size_t>(mReceiveBufferSize, MaxGroSize) : mReceiveBufferSize);
+		return true;
+	}
+
+	/**
+	 * @brief Attach software receive timestamps (SO_TIMESTAMPNS) to every datagram
+	 */
+	bool SetReceiveTimestamps(bool enable) noexcept
 	{
+		const int value = enable ? 1 : 0;
+		if(::setsockopt(mFd, SOL_SOCKET, SO_TIMESTAMPNS, &value, sizeof(value)) == -1)
+		{
+			mLogger->warn("Failed to set SO_TIMESTAMPNS on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		mReceiveTimestamps = enable;
+		return true;
+	}
 
+	/**
+	 * @brief Fill Datagram::mDestination with the destination address of every datagram (IP_PKTINFO)
+	 *
+	 * Tells apart the groups when one socket joined several, see UDPDestinationDemux.
+	 */
+	bool SetReceiveDestination(bool enable) noexcept
+	{
+		const int value = enable ? 1 : 0;
+		if(::setsockopt(mFd, IPPROTO_IP, IP_PKTINFO, &value, sizeof(value)) == -1)
+		{
+			mLogger->warn("Failed to set IP_PKTINFO on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		mReceiveDestination = enable;
+		return true;
+	}
+
+	/**
+	 * @brief Receive datagrams sent to multicast @p group on the interface with address @p interface
+	 *
+	 * A null @p interface lets the kernel pick one from the routing table. The socket has to be listening on
+	 * the port the group is sent to, bound to all interfaces or to the group address.
+	 */
+	bool JoinGroup(const char* group, const char* interface = nullptr) noexcept
+	{
+		return ChangeMembership(IP_ADD_MEMBERSHIP, group, nullptr, interface);
+	}
+
+	bool LeaveGroup(const char* group, const char* interface = nullptr) noexcept
+	{
+		return ChangeMembership(IP_DROP_MEMBERSHIP, group, nullptr, interface);
+	}
+
+	/**
+	 * @brief Source specific join, only datagrams from @p source sent to @p group are received
+	 */
+	bool JoinSourceGroup(const char* group, const char* source, const char* interface = nullptr) noexcept
+	{
+		return ChangeMembership(IP_ADD_SOURCE_MEMBERSHIP, group, source, interface);
+	}
+
+	bool LeaveSourceGroup(const char* group, const char* source, const char* interface = nullptr) noexcept
+	{
+		return ChangeMembership(IP_DROP_SOURCE_MEMBERSHIP, group, source, interface);
+	}
+
+	/**
+	 * @brief Whether multicast sent from this socket is also delivered to listeners on this host
+	 */
+	bool SetMulticastLoop(bool enable) noexcept
+	{
+		const unsigned char value = enable ? 1 : 0;
+		if(::setsockopt(mFd, IPPROTO_IP, IP_MULTICAST_LOOP, &value, sizeof(value)) == -1)
+		{
+			mLogger->warn("Failed to set IP_MULTICAST_LOOP on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Number of router hops multicast sent from this socket may cross, the kernel default is 1
+	 */
+	bool SetMulticastTtl(uint8_t ttl) noexcept
+	{
+		const unsigned char value = ttl;
+		if(::setsockopt(mFd, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) == -1)
+		{
+			mLogger->warn("Failed to set IP_MULTICAST_TTL on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Send multicast out of the interface with address @p interface instead of the routed one
+	 */
+	bool SetMulticastInterface(const char* interface) noexcept
+	{
+		in_addr addr{};
+		if(!ParseInterface(interface, addr))
+		{
+			return false;
+		}
+		if(::setsockopt(mFd, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr)) == -1)
+		{
+			mLogger->warn("Failed to set IP_MULTICAST_IF on fd:{}, errno:{}", mFd, errno);
+			return false;
+		}
+		return true;
 	}
 
 	void Send(const char* data, size_t len, const char* dst = nullptr, const uint16_t port = 0) const noexcept
@@ -118,7 +495,248 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Send a single datagram to a pre-parsed endpoint
+	 */
+	void Send(const char* data, size_t len, const UDPEndpoint& dst) const noexcept
+	{
+		const auto ret = ::sendto(mFd, data, len, MSG_DONTWAIT, dst.Get(), dst.GetLength());
+		if(ret == -1)
+		{
+			mLogger->error("UDP sendto failed with errno:{}", errno);
+		}
+	}
+
+	/**
+	 * @brief Copy a datagram into the send batch
+	 *
+	 * The batch is written with a single sendmmsg() on the next loop cycle, or earlier with Flush().
+	 */
+	void Queue(const char* data, size_t len, const UDPEndpoint& dst) noexcept
+	{
+		mSendQueue.push_back(QueuedDatagram{mSendBuffer.size(), len, dst});
+		mSendBuffer.insert(std::end(mSendBuffer), data, data + len);
+
+		if(!mFlushScheduled)
+		{
+			mFlushScheduled = true;
+			std::weak_ptr<bool> alive = mAlive;
+			mEventLoop.SheduleForNextCycle([this, alive](){
+				if(!alive.expired())
+				{
+					mFlushScheduled = false;
+					Flush();
+				}
+			});
+		}
+	}
+
+	/**
+	 * @brief Let the kernel split same size datagrams to the same destination (UDP GSO)
+	 *
+	 * Consecutive queued datagrams with the same destination and size, optionally followed by one shorter
+	 * datagram, are passed down as a single buffer with UDP_SEGMENT. Falls back to separate datagrams
+	 * when the kernel rejects it.
+	 */
+	void SetSegmentation(bool enable) noexcept
+	{
+		mSegmentation = enable;
+	}
+
+	/**
+	 * @brief Write all queued datagrams
+	 *
+	 * @return The number of datagrams written, datagrams the socket buffer had no room for are dropped.
+	 */
+	std::size_t Flush() noexcept
+	{
+		if(mSendQueue.empty())
+		{
+			return 0;
+		}
+
+		mSendVectors.clear();
+		mSendHeaders.clear();
+		mSendControl.resize(mSendQueue.size());
+		mSendSegments.clear();
+
+		for(std::size_t i = 0; i < mSendQueue.size(); )
+		{
+			const auto& first = mSendQueue[i];
+			std::size_t count = 1;
+			std::size_t total = first.mLength;
+			if(mSegmentation)
+			{
+				while(i + count < mSendQueue.size() && count < MaxSegments)
+				{
+					const auto& next = mSendQueue[i + count];
+					if(!(next.mDestination == first.mDestination) ||
+						next.mLength > first.mLength ||
+						total + next.mLength > MaxSegmentedSize)
+					{
+						break;
+					}
+					total += next.mLength;
+					++count;
+					if(next.mLength < first.mLength)
+					{
+						break;
+					}
+				}
+			}
+
+			// Queued datagrams are contiguous in the send buffer
+			mSendVectors.push_back(iovec{mSendBuffer.data() + first.mOffset, total});
+
+			mmsghdr header{};
+			header.msg_hdr.msg_name = const_cast<sockaddr*>(first.mDestination.Get());
+			header.msg_hdr.msg_namelen = first.mDestination.GetLength();
+			if(count > 1)
+			{
+				auto& control = mSendControl[mSendHeaders.size()];
+				header.msg_hdr.msg_control = control.mData;
+				header.msg_hdr.msg_controllen = sizeof(control.mData);
+
+				cmsghdr* cmsg = CMSG_FIRSTHDR(&header.msg_hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				const uint16_t segment = first.mLength;
+				std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+			}
+			mSendHeaders.push_back(header);
+			mSendSegments.push_back(count);
+
+			i += count;
+		}
+
+		// iovecs are only stable now that the vector is complete
+		for(std::size_t i = 0; i < mSendHeaders.size(); ++i)
+		{
+			mSendHeaders[i].msg_hdr.msg_iov = &mSendVectors[i];
+			mSendHeaders[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		std::size_t sent = 0;
+		std::size_t datagrams = 0;
+		while(sent < mSendHeaders.size())
+		{
+			const int ret = ::sendmmsg(mFd, mSendHeaders.data() + sent, mSendHeaders.size() - sent, MSG_DONTWAIT);
+			if(ret > 0)
+			{
+				for(int i = 0; i < ret; ++i)
+				{
+					datagrams += mSendSegments[sent + i];
+				}
+				sent += ret;
+				continue;
+			}
+
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(mSegmentation && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT))
+			{
+				// Kernel or device without UDP GSO, send the rest as separate datagrams
+				mLogger->warn("UDP segmentation offload unavailable, errno:{}, disabling", errno);
+				mSegmentation = false;
+				ResendUnsegmented(sent);
+				return datagrams + Flush();
+			}
+
+			mLogger->warn("Dropping {} queued datagrams, errno:{}", mSendQueue.size() - datagrams, errno);
+			break;
+		}
+
+		mSendQueue.clear();
+		mSendBuffer.clear();
+		return datagrams;
+	}
+
 private:
+	struct QueuedDatagram
+	{
+		std::size_t mOffset;
+		std::size_t mLength;
+		UDPEndpoint mDestination;
+	};
+
+	struct alignas(cmsghdr) SegmentControl
+	{
+		char mData[CMSG_SPACE(sizeof(uint16_t))];
+	};
+
+	/**
+	 * @brief Drop the datagrams of the first @p sent messages from the queue so Flush() can retry the rest
+	 */
+	void ResendUnsegmented(std::size_t sent) noexcept
+	{
+		std::size_t done = 0;
+		for(std::size_t i = 0; i < sent; ++i)
+		{
+			done += mSendSegments[i];
+		}
+		mSendQueue.erase(std::begin(mSendQueue), std::begin(mSendQueue) + done);
+	}
+
+	/**
+	 * @brief A null or empty @p interface is any interface
+	 */
+	bool ParseInterface(const char* interface, in_addr& addr) const noexcept
+	{
+		addr.s_addr = htonl(INADDR_ANY);
+		if(interface != nullptr && *interface != '\0' && ::inet_pton(AF_INET, interface, &addr) != 1)
+		{
+			mLogger->error("Invalid interface address: {}", interface);
+			return false;
+		}
+		return true;
+	}
+
+	bool ChangeMembership(int option, const char* group, const char* source, const char* interface) noexcept
+	{
+		in_addr groupAddr{};
+		in_addr interfaceAddr{};
+		if(group == nullptr || ::inet_pton(AF_INET, group, &groupAddr) != 1 || !IN_MULTICAST(ntohl(groupAddr.s_addr)))
+		{
+			mLogger->error("Invalid multicast group: {}", group != nullptr ? group : "");
+			return false;
+		}
+		if(!ParseInterface(interface, interfaceAddr))
+		{
+			return false;
+		}
+
+		int ret;
+		if(source == nullptr)
+		{
+			ip_mreq request{};
+			request.imr_multiaddr = groupAddr;
+			request.imr_interface = interfaceAddr;
+			ret = ::setsockopt(mFd, IPPROTO_IP, option, &request, sizeof(request));
+		}
+		else
+		{
+			ip_mreq_source request{};
+			request.imr_multiaddr = groupAddr;
+			request.imr_interface = interfaceAddr;
+			if(::inet_pton(AF_INET, source, &request.imr_sourceaddr) != 1)
+			{
+				mLogger->error("Invalid multicast source: {}", source);
+				return false;
+			}
+			ret = ::setsockopt(mFd, IPPROTO_IP, option, &request, sizeof(request));
+		}
+
+		if(ret == -1)
+		{
+			mLogger->error("Failed to change membership of group:{} on fd:{}, errno:{}", group, mFd, errno);
+			return false;
+		}
+		return true;
+	}
+
 	void OnFiledescriptorWrite(int fd) final
 	{
 
@@ -126,7 +744,83 @@ private:
 
 	void OnFiledescriptorRead(int fd) final
 	{
+		const std::size_t count = mReceiveHeaders.size();
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			msghdr& header = mReceiveHeaders[i].msg_hdr;
+			header = msghdr{};
+			header.msg_name = &mReceiveAddresses[i];
+			header.msg_namelen = sizeof(sockaddr_storage);
+			header.msg_iov = &mReceiveVectors[i];
+			header.msg_iovlen = 1;
+			if(mReceiveOffload || mReceiveTimestamps || mReceiveDestination)
+			{
+				header.msg_control = mReceiveControl[i].mData;
+				header.msg_controllen = sizeof(mReceiveControl[i].mData);
+			}
+		}
+
+		const int received = ::recvmmsg(fd, mReceiveHeaders.data(), count, MSG_DONTWAIT, nullptr);
+		if(received <= 0)
+		{
+			if(received == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				mLogger->error("recvmmsg failed on fd:{}, errno:{}", fd, errno);
+			}
+			return;
+		}
+
+		mDatagrams.clear();
+		for(int i = 0; i < received; ++i)
+		{
+			auto& header = mReceiveHeaders[i];
+			char* data = static_cast<char*>(mReceiveVectors[i].iov_base);
+			const std::size_t len = std::min<std::size_t>(header.msg_len, mReceiveBufferSize);
+			const bool truncated = (header.msg_hdr.msg_flags & MSG_TRUNC) != 0;
+
+			std::size_t segment = len;
+			std::chrono::nanoseconds timestamp{0};
+			in_addr destination{};
+			for(cmsghdr* cmsg = CMSG_FIRSTHDR(&header.msg_hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header.msg_hdr, cmsg))
+			{
+				if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				{
+					int size;
+					std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+					segment = (size > 0) ? size : len;
+				}
+				else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				{
+					timespec ts;
+					std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					timestamp = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+				}
+				else if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+				{
+					in_pktinfo info;
+					std::memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+					destination = info.ipi_addr;
+				}
+			}
 
+			// Coalesced datagrams are all segment sized, except for a shorter last one
+			std::size_t offset = 0;
+			do
+			{
+				const std::size_t length = std::min(segment, len - offset);
+				mDatagrams.push_back(Datagram{
+					data + offset,
+					length,
+					&mReceiveAddresses[i],
+					header.msg_hdr.msg_namelen,
+					truncated,
+					timestamp,
+					destination});
+				offset += length;
+			} while(offset < len);
+		}
+
+		mHandler->OnIncomingDatagrams(this, Span<Datagram>(mDatagrams.data(), mDatagrams.size()));
 	}
 
 private:
@@ -140,6 +834,42 @@ private:
 
 	uint16_t mPort = 0;
 
+	SocketOptions mOptions;
+
+	static constexpr std::size_t DefaultReceiveBatch = 32;
+	static constexpr std::size_t DefaultReceiveBufferSize = 2048;
+
+	static constexpr std::size_t MaxSegments = 64;
+	static constexpr std::size_t MaxSegmentedSize = 65000;
+	static constexpr std::size_t MaxGroSize = 65535;
+
+	struct alignas(cmsghdr) ReceiveControl
+	{
+		char mData[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(in_pktinfo))];
+	};
+
+	bool mListening = false;
+	std::size_t mReceiveBufferSize = 0;
+	std::vector<char> mReceiveBuffer;
+	std::vector<sockaddr_storage> mReceiveAddresses;
+	std::vector<iovec> mReceiveVectors;
+	std::vector<mmsghdr> mReceiveHeaders;
+	std::vector<ReceiveControl> mReceiveControl;
+	bool mReceiveOffload = false;
+	bool mReceiveTimestamps = false;
+	bool mReceiveDestination = false;
+	std::vector<Datagram> mDatagrams;
+
+	std::vector<char> mSendBuffer;
+	std::vector<QueuedDatagram> mSendQueue;
+	std::vector<iovec> mSendVectors;
+	std::vector<mmsghdr> mSendHeaders;
+	std::vector<SegmentControl> mSendControl;
+	std::vector<std::size_t> mSendSegments;
+	bool mSegmentation = false;
+	bool mFlushScheduled = false;
+	std::shared_ptr<bool> mAlive;
+
 	std::shared_ptr<spdlog::logger> mLogger;
 };
 
@@ -1,5 +1,7 @@
 #include "EventLoop.h"
 
+#include <sys/eventfd.h>
+
 namespace EventLoop {
 
 EventLoop::EventLoop()
@@ -27,9 +29,11 @@ int EventLoop::Run()
 {
 	mStatsTime = std::chrono::high_resolution_clock::now();
 	mLogger->info("Eventloop has started");
-	while (true)
+	mStarted = true;
+	while (mStarted)
 	{
-		mEpollReturn = ::epoll_wait(mEpollFd, mEpollEvents, MaxEpollEvents, mEpollTimeout);
+		// Work scheduled for the next cycle doesn't wait for the epoll timeout
+		mEpollReturn = ::epoll_wait(mEpollFd, mEpollEvents, MaxEpollEvents, mNextCycle.empty() ? mEpollTimeout : 0);
 		mLogger->trace("epoll_wait returned: {}", mEpollReturn);
 		if(mEpollReturn < 0)
 		{
@@ -46,8 +50,19 @@ int EventLoop::Run()
 					!(mEpollEvents[event].events & EPOLLIN) ||
 					!(mEpollEvents[event].events & EPOLLOUT))*/ // error
 				{
-					mLogger->error("epoll event error, fd:{}, event:{}, errno:{}", mEpollEvents[event].data.fd, mEpollEvents[event].events, errno);
-					close(mEpollEvents[event].data.fd);
+					// Let the owner pick up the error, a pending connect reports through the write side
+					const int fd = mEpollEvents[event].data.fd;
+					const uint32_t events = mEpollEvents[event].events;
+					if(mFdHandlers.find(fd) != mFdHandlers.end())
+					{
+						mLogger->debug("epoll event error, fd:{}, event:{}", fd, events);
+						DispatchFiledescriptorEvent(fd, (events & EPOLLOUT) ? EPOLLOUT : EPOLLIN);
+					}
+					else
+					{
+						mLogger->error("epoll event error, fd:{}, event:{}, errno:{}", mEpollEvents[event].data.fd, mEpollEvents[event].events, errno);
+						close(mEpollEvents[event].data.fd);
+					}
 				}
 				else if(mEpollEvents[event].events & EPOLLIN)
 				{
@@ -71,14 +86,18 @@ int EventLoop::Run()
 							return 0;
 						}
 					}
+					else if(mEpollEvents[event].data.fd == mBackgroundFd)
+					{
+						RunBackgroundCompletions();
+					}
 					else
 					{
-						mFdHandlers[mEpollEvents[event].data.fd]->OnFiledescriptorRead(mEpollEvents[event].data.fd);
+						DispatchFiledescriptorEvent(mEpollEvents[event].data.fd, EPOLLIN);
 					}
 				}
 				else if(mEpollEvents[event].events & EPOLLOUT)
 				{
-					mFdHandlers[mEpollEvents[event].data.fd]->OnFiledescriptorWrite(mEpollEvents[event].data.fd);
+					DispatchFiledescriptorEvent(mEpollEvents[event].data.fd, EPOLLOUT);
 				}
 				//else if(mEpollEvents[event].events & EPOLLHUP)
 				//{
@@ -91,8 +110,15 @@ int EventLoop::Run()
 			}
 		}
 
+		mInCallbacks = true;
 		for(const auto& [callback, latencyClass] : mCallbacks)
 		{
+			if(!mRemovedCallbacks.empty() &&
+				std::find(std::begin(mRemovedCallbacks), std::end(mRemovedCallbacks), callback) != std::end(mRemovedCallbacks))
+			{
+				continue;
+			}
+
 			/**
 			 * Two different methods are available for scheduling timers with a high latency.
 			 *
@@ -132,39 +158,96 @@ int EventLoop::Run()
 			}
 			*/
 		}
+		mInCallbacks = false;
+		for(const auto& callback : mRemovedCallbacks)
+		{
+			mCallbacks.erase(callback);
+		}
+		mRemovedCallbacks.clear();
 
+		// Callbacks may add or remove timers, collect the expired ones first
+		mExpiredTimers.clear();
 		for(const auto& timer : mTimers)
 		{
 			if(timer->CheckTimerExpired())
 			{
-				timer->mCallback();
-				//mLogger->info("Timer has expired after {}", std::chrono::seconds(timer.mDuration).count());
-				if(timer->mType == TimerType::Oneshot)
-				{
-					mTimers.erase(std::remove(std::begin(mTimers), std::end(mTimers), timer), std::end(mTimers));
-				}
-				else
-				{
-					timer->UpdateDeadline();
-				}
+				mExpiredTimers.push_back(timer);
 			}
 		}
 
+		for(const auto& timer : mExpiredTimers)
+		{
+			if(!IsTimerActive(timer))
+			{
+				continue;
+			}
+
+			//mLogger->info("Timer has expired after {}", std::chrono::seconds(timer.mDuration).count());
+			if(timer->mType == TimerType::Oneshot)
+			{
+				RemoveTimer(timer);
+			}
+			else
+			{
+				timer->UpdateDeadline();
+			}
+			timer->mCallback();
+		}
+
+		mCurrentCycle.swap(mNextCycle);
+		for(const auto& func : mCurrentCycle)
+		{
+			func();
+		}
+		mCurrentCycle.clear();
+
 		mCycleCount++;
 	}
 
+	mLogger->info("Eventloop has stopped");
+	return 0;
+}
+
+void EventLoop::Stop()
+{
+	mStarted = false;
 }
 
 void EventLoop::AddTimer(Timer* timer)
 {
+	if(IsTimerActive(timer))
+	{
+		return;
+	}
 	mTimers.push_back(timer);
 }
 
+void EventLoop::RemoveTimer(Timer* timer)
+{
+	mTimers.erase(std::remove(std::begin(mTimers), std::end(mTimers), timer), std::end(mTimers));
+}
+
+bool EventLoop::IsTimerActive(const Timer* timer) const noexcept
+{
+	return std::find(std::begin(mTimers), std::end(mTimers), timer) != std::end(mTimers);
+}
+
 void EventLoop::RegisterCallbackHandler(IEventLoopCallbackHandler* callback, LatencyType latency)
 {
 	mCallbacks.insert({callback, latency});
 }
 
+void EventLoop::UnregisterCallbackHandler(IEventLoopCallbackHandler* callback)
+{
+	// Erasing would invalidate the iteration in Run()
+	if(mInCallbacks)
+	{
+		mRemovedCallbacks.push_back(callback);
+		return;
+	}
+	mCallbacks.erase(callback);
+}
+
 void EventLoop::RegisterFiledescriptor(int fd, uint32_t events, IFiledescriptorCallbackHandler* handler)
 {
 	struct epoll_event event{};
@@ -284,8 +367,134 @@ void EventLoop::ToggleRunHot() noexcept
 
 void EventLoop::SheduleForNextCycle(const std::function<void()> func) noexcept
 {
-	mShortTimers.push_back(Timer(0s, TimerType::Oneshot, func));
-	AddTimer(&mShortTimers.back());
+	mNextCycle.push_back(func);
+}
+
+void EventLoop::DispatchFiledescriptorEvent(int fd, uint32_t events)
+{
+	// A handler earlier in this batch may have unregistered the fd
+	const auto handler = mFdHandlers.find(fd);
+	if(handler == mFdHandlers.end())
+	{
+		return;
+	}
+
+	if(events & EPOLLOUT)
+	{
+		handler->second->OnFiledescriptorWrite(fd);
+	}
+	else
+	{
+		handler->second->OnFiledescriptorRead(fd);
+	}
+}
+
+void EventLoop::RunInBackground(std::function<void()> job, std::function<void()> completion)
+{
+	if(mBackgroundThreads.empty())
+	{
+		SetupBackgroundWorkers();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mBackgroundMutex);
+		mBackgroundJobs.push_back({std::move(job), std::move(completion)});
+	}
+	mBackgroundCondition.notify_one();
+}
+
+void EventLoop::SetupBackgroundWorkers()
+{
+	mBackgroundFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(mBackgroundFd == -1)
+	{
+		mLogger->critical("Failed to create background completion fd, errno:{}", errno);
+		throw std::runtime_error("Failed to create background completion fd");
+	}
+
+	struct epoll_event event{};
+	event.data.fd = mBackgroundFd;
+	event.events = EPOLLIN;
+	if(::epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mBackgroundFd, &event) == -1)
+	{
+		mLogger->critical("Failed to add background completion fd to epoll interface, errno:{}", errno);
+		throw std::runtime_error("Failed to add background completion fd to epoll interface");
+	}
+
+	for(std::size_t i = 0; i < BackgroundWorkers; ++i)
+	{
+		mBackgroundThreads.emplace_back([this](){ BackgroundWorker(); });
+	}
+}
+
+void EventLoop::BackgroundWorker()
+{
+	while(true)
+	{
+		BackgroundJob job;
+		{
+			std::unique_lock<std::mutex> lock(mBackgroundMutex);
+			mBackgroundCondition.wait(lock, [this](){ return mBackgroundStop || !mBackgroundJobs.empty(); });
+			if(mBackgroundStop)
+			{
+				return;
+			}
+			job = std::move(mBackgroundJobs.front());
+			mBackgroundJobs.pop_front();
+		}
+
+		job.mJob();
+
+		{
+			std::lock_guard<std::mutex> lock(mBackgroundMutex);
+			mBackgroundCompletions.push_back(std::move(job.mCompletion));
+		}
+
+		const std::uint64_t one = 1;
+		if(::write(mBackgroundFd, &one, sizeof(one)) != sizeof(one))
+		{
+			mLogger->error("Failed to signal background completion, errno:{}", errno);
+		}
+	}
+}
+
+void EventLoop::RunBackgroundCompletions()
+{
+	std::uint64_t count = 0;
+	if(::read(mBackgroundFd, &count, sizeof(count)) != sizeof(count))
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mBackgroundMutex);
+		mRunningCompletions.swap(mBackgroundCompletions);
+	}
+
+	for(const auto& completion : mRunningCompletions)
+	{
+		completion();
+	}
+	mRunningCompletions.clear();
+}
+
+EventLoop::~EventLoop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mBackgroundMutex);
+		mBackgroundStop = true;
+	}
+	mBackgroundCondition.notify_all();
+
+	for(auto& thread : mBackgroundThreads)
+	{
+		thread.join();
+	}
+
+	if(mBackgroundFd != -1)
+	{
+		::close(mBackgroundFd);
+	}
 }
 
 }
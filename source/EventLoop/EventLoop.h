@@ -1,7 +1,13 @@
 #ifndef EVENTLOOP_H
 #define EVENTLOOP_H
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -75,8 +81,9 @@ public:
 		using TimePoint = std::chrono::high_resolution_clock::time_point;
 		using Clock = std::chrono::high_resolution_clock;
 		using seconds = std::chrono::seconds;
+		using milliseconds = std::chrono::milliseconds;
 
-		Timer(seconds duration, TimerType type, std::function<void()> callback)
+		Timer(milliseconds duration, TimerType type, std::function<void()> callback)
 			: mEnd(static_cast<TimePoint>(Clock::now()) + duration)
 			, mState(TimerState::Active)
 			, mDuration(duration)
@@ -103,20 +110,40 @@ public:
 
 		TimePoint mEnd;
 		TimerState mState;
-		seconds mDuration;
+		milliseconds mDuration;
 		TimerType mType;
 		std::function<void()> mCallback;
 	};
 
-	//TODO Add RemoveTimer function
+	/**
+	 * @brief Add a timer to the loop
+	 *
+	 * Adding a timer that is already active is a no-op.
+	 * Timer resolution is bound by the epoll timeout, so ~20ms when not running hot.
+	 */
 	void AddTimer(Timer* timer);
 
+	/**
+	 * @brief Remove a timer from the loop
+	 *
+	 * Safe to call from within any callback, including the callback of the timer itself.
+	 * Has to be called before an active timer is destroyed.
+	 */
+	void RemoveTimer(Timer* timer);
+
+	bool IsTimerActive(const Timer* timer) const noexcept;
+
 	enum class LatencyType : std::uint8_t {
 		Low = 0,
 		High = 1
 	};
 
 	void RegisterCallbackHandler(IEventLoopCallbackHandler* callback, LatencyType latency);
+
+	/**
+	 * @brief Stop calling @p callback, safe to call from within any callback
+	 */
+	void UnregisterCallbackHandler(IEventLoopCallbackHandler* callback);
 	void RegisterFiledescriptor(int fd, uint32_t events, IFiledescriptorCallbackHandler* handler);
 	void ModifyFiledescriptor(int fd, uint32_t events, IFiledescriptorCallbackHandler* handler);
 	void UnregisterFiledescriptor(int fd);
@@ -126,14 +153,38 @@ public:
 
 	void SheduleForNextCycle(const std::function<void()> func) noexcept;
 
+	/**
+	 * @brief Run blocking work off the loop
+	 *
+	 * @p job is executed on one of the background worker threads, @p completion is called on the loop
+	 * thread once the job has finished. Jobs must not touch loop owned state, pass results to the
+	 * completion through captured state instead.
+	 * Workers are started on first use.
+	 */
+	void RunInBackground(std::function<void()> job, std::function<void()> completion);
+
 	void ToggleRunHot() noexcept;
 
+	bool IsRunningHot() const noexcept
+	{
+		return mRunHot;
+	}
+
+	~EventLoop();
+
 private:
 	void PrintStatistics() noexcept;
 
 	void SetupSignalWatcher();
 
+	void SetupBackgroundWorkers();
+	void BackgroundWorker();
+	void RunBackgroundCompletions();
+
+	void DispatchFiledescriptorEvent(int fd, uint32_t events);
+
 	static constexpr int MaxEpollEvents = 64;
+	static constexpr std::size_t BackgroundWorkers = 2;
 
 	bool mStarted;
 	bool mStatistics;
@@ -143,11 +194,14 @@ private:
 	bool mRunHot = true;
 
 	std::vector<Timer*> mTimers;
+	std::vector<Timer*> mExpiredTimers;
+
+	std::vector<std::function<void()>> mNextCycle;
+	std::vector<std::function<void()>> mCurrentCycle;
 
-	// Need to change mTimers to use unique_ptr's.
-	// This way we can get rid of this backup vector
-	std::vector<Timer> mShortTimers;
 	std::unordered_map<IEventLoopCallbackHandler*, LatencyType> mCallbacks;
+	std::vector<IEventLoopCallbackHandler*> mRemovedCallbacks;
+	bool mInCallbacks = false;
 
 	const int mEpollFd = 0;
 	int mEpollReturn = 0;
@@ -163,6 +217,21 @@ private:
 
 	//int mTimerIterationCounter = 0;
 
+	struct BackgroundJob
+	{
+		std::function<void()> mJob;
+		std::function<void()> mCompletion;
+	};
+
+	int mBackgroundFd = -1;
+	bool mBackgroundStop = false;
+	std::vector<std::thread> mBackgroundThreads;
+	std::mutex mBackgroundMutex;
+	std::condition_variable mBackgroundCondition;
+	std::deque<BackgroundJob> mBackgroundJobs;
+	std::vector<std::function<void()>> mBackgroundCompletions;
+	std::vector<std::function<void()>> mRunningCompletions;
+
 	std::shared_ptr<spdlog::logger> mLogger;
 };
 
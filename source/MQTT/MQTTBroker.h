@@ -1,14 +1,22 @@
 #ifndef MQTT_BROKER_H
 #define MQTT_BROKER_H
 
+#include <algorithm>
+#include <array>
 #include <deque>
+#include <limits>
+#include <string_view>
+#include <unordered_set>
 #include <variant>
 
 #include <spdlog/fmt/ostr.h>
 
 #include "EventLoop.h"
+#include "StreamSocket.h"
 
 #include "MQTTPacket.h"
+#include "MQTTParser.h"
+#include "MQTTSubscriptionTrie.h"
 
 namespace MQTTBroker {
 
@@ -16,7 +24,8 @@ namespace MQTTBroker {
  * @brief An MQTT broker
  *
  * This is a *very* rough and basic implementation of an MQTT broker/server.
- * It only supports QoS 0 for now and barely at that.
+ * It accepts QoS 1 and 2 messages from publishers but delivers everything with QoS 0.
+ * Topic filters may hold '+' and '#' wildcards, a client with several matching filters gets a message once.
  *
  * A lot of the edge cases haven't been implemented. but most of it should function as the standard dictates.
  *
@@ -29,6 +38,9 @@ class MQTTBroker : public Common::IStreamSocketHandler
 				 , public Common::IStreamSocketServerHandler
 {
 public:
+	/// Topic aliases each MQTT 5 client may set towards the broker
+	static constexpr std::uint16_t TopicAliasMaximum = 64;
+
 	MQTTBroker(EventLoop::EventLoop& ev)
 		: mEv(ev)
 		, mMQTTServer(mEv, this)
@@ -39,14 +51,55 @@ public:
 			auto mqttclientlogger = spdlog::stdout_color_mt("MQTTBroker");
 			mLogger = spdlog::get("MQTTBroker");
 		}
+
+		// Acknowledgements are small, Nagle would hold them back until the previous one is ACKed
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mMQTTServer.SetConnectionOptions(options);
 	}
 
-	void Initialise()
+	void Initialise(std::uint16_t port = 1883)
 	{
-		mMQTTServer.BindAndListen(1883);
+		mMQTTServer.BindAndListen(port);
 	}
 
 private:
+	struct Connection;
+
+	struct Subscriber
+	{
+		Common::StreamSocket* mSocket;
+		Connection* mConnection;
+	};
+
+	using SubscriptionTrie = MQTTSubscriptionTrie<Subscriber>;
+
+	/**
+	 * @brief What the broker keeps for each client connection
+	 */
+	struct Connection
+	{
+		/// Partial packets are kept until the rest arrives
+		MQTTParser mParser;
+		MQTTVersion mVersion = MQTTVersion::V311;
+		/// Limits the client announced with MQTT 5
+		std::uint16_t mReceiveMaximum = std::numeric_limits<std::uint16_t>::max();
+		std::uint32_t mMaximumPacketSize = std::numeric_limits<std::uint32_t>::max();
+		std::uint16_t mTopicAliasMaximum = 0;
+		/// Topics the client set for its aliases, the index is the alias - 1
+		std::vector<std::string> mInboundAliases;
+		/// Aliases the broker set towards the client, by topic, so a delivery looks them up without a copy
+		std::unordered_map<std::string_view, std::uint16_t> mOutboundAliases;
+		/// Owns the topics the keys of mOutboundAliases refer to, the index is the alias - 1
+		std::deque<std::string> mOutboundAliasTopics;
+		/// Packet identifiers of QoS 2 messages from the client that were delivered and await their PUBREL
+		std::unordered_set<std::uint16_t> mReceivedQoS2;
+		/// The subscriptions of the client by topic filter, to remove them without searching the trie
+		std::unordered_map<std::string, SubscriptionTrie::Handle> mSubscriptions;
+		/// The last message delivered to the client, so overlapping filters deliver it once
+		std::uint64_t mLastDelivered = 0;
+	};
+
 	void OnConnected() final
 	{
 		mLogger->info("Connection to client established");
@@ -55,20 +108,47 @@ private:
 	void OnDisconnect(Common::StreamSocket* conn) final
 	{
 		mLogger->info("Connection with client terminated");
-		for(auto& client : mPubClients)
+		const auto connection = mConnections.find(conn);
+		if(connection == mConnections.end())
 		{
-			for(auto it = client.second.begin(); it != client.second.end(); ) {
-				if(*it == conn)
-					it = client.second.erase(it);
-				else
-					++it;
-			}
+			return;
 		}
+		for(auto& subscription : connection->second.mSubscriptions)
+		{
+			mSubscriptions.Unsubscribe(subscription.second);
+		}
+		mConnections.erase(connection);
 	}
 
 	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
 	{
-		MQTTPacket incomingPacket(data);
+		auto& connection = mConnections[conn];
+		const auto status = connection.mParser.Feed(data, len, [this, conn, &connection](const char* packet, std::size_t size) {
+			return HandlePacket(conn, connection, packet, size);
+		});
+		if(status != Common::DecodeStatus::Incomplete)
+		{
+			mLogger->error("Malformed or invalid packet from client, closing connection");
+			conn->Shutdown();
+			OnDisconnect(conn);
+		}
+	}
+
+	/**
+	 * @return False when the packet breaks the protocol and the connection has to be closed.
+	 */
+	bool HandlePacket(Common::StreamSocket* conn, Connection& connection, const char* data, std::size_t len)
+	{
+		if(static_cast<MQTTPacketType>(static_cast<std::uint8_t>(data[0]) >> 4) == MQTTPacketType::PUBLISH)
+		{
+			return HandlePublish(conn, connection, data, len);
+		}
+
+		const MQTTPacket incomingPacket(data, len, connection.mVersion);
+		if(!incomingPacket.IsValid())
+		{
+			return false;
+		}
 
 		mLogger->info("Incoming packet");
 
@@ -76,31 +156,27 @@ private:
 		{
 			case MQTTPacketType::CONNECT:
 			{
+				const auto* connect = incomingPacket.GetConnectPacket();
+				if(!IsValidUtf8String(connect->GetClientID()))
+				{
+					return false;
+				}
 				mLogger->info("Incoming connect");
-				mLogger->info("	Client identifier: {}", incomingPacket.mConnect.GetClientID());
-
-				mLogger->info("	Sending CONNACK");
-				SendConnack(incomingPacket.mConnect, conn);
-
-				mClientConnections.insert({incomingPacket.mConnect.GetClientID(), conn});
-				break;
-			}
-
-			case MQTTPacketType::PUBLISH:
-			{
-				mLogger->info("Incoming publish:");
-				mLogger->info("	topic: {}", incomingPacket.mPublish.mTopicFilter);
-				mLogger->info("	payload: {}", incomingPacket.mPublish.mTopicPayload);
+				mLogger->info("	Client identifier: {}", connect->GetClientID());
 
-				//mPubQueue[incomingPacket.mPublish.mTopicName].push_back(incomingPacket.mPublish.mTopicPayload);
+				// The limits of the client, only sent with MQTT 5
+				const auto& properties = connect->GetProperties();
+				connection.mVersion = connect->GetVersion();
+				connection.mReceiveMaximum = properties.mReceiveMaximum.value_or(connection.mReceiveMaximum);
+				connection.mMaximumPacketSize = properties.mMaximumPacketSize.value_or(connection.mMaximumPacketSize);
+				connection.mTopicAliasMaximum = properties.mTopicAliasMaximum.value_or(0);
+				connection.mInboundAliases.assign(connection.mVersion == MQTTVersion::V5 ? TopicAliasMaximum : 0,
+						std::string());
 
-				const auto& clients = mPubClients[incomingPacket.mPublish.mTopicFilter];
-
-				for(const auto& client : clients)
-				{
-					client->Send(data, len);
-				}
+				mLogger->info("	Sending CONNACK");
+				SendConnack(*connect, conn);
 
+				mClientConnections.insert({connect->GetClientID(), conn});
 				break;
 			}
 
@@ -121,18 +197,80 @@ private:
 
 			case MQTTPacketType::SUBSCRIBE:
 			{
+				const auto* subscribe = incomingPacket.GetSubscribePacket();
 				mLogger->info("Incoming Subscribe:");
-				mLogger->info("	Packet identifier: {}", incomingPacket.mSubscribe.mPacketIdentifier);
-				mLogger->info("	Topic length: {}", incomingPacket.mSubscribe.mTopicLength);
-				mLogger->info("	Topic filter: {}", incomingPacket.mSubscribe.mTopicFilter);
+				mLogger->info("	Packet identifier: {}", subscribe->GetPacketId());
+				mLogger->info("	Topic filters: {}", subscribe->GetTopicFilters().size());
 
-				mPubClients[incomingPacket.mSubscribe.mTopicFilter].push_back(conn);
+				// One return code per topic filter, in the order of the SUBSCRIBE
+				std::vector<std::uint8_t> returnCodes;
+				returnCodes.reserve(subscribe->GetTopicFilters().size());
+				for(const auto& topicFilter : subscribe->GetTopicFilters())
+				{
+					mLogger->debug("	Topic filter: {}", topicFilter);
+
+					// MQTT 3.1.1 allows refusing a filter with a failure return code
+					if(!IsValidTopicFilter(topicFilter))
+					{
+						mLogger->warn("Rejecting invalid topic filter");
+						returnCodes.push_back(SubackFailure);
+						continue;
+					}
+
+					// A repeated subscription replaces the existing one (MQTT 3.1.1 section 3.8.4)
+					auto& handle = connection.mSubscriptions.try_emplace(topicFilter).first->second;
+					if(!handle.IsSubscribed())
+					{
+						mSubscriptions.Subscribe(topicFilter, Subscriber{conn, &connection}, handle);
+					}
+					returnCodes.push_back(0);
+				}
 
-				SendSuback(incomingPacket.mSubscribe, conn);
+				SendSuback(*subscribe, std::move(returnCodes), connection.mVersion, conn);
 
 				break;
 			}
 
+			case MQTTPacketType::UNSUBSCRIBE:
+			{
+				const auto* unsubscribe = incomingPacket.GetUnsubscribePacket();
+				mLogger->info("Incoming Unsubscribe:");
+				mLogger->info("	Packet identifier: {}", unsubscribe->GetPacketId());
+				mLogger->info("	Topic filters: {}", unsubscribe->GetTopicFilters().size());
+
+				// Reason codes are only sent with MQTT 5
+				std::vector<std::uint8_t> reasonCodes;
+				reasonCodes.reserve(unsubscribe->GetTopicFilters().size());
+				for(const auto& topicFilter : unsubscribe->GetTopicFilters())
+				{
+					mLogger->debug("	Topic filter: {}", topicFilter);
+					reasonCodes.push_back(RemoveSubscription(topicFilter, connection) ? 0 : UnsubackNoSubscriptionExisted);
+				}
+
+				const auto unsuback = MQTTUnsubackPacket(unsubscribe->GetPacketId(), std::move(reasonCodes),
+						connection.mVersion).GetMessage();
+				conn->Send(unsuback.data(), unsuback.size());
+
+				break;
+			}
+
+			case MQTTPacketType::PUBREL:
+			{
+				// The second half of a QoS 2 message, it was delivered with the PUBLISH
+				const auto packetId = incomingPacket.GetPublishAckPacket()->GetPacketId();
+				connection.mReceivedQoS2.erase(packetId);
+				SendPublishAck(MQTTPacketType::PUBCOMP, packetId, conn);
+				break;
+			}
+
+			case MQTTPacketType::PUBACK:
+			case MQTTPacketType::PUBREC:
+			case MQTTPacketType::PUBCOMP:
+			{
+				// Messages are delivered with QoS 0, nothing waits for these
+				break;
+			}
+
 			case MQTTPacketType::PINGREQ:
 			{
 				mLogger->info("Incoming ping request, sending response");
@@ -148,6 +286,130 @@ private:
 				break;
 			}
 		}
+		return true;
+	}
+
+	/**
+	 * @brief Forward the packet, as received when it is QoS 0, the subscriber has the publisher's version and no
+	 * aliases are involved, otherwise encoded for each subscriber, then acknowledge QoS 1 and 2
+	 *
+	 * Topic and payload are only looked at in place.
+	 */
+	bool HandlePublish(Common::StreamSocket* conn, Connection& connection, const char* data, std::size_t len)
+	{
+		const MQTTPublishView publish(data, len, connection.mVersion);
+		if(!publish.IsValid())
+		{
+			return false;
+		}
+		std::string_view topic = publish.GetTopic();
+		if(const auto alias = publish.GetTopicAlias())
+		{
+			if(alias > connection.mInboundAliases.size())
+			{
+				return false;
+			}
+			auto& aliasedTopic = connection.mInboundAliases[alias - 1];
+			if(topic.empty())
+			{
+				if(aliasedTopic.empty())
+				{
+					return false;
+				}
+				topic = aliasedTopic;
+			}
+			else
+			{
+				aliasedTopic.assign(topic);
+			}
+		}
+		const auto payload = publish.GetPayload();
+		mLogger->info("Incoming publish:");
+		mLogger->info("	topic: {}", topic);
+		mLogger->info("	payload: {}", std::string_view(payload.data(), payload.size()));
+
+		// QoS 2 is delivered once, a PUBLISH sent again before the PUBREL is only acknowledged again
+		const auto qos = publish.GetQoS();
+		const bool duplicate = qos == 2 && !connection.mReceivedQoS2.insert(publish.GetPacketId()).second;
+		if(!duplicate)
+		{
+			const bool forwardable = qos == 0 && publish.GetTopicAlias() == 0;
+			const std::uint64_t message = ++mMessageCount;
+			mSubscriptions.Match(topic, [&](const Subscriber& subscriber) {
+				auto& client = *subscriber.mConnection;
+				if(client.mLastDelivered == message)
+				{
+					return;
+				}
+				client.mLastDelivered = message;
+				if(forwardable && client.mVersion == connection.mVersion && client.mTopicAliasMaximum == 0)
+				{
+					subscriber.mSocket->Send(data, len);
+				}
+				else
+				{
+					SendPublish(subscriber.mSocket, client, topic, payload);
+				}
+			});
+		}
+
+		if(qos == 1)
+		{
+			SendPublishAck(MQTTPacketType::PUBACK, publish.GetPacketId(), conn);
+		}
+		else if(qos == 2)
+		{
+			SendPublishAck(MQTTPacketType::PUBREC, publish.GetPacketId(), conn);
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Encode a QoS 0 PUBLISH for @p subscriber, with a topic alias when it accepts more
+	 */
+	void SendPublish(Common::StreamSocket* client, Connection& subscriber, std::string_view topic,
+			Common::Span<const char> payload)
+	{
+		std::uint16_t alias = 0;
+		bool newAlias = false;
+		std::string_view topicName = topic;
+		if(subscriber.mTopicAliasMaximum != 0)
+		{
+			const auto known = subscriber.mOutboundAliases.find(topic);
+			if(known != subscriber.mOutboundAliases.end())
+			{
+				alias = known->second;
+				topicName = {};
+			}
+			else if(subscriber.mOutboundAliases.size() < subscriber.mTopicAliasMaximum)
+			{
+				alias = static_cast<std::uint16_t>(subscriber.mOutboundAliases.size() + 1);
+				newAlias = true;
+			}
+		}
+
+		const std::string_view message(payload.data(), payload.size());
+		const std::size_t size = MQTTPublishPacket::GetEncodedSize(topicName.size(), message.size(), 0,
+				subscriber.mVersion, alias);
+		// Larger packets are dropped as the client would refuse them (MQTT 5.0 section 3.1.2.11.4)
+		if(size > subscriber.mMaximumPacketSize)
+		{
+			mLogger->warn("Dropping {} byte message, larger than the client accepts", size);
+			return;
+		}
+		if(mSendBuffer.size() < size)
+		{
+			mSendBuffer.resize(size);
+		}
+		const Common::Span<char> buffer(mSendBuffer.data(), size);
+		client->Send(buffer.data(),
+				MQTTPublishPacket::Encode(buffer, 0, topicName, message, 0, subscriber.mVersion, alias));
+		// Only known to the client once a packet setting it was sent
+		if(newAlias)
+		{
+			subscriber.mOutboundAliasTopics.emplace_back(topic);
+			subscriber.mOutboundAliases.emplace(subscriber.mOutboundAliasTopics.back(), alias);
+		}
 	}
 
 	void SendConnack(const MQTTConnectPacket& incConn, Common::StreamSocket* conn)
@@ -165,20 +427,48 @@ private:
 				mLogger->info("Existing client session not found, setting SP to 0");
 			}
 		}
-		const auto connack = MQTTConnackPacket(incConn, incConn.IsCleanSessionRequest());
 
-		conn->Send(connack.GetMessage(), connack.GetSize());
+		// The limits of the broker, only sent with MQTT 5
+		MQTTProperties properties;
+		properties.mMaximumPacketSize = MQTTParser::DefaultMaxPacketSize;
+		properties.mTopicAliasMaximum = TopicAliasMaximum;
+		const auto connack = MQTTConnackPacket(incConn, incConn.IsCleanSessionRequest(), properties).GetMessage();
+
+		conn->Send(connack.data(), connack.size());
+	}
+
+	void SendSuback(const MQTTSubscribePacket& subPacket, std::vector<std::uint8_t> returnCodes, MQTTVersion version,
+			Common::StreamSocket* conn)
+	{
+		const auto suback = MQTTSubackPacket(subPacket.GetPacketId(), std::move(returnCodes), version).GetMessage();
+		conn->Send(suback.data(), suback.size());
+	}
+
+	/**
+	 * @return False when the client was not subscribed to @p topicFilter.
+	 */
+	bool RemoveSubscription(const std::string& topicFilter, Connection& connection)
+	{
+		const auto subscription = connection.mSubscriptions.find(topicFilter);
+		if(subscription == connection.mSubscriptions.end())
+		{
+			return false;
+		}
+		mSubscriptions.Unsubscribe(subscription->second);
+		connection.mSubscriptions.erase(subscription);
+		return true;
 	}
 
-	void SendSuback(const MQTTSubscribePacket& subPacket, Common::StreamSocket* conn)
+	void SendPublishAck(MQTTPacketType type, std::uint16_t packetId, Common::StreamSocket* conn)
 	{
-		const auto suback = MQTTSubackPacket(subPacket.mPacketIdentifier, 0);
-		conn->Send(suback.GetMessage(), suback.GetSize());
+		const MQTTPublishAckPacket ack(type, packetId);
+		std::array<char, 5> buffer;
+		conn->Send(buffer.data(), ack.Encode(Common::Span<char>(buffer.data(), buffer.size())));
 	}
 
 	void SendPingResponse(Common::StreamSocket* conn)
 	{
-		auto pingResp = MQTTPingResponsePacket();
+		static constexpr MQTTPingResponsePacket pingResp;
 		conn->Send(pingResp.GetMessage(), pingResp.GetSize());
 	}
 
@@ -191,10 +481,12 @@ private:
 	Common::StreamSocketServer mMQTTServer;
 	//std::vector<Common::StreamSocket*> mClientConnections;
 	std::unordered_map<std::string, Common::StreamSocket*> mClientConnections;
-	std::unordered_map<std::string, std::vector<Common::StreamSocket*>> mPubClients;
-	//[TOPIC]->QUEUEU<PAYLOAD>
-	//This means that there is no wildcard support yet.
-	std::unordered_map<std::string, std::deque<std::string>> mPubQueue;
+	std::unordered_map<Common::StreamSocket*, Connection> mConnections;
+	SubscriptionTrie mSubscriptions;
+	/// Numbers the messages routed, see Connection::mLastDelivered
+	std::uint64_t mMessageCount = 0;
+	/// PUBLISH packets encoded for a subscriber are written here
+	std::vector<char> mSendBuffer;
 
 	std::shared_ptr<spdlog::logger> mLogger;
 };
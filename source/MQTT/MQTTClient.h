@@ -1,10 +1,24 @@
 #ifndef MQTTClIENT_H
 #define MQTTCLIENT_H
 
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "EventLoop.h"
 #include "StreamSocket.h"
 
 #include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTPacketIdAllocator.h"
+#include "MQTT/MQTTParser.h"
+#include "MQTT/MQTTSpool.h"
+#include "MQTT/MQTTTopicTrie.h"
 
 using namespace std::chrono_literals;
 
@@ -16,19 +30,57 @@ class IMQTTClientHandler
 {
 public:
 	virtual void OnConnected() = 0;
+	/**
+	 * @brief Called when the connection was lost or a connection attempt failed, Connect() may be called again
+	 */
 	virtual void OnDisconnect(MQTTClient* conn) = 0;
-	virtual void OnPublish(const std::string& topic, const std::string& msg) = 0;
+	/**
+	 * @brief Called with copies of topic and payload, unless the overload below is overridden
+	 *
+	 * The default drops the message, a handler receiving messages has to override one of the two overloads.
+	 */
+	virtual void OnPublish(const std::string& /*topic*/, const std::string& /*msg*/) {}
+	/**
+	 * @brief Topic and payload point into the receive buffer and are only valid during the call
+	 *
+	 * Override this one to handle messages without copying them.
+	 */
+	virtual void OnPublish(std::string_view topic, Common::Span<const char> payload)
+	{
+		OnPublish(std::string(topic), std::string(payload.data(), payload.size()));
+	}
+	/**
+	 * @brief Called for each topic filter once the broker acknowledged it, return codes from 0x80 are refusals
+	 */
+	virtual void OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t /*returnCode*/) {}
+	/**
+	 * @brief Called when the broker acknowledged a QoS 1 or 2 message to @p topic, with PUBACK or PUBCOMP
+	 */
+	virtual void OnPublishComplete(const std::string& /*topic*/) {}
 	virtual ~IMQTTClientHandler() {}
 };
 
 class MQTTClient : public Common::IStreamSocketHandler
 {
 public:
+	/// Topic and payload point into the receive buffer and are only valid during the call
+	using PublishCallback = std::function<void(std::string_view topic, Common::Span<const char> payload)>;
+
+	static constexpr std::uint16_t DefaultTopicAliasMaximum = 64;
+	/// SUBSCRIBE and UNSUBSCRIBE packets are split at this size, so each one is a single short send
+	static constexpr std::size_t MaxSubscribePacketSize = 64 * 1024;
+	static constexpr std::uint16_t DefaultInFlightWindow = 16;
+	static constexpr std::chrono::milliseconds DefaultRetransmitInterval = 10s;
+	/// Collected packets are sent once they reach this size
+	static constexpr std::size_t DefaultCoalescingThreshold = 16 * 1024;
+
 	MQTTClient(EventLoop::EventLoop& ev, IMQTTClientHandler* handler)
 		: mEv(ev)
 		, mConnection(mEv, this)
 		, mHandler(handler)
 		, mKeepAliveTimer(10s, EventLoop::EventLoop::TimerType::Repeating, [this](){ KeepAlive(); })
+		, mRetransmitTimer(DefaultRetransmitInterval, EventLoop::EventLoop::TimerType::Repeating, [this](){ Retransmit(); })
+		, mAlive(std::make_shared<bool>(true))
 	{
 		mLogger = spdlog::get("MQTTClient");
 		if(mLogger == nullptr)
@@ -36,6 +88,11 @@ public:
 			auto mqttclientlogger = spdlog::stdout_color_mt("MQTTClient");
 			mLogger = spdlog::get("MQTTClient");
 		}
+
+		// Requests and acknowledgements are small, Nagle would hold them back until the previous one is ACKed
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mConnection.SetOptions(options);
 	}
 
 	~MQTTClient()
@@ -48,12 +105,140 @@ public:
 		{
 			mConnection.Shutdown();
 		}
+		mEv.RemoveTimer(&mKeepAliveTimer);
+		mEv.RemoveTimer(&mRetransmitTimer);
 	}
 
-	void Initialise(const std::string& clientId, std::optional<int> keepAlive)
+	/**
+	 * @param version MQTT 5 adds topic aliases and the limits below, negotiated with the broker on connect
+	 */
+	void Initialise(const std::string& clientId, std::optional<int> keepAlive,
+			MQTTVersion version = MQTTVersion::V311)
 	{
 		mClientId = clientId;
 		mKeepAlive = keepAlive.value_or(60);
+		mVersion = version;
+	}
+
+	/**
+	 * @brief Largest packet accepted from the broker, MQTT 5 announces it so the broker does not send larger ones
+	 */
+	void SetMaximumPacketSize(std::uint32_t size) noexcept
+	{
+		mParser.SetMaxPacketSize(size);
+		mMaximumPacketSize = size;
+	}
+
+	/**
+	 * @brief Number of topic aliases the broker may set towards this client, MQTT 5 only
+	 */
+	void SetTopicAliasMaximum(std::uint16_t aliases) noexcept
+	{
+		mTopicAliasMaximum = aliases;
+	}
+
+	/**
+	 * @brief Number of QoS 1 and 2 messages sent without waiting for their acknowledgement
+	 *
+	 * The broker's ReceiveMaximum lowers it when that is smaller. Further messages are queued until an
+	 * acknowledgement makes room.
+	 */
+	void SetInFlightWindow(std::uint16_t window) noexcept
+	{
+		mInFlightWindow = std::max<std::uint16_t>(window, 1);
+	}
+
+	/**
+	 * @brief MQTT 3.1.1 QoS 1 and 2 messages unacknowledged for longer are sent again, checked at the same interval
+	 *
+	 * MQTT 5 only allows sending them again after a reconnect (MQTT 5.0 section 4.4), which happens for both.
+	 */
+	void SetRetransmitInterval(std::chrono::milliseconds interval) noexcept
+	{
+		mRetransmitInterval = interval;
+		mRetransmitTimer.mDuration = interval;
+		mRetransmitTimer.UpdateDeadline();
+	}
+
+	/**
+	 * @brief Collect outgoing packets and write them with one send per event loop cycle
+	 *
+	 * Off by default, every packet is then a send of its own. When enabled packets are appended to a buffer that is
+	 * sent after the data from the broker was handled, at the end of the event loop cycle they were queued in, or as
+	 * soon as it holds @p threshold bytes, whichever is first. No packet waits for a later cycle.
+	 */
+	void SetCoalescing(bool enabled, std::size_t threshold = DefaultCoalescingThreshold)
+	{
+		mCoalescing = enabled;
+		mCoalescingThreshold = threshold;
+		if(!mCoalescing)
+		{
+			Flush();
+		}
+	}
+
+	/**
+	 * @brief Keep messages published while disconnected in the spool file at @p path instead of dropping them
+	 *
+	 * The file holds up to @p capacity bytes of messages, it is created when missing and messages in it from an
+	 * earlier run are sent as well. Once the broker accepted the connection they are sent with QoS 1, or 2 when
+	 * published with it, as fast as the in-flight window allows. QoS 1 and 2 messages published meanwhile are
+	 * appended until it is drained, so their order is kept. Each message stays in the file until the broker
+	 * acknowledged it. Messages waiting for room in the window when the connection drops are spooled as well.
+	 *
+	 * Throws std::runtime_error when the file can't be opened.
+	 */
+	void EnableOfflineSpool(const std::string& path, std::size_t capacity = MQTTSpool::DefaultCapacity)
+	{
+		mSpool = std::make_unique<MQTTSpool>(path, capacity);
+		SendQueued();
+	}
+
+	/**
+	 * @brief Messages in the spool the broker didn't acknowledge yet, 0 without a spool
+	 */
+	std::size_t GetSpooledCount() const noexcept
+	{
+		return mSpool ? mSpool->GetCount() : 0;
+	}
+
+	/**
+	 * @brief Send the packets collected while coalescing right away
+	 *
+	 * What the socket has no room for is kept by the StreamSocket and sent in order once it is writable, a packet
+	 * is never cut off.
+	 */
+	void Flush()
+	{
+		if(mSendSize != 0)
+		{
+			mConnection.Send(mSendBuffer.data(), mSendSize);
+			mSendSize = 0;
+		}
+	}
+
+	/**
+	 * @brief QoS 1 and 2 messages sent and not yet acknowledged
+	 */
+	std::size_t GetInFlightCount() const noexcept
+	{
+		return mInFlight.size();
+	}
+
+	/**
+	 * @brief QoS 1 and 2 messages waiting for room in the in-flight window
+	 */
+	std::size_t GetQueuedCount() const noexcept
+	{
+		return mQueued.size();
+	}
+
+	/**
+	 * @brief Number of QoS 1 and 2 messages the broker allows in flight, 65535 unless it said otherwise
+	 */
+	std::uint16_t GetBrokerReceiveMaximum() const noexcept
+	{
+		return mBrokerReceiveMaximum;
 	}
 
 	bool IsConnected() const noexcept
@@ -68,14 +253,20 @@ public:
 
 	void Disconnect()
 	{
-		const MQTTDisconnectPacket disconPacket;
-		const auto packet = disconPacket.GetMessage();
-
-		mConnection.Send(packet.data(), packet.size());
+		SendPacket(MQTTDisconnectPacket());
+		Flush();
 		mMQTTConnected = false;
 	}
 
 	void Subscribe(const std::string& topic)
+	{
+		Subscribe(std::vector<std::string>{topic});
+	}
+
+	/**
+	 * @brief Subscribe to all of @p topics, in as few SUBSCRIBE packets as the size limits allow
+	 */
+	void Subscribe(const std::vector<std::string>& topics)
 	{
 		if(!mTCPConnected && !mMQTTConnected)
 		{
@@ -83,17 +274,41 @@ public:
 			return;
 		}
 
-		const MQTTSubscribePacket subPacket(mPacketIdentifier, topic);
-		const auto packet = subPacket.GetMessage();
-
-		mConnection.Send(packet.data(), packet.size());
+		SendFilters<MQTTSubscribePacket>(topics);
+	}
 
-		mUnacknoledgedPackets[mPacketIdentifier] = topic;
+	/**
+	 * @brief Subscribe to @p topicFilter and hand the messages matching it to @p callback
+	 *
+	 * Every message is matched once against the filters with a callback, wildcards included, and passed to each
+	 * one it matches. Messages matching none go to IMQTTClientHandler::OnPublish. The callback is kept across
+	 * reconnects, the filter is subscribed to again once the broker accepted the new connection, until the broker
+	 * refused the filter or acknowledged its Unsubscribe(). A callback may subscribe and unsubscribe, but not replace
+	 * itself.
+	 */
+	void Subscribe(const std::string& topicFilter, PublishCallback callback)
+	{
+		if(!mTCPConnected && !mMQTTConnected)
+		{
+			mLogger->error("Can't subscribe while not connected");
+			return;
+		}
+		if(!IsValidTopicFilter(topicFilter))
+		{
+			mLogger->error("Can't subscribe to invalid topic filter {}", topicFilter);
+			return;
+		}
 
-		++mPacketIdentifier;
+		mCallbacks.Insert(topicFilter) = std::move(callback);
+		SendFilters<MQTTSubscribePacket>({topicFilter});
 	}
 
 	void Unsubscribe(const std::string& topic)
+	{
+		Unsubscribe(std::vector<std::string>{topic});
+	}
+
+	void Unsubscribe(const std::vector<std::string>& topics)
 	{
 		if(!mTCPConnected && !mMQTTConnected)
 		{
@@ -101,39 +316,61 @@ public:
 			return;
 		}
 
-		if(
-			(std::find(std::begin(mAcknowledgedSubscriptions), std::end(mAcknowledgedSubscriptions), topic)
-			== std::end(mAcknowledgedSubscriptions)))
+		std::vector<std::string> subscribed;
+		subscribed.reserve(topics.size());
+		for(const auto& topic : topics)
 		{
-			mLogger->error("Can't unsubscribe from unconfirmed or unsubscribed topic");
-			return;
+			// A filter with a callback may still wait for its SUBACK after a reconnect
+			if(mAcknowledgedSubscriptions.count(topic) == 0 && mCallbacks.Find(topic) == nullptr)
+			{
+				mLogger->error("Can't unsubscribe from unconfirmed or unsubscribed topic {}", topic);
+				continue;
+			}
+			subscribed.push_back(topic);
 		}
 
-		const MQTTUnsubscribePacket unsubPacket(mPacketIdentifier, topic);
-		const auto packet = unsubPacket.GetMessage();
-
-		mConnection.Send(packet.data(), packet.size());
-
-		mUnacknoledgedPackets[mPacketIdentifier] = topic;
-
-		++mPacketIdentifier;
+		SendFilters<MQTTUnsubscribePacket>(subscribed);
 	}
 
-	void Publish(const std::string& topic, const std::string& message)
+	/**
+	 * @brief Publish @p message to @p topic with @p qos
+	 *
+	 * QoS 1 and 2 messages are sent right away while the in-flight window has room and queued otherwise, they are
+	 * kept until the broker acknowledged them and sent again after a reconnect.
+	 */
+	void Publish(const std::string& topic, const std::string& message, int qos = 0)
 	{
+		if(qos < 0 || qos > 2)
+		{
+			mLogger->error("Can't publish with QoS {}", qos);
+			return;
+		}
+		if(mSpool && (!IsConnected() || (qos != 0 && mSpool->HasUnread())))
+		{
+			if(!mSpool->Append(topic, message, qos))
+			{
+				mLogger->error("Spool is full, dropping message to {}", topic);
+			}
+			return;
+		}
 		if(!mTCPConnected && !mMQTTConnected)
 		{
 			mLogger->error("Can't publish while not connected");
 			return;
 		}
 
-		const MQTTPublishPacket pubPacket(mPacketIdentifier, topic, message, std::nullopt);
-		const auto packet = pubPacket.GetMessage();
-
-		mConnection.Send(packet.data(), packet.size());
-
-		//TODO Implement QoS higher then 0
-		//++mPacketIdentifier;
+		if(qos == 0)
+		{
+			SendPublish(topic, message, 0, 0, false);
+		}
+		else if(mQueued.empty() && HasInFlightRoom())
+		{
+			StartPublish(topic, message, qos);
+		}
+		else
+		{
+			mQueued.push_back({topic, message, qos});
+		}
 	}
 
 	void OnConnected() final
@@ -141,11 +378,31 @@ public:
 		mLogger->info("Connection succeeded");
 		mTCPConnected = true;
 
-		const MQTTConnectPacket connectPacket(mKeepAlive, mClientId, 1);
-		const auto packet = connectPacket.GetMessage();
-		mConnection.Send(packet.data(), packet.size());
+		// Aliases, limits and with the clean session also subscriptions only hold for one connection, messages in
+		// flight are sent again once the broker accepted the connection
+		mAcknowledgedSubscriptions.clear();
+		for(const auto& pending : mUnacknoledgedPackets)
+		{
+			mPacketIds.Release(pending.first);
+		}
+		mUnacknoledgedPackets.clear();
+		mReceivedQoS2.reset();
+		mTopicAliases.clear();
+		mInboundTopicAliases.assign(mTopicAliasMaximum, std::string());
+		mBrokerReceiveMaximum = std::numeric_limits<std::uint16_t>::max();
+		mBrokerMaximumPacketSize = std::numeric_limits<std::uint32_t>::max();
+		mBrokerTopicAliasMaximum = 0;
+
+		MQTTProperties properties;
+		if(mVersion == MQTTVersion::V5)
+		{
+			properties.mMaximumPacketSize = mMaximumPacketSize;
+			properties.mTopicAliasMaximum = mTopicAliasMaximum;
+		}
+		SendPacket(MQTTConnectPacket(mKeepAlive, mClientId, 1, mVersion, properties));
 
 		mEv.AddTimer(&mKeepAliveTimer);
+		mEv.AddTimer(&mRetransmitTimer);
 	}
 
 	void OnDisconnect(Common::StreamSocket* conn) final
@@ -153,53 +410,573 @@ public:
 		mLogger->warn("Connection terminated");
 		mTCPConnected = false;
 		mMQTTConnected = false;
+		mParser.Clear();
+		// QoS 1 and 2 messages are still in flight and sent again on the next connection
+		mSendSize = 0;
+		if(mSpool)
+		{
+			SpoolQueued();
+		}
+		mHandler->OnDisconnect(this);
 	}
 
 	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
 	{
-		MQTTPacket incomingPacket(data);
+		// Acknowledgements and what the handler publishes in response go out together after the read
+		mInReceive = true;
+		const auto status = mParser.Feed(data, len, [this](const char* packet, std::size_t size) {
+			return HandlePacket(packet, size) && mTCPConnected;
+		});
+		mInReceive = false;
+		if(status != Common::DecodeStatus::Incomplete && mTCPConnected)
+		{
+			mLogger->error("Malformed or invalid packet from broker, closing connection");
+			mConnection.Shutdown();
+			OnDisconnect(&mConnection);
+			return;
+		}
+		Flush();
+	}
+
+	void KeepAlive()
+	{
+		if(mTCPConnected && mMQTTConnected)
+		{
+			SendPacket(MQTTPingRequestPacket());
+		}
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct InFlightMessage
+	{
+		std::string mTopic;
+		std::string mPayload;
+		int mQoS = 1;
+		/// QoS 2 after the PUBREC, PUBREL is sent in place of the PUBLISH
+		bool mReleased = false;
+		Clock::time_point mSentAt;
+		/// Where the message is kept in the spool, NoSpoolRecord when it isn't
+		std::uint64_t mSpoolRecord = NoSpoolRecord;
+	};
+
+	struct QueuedMessage
+	{
+		std::string mTopic;
+		std::string mPayload;
+		int mQoS = 1;
+	};
+
+	/**
+	 * @brief Space for a packet of @p size behind the packets collected so far, Commit() it once it is encoded
+	 *
+	 * Packets are encoded into one buffer that is reused, it only allocates when it has to grow.
+	 */
+	char* GetSendBuffer(std::size_t size)
+	{
+		if(mSendBuffer.size() < mSendSize + size)
+		{
+			mSendBuffer.resize(mSendSize + size);
+		}
+		return mSendBuffer.data() + mSendSize;
+	}
+
+	/**
+	 * @brief Send the @p size bytes encoded at GetSendBuffer(), or while coalescing keep them for the flush
+	 */
+	void Commit(std::size_t size)
+	{
+		mSendSize += size;
+		if(!mCoalescing || mSendSize >= mCoalescingThreshold)
+		{
+			Flush();
+		}
+		else if(!mInReceive && !mFlushScheduled)
+		{
+			// Runs at the end of this event loop cycle, after the timers
+			mFlushScheduled = true;
+			std::weak_ptr<bool> alive = mAlive;
+			mEv.SheduleForNextCycle([this, alive](){
+				if(!alive.expired())
+				{
+					mFlushScheduled = false;
+					Flush();
+				}
+			});
+		}
+	}
+
+	/**
+	 * @brief Encode and send a PUBLISH, with a topic alias in place of the topic once the broker knows it
+	 *
+	 * @return False when the packet is larger than the broker accepts and was dropped.
+	 */
+	bool SendPublish(const std::string& topic, const std::string& message, int qos, std::uint16_t packetId,
+			bool duplicate)
+	{
+		// After the first message on a topic an alias is sent in place of the topic, while the broker allows more
+		std::uint16_t alias = 0;
+		bool newAlias = false;
+		std::string_view topicName = topic;
+		if(mBrokerTopicAliasMaximum != 0)
+		{
+			const auto known = mTopicAliases.find(topic);
+			if(known != mTopicAliases.end())
+			{
+				alias = known->second;
+				topicName = {};
+			}
+			else if(mTopicAliases.size() < mBrokerTopicAliasMaximum)
+			{
+				alias = static_cast<std::uint16_t>(mTopicAliases.size() + 1);
+				newAlias = true;
+			}
+		}
+
+		// Encoded from the caller's strings, without building a packet
+		const std::size_t size = MQTTPublishPacket::GetEncodedSize(topicName.size(), message.size(), qos, mVersion, alias);
+		if(size > mBrokerMaximumPacketSize)
+		{
+			mLogger->error("Can't publish {} bytes, the broker accepts at most {}", size, mBrokerMaximumPacketSize);
+			return false;
+		}
+		const Common::Span<char> buffer(GetSendBuffer(size), size);
+		const std::size_t written = MQTTPublishPacket::Encode(buffer, packetId, topicName, message, qos, mVersion, alias);
+		if(duplicate)
+		{
+			buffer[0] = static_cast<char>(buffer[0] | PublishDuplicateFlag);
+		}
+		Commit(written);
+		// Only known to the broker once a packet setting it was sent
+		if(newAlias)
+		{
+			mTopicAliases.emplace(topic, alias);
+		}
+		return true;
+	}
+
+	bool HasInFlightRoom() const noexcept
+	{
+		return mInFlight.size() < std::min(mInFlightWindow, mBrokerReceiveMaximum) &&
+				mPacketIds.GetInUse() < std::numeric_limits<std::uint16_t>::max();
+	}
+
+	static constexpr std::uint64_t NoSpoolRecord = std::numeric_limits<std::uint64_t>::max();
+
+	/**
+	 * @brief Send a QoS 1 or 2 message under a new packet identifier and keep it until it is acknowledged
+	 */
+	void StartPublish(std::string topic, std::string message, int qos, std::uint64_t spoolRecord = NoSpoolRecord)
+	{
+		const auto packetId = mPacketIds.Allocate();
+		if(!SendPublish(topic, message, qos, packetId, false))
+		{
+			mPacketIds.Release(packetId);
+			ReleaseSpoolRecord(spoolRecord);
+			return;
+		}
+		const auto now = Clock::now();
+		mInFlight[packetId] = {std::move(topic), std::move(message), qos, false, now, spoolRecord};
+		mRetransmitOrder.emplace_back(packetId, now);
+	}
+
+	/**
+	 * @brief Send spooled, then queued messages while the in-flight window has room
+	 */
+	void SendQueued()
+	{
+		while(HasInFlightRoom() && IsConnected())
+		{
+			// Spooled messages were published first, the queue only fills while the spool is drained
+			if(mSpool && mSpool->HasUnread())
+			{
+				mSpool->ReadNext([this](std::string_view topic, std::string_view payload, int qos, std::uint64_t record) {
+					StartPublish(std::string(topic), std::string(payload), std::max(qos, 1), record);
+				});
+			}
+			else if(!mQueued.empty())
+			{
+				auto message = std::move(mQueued.front());
+				mQueued.pop_front();
+				StartPublish(std::move(message.mTopic), std::move(message.mPayload), message.mQoS);
+			}
+			else
+			{
+				break;
+			}
+		}
+	}
+
+	/**
+	 * @brief Move the messages waiting for room in the in-flight window to the spool
+	 */
+	void SpoolQueued()
+	{
+		for(const auto& message : mQueued)
+		{
+			if(!mSpool->Append(message.mTopic, message.mPayload, message.mQoS))
+			{
+				mLogger->error("Spool is full, dropping message to {}", message.mTopic);
+			}
+		}
+		mQueued.clear();
+	}
+
+	void ReleaseSpoolRecord(std::uint64_t record) noexcept
+	{
+		if(record != NoSpoolRecord && mSpool)
+		{
+			mSpool->Release(record);
+		}
+	}
+
+	/**
+	 * @brief Send the PUBLISH, or once the broker has it the PUBREL, of a message in flight again
+	 */
+	void Resend(std::uint16_t packetId, InFlightMessage& message)
+	{
+		message.mSentAt = Clock::now();
+		mRetransmitOrder.emplace_back(packetId, message.mSentAt);
+		if(message.mReleased)
+		{
+			SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBREL, packetId));
+		}
+		else
+		{
+			SendPublish(message.mTopic, message.mPayload, message.mQoS, packetId, true);
+		}
+	}
+
+	/**
+	 * @brief Send messages that were not acknowledged within the retransmit interval again, oldest first
+	 */
+	void Retransmit()
+	{
+		if(!IsConnected() || mVersion == MQTTVersion::V5)
+		{
+			return;
+		}
+		const auto expired = Clock::now() - mRetransmitInterval;
+		while(!mRetransmitOrder.empty() && mRetransmitOrder.front().second <= expired)
+		{
+			const auto [packetId, sentAt] = mRetransmitOrder.front();
+			mRetransmitOrder.pop_front();
+			const auto message = mInFlight.find(packetId);
+			// Acknowledged or sent again since
+			if(message == mInFlight.end() || message->second.mSentAt != sentAt)
+			{
+				continue;
+			}
+			Resend(packetId, message->second);
+		}
+	}
+
+	/**
+	 * @brief Subscribe to the filters with a callback again, the clean session dropped them with the last connection
+	 */
+	void SubscribeCallbacks()
+	{
+		std::vector<std::string> filters;
+		filters.reserve(mCallbacks.GetSize());
+		mCallbacks.ForEach([&filters](const std::string& filter, const PublishCallback& /*callback*/) {
+			filters.push_back(filter);
+		});
+		SendFilters<MQTTSubscribePacket>(filters);
+	}
+
+	/**
+	 * @brief Send everything in flight again on a new connection, in the order it was sent, then what is queued
+	 */
+	void ResendAll()
+	{
+		const auto order = std::move(mRetransmitOrder);
+		mRetransmitOrder.clear();
+		for(const auto& [packetId, sentAt] : order)
+		{
+			const auto message = mInFlight.find(packetId);
+			if(message != mInFlight.end() && message->second.mSentAt == sentAt)
+			{
+				Resend(packetId, message->second);
+			}
+		}
+		SendQueued();
+	}
+
+	/**
+	 * @return False when the packet breaks the protocol and the connection has to be closed.
+	 */
+	bool HandlePublishAck(const MQTTPublishAckPacket& ack)
+	{
+		const auto packetId = ack.GetPacketId();
+		if(ack.GetType() == MQTTPacketType::PUBREL)
+		{
+			// The second half of a QoS 2 message from the broker, it was handed on with the PUBLISH
+			mReceivedQoS2.reset(packetId);
+			SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBCOMP, packetId));
+			return true;
+		}
+
+		const auto message = mInFlight.find(packetId);
+		if(message == mInFlight.end())
+		{
+			// Acknowledgements of messages sent twice can arrive twice
+			mLogger->debug("Acknowledgement for packet identifier {} that is not in flight", packetId);
+			return true;
+		}
+		auto& inFlight = message->second;
+		const bool expected = inFlight.mQoS == 1 ? ack.GetType() == MQTTPacketType::PUBACK :
+				ack.GetType() == (inFlight.mReleased ? MQTTPacketType::PUBCOMP : MQTTPacketType::PUBREC);
+		if(!expected)
+		{
+			// A repeated PUBREC is answered with PUBREL again
+			if(inFlight.mReleased && ack.GetType() == MQTTPacketType::PUBREC)
+			{
+				SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBREL, packetId));
+				return true;
+			}
+			mLogger->error("Unexpected acknowledgement for packet identifier {}", packetId);
+			return false;
+		}
+		// Reason codes from 0x80 are failures (MQTT 5.0 section 2.4)
+		if(ack.GetReasonCode() >= 0x80)
+		{
+			mLogger->warn("Message to {} refused by the broker, reason code {}", inFlight.mTopic, ack.GetReasonCode());
+		}
+		else if(ack.GetType() == MQTTPacketType::PUBREC)
+		{
+			inFlight.mReleased = true;
+			inFlight.mSentAt = Clock::now();
+			mRetransmitOrder.emplace_back(packetId, inFlight.mSentAt);
+			SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBREL, packetId));
+			return true;
+		}
+
+		const std::string topic = std::move(inFlight.mTopic);
+		ReleaseSpoolRecord(inFlight.mSpoolRecord);
+		mInFlight.erase(message);
+		mPacketIds.Release(packetId);
+		SendQueued();
+		mHandler->OnPublishComplete(topic);
+		return true;
+	}
+
+	/**
+	 * @brief Pass a message to the callbacks of the filters it matches, or to the handler when there are none
+	 */
+	void Dispatch(std::string_view topic, Common::Span<const char> payload)
+	{
+		bool dispatched = false;
+		mCallbacks.Match(topic, [&](const PublishCallback& callback) {
+			callback(topic, payload);
+			dispatched = true;
+		});
+		if(!dispatched)
+		{
+			mHandler->OnPublish(topic, payload);
+		}
+	}
+
+	template<typename Packet>
+	void SendPacket(const Packet& packet)
+	{
+		const std::size_t size = packet.GetEncodedSize();
+		const Common::Span<char> buffer(GetSendBuffer(size), size);
+		Commit(packet.Encode(buffer));
+	}
+
+	/**
+	 * @brief Send @p topics in SUBSCRIBE or UNSUBSCRIBE packets of up to MaxSubscribePacketSize, or what the broker
+	 * accepts when that is less, and remember them until they are acknowledged
+	 */
+	template<typename Packet>
+	void SendFilters(const std::vector<std::string>& topics)
+	{
+		// Fixed header, packet identifier and MQTT 5 properties
+		constexpr std::size_t overhead = 1 + 4 + 2 + EmptyPropertiesSize;
+		const std::size_t limit = std::min<std::size_t>(MaxSubscribePacketSize, mBrokerMaximumPacketSize);
+
+		std::vector<std::string> batch;
+		std::size_t size = overhead;
+		const auto flush = [this, &batch, &size]() {
+			if(batch.empty())
+			{
+				return;
+			}
+			const auto packetId = mPacketIds.Allocate();
+			if(packetId == 0)
+			{
+				mLogger->error("No free packet identifier, dropping {} topic filters", batch.size());
+				batch.clear();
+				size = overhead;
+				return;
+			}
+			SendPacket(Packet(packetId, batch, mVersion));
+			mUnacknoledgedPackets[packetId] = std::move(batch);
+			batch.clear();
+			size = overhead;
+		};
+		for(const auto& topic : topics)
+		{
+			const std::size_t filterSize = Packet::GetFilterSize(topic.size());
+			if(overhead + filterSize > mBrokerMaximumPacketSize)
+			{
+				mLogger->error("Topic filter {} is larger than the broker accepts", topic);
+				continue;
+			}
+			if(size + filterSize > limit)
+			{
+				flush();
+			}
+			batch.push_back(topic);
+			size += filterSize;
+		}
+		flush();
+	}
+
+	/**
+	 * @return False when the packet breaks the protocol and the connection has to be closed.
+	 */
+	bool HandlePacket(const char* data, std::size_t len)
+	{
+		// Messages are passed on as views into the packet, other packets are small and parsed into copies
+		if(static_cast<MQTTPacketType>(static_cast<std::uint8_t>(data[0]) >> 4) == MQTTPacketType::PUBLISH)
+		{
+			const MQTTPublishView publish(data, len, mVersion);
+			if(!publish.IsValid())
+			{
+				return false;
+			}
+			std::string_view topic = publish.GetTopic();
+			if(const auto alias = publish.GetTopicAlias())
+			{
+				if(alias > mInboundTopicAliases.size())
+				{
+					return false;
+				}
+				auto& aliasedTopic = mInboundTopicAliases[alias - 1];
+				if(topic.empty())
+				{
+					// An alias the broker never set
+					if(aliasedTopic.empty())
+					{
+						return false;
+					}
+					topic = aliasedTopic;
+				}
+				else
+				{
+					aliasedTopic.assign(topic);
+				}
+			}
+
+			// QoS 2 is handed on once, a PUBLISH sent again before the PUBREL is only acknowledged again
+			const auto packetId = publish.GetPacketId();
+			const auto qos = publish.GetQoS();
+			if(qos != 2 || !mReceivedQoS2.test(packetId))
+			{
+				Dispatch(topic, publish.GetPayload());
+			}
+			if(qos == 1)
+			{
+				SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBACK, packetId));
+			}
+			else if(qos == 2)
+			{
+				mReceivedQoS2.set(packetId);
+				SendPacket(MQTTPublishAckPacket(MQTTPacketType::PUBREC, packetId));
+			}
+			return true;
+		}
+
+		const MQTTPacket incomingPacket(data, len, mVersion);
+		if(!incomingPacket.IsValid())
+		{
+			return false;
+		}
 
 		switch(incomingPacket.mFixedHeader.mType)
 		{
 			case MQTTPacketType::CONNACK:
 			{
 				mLogger->info("Incoming connack");
+				const auto* connack = incomingPacket.GetConnackPacket();
+				if(connack->GetReturnCode() != 0)
+				{
+					mLogger->error("Connection refused by the broker, return code {}", connack->GetReturnCode());
+					return false;
+				}
+				const auto& properties = connack->GetProperties();
+				mBrokerReceiveMaximum = properties.mReceiveMaximum.value_or(mBrokerReceiveMaximum);
+				mBrokerMaximumPacketSize = properties.mMaximumPacketSize.value_or(mBrokerMaximumPacketSize);
+				mBrokerTopicAliasMaximum = properties.mTopicAliasMaximum.value_or(0);
 				mMQTTConnected = true;
+				ResendAll();
+				SubscribeCallbacks();
 				mHandler->OnConnected();
 				break;
 			}
 
-			case MQTTPacketType::PUBLISH:
+			case MQTTPacketType::PINGRESP:
 			{
-				auto pubPacket = incomingPacket.GetPublishPacket();
-				mHandler->OnPublish(pubPacket->GetTopicFilter(),
-						pubPacket->GetTopicPayload());
 				break;
 			}
 
-			case MQTTPacketType::PINGRESP:
+			case MQTTPacketType::PUBACK:
+			case MQTTPacketType::PUBREC:
+			case MQTTPacketType::PUBREL:
+			case MQTTPacketType::PUBCOMP:
 			{
-				break;
+				return HandlePublishAck(*incomingPacket.GetPublishAckPacket());
 			}
 
 			case MQTTPacketType::SUBACK:
 			{
-				auto subAckPacket = incomingPacket.GetSubAckPacket();
-				const auto& topic = mUnacknoledgedPackets[subAckPacket->GetPacketId()];
-				mAcknowledgedSubscriptions.push_back(topic);
+				const auto* suback = incomingPacket.GetSubAckPacket();
+				const auto& returnCodes = suback->GetReturnCodes();
+				const auto pending = mUnacknoledgedPackets.find(suback->GetPacketId());
+				if(pending == mUnacknoledgedPackets.end() || pending->second.size() != returnCodes.size())
+				{
+					mLogger->error("SUBACK does not match a SUBSCRIBE, packet identifier {}", suback->GetPacketId());
+					return false;
+				}
+				// Taken out first, the handler may subscribe again
+				const auto topics = std::move(pending->second);
+				mUnacknoledgedPackets.erase(pending);
+				mPacketIds.Release(suback->GetPacketId());
+				for(std::size_t i = 0; i < topics.size(); ++i)
+				{
+					if(returnCodes[i] < SubackFailure)
+					{
+						mAcknowledgedSubscriptions.insert(topics[i]);
+					}
+					else
+					{
+						mLogger->warn("Subscription to {} refused, return code {}", topics[i], returnCodes[i]);
+						mCallbacks.Erase(topics[i]);
+					}
+					mHandler->OnSubscribed(topics[i], returnCodes[i]);
+				}
 				break;
 			}
 
 			case MQTTPacketType::UNSUBACK:
 			{
 				mLogger->info("Unsubscribe confirmed");
-				auto unSubAckPacket = incomingPacket.GetUnSubAckPacket();
-				const auto& topic = mUnacknoledgedPackets[unSubAckPacket->GetPacketId()];
-				mAcknowledgedSubscriptions.erase(
-						std::find(
-							std::begin(mAcknowledgedSubscriptions),
-							std::end(mAcknowledgedSubscriptions),
-							topic));
+				const auto* unsuback = incomingPacket.GetUnSubAckPacket();
+				const auto pending = mUnacknoledgedPackets.find(unsuback->GetPacketId());
+				if(pending == mUnacknoledgedPackets.end())
+				{
+					mLogger->error("UNSUBACK does not match an UNSUBSCRIBE, packet identifier {}", unsuback->GetPacketId());
+					return false;
+				}
+				for(const auto& topic : pending->second)
+				{
+					mAcknowledgedSubscriptions.erase(topic);
+					mCallbacks.Erase(topic);
+				}
+				mUnacknoledgedPackets.erase(pending);
+				mPacketIds.Release(unsuback->GetPacketId());
 				break;
 			}
 
@@ -209,34 +986,67 @@ public:
 				break;
 			}
 		}
+		return true;
 	}
 
-	void KeepAlive()
-	{
-		if(mTCPConnected && mMQTTConnected)
-		{
-			const MQTTPingRequestPacket packet;
-			mConnection.Send(packet.GetMessage(), packet.GetSize());
-		}
-	}
-
-private:
 	EventLoop::EventLoop& mEv;
 	Common::StreamSocket mConnection;
+	MQTTParser mParser;
+	std::vector<char> mSendBuffer;
+	/// Bytes at the start of mSendBuffer not sent yet
+	std::size_t mSendSize = 0;
 	IMQTTClientHandler* mHandler;
 
 	EventLoop::EventLoop::Timer mKeepAliveTimer;
+	EventLoop::EventLoop::Timer mRetransmitTimer;
 
 	std::string mClientId;
 	int mKeepAlive;
+	MQTTVersion mVersion = MQTTVersion::V311;
+
+	/// Announced to the broker with MQTT 5
+	std::uint32_t mMaximumPacketSize = MQTTParser::DefaultMaxPacketSize;
+	std::uint16_t mTopicAliasMaximum = DefaultTopicAliasMaximum;
+	/// Limits the broker announced in CONNACK
+	std::uint16_t mBrokerReceiveMaximum = std::numeric_limits<std::uint16_t>::max();
+	std::uint32_t mBrokerMaximumPacketSize = std::numeric_limits<std::uint32_t>::max();
+	std::uint16_t mBrokerTopicAliasMaximum = 0;
+	/// Aliases this client set, by topic
+	std::unordered_map<std::string, std::uint16_t> mTopicAliases;
+	/// Topics the broker set for its aliases, the index is the alias - 1
+	std::vector<std::string> mInboundTopicAliases;
 
 	bool mTCPConnected = false;
 	bool mMQTTConnected = false;
 
-	uint16_t mPacketIdentifier = 1;
+	bool mCoalescing = false;
+	std::size_t mCoalescingThreshold = DefaultCoalescingThreshold;
+	/// Set while the data from the broker is handled, it is flushed afterwards
+	bool mInReceive = false;
+	bool mFlushScheduled = false;
+	/// Expires with the client, for the flush scheduled on the event loop
+	std::shared_ptr<bool> mAlive;
+
+	/// Shared by SUBSCRIBE, UNSUBSCRIBE and QoS 1 and 2 messages until they are acknowledged
+	MQTTPacketIdAllocator mPacketIds;
+	std::uint16_t mInFlightWindow = DefaultInFlightWindow;
+	std::chrono::milliseconds mRetransmitInterval = DefaultRetransmitInterval;
+	/// QoS 1 and 2 messages sent and not yet acknowledged, by packet identifier
+	std::unordered_map<std::uint16_t, InFlightMessage> mInFlight;
+	/// Packet identifiers in flight in the order they were last sent, entries sent again since are skipped
+	std::deque<std::pair<std::uint16_t, Clock::time_point>> mRetransmitOrder;
+	/// QoS 1 and 2 messages waiting for room in the in-flight window
+	std::deque<QueuedMessage> mQueued;
+	/// Messages published while disconnected, when enabled
+	std::unique_ptr<MQTTSpool> mSpool;
+	/// Packet identifiers of QoS 2 messages from the broker that were handed on and await their PUBREL
+	std::bitset<65536> mReceivedQoS2;
 
-	std::vector<std::string> mAcknowledgedSubscriptions;
-	std::unordered_map<int, std::string> mUnacknoledgedPackets;
+	std::unordered_set<std::string> mAcknowledgedSubscriptions;
+	/// Callbacks passed to Subscribe(), by topic filter
+	MQTTTopicTrie<PublishCallback> mCallbacks;
+	/// Topic filters of each SUBSCRIBE and UNSUBSCRIBE until it is acknowledged, by packet identifier
+	std::unordered_map<std::uint16_t, std::vector<std::string>> mUnacknoledgedPackets;
 
 	std::shared_ptr<spdlog::logger> mLogger;
 };
@@ -0,0 +1,62 @@
+#ifndef MQTTCODEC_H
+#define MQTTCODEC_H
+
+#include <cstring>
+
+#include "FramedSocket.h"
+#include "MQTTPacket.h"
+
+namespace MQTT {
+
+/**
+ * @brief FramedSocket codec for MQTT control packets
+ *
+ * MQTT packets carry their own framing in the fixed header, so the payload is the complete packet in both
+ * directions. Decoding only determines where a packet ends, the contents are parsed by MQTTPacket.
+ */
+struct MQTTCodec
+{
+	static constexpr std::size_t MaxOverhead = 0;
+	/// Packet type byte, 4 byte remaining length and the largest remaining length it can express
+	static constexpr std::size_t MaxPayloadSize = MaxFixedHeaderSize + MaxRemainingLength;
+
+	static Common::DecodeStatus Decode(const char* data, std::size_t len, Common::Frame& frame) noexcept
+	{
+		if(len < 2)
+		{
+			return Common::DecodeStatus::Incomplete;
+		}
+
+		std::size_t remainingLength = 0;
+		std::size_t lengthSize = 0;
+		switch(DecodeRemainingLength(data + 1, len - 1, remainingLength, lengthSize))
+		{
+			case RemainingLengthStatus::Incomplete:
+				return Common::DecodeStatus::Incomplete;
+			case RemainingLengthStatus::Malformed:
+				return Common::DecodeStatus::Malformed;
+			case RemainingLengthStatus::Complete:
+				break;
+		}
+
+		const std::size_t packetLen = 1 + lengthSize + remainingLength;
+		if(len < packetLen)
+		{
+			return Common::DecodeStatus::Incomplete;
+		}
+
+		frame.mFrame = std::string_view(data, packetLen);
+		frame.mPayload = frame.mFrame;
+		return Common::DecodeStatus::Complete;
+	}
+
+	static std::size_t Encode(char* out, const char* payload, std::size_t len) noexcept
+	{
+		std::memcpy(out, payload, len);
+		return len;
+	}
+};
+
+}
+
+#endif // MQTTCODEC_H
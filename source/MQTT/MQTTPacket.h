@@ -1,7 +1,21 @@
 #ifndef MQTTPACKET_H
 #define MQTTPACKET_H
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
+#include <vector>
+
+#include <endian.h>
+
+#include "Span.h"
+
+#include "MQTTValidation.h"
 
 namespace MQTT {
 
@@ -30,96 +44,617 @@ enum class MQTTQoSType : char
 	THREE = 3,
 };
 
-class MQTTHeaderOnlyPacket
+/// Protocol level sent in CONNECT
+enum class MQTTVersion : std::uint8_t
+{
+	V311 = 4,
+	V5 = 5,
+};
+
+/// Largest value the Remaining Length field can hold (MQTT 3.1.1 section 2.2.3)
+constexpr std::size_t MaxRemainingLength = 268435455;
+/// Packet type byte plus the longest Remaining Length field
+constexpr std::size_t MaxFixedHeaderSize = 5;
+
+enum class RemainingLengthStatus
+{
+	Complete,
+	Incomplete,
+	Malformed
+};
+
+/**
+ * @brief Bytes needed to encode @p length as Remaining Length, 1 to 4
+ */
+constexpr std::size_t RemainingLengthSize(std::size_t length) noexcept
+{
+	return 1 + (length > 127) + (length > 16383) + (length > 2097151);
+}
+
+/**
+ * @brief Write @p length as Remaining Length to @p out, which needs room for 4 bytes
+ *
+ * @return The number of bytes written.
+ */
+inline std::size_t EncodeRemainingLength(char* out, std::size_t length) noexcept
+{
+	std::size_t size = 0;
+	do
+	{
+		std::uint8_t byte = length & 0x7F;
+		length >>= 7;
+		if(length != 0)
+		{
+			byte |= 0x80;
+		}
+		out[size++] = static_cast<char>(byte);
+	} while(length != 0);
+	return size;
+}
+
+/**
+ * @brief Decode the Remaining Length starting at @p data, never reads beyond @p len bytes
+ *
+ * Longer fields are read as one word when 4 bytes are available, the end of the field is found from the
+ * continuation bits and the 7 bit groups are combined without branches. Near the end of a buffer a byte by
+ * byte loop is used.
+ * @p size is set to the number of bytes the field took.
+ */
+inline RemainingLengthStatus DecodeRemainingLength(const char* data, std::size_t len, std::size_t& length, std::size_t& size) noexcept
+{
+	// Most packets are under 128 bytes
+	if(len != 0 && (data[0] & 0x80) == 0)
+	{
+		length = static_cast<std::uint8_t>(data[0]);
+		size = 1;
+		return RemainingLengthStatus::Complete;
+	}
+
+	if(len >= 4)
+	{
+		std::uint32_t word;
+		std::memcpy(&word, data, sizeof(word));
+		word = le32toh(word);
+
+		const std::uint32_t terminators = ~word & 0x80808080u;
+		if(terminators == 0)
+		{
+			return RemainingLengthStatus::Malformed;
+		}
+		size = static_cast<std::size_t>(__builtin_ctz(terminators)) / 8 + 1;
+		word &= 0xFFFFFFFFu >> (32 - 8 * size);
+		length = (word & 0x7Fu) | ((word >> 1) & 0x3F80u) | ((word >> 2) & 0x1FC000u) | ((word >> 3) & 0xFE00000u);
+		return RemainingLengthStatus::Complete;
+	}
+
+	length = 0;
+	for(std::size_t i = 0; i < len; ++i)
+	{
+		const auto byte = static_cast<std::uint8_t>(data[i]);
+		length |= static_cast<std::size_t>(byte & 0x7F) << (7 * i);
+		if((byte & 0x80) == 0)
+		{
+			size = i + 1;
+			return RemainingLengthStatus::Complete;
+		}
+	}
+	return RemainingLengthStatus::Incomplete;
+}
+
+/**
+ * @brief Size of a packet with @p remainingLength bytes after the fixed header
+ */
+constexpr std::size_t PacketSize(std::size_t remainingLength) noexcept
+{
+	return 1 + RemainingLengthSize(remainingLength) + remainingLength;
+}
+
+/**
+ * @brief Write the packet type and flags byte and @p remainingLength to @p out
+ *
+ * @return Pointer past the fixed header.
+ */
+inline char* EncodeFixedHeader(char* out, char typeAndFlags, std::size_t remainingLength) noexcept
+{
+	out[0] = typeAndFlags;
+	return out + 1 + EncodeRemainingLength(out + 1, remainingLength);
+}
+
+inline char* EncodeUint16(char* out, std::uint16_t value) noexcept
+{
+	out[0] = static_cast<char>(value >> 8);
+	out[1] = static_cast<char>(value & 0xFF);
+	return out + 2;
+}
+
+inline std::uint16_t DecodeUint16(const char* in) noexcept
+{
+	return static_cast<std::uint16_t>((in[0] & 0xFF) << 8 | (in[1] & 0xFF));
+}
+
+inline char* EncodeUint32(char* out, std::uint32_t value) noexcept
+{
+	value = htobe32(value);
+	std::memcpy(out, &value, sizeof(value));
+	return out + sizeof(value);
+}
+
+inline std::uint32_t DecodeUint32(const char* in) noexcept
+{
+	std::uint32_t value;
+	std::memcpy(&value, in, sizeof(value));
+	return be32toh(value);
+}
+
+/**
+ * @brief Write @p value as length prefixed UTF-8 string
+ */
+inline char* EncodeString(char* out, std::string_view value) noexcept
+{
+	out = EncodeUint16(out, static_cast<std::uint16_t>(value.size()));
+	// Empty views, e.g. the topic sent with an alias, may have no data pointer
+	if(!value.empty())
+	{
+		std::memcpy(out, value.data(), value.size());
+	}
+	return out + value.size();
+}
+
+/**
+ * @brief Encode @p packet at the end of @p buffer, which is grown by exactly the packet size
+ *
+ * Lets a buffer that is reused, e.g. per connection, collect packets without allocating once it has grown.
+ * @return The packet size.
+ */
+template<typename Packet>
+std::size_t AppendMessage(std::vector<char>& buffer, const Packet& packet)
+{
+	const std::size_t offset = buffer.size();
+	const std::size_t size = packet.GetEncodedSize();
+	buffer.resize(offset + size);
+	return packet.Encode(Common::Span<char>(buffer.data() + offset, size));
+}
+
+/**
+ * @brief Copy a packet encoded at compile time to @p out
+ *
+ * @return Bytes written, 0 when @p out is too small.
+ */
+template<std::size_t Size>
+std::size_t EncodeFixed(Common::Span<char> out, const std::array<char, Size>& message) noexcept
+{
+	if(out.size() < Size)
+	{
+		return 0;
+	}
+	std::memcpy(out.data(), message.data(), Size);
+	return Size;
+}
+
+/**
+ * @brief Packet as a newly allocated vector, for packets encoded from their fields
+ */
+template<typename Packet>
+std::vector<char> MakeMessage(const Packet& packet)
+{
+	std::vector<char> message(packet.GetEncodedSize());
+	packet.Encode(Common::Span<char>(message.data(), message.size()));
+	return message;
+}
+
+/// MQTT 5 property identifiers (MQTT 5.0 section 2.2.2.2)
+enum class MQTTPropertyId : std::uint8_t
+{
+	PayloadFormatIndicator = 0x01,
+	MessageExpiryInterval = 0x02,
+	ContentType = 0x03,
+	ResponseTopic = 0x08,
+	CorrelationData = 0x09,
+	SubscriptionIdentifier = 0x0B,
+	SessionExpiryInterval = 0x11,
+	AssignedClientIdentifier = 0x12,
+	ServerKeepAlive = 0x13,
+	AuthenticationMethod = 0x15,
+	AuthenticationData = 0x16,
+	RequestProblemInformation = 0x17,
+	WillDelayInterval = 0x18,
+	RequestResponseInformation = 0x19,
+	ResponseInformation = 0x1A,
+	ServerReference = 0x1C,
+	ReasonString = 0x1F,
+	ReceiveMaximum = 0x21,
+	TopicAliasMaximum = 0x22,
+	TopicAlias = 0x23,
+	MaximumQoS = 0x24,
+	RetainAvailable = 0x25,
+	UserProperty = 0x26,
+	MaximumPacketSize = 0x27,
+	WildcardSubscriptionAvailable = 0x28,
+	SubscriptionIdentifierAvailable = 0x29,
+	SharedSubscriptionAvailable = 0x2A,
+};
+
+/**
+ * @brief MQTT 5 properties of a packet
+ *
+ * Only the properties the client and broker act on are kept, any other valid property is skipped when decoding.
+ */
+class MQTTProperties
 {
 public:
-	MQTTHeaderOnlyPacket(MQTTPacketType type, std::uint8_t flags)
-		: mMessage({static_cast<char>((static_cast<std::uint8_t>(type) << 4 | (flags & 0x0F))), 0})
-	{}
+	/**
+	 * @brief Decode the property length and properties at @p data, never reads beyond @p len bytes
+	 *
+	 * @p size is set to the bytes taken, including the property length.
+	 * @return False when the properties are malformed, a kept property is repeated or has a value not allowed.
+	 */
+	bool Decode(const char* data, std::size_t len, std::size_t& size) noexcept
+	{
+		*this = MQTTProperties();
+		std::size_t length = 0;
+		std::size_t lengthSize = 0;
+		if(DecodeRemainingLength(data, len, length, lengthSize) != RemainingLengthStatus::Complete ||
+				length > len - lengthSize)
+		{
+			return false;
+		}
+		const char* pos = data + lengthSize;
+		const char* end = pos + length;
+		while(pos != end)
+		{
+			const auto id = static_cast<MQTTPropertyId>(*pos++);
+			const std::size_t left = end - pos;
+			std::size_t skip = 0;
+			switch(id)
+			{
+				case MQTTPropertyId::SessionExpiryInterval:
+					skip = DecodeValue(pos, left, mSessionExpiryInterval);
+					break;
+				case MQTTPropertyId::ReceiveMaximum:
+					skip = DecodeValue(pos, left, mReceiveMaximum);
+					break;
+				case MQTTPropertyId::MaximumPacketSize:
+					skip = DecodeValue(pos, left, mMaximumPacketSize);
+					break;
+				case MQTTPropertyId::TopicAliasMaximum:
+					skip = DecodeValue(pos, left, mTopicAliasMaximum);
+					break;
+				case MQTTPropertyId::TopicAlias:
+					skip = DecodeValue(pos, left, mTopicAlias);
+					break;
+				case MQTTPropertyId::PayloadFormatIndicator:
+				case MQTTPropertyId::RequestProblemInformation:
+				case MQTTPropertyId::RequestResponseInformation:
+				case MQTTPropertyId::MaximumQoS:
+				case MQTTPropertyId::RetainAvailable:
+				case MQTTPropertyId::WildcardSubscriptionAvailable:
+				case MQTTPropertyId::SubscriptionIdentifierAvailable:
+				case MQTTPropertyId::SharedSubscriptionAvailable:
+					skip = left >= 1 ? 1 : 0;
+					break;
+				case MQTTPropertyId::ServerKeepAlive:
+					skip = left >= 2 ? 2 : 0;
+					break;
+				case MQTTPropertyId::MessageExpiryInterval:
+				case MQTTPropertyId::WillDelayInterval:
+					skip = left >= 4 ? 4 : 0;
+					break;
+				case MQTTPropertyId::SubscriptionIdentifier:
+				{
+					std::size_t value = 0;
+					if(DecodeRemainingLength(pos, left, value, skip) != RemainingLengthStatus::Complete)
+					{
+						skip = 0;
+					}
+					break;
+				}
+				case MQTTPropertyId::ContentType:
+				case MQTTPropertyId::ResponseTopic:
+				case MQTTPropertyId::CorrelationData:
+				case MQTTPropertyId::AssignedClientIdentifier:
+				case MQTTPropertyId::AuthenticationMethod:
+				case MQTTPropertyId::AuthenticationData:
+				case MQTTPropertyId::ResponseInformation:
+				case MQTTPropertyId::ServerReference:
+				case MQTTPropertyId::ReasonString:
+					skip = StringSize(pos, left);
+					break;
+				case MQTTPropertyId::UserProperty:
+				{
+					// Name and value
+					const std::size_t name = StringSize(pos, left);
+					const std::size_t value = name ? StringSize(pos + name, left - name) : 0;
+					skip = value ? name + value : 0;
+					break;
+				}
+			}
+			if(skip == 0)
+			{
+				return false;
+			}
+			pos += skip;
+		}
+		size = lengthSize + length;
+		// Zero is a protocol error for these
+		return mReceiveMaximum != 0 && mMaximumPacketSize != 0 && mTopicAlias != 0;
+	}
 
-	const char* GetMessage() const
+	/**
+	 * @brief Size of the property length and the properties
+	 */
+	std::size_t GetEncodedSize() const noexcept
 	{
-		return mMessage.data();
+		const std::size_t length = GetLength();
+		return RemainingLengthSize(length) + length;
 	}
 
-	constexpr std::size_t GetSize() const
+	/**
+	 * @brief Write the property length and the properties to @p out, which needs GetEncodedSize() bytes
+	 *
+	 * @return Pointer past the properties.
+	 */
+	char* Encode(char* out) const noexcept
 	{
-		return mMessage.size();
+		out += EncodeRemainingLength(out, GetLength());
+		out = EncodeValue(out, MQTTPropertyId::SessionExpiryInterval, mSessionExpiryInterval);
+		out = EncodeValue(out, MQTTPropertyId::ReceiveMaximum, mReceiveMaximum);
+		out = EncodeValue(out, MQTTPropertyId::MaximumPacketSize, mMaximumPacketSize);
+		out = EncodeValue(out, MQTTPropertyId::TopicAliasMaximum, mTopicAliasMaximum);
+		out = EncodeValue(out, MQTTPropertyId::TopicAlias, mTopicAlias);
+		return out;
 	}
 
+	std::optional<std::uint32_t> mSessionExpiryInterval;
+	std::optional<std::uint16_t> mReceiveMaximum;
+	std::optional<std::uint32_t> mMaximumPacketSize;
+	std::optional<std::uint16_t> mTopicAliasMaximum;
+	std::optional<std::uint16_t> mTopicAlias;
+
 private:
-	std::array<char, 2> mMessage;
+	std::size_t GetLength() const noexcept
+	{
+		return ValueSize(mSessionExpiryInterval) + ValueSize(mReceiveMaximum) + ValueSize(mMaximumPacketSize) +
+			ValueSize(mTopicAliasMaximum) + ValueSize(mTopicAlias);
+	}
+
+	template<typename T>
+	static std::size_t ValueSize(const std::optional<T>& value) noexcept
+	{
+		return value ? 1 + sizeof(T) : 0;
+	}
+
+	/**
+	 * @return Bytes taken, 0 when there are too few or the property was already set.
+	 */
+	template<typename T>
+	static std::size_t DecodeValue(const char* pos, std::size_t left, std::optional<T>& value) noexcept
+	{
+		if(left < sizeof(T) || value)
+		{
+			return 0;
+		}
+		if constexpr(sizeof(T) == 2)
+		{
+			value = DecodeUint16(pos);
+		}
+		else
+		{
+			value = DecodeUint32(pos);
+		}
+		return sizeof(T);
+	}
+
+	template<typename T>
+	static char* EncodeValue(char* out, MQTTPropertyId id, const std::optional<T>& value) noexcept
+	{
+		if(!value)
+		{
+			return out;
+		}
+		*out++ = static_cast<char>(id);
+		if constexpr(sizeof(T) == 2)
+		{
+			return EncodeUint16(out, *value);
+		}
+		else
+		{
+			return EncodeUint32(out, *value);
+		}
+	}
+
+	/**
+	 * @brief Size of the length prefixed string or binary data at @p pos, 0 when it does not fit in @p left
+	 */
+	static std::size_t StringSize(const char* pos, std::size_t left) noexcept
+	{
+		return left >= 2 && left - 2 >= DecodeUint16(pos) ? 2 + DecodeUint16(pos) : 0;
+	}
 };
 
-class MQTTHeaderIdPacket
+/// Properties of a packet sent without any, a property length of 0
+constexpr std::size_t EmptyPropertiesSize = 1;
+
+/**
+ * @brief Packet of a fixed size, built completely at construction and usable as constant expression
+ */
+template<std::size_t Size>
+class MQTTFixedSizePacket
 {
 public:
-	MQTTHeaderIdPacket(MQTTPacketType type, std::uint8_t flags, std::uint16_t id)
-		: mMessage({static_cast<char>((static_cast<std::uint8_t>(type) << 4 | (flags & 0x0F))),
-				0,
-				static_cast<char>(id >> 8),
-				static_cast<char>(id & 0xFF)})
+	static constexpr std::size_t EncodedSize = Size;
+
+	constexpr MQTTFixedSizePacket(const std::array<char, Size>& message)
+		: mMessage(message)
 	{}
 
-	const char* GetMessage() const
+	constexpr const char* GetMessage() const
 	{
 		return mMessage.data();
 	}
 
 	constexpr std::size_t GetSize() const
 	{
-		return mMessage.size();
+		return Size;
+	}
+
+	constexpr std::size_t GetEncodedSize() const noexcept
+	{
+		return Size;
+	}
+
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		return EncodeFixed(out, mMessage);
 	}
 
 private:
-	std::array<char, 4> mMessage;
+	std::array<char, Size> mMessage;
+};
+
+class MQTTHeaderOnlyPacket : public MQTTFixedSizePacket<2>
+{
+public:
+	constexpr MQTTHeaderOnlyPacket(MQTTPacketType type, std::uint8_t flags)
+		: MQTTFixedSizePacket({static_cast<char>((static_cast<std::uint8_t>(type) << 4 | (flags & 0x0F))), 0})
+	{}
+};
+
+class MQTTHeaderIdPacket : public MQTTFixedSizePacket<4>
+{
+public:
+	constexpr MQTTHeaderIdPacket(MQTTPacketType type, std::uint8_t flags, std::uint16_t id)
+		: MQTTFixedSizePacket({static_cast<char>((static_cast<std::uint8_t>(type) << 4 | (flags & 0x0F))),
+				2,
+				static_cast<char>(id >> 8),
+				static_cast<char>(id & 0xFF)})
+	{}
 };
 
 class MQTTFixedHeader
 {
 public:
+	/**
+	 * @brief Parse the fixed header from the first @p len bytes of @p data
+	 *
+	 * Check IsValid() before using the sizes.
+	 */
+	MQTTFixedHeader(const char* data, std::size_t len)
+	{
+		if(len == 0)
+		{
+			return;
+		}
+		mType = static_cast<MQTTPacketType>(static_cast<uint8_t>(*data) >> 4);
+		std::size_t lengthSize = 0;
+		mValid = DecodeRemainingLength(data + 1, len - 1, mRemainingLength, lengthSize) == RemainingLengthStatus::Complete;
+		mHeaderSize = 1 + lengthSize;
+	}
+
+	/**
+	 * @brief Parse the fixed header of a complete packet
+	 */
 	MQTTFixedHeader(const char* data)
-		: mType(static_cast<MQTTPacketType>(static_cast<uint8_t>(*data) >> 4))
-		, mRemainingLength(data[1])
+		: MQTTFixedHeader(data, MaxFixedHeaderSize)
 	{}
 
 	MQTTFixedHeader()
 	{}
 
+	/**
+	 * @brief The Remaining Length, size of the packet after the fixed header
+	 */
 	std::size_t GetSize() const noexcept
 	{
 		return mRemainingLength;
 	}
 
+	std::size_t GetHeaderSize() const noexcept
+	{
+		return mHeaderSize;
+	}
+
+	std::size_t GetPacketSize() const noexcept
+	{
+		return mHeaderSize + mRemainingLength;
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
 	MQTTPacketType mType;
 private:
 	//MQTTFlag mFlag;
-	std::size_t mRemainingLength;
+	std::size_t mRemainingLength = 0;
+	std::size_t mHeaderSize = 0;
+	bool mValid = false;
 };
 
 class MQTTConnectPacket
 {
 public:
-	MQTTConnectPacket(const char* data)
-		: mProtocolName(data, 4)
-		, mProtocolLevel(data[4])
-		, mConnectFlags(data[5])
-		, mKeepAlive(data[6] << 8 | (data[7] & 0xFF))
-		, mClientIDLength(data[8] << 8 | (data[9] & 0xFF))
-		, mClientID(data + 10)
-	{}
+	/**
+	 * @brief Parse the variable header and payload, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTConnectPacket(const char* data, std::size_t size)
+	{
+		// Protocol name "MQTT", level, flags and keep alive
+		if(size < 10 || DecodeUint16(data) != 4)
+		{
+			return;
+		}
+		mProtocolName.assign(data + 2, 4);
+		mProtocolLevel = data[6];
+		mConnectFlags = data[7];
+		mKeepAlive = DecodeUint16(data + 8);
+
+		std::size_t offset = 10;
+		if(mProtocolLevel == static_cast<std::uint8_t>(MQTTVersion::V5))
+		{
+			std::size_t propertiesSize = 0;
+			if(!mProperties.Decode(data + offset, size - offset, propertiesSize))
+			{
+				return;
+			}
+			offset += propertiesSize;
+		}
+		else if(mProtocolLevel != static_cast<std::uint8_t>(MQTTVersion::V311))
+		{
+			return;
+		}
+
+		if(size - offset < 2 || size - offset - 2 < DecodeUint16(data + offset))
+		{
+			return;
+		}
+		mClientIDLength = DecodeUint16(data + offset);
+		mClientID.assign(data + offset + 2, mClientIDLength);
+		mValid = true;
+	}
 
 	MQTTConnectPacket(const std::uint16_t keepAlive,
 					const std::string clientId,
-					bool cleanSession)
-		: mKeepAlive(keepAlive)
+					bool cleanSession,
+					MQTTVersion version = MQTTVersion::V311,
+					const MQTTProperties& properties = {})
+		: mProtocolLevel(static_cast<std::uint8_t>(version))
+		, mKeepAlive(keepAlive)
 		, mClientID(clientId)
 		, mCleanSession(cleanSession)
+		, mProperties(properties)
 	{}
 
 	MQTTConnectPacket()
 	{}
 
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
 	bool IsCleanSessionRequest() const noexcept
 	{
 		return (mConnectFlags & (1 << 1));
@@ -130,303 +665,962 @@ public:
 		return mClientID;
 	}
 
-	std::vector<char> GetMessage() const noexcept
+	std::uint16_t GetKeepAlive() const noexcept
+	{
+		return mKeepAlive;
+	}
+
+	MQTTVersion GetVersion() const noexcept
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::CONNECT) << 4);
-		message.push_back(static_cast<char>(12 + mClientID.size()));
+		return static_cast<MQTTVersion>(mProtocolLevel);
+	}
+
+	/**
+	 * @brief Only sent with MQTT 5
+	 */
+	const MQTTProperties& GetProperties() const noexcept
+	{
+		return mProperties;
+	}
+
+	std::size_t GetEncodedSize() const noexcept
+	{
+		return PacketSize(GetRemainingLength());
+	}
+
+	/**
+	 * @return Bytes written, 0 when @p out is too small.
+	 */
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(), static_cast<char>(MQTTPacketType::CONNECT) << 4, GetRemainingLength());
 
-		message.insert(std::end(message), std::begin(mProtocolNameAndLevel), std::end(mProtocolNameAndLevel));
+		std::memcpy(pos, ProtocolName.data(), ProtocolName.size());
+		pos += ProtocolName.size();
+		*pos++ = static_cast<char>(mProtocolLevel);
 
 		//TODO Implement flags for e.g will
-		message.push_back(2);
+		*pos++ = 2;
 
-		message.push_back(static_cast<char>(mKeepAlive >> 8));
-		message.push_back(static_cast<char>(mKeepAlive & 0x0F));
+		pos = EncodeUint16(pos, mKeepAlive);
+		if(GetVersion() == MQTTVersion::V5)
+		{
+			pos = mProperties.Encode(pos);
+		}
+		pos = EncodeString(pos, mClientID);
 
-		message.push_back(static_cast<char>(mClientID.size() >> 8));
-		message.push_back(static_cast<char>(mClientID.size() & 0x0F));
-		message.insert(std::end(message), std::begin(mClientID), std::end(mClientID));
+		return pos - out.data();
+	}
 
-		return message;
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
 	}
 
 private:
 	std::string mProtocolName;
-	std::uint8_t mProtocolLevel;
-	std::uint8_t mConnectFlags;
-	std::uint16_t mKeepAlive;
-	std::size_t mClientIDLength;
+	std::uint8_t mProtocolLevel = static_cast<std::uint8_t>(MQTTVersion::V311);
+	std::uint8_t mConnectFlags = 0;
+	std::uint16_t mKeepAlive = 0;
+	std::size_t mClientIDLength = 0;
 	std::string mClientID;
-	bool mCleanSession;
+	bool mCleanSession = false;
+	MQTTProperties mProperties;
+	bool mValid = false;
 
-	std::vector<char> mProtocolNameAndLevel{0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04};
+	static constexpr std::array<char, 6> ProtocolName{0x00, 0x04, 'M', 'Q', 'T', 'T'};
+
+	/// Protocol name and level, connect flags, keep alive, the MQTT 5 properties and the client id
+	std::size_t GetRemainingLength() const noexcept
+	{
+		const std::size_t properties = GetVersion() == MQTTVersion::V5 ? mProperties.GetEncodedSize() : 0;
+		return ProtocolName.size() + 1 + 1 + 2 + properties + 2 + mClientID.size();
+	}
 
 	bool ValidateConnectFlags()
 	{
 		return (mConnectFlags & (1));
 	}
-};
+};
+
+/// Set in the first byte of a QoS 1 or 2 PUBLISH that is sent again (MQTT 3.1.1 section 3.3.1.1)
+constexpr std::uint8_t PublishDuplicateFlag = 0b1000;
+
+class MQTTPublishPacket
+{
+public:
+	MQTTPublishPacket()
+	{}
+
+	/**
+	 * @param topicAlias MQTT 5 only, 0 for none. With an alias the topic may be empty once the alias was set.
+	 */
+	MQTTPublishPacket(std::uint16_t packetID, const std::string& topic,
+			const std::string& msg, std::optional<int> qos,
+			MQTTVersion version = MQTTVersion::V311, std::uint16_t topicAlias = 0)
+		: mTopicFilter(topic)
+		, mTopicPayload(msg)
+		, mPacketIdentifier(packetID)
+		, mVersion(version)
+		, mTopicAlias(topicAlias)
+	{
+		mQoS = qos.value_or(0);
+	}
+
+	/**
+	 * @brief Size of a PUBLISH with the given contents, without constructing one
+	 */
+	static constexpr std::size_t GetEncodedSize(std::size_t topicSize, std::size_t payloadSize, int qos,
+			MQTTVersion version = MQTTVersion::V311, std::uint16_t topicAlias = 0) noexcept
+	{
+		return PacketSize(GetRemainingLength(topicSize, payloadSize, qos, version, topicAlias));
+	}
+
+	/**
+	 * @brief Encode a PUBLISH straight from the topic and payload, without copying them into a packet first
+	 *
+	 * @return Bytes written, 0 when @p out is too small.
+	 */
+	static std::size_t Encode(Common::Span<char> out, std::uint16_t packetId, std::string_view topic,
+			std::string_view payload, int qos, MQTTVersion version = MQTTVersion::V311,
+			std::uint16_t topicAlias = 0) noexcept
+	{
+		const std::size_t remainingLength = GetRemainingLength(topic.size(), payload.size(), qos, version, topicAlias);
+		if(out.size() < PacketSize(remainingLength))
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(),
+				static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::PUBLISH) << 4 | (qos & 0x03) << 1),
+				remainingLength);
+
+		pos = EncodeString(pos, topic);
+		if(qos)
+		{
+			pos = EncodeUint16(pos, packetId);
+		}
+		if(version == MQTTVersion::V5)
+		{
+			// The alias is the only property sent, written directly rather than through MQTTProperties
+			*pos++ = static_cast<char>(topicAlias ? 3 : 0);
+			if(topicAlias)
+			{
+				*pos++ = static_cast<char>(MQTTPropertyId::TopicAlias);
+				pos = EncodeUint16(pos, topicAlias);
+			}
+		}
+		std::memcpy(pos, payload.data(), payload.size());
+		pos += payload.size();
+
+		return pos - out.data();
+	}
+
+	std::size_t GetEncodedSize() const noexcept
+	{
+		return GetEncodedSize(mTopicFilter.size(), mTopicPayload.size(), mQoS, mVersion, mTopicAlias);
+	}
+
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		return Encode(out, mPacketIdentifier, mTopicFilter, mTopicPayload, mQoS, mVersion, mTopicAlias);
+	}
+
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
+	}
+
+	const std::string& GetTopicFilter() const noexcept
+	{
+		return mTopicFilter;
+	}
+
+	const std::string& GetTopicPayload() const noexcept
+	{
+		return mTopicPayload;
+	}
+
+	std::uint16_t GetPacketId() const noexcept
+	{
+		return mPacketIdentifier;
+	}
+
+	int GetQoS() const noexcept
+	{
+		return mQoS;
+	}
+
+	std::uint16_t GetTopicAlias() const noexcept
+	{
+		return mTopicAlias;
+	}
+
+private:
+	std::string mTopicFilter;
+	std::string mTopicPayload;
+	std::uint16_t mPacketIdentifier = 0;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	std::uint16_t mTopicAlias = 0;
+
+	int mQoS = 0;
+
+	/// Topic length and topic, the packet identifier for QoS 1 and 2, MQTT 5 properties, then the payload
+	static constexpr std::size_t GetRemainingLength(std::size_t topicSize, std::size_t payloadSize, int qos,
+			MQTTVersion version, std::uint16_t topicAlias) noexcept
+	{
+		const std::size_t properties = version == MQTTVersion::V5 ? EmptyPropertiesSize + (topicAlias ? 3 : 0) : 0;
+		return 2 + topicSize + (qos ? 2 : 0) + properties + payloadSize;
+	}
+};
+
+/**
+ * @brief PUBLISH decoded in place, topic and payload point into the packet
+ *
+ * Nothing is copied, the view is only valid as long as the packet bytes are.
+ */
+class MQTTPublishView
+{
+public:
+	/**
+	 * @brief View the complete PUBLISH packet of @p len bytes at @p data
+	 *
+	 * The lengths in the packet are checked against @p len and the topic name is validated, check IsValid()
+	 * before using the view.
+	 */
+	MQTTPublishView(const char* data, std::size_t len, MQTTVersion version = MQTTVersion::V311) noexcept
+	{
+		const MQTTFixedHeader header(data, len);
+		if(!header.IsValid() || header.mType != MQTTPacketType::PUBLISH || header.GetPacketSize() > len)
+		{
+			return;
+		}
+		mQoS = (static_cast<std::uint8_t>(data[0]) >> 1) & 0x03;
+
+		const char* body = data + header.GetHeaderSize();
+		const char* end = body + header.GetSize();
+		if(mQoS == 3 || end - body < 2)
+		{
+			return;
+		}
+		const std::size_t topicLength = (body[0] & 0xFF) << 8 | (body[1] & 0xFF);
+		const std::size_t variableHeaderSize = 2 + topicLength + (mQoS ? 2 : 0);
+		if(static_cast<std::size_t>(end - body) < variableHeaderSize)
+		{
+			return;
+		}
+		mTopic = std::string_view(body + 2, topicLength);
+		if(mQoS)
+		{
+			mPacketIdentifier = DecodeUint16(body + 2 + topicLength);
+		}
+		const char* payload = body + variableHeaderSize;
+		if(version == MQTTVersion::V5)
+		{
+			// Most messages have no properties or only an alias
+			std::size_t propertiesSize = 0;
+			MQTTProperties properties;
+			if(!properties.Decode(payload, end - payload, propertiesSize))
+			{
+				return;
+			}
+			payload += propertiesSize;
+			mTopicAlias = properties.mTopicAlias.value_or(0);
+		}
+		mPayload = Common::Span<const char>(payload, end - payload);
+		// An empty topic refers to the one last sent with the alias
+		mValid = mTopic.empty() ? mTopicAlias != 0 : IsValidTopicName(mTopic);
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
+	std::string_view GetTopic() const noexcept
+	{
+		return mTopic;
+	}
+
+	Common::Span<const char> GetPayload() const noexcept
+	{
+		return mPayload;
+	}
+
+	/**
+	 * @brief Only present for QoS 1 and 2
+	 */
+	std::uint16_t GetPacketId() const noexcept
+	{
+		return mPacketIdentifier;
+	}
+
+	int GetQoS() const noexcept
+	{
+		return mQoS;
+	}
+
+	/**
+	 * @brief MQTT 5 topic alias, 0 when none was sent
+	 */
+	std::uint16_t GetTopicAlias() const noexcept
+	{
+		return mTopicAlias;
+	}
+
+private:
+	std::string_view mTopic;
+	Common::Span<const char> mPayload;
+	std::uint16_t mPacketIdentifier = 0;
+	std::uint16_t mTopicAlias = 0;
+	int mQoS = 0;
+	bool mValid = false;
+};
+
+class MQTTDisconnectPacket
+{
+public:
+	MQTTDisconnectPacket(const char* data)
+	{
+		if(data[0] != ((static_cast<uint8_t>(MQTTPacketType::DISCONNECT) << 4) & 0xF0))
+		{
+			mValidDisconnect = false;
+		}
+	}
+
+	constexpr MQTTDisconnectPacket()
+	{}
+
+	static constexpr std::size_t EncodedSize = 2;
+
+	constexpr std::array<char, EncodedSize> GetMessage() const noexcept
+	{
+		return {static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::DISCONNECT) << 4), 0};
+	}
+
+	constexpr std::size_t GetEncodedSize() const noexcept
+	{
+		return EncodedSize;
+	}
+
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		return EncodeFixed(out, GetMessage());
+	}
+
+	bool IsPacketValid() const noexcept
+	{
+		return mValidDisconnect;
+	}
+
+private:
+	bool mValidDisconnect = true;
+};
+
+class MQTTPingRequestPacket : public MQTTHeaderOnlyPacket
+{
+public:
+	constexpr MQTTPingRequestPacket()
+		: MQTTHeaderOnlyPacket(MQTTPacketType::PINGREQ, 0)
+	{}
+};
+
+class MQTTPingResponsePacket : public MQTTHeaderOnlyPacket
+{
+public:
+	constexpr MQTTPingResponsePacket()
+		: MQTTHeaderOnlyPacket(MQTTPacketType::PINGRESP, 0)
+	{}
+};
+
+/**
+ * @brief Bytes an MQTT 5 packet identifier is followed by properties in, checked against @p size
+ *
+ * Shared by the packets that start with a packet identifier, in MQTT 3.1.1 there are no properties and 0 is
+ * returned. Sets @p valid to false when the properties are malformed.
+ */
+inline std::size_t SkipProperties(const char* data, std::size_t size, MQTTVersion version, bool& valid) noexcept
+{
+	valid = true;
+	if(version != MQTTVersion::V5)
+	{
+		return 0;
+	}
+	std::size_t propertiesSize = 0;
+	MQTTProperties properties;
+	valid = properties.Decode(data, size, propertiesSize);
+	return propertiesSize;
+}
+
+/**
+ * @brief PUBACK, PUBREC, PUBREL or PUBCOMP, the acknowledgements of QoS 1 and 2 messages
+ */
+class MQTTPublishAckPacket
+{
+public:
+	MQTTPublishAckPacket()
+	{}
+
+	/**
+	 * @param reasonCode MQTT 5 only, sent when it is not 0 (success)
+	 */
+	constexpr MQTTPublishAckPacket(MQTTPacketType type, std::uint16_t packetId, std::uint8_t reasonCode = 0)
+		: mType(type)
+		, mPacketIdentifier(packetId)
+		, mReasonCode(reasonCode)
+		, mValid(true)
+	{}
+
+	/**
+	 * @brief Parse the variable header, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTPublishAckPacket(MQTTPacketType type, const char* data, std::size_t size, MQTTVersion version)
+		: mType(type)
+	{
+		// MQTT 5 may add a reason code and properties
+		if(size < 2 || (size != 2 && version != MQTTVersion::V5))
+		{
+			return;
+		}
+		mPacketIdentifier = DecodeUint16(data);
+		if(size > 2)
+		{
+			mReasonCode = static_cast<std::uint8_t>(data[2]);
+		}
+		if(size > 3)
+		{
+			bool valid = false;
+			if(SkipProperties(data + 3, size - 3, version, valid) != size - 3 || !valid)
+			{
+				return;
+			}
+		}
+		mValid = true;
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
+	constexpr std::size_t GetEncodedSize() const noexcept
+	{
+		return mReasonCode == 0 ? 4 : 5;
+	}
+
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		// PUBREL has the flags of a packet that needs an acknowledgement (MQTT 3.1.1 section 3.6.1)
+		const std::uint8_t flags = mType == MQTTPacketType::PUBREL ? 0b0010 : 0;
+		char* pos = out.data();
+		*pos++ = static_cast<char>(static_cast<std::uint8_t>(mType) << 4 | flags);
+		*pos++ = static_cast<char>(GetEncodedSize() - 2);
+		pos = EncodeUint16(pos, mPacketIdentifier);
+		if(mReasonCode != 0)
+		{
+			*pos++ = static_cast<char>(mReasonCode);
+		}
+		return pos - out.data();
+	}
+
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
+	}
+
+	MQTTPacketType GetType() const noexcept
+	{
+		return mType;
+	}
+
+	std::uint16_t GetPacketId() const noexcept
+	{
+		return mPacketIdentifier;
+	}
+
+	/**
+	 * @brief 0 for success, from 0x80 the message was refused, always 0 with MQTT 3.1.1
+	 */
+	std::uint8_t GetReasonCode() const noexcept
+	{
+		return mReasonCode;
+	}
+
+private:
+	MQTTPacketType mType = MQTTPacketType::PUBACK;
+	std::uint16_t mPacketIdentifier = 0;
+	std::uint8_t mReasonCode = 0;
+	bool mValid = false;
+};
+
+class MQTTSubscribePacket
+{
+public:
+	MQTTSubscribePacket()
+	{}
+
+	/**
+	 * @brief Parse the variable header and payload, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTSubscribePacket(const char* data, std::size_t size, MQTTVersion version)
+		: mVersion(version)
+	{
+		if(size < 2)
+		{
+			return;
+		}
+		mPacketIdentifier = DecodeUint16(data);
+		bool valid = false;
+		std::size_t offset = 2 + SkipProperties(data + 2, size - 2, version, valid);
+		if(!valid)
+		{
+			return;
+		}
+		// Topic length and topic, then the QoS or subscription options, until the end of the packet
+		while(offset < size)
+		{
+			if(size - offset < 2 || size - offset - 2 < DecodeUint16(data + offset) + 1u)
+			{
+				return;
+			}
+			const std::size_t length = DecodeUint16(data + offset);
+			mTopicFilters.emplace_back(data + offset + 2, length);
+			mOptions.push_back(static_cast<std::uint8_t>(data[offset + 2 + length]));
+			offset += GetFilterSize(length);
+		}
+		// A SUBSCRIBE without a topic filter is a protocol violation (MQTT 3.1.1 section 3.8.3)
+		mValid = !mTopicFilters.empty();
+	}
 
-class MQTTPublishPacket
-{
-public:
-	MQTTPublishPacket()
+	/**
+	 * @brief Subscribe to all of @p topicFilters, with QoS 0
+	 */
+	MQTTSubscribePacket(std::uint16_t packetId, std::vector<std::string> topicFilters,
+			MQTTVersion version = MQTTVersion::V311)
+		: mPacketIdentifier(packetId)
+		, mTopicFilters(std::move(topicFilters))
+		, mOptions(mTopicFilters.size(), 0)
+		, mVersion(version)
 	{}
 
-	MQTTPublishPacket(const char* data, size_t topicLen, size_t payloadLen)
-		: mTopicFilter(data, topicLen)
-		, mTopicPayload(data + topicLen, payloadLen - 2)
+	MQTTSubscribePacket(std::uint16_t packetId, const std::string& topic, MQTTVersion version = MQTTVersion::V311)
+		: MQTTSubscribePacket(packetId, std::vector<std::string>{topic}, version)
 	{}
 
-	MQTTPublishPacket(std::uint16_t packetID, const std::string& topic,
-			const std::string& msg, std::optional<int> qos)
-		: mTopicFilter(topic)
-		, mTopicPayload(msg)
-		, mPacketIdentifier(packetID)
+	/**
+	 * @brief Bytes a topic filter of @p topicSize takes in the payload
+	 */
+	static constexpr std::size_t GetFilterSize(std::size_t topicSize) noexcept
 	{
-		mQoS = qos.value_or(0);
+		return 2 + topicSize + 1;
 	}
 
-	std::vector<char> GetMessage() const noexcept
+	bool IsValid() const noexcept
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::PUBLISH) << 4);
-
-		message.push_back(static_cast<char>(2 + // var header
-											mTopicFilter.size() + // size bytes + topic size
-											mTopicPayload.size() // QoS byte
-											));
+		return mValid;
+	}
 
-		message.push_back(static_cast<char>(mTopicFilter.size() >> 8));
-		message.push_back(static_cast<char>(mTopicFilter.size() & 0x0F));
+	std::size_t GetEncodedSize() const noexcept
+	{
+		return PacketSize(GetRemainingLength());
+	}
 
-		message.insert(std::end(message), std::begin(mTopicFilter), std::end(mTopicFilter));
+	/**
+	 * @return Bytes written, 0 when @p out is too small.
+	 */
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(),
+				static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::SUBSCRIBE) << 4 | 0b0000010),
+				GetRemainingLength());
 
-		if(mQoS)
+		pos = EncodeUint16(pos, mPacketIdentifier);
+		if(mVersion == MQTTVersion::V5)
+		{
+			*pos++ = 0; // No properties
+		}
+		for(std::size_t i = 0; i < mTopicFilters.size(); ++i)
 		{
-			message.push_back(static_cast<char>(mPacketIdentifier >> 8));
-			message.push_back(static_cast<char>(mPacketIdentifier & 0x0F));
+			pos = EncodeString(pos, mTopicFilters[i]);
+			*pos++ = static_cast<char>(mOptions[i]);
 		}
 
-		message.insert(std::end(message), std::begin(mTopicPayload), std::end(mTopicPayload));
+		return pos - out.data();
+	}
 
-		message.push_back(0);
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
+	}
 
-		return message;
+	std::uint16_t GetPacketId() const noexcept
+	{
+		return mPacketIdentifier;
 	}
 
-	std::string GetTopicFilter() const noexcept
+	const std::vector<std::string>& GetTopicFilters() const noexcept
 	{
-		return mTopicFilter;
+		return mTopicFilters;
 	}
 
-	std::string GetTopicPayload() const noexcept
+	/**
+	 * @brief The requested QoS of each topic filter, in MQTT 5 the whole subscription options byte
+	 */
+	const std::vector<std::uint8_t>& GetOptions() const noexcept
 	{
-		return mTopicPayload;
+		return mOptions;
 	}
 
 private:
-	std::string mTopicFilter;
-	std::string mTopicPayload;
-	std::uint16_t mPacketIdentifier;
-
-	int mQoS = 0;
+	std::uint16_t mPacketIdentifier = 0;
+	std::vector<std::string> mTopicFilters;
+	std::vector<std::uint8_t> mOptions;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	bool mValid = false;
+
+	/// Packet identifier, MQTT 5 properties, then each topic filter
+	std::size_t GetRemainingLength() const noexcept
+	{
+		std::size_t length = 2 + (mVersion == MQTTVersion::V5 ? EmptyPropertiesSize : 0);
+		for(const auto& topicFilter : mTopicFilters)
+		{
+			length += GetFilterSize(topicFilter.size());
+		}
+		return length;
+	}
 };
 
-class MQTTDisconnectPacket
+class MQTTUnsubscribePacket
 {
 public:
-	MQTTDisconnectPacket(const char* data)
+	MQTTUnsubscribePacket()
+	{}
+
+	/**
+	 * @brief Parse the variable header and payload, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTUnsubscribePacket(const char* data, std::size_t size, MQTTVersion version)
+		: mVersion(version)
 	{
-		if(data[0] != ((static_cast<uint8_t>(MQTTPacketType::DISCONNECT) << 4) & 0xF0))
+		if(size < 2)
 		{
-			mValidDisconnect = false;
+			return;
+		}
+		mPacketIdentifier = DecodeUint16(data);
+		bool valid = false;
+		std::size_t offset = 2 + SkipProperties(data + 2, size - 2, version, valid);
+		if(!valid)
+		{
+			return;
+		}
+		while(offset < size)
+		{
+			if(size - offset < 2 || size - offset - 2 < DecodeUint16(data + offset))
+			{
+				return;
+			}
+			const std::size_t length = DecodeUint16(data + offset);
+			mTopicFilters.emplace_back(data + offset + 2, length);
+			offset += GetFilterSize(length);
 		}
+		// As for SUBSCRIBE at least one topic filter is required (MQTT 3.1.1 section 3.10.3)
+		mValid = !mTopicFilters.empty();
 	}
 
-	MQTTDisconnectPacket()
+	MQTTUnsubscribePacket(std::uint16_t packetId, std::vector<std::string> topicFilters,
+			MQTTVersion version = MQTTVersion::V311)
+		: mPacketIdentifier(packetId)
+		, mTopicFilters(std::move(topicFilters))
+		, mVersion(version)
+	{}
+
+	MQTTUnsubscribePacket(std::uint16_t packetId, const std::string& topic, MQTTVersion version = MQTTVersion::V311)
+		: MQTTUnsubscribePacket(packetId, std::vector<std::string>{topic}, version)
 	{}
 
-	std::vector<char> GetMessage() const noexcept
+	/**
+	 * @brief Bytes a topic filter of @p topicSize takes in the payload
+	 */
+	static constexpr std::size_t GetFilterSize(std::size_t topicSize) noexcept
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::DISCONNECT) << 4);
-		message.push_back(0);
+		return 2 + topicSize;
+	}
 
-		return message;
+	bool IsValid() const noexcept
+	{
+		return mValid;
 	}
 
-	bool IsPacketValid() const noexcept
+	std::size_t GetEncodedSize() const noexcept
 	{
-		return mValidDisconnect;
+		return PacketSize(GetRemainingLength());
 	}
 
-private:
-	bool mValidDisconnect = true;
-};
+	/**
+	 * @return Bytes written, 0 when @p out is too small.
+	 */
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(),
+				static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::UNSUBSCRIBE) << 4 | 0b0010),
+				GetRemainingLength());
 
-class MQTTPingRequestPacket
-{
-public:
-	MQTTPingRequestPacket()
-		: mPacket(MQTTPacketType::PINGREQ, 0)
-	{}
+		pos = EncodeUint16(pos, mPacketIdentifier);
+		if(mVersion == MQTTVersion::V5)
+		{
+			*pos++ = 0; // No properties
+		}
+		for(const auto& topicFilter : mTopicFilters)
+		{
+			pos = EncodeString(pos, topicFilter);
+		}
 
-	const char* GetMessage() const
-	{
-		return mPacket.GetMessage();
+		return pos - out.data();
 	}
 
-	std::size_t GetSize() const
+	std::vector<char> GetMessage() const
 	{
-		return mPacket.GetSize();
+		return MakeMessage(*this);
 	}
 
-private:
-	MQTTHeaderOnlyPacket mPacket;
-};
-
-class MQTTPingResponsePacket
-{
-public:
-	MQTTPingResponsePacket()
-		: mPacket(MQTTPacketType::PINGRESP, 0)
-	{}
-
-	const char* GetMessage() const
+	std::uint16_t GetPacketId() const noexcept
 	{
-		return mPacket.GetMessage();
+		return mPacketIdentifier;
 	}
 
-	std::size_t GetSize() const
+	const std::vector<std::string>& GetTopicFilters() const noexcept
 	{
-		return mPacket.GetSize();
+		return mTopicFilters;
 	}
 
 private:
-	MQTTHeaderOnlyPacket mPacket;
+	std::uint16_t mPacketIdentifier = 0;
+	std::vector<std::string> mTopicFilters;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	bool mValid = false;
+
+	/// Packet identifier, MQTT 5 properties, then each topic filter
+	std::size_t GetRemainingLength() const noexcept
+	{
+		std::size_t length = 2 + (mVersion == MQTTVersion::V5 ? EmptyPropertiesSize : 0);
+		for(const auto& topicFilter : mTopicFilters)
+		{
+			length += GetFilterSize(topicFilter.size());
+		}
+		return length;
+	}
 };
 
-//TODO Support multiple topics from a single sub packet
-class MQTTSubscribePacket
+/// Return code refusing a subscription (MQTT 3.1.1 section 3.9.3)
+constexpr std::uint8_t SubackFailure = 0x80;
+/// Reason code for unsubscribing from a topic filter that had no subscription (MQTT 5.0 section 3.11.2.2)
+constexpr std::uint8_t UnsubackNoSubscriptionExisted = 0x11;
+
+//TODO return code needs to be in typed enum so validity can be checked
+class MQTTSubackPacket
 {
 public:
-	MQTTSubscribePacket()
+	MQTTSubackPacket()
 	{}
 
-	MQTTSubscribePacket(const char* data)
-		: mPacketIdentifier(data[0] << 8 | data[1])
-		, mTopicLength(data[2] << 8 | data[3])
-		, mTopicFilter(data + 4 , mTopicLength)
+	/**
+	 * @param returnCodes One per topic filter of the SUBSCRIBE, in the same order
+	 */
+	MQTTSubackPacket(std::uint16_t packetId, std::vector<std::uint8_t> returnCodes,
+			MQTTVersion version = MQTTVersion::V311)
+		: mPacketIdentifier(packetId)
+		, mReturnCodes(std::move(returnCodes))
+		, mVersion(version)
 	{}
 
-	MQTTSubscribePacket(std::uint16_t packetId, const std::string& topic)
-		: mPacketIdentifier(packetId)
-		, mTopicLength(topic.size())
-		, mTopicFilter(topic)
+	MQTTSubackPacket(std::uint16_t packetId, std::uint8_t retCode, MQTTVersion version = MQTTVersion::V311)
+		: MQTTSubackPacket(packetId, std::vector<std::uint8_t>(1, retCode), version)
 	{}
 
-	std::vector<char> GetMessage() const noexcept
+	/**
+	 * @brief Parse the variable header and payload, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTSubackPacket(const char* data, std::size_t size, MQTTVersion version)
+		: mVersion(version)
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::SUBSCRIBE) << 4 | 0b0000010);
-		message.push_back(static_cast<char>(2 + // var header
-											2 + mTopicLength + // size bytes + topic size
-											1 // QoS byte
-											));
-
-		message.push_back(static_cast<char>(mPacketIdentifier >> 8));
-		message.push_back(static_cast<char>(mPacketIdentifier & 0x0F));
-
-		message.push_back(static_cast<char>(mTopicLength >> 8));
-		message.push_back(static_cast<char>(mTopicLength & 0x0F));
-
-		message.insert(std::end(message), std::begin(mTopicFilter), std::end(mTopicFilter));
-
-		message.push_back(0); // QoS
-
-		return message;
+		if(size < 2)
+		{
+			return;
+		}
+		mPacketIdentifier = DecodeUint16(data);
+		bool valid = false;
+		const std::size_t offset = 2 + SkipProperties(data + 2, size - 2, version, valid);
+		if(!valid || size - offset < 1)
+		{
+			return;
+		}
+		mReturnCodes.assign(data + offset, data + size);
+		mValid = true;
 	}
 
-private:
-	std::uint16_t mPacketIdentifier;
-	std::size_t mTopicLength;
-	std::string mTopicFilter;
-};
-
-class MQTTUnsubscribePacket
-{
-public:
-	MQTTUnsubscribePacket()
-	{}
-
-	MQTTUnsubscribePacket(const char* data)
-		: mPacketIdentifier(data[0] << 8 | data[1])
-		, mTopicLength(data[2] << 8 | data[3])
-		, mTopicFilter(data + 4 , mTopicLength)
-	{}
-
-	MQTTUnsubscribePacket(std::uint16_t packetId, const std::string& topic)
-		: mPacketIdentifier(packetId)
-		, mTopicLength(topic.size())
-		, mTopicFilter(topic)
-	{}
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
 
-	std::vector<char> GetMessage() const noexcept
+	std::size_t GetEncodedSize() const noexcept
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::UNSUBSCRIBE) << 4 | 0b0010);
-		message.push_back(static_cast<char>(2 + // var header
-											2 + mTopicLength // size bytes + topic size
-											));
+		return PacketSize(GetRemainingLength());
+	}
 
-		message.push_back(static_cast<char>(mPacketIdentifier >> 8));
-		message.push_back(static_cast<char>(mPacketIdentifier & 0x0F));
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(), static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::SUBACK) << 4),
+				GetRemainingLength());
+		pos = EncodeUint16(pos, mPacketIdentifier);
+		if(mVersion == MQTTVersion::V5)
+		{
+			*pos++ = 0; // No properties
+		}
+		if(!mReturnCodes.empty())
+		{
+			std::memcpy(pos, mReturnCodes.data(), mReturnCodes.size());
+			pos += mReturnCodes.size();
+		}
+		return pos - out.data();
+	}
 
-		message.push_back(static_cast<char>(mTopicLength >> 8));
-		message.push_back(static_cast<char>(mTopicLength & 0x0F));
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
+	}
 
-		message.insert(std::end(message), std::begin(mTopicFilter), std::end(mTopicFilter));
+	std::uint16_t GetPacketId() const noexcept
+	{
+		return mPacketIdentifier;
+	}
 
-		return message;
+	const std::vector<std::uint8_t>& GetReturnCodes() const noexcept
+	{
+		return mReturnCodes;
 	}
 
 private:
-	std::uint16_t mPacketIdentifier;
-	std::size_t mTopicLength;
-	std::string mTopicFilter;
+	std::uint16_t mPacketIdentifier = 0;
+	std::vector<std::uint8_t> mReturnCodes;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	bool mValid = false;
+
+	/// Packet identifier, MQTT 5 properties and a return code per topic filter
+	std::size_t GetRemainingLength() const noexcept
+	{
+		return 2 + (mVersion == MQTTVersion::V5 ? EmptyPropertiesSize : 0) + mReturnCodes.size();
+	}
 };
 
-//TODO return code needs to be in typed enum so validity can be checked
-class MQTTSubackPacket
+class MQTTUnsubackPacket
 {
 public:
-	MQTTSubackPacket()
+	MQTTUnsubackPacket()
 	{}
 
-	MQTTSubackPacket(std::uint16_t packetId, std::uint8_t retCode)
+	/**
+	 * @param reasonCodes One per topic filter of the UNSUBSCRIBE, only sent with MQTT 5
+	 */
+	MQTTUnsubackPacket(std::uint16_t packetId, std::vector<std::uint8_t> reasonCodes,
+			MQTTVersion version = MQTTVersion::V311)
 		: mPacketIdentifier(packetId)
-		, mReturnCode(retCode)
+		, mReasonCodes(std::move(reasonCodes))
+		, mVersion(version)
 	{}
 
-	MQTTSubackPacket(const char* data)
-		: mPacketIdentifier(data[0] << 8 | data[1])
-		, mReturnCode(data[3])
+	/**
+	 * @brief Acknowledge an UNSUBSCRIBE of one topic filter
+	 */
+	MQTTUnsubackPacket(std::uint16_t packetId, MQTTVersion version = MQTTVersion::V311)
+		: MQTTUnsubackPacket(packetId, std::vector<std::uint8_t>(1, 0), version)
 	{}
 
-	std::vector<char> GetMessage() const
+	/**
+	 * @brief Parse the variable header and payload, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTUnsubackPacket(const char* data, std::size_t size, MQTTVersion version)
+		: mVersion(version)
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::SUBACK) << 4 | 0);
-		message.push_back(3); // packet length
+		if(size < 2 || (version != MQTTVersion::V5 && size != 2))
+		{
+			return;
+		}
+		mPacketIdentifier = DecodeUint16(data);
+		bool valid = false;
+		const std::size_t offset = 2 + SkipProperties(data + 2, size - 2, version, valid);
+		// MQTT 5 has a reason code per topic filter
+		if(!valid || (version == MQTTVersion::V5 && size - offset < 1))
+		{
+			return;
+		}
+		mReasonCodes.assign(data + offset, data + size);
+		mValid = true;
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
 
-		message.push_back(static_cast<char>(mPacketIdentifier >> 8));
-		message.push_back(static_cast<char>(mPacketIdentifier & 0x0F));
+	std::size_t GetEncodedSize() const noexcept
+	{
+		return PacketSize(GetRemainingLength());
+	}
 
-		message.push_back(mReturnCode);
+	std::size_t Encode(Common::Span<char> out) const noexcept
+	{
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(), static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::UNSUBACK) << 4),
+				GetRemainingLength());
+		pos = EncodeUint16(pos, mPacketIdentifier);
+		if(mVersion == MQTTVersion::V5)
+		{
+			*pos++ = 0; // No properties
+			if(!mReasonCodes.empty())
+			{
+				std::memcpy(pos, mReasonCodes.data(), mReasonCodes.size());
+				pos += mReasonCodes.size();
+			}
+		}
+		return pos - out.data();
+	}
 
-		return message;
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
 	}
 
 	std::uint16_t GetPacketId() const noexcept
@@ -434,95 +1628,251 @@ public:
 		return mPacketIdentifier;
 	}
 
+	/**
+	 * @brief Empty with MQTT 3.1.1, which has no reason codes
+	 */
+	const std::vector<std::uint8_t>& GetReasonCodes() const noexcept
+	{
+		return mReasonCodes;
+	}
+
 private:
-	std::uint16_t mPacketIdentifier;
-	std::uint8_t mReturnCode;
+	std::uint16_t mPacketIdentifier = 0;
+	std::vector<std::uint8_t> mReasonCodes;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	bool mValid = false;
+
+	/// Packet identifier, then for MQTT 5 the properties and a reason code per topic filter
+	std::size_t GetRemainingLength() const noexcept
+	{
+		return 2 + (mVersion == MQTTVersion::V5 ? EmptyPropertiesSize + mReasonCodes.size() : 0);
+	}
 };
 
-class MQTTUnsubackPacket
+class MQTTConnackPacket
 {
 public:
-	MQTTUnsubackPacket()
+	/**
+	 * @param properties MQTT 5 only, the limits of the server
+	 */
+	explicit MQTTConnackPacket(bool sessionPresent, MQTTVersion version = MQTTVersion::V311,
+			const MQTTProperties& properties = {})
+		: mSessionPresent(sessionPresent)
+		, mVersion(version)
+		, mProperties(properties)
 	{}
 
-	MQTTUnsubackPacket(std::uint16_t packetId)
-		: mPacketIdentifier(packetId)
+	MQTTConnackPacket(const MQTTConnectPacket& incConn, bool sessionPresent, const MQTTProperties& properties = {})
+		: MQTTConnackPacket(sessionPresent, incConn.GetVersion(), properties)
 	{}
 
-	MQTTUnsubackPacket(const char* data)
-		: mPacketIdentifier(data[0] << 8 | data[1])
-	{}
+	/**
+	 * @brief Parse the variable header, the @p size bytes after the fixed header
+	 *
+	 * Check IsValid() before using the packet.
+	 */
+	MQTTConnackPacket(const char* data, std::size_t size, MQTTVersion version)
+		: mVersion(version)
+	{
+		if(size < 2 || (version != MQTTVersion::V5 && size != 2))
+		{
+			return;
+		}
+		mSessionPresent = data[0] & 0x01;
+		mReturnCode = data[1];
+		std::size_t propertiesSize = 0;
+		mValid = version != MQTTVersion::V5 || mProperties.Decode(data + 2, size - 2, propertiesSize);
+	}
 
-	std::vector<char> GetMessage() const
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
+	bool IsSessionPresent() const noexcept
+	{
+		return mSessionPresent;
+	}
+
+	/**
+	 * @brief 0 when the connection was accepted, the reason code in MQTT 5
+	 */
+	std::uint8_t GetReturnCode() const noexcept
 	{
-		std::vector<char> message;
-		message.push_back(static_cast<char>(MQTTPacketType::UNSUBACK) << 4 | 0);
-		message.push_back(2); // packet length
+		return mReturnCode;
+	}
 
-		message.push_back(static_cast<char>(mPacketIdentifier >> 8));
-		message.push_back(static_cast<char>(mPacketIdentifier & 0x0F));
+	const MQTTProperties& GetProperties() const noexcept
+	{
+		return mProperties;
+	}
 
-		return message;
+	std::size_t GetEncodedSize() const noexcept
+	{
+		return PacketSize(GetRemainingLength());
 	}
 
-	std::uint16_t GetPacketId() const noexcept
+	std::size_t Encode(Common::Span<char> out) const noexcept
 	{
-		return mPacketIdentifier;
+		if(out.size() < GetEncodedSize())
+		{
+			return 0;
+		}
+		char* pos = EncodeFixedHeader(out.data(), static_cast<char>(static_cast<std::uint8_t>(MQTTPacketType::CONNACK) << 4),
+				GetRemainingLength());
+		*pos++ = static_cast<char>(mSessionPresent ? 1 : 0);
+		*pos++ = static_cast<char>(mReturnCode);
+		if(mVersion == MQTTVersion::V5)
+		{
+			pos = mProperties.Encode(pos);
+		}
+		return pos - out.data();
+	}
+
+	std::vector<char> GetMessage() const
+	{
+		return MakeMessage(*this);
 	}
 
 private:
-	std::uint16_t mPacketIdentifier;
+	bool mSessionPresent = false;
+	std::uint8_t mReturnCode = 0;
+	MQTTVersion mVersion = MQTTVersion::V311;
+	MQTTProperties mProperties;
+	bool mValid = false;
+
+	/// Acknowledge flags and return code, then the MQTT 5 properties
+	std::size_t GetRemainingLength() const noexcept
+	{
+		return 2 + (mVersion == MQTTVersion::V5 ? mProperties.GetEncodedSize() : 0);
+	}
 };
 
 class MQTTPacket
 {
 public:
-	MQTTPacket(const char* data)
-		: mFixedHeader(data)
+	/**
+	 * @brief Parse the complete packet of @p len bytes at @p data
+	 *
+	 * Every length in the packet is checked against @p len before it is used, so truncated or hostile packets are
+	 * only invalid. Check IsValid() before using the contents, packet types not parsed here have none.
+	 * @param version Of the connection, CONNECT is parsed the same for every version.
+	 */
+	MQTTPacket(const char* data, std::size_t len, MQTTVersion version = MQTTVersion::V311)
+		: mFixedHeader(data, len)
 	{
+		if(!mFixedHeader.IsValid() || mFixedHeader.GetPacketSize() > len)
+		{
+			return;
+		}
+		const char* body = data + mFixedHeader.GetHeaderSize();
+		const std::size_t size = mFixedHeader.GetSize();
 		switch(mFixedHeader.mType)
 		{
 			case MQTTPacketType::CONNECT:
 			{
-				mContents = MQTTConnectPacket(data + 4);
-				break;
+				mValid = SetContents(MQTTConnectPacket(body, size));
+				return;
+			}
+			case MQTTPacketType::CONNACK:
+			{
+				mValid = SetContents(MQTTConnackPacket(body, size, version));
+				return;
 			}
 			case MQTTPacketType::PUBLISH:
 			{
-				mContents = MQTTPublishPacket(data + 4, (data[2] << 8 | (data[3] & 0xFF)), mFixedHeader.GetSize() - (data[2] << 8 | (data[3] & 0xFF)));
+				const MQTTPublishView publish(data, len, version);
+				if(!publish.IsValid())
+				{
+					return;
+				}
+				const auto payload = publish.GetPayload();
+				mContents = MQTTPublishPacket(publish.GetPacketId(),
+						std::string(publish.GetTopic()),
+						std::string(payload.data(), payload.size()),
+						publish.GetQoS(),
+						version,
+						publish.GetTopicAlias());
 				break;
 			}
 			case MQTTPacketType::DISCONNECT:
 			{
+				// MQTT 5 may add a reason code and properties
+				if(size != 0 && version != MQTTVersion::V5)
+				{
+					return;
+				}
 				mContents = MQTTDisconnectPacket(data);
 				break;
 			}
 			case MQTTPacketType::SUBSCRIBE:
 			{
-				mContents = MQTTSubscribePacket(data + 2);
-				break;
+				mValid = SetContents(MQTTSubscribePacket(body, size, version));
+				return;
+			}
+			case MQTTPacketType::UNSUBSCRIBE:
+			{
+				mValid = SetContents(MQTTUnsubscribePacket(body, size, version));
+				return;
 			}
 			case MQTTPacketType::SUBACK:
 			{
-				mContents = MQTTSubackPacket(data + 2);
-				break;
+				mValid = SetContents(MQTTSubackPacket(body, size, version));
+				return;
 			}
 			case MQTTPacketType::UNSUBACK:
 			{
-				mContents = MQTTUnsubackPacket(data + 2);
-				break;
+				mValid = SetContents(MQTTUnsubackPacket(body, size, version));
+				return;
 			}
 			case MQTTPacketType::PINGREQ:
 			{
+				if(size != 0)
+				{
+					return;
+				}
 				mContents = MQTTPingRequestPacket();
 				break;
 			}
 			case MQTTPacketType::PINGRESP:
 			{
+				if(size != 0)
+				{
+					return;
+				}
 				mContents = MQTTPingResponsePacket();
 				break;
 			}
+			case MQTTPacketType::PUBACK:
+			case MQTTPacketType::PUBREC:
+			case MQTTPacketType::PUBREL:
+			case MQTTPacketType::PUBCOMP:
+			{
+				mValid = SetContents(MQTTPublishAckPacket(mFixedHeader.mType, body, size, version));
+				return;
+			}
+			default:
+			{
+				// Reserved types 0 and 15
+				return;
+			}
 		}
+		mValid = true;
+	}
+
+	bool IsValid() const noexcept
+	{
+		return mValid;
+	}
+
+	auto GetConnectPacket() const noexcept
+	{
+		return std::get_if<MQTTConnectPacket>(&mContents);
+	}
+
+	auto GetConnackPacket() const noexcept
+	{
+		return std::get_if<MQTTConnackPacket>(&mContents);
 	}
 
 	auto GetPublishPacket() const noexcept
@@ -530,6 +1880,24 @@ public:
 		return std::get_if<MQTTPublishPacket>(&mContents);
 	}
 
+	/**
+	 * @brief PUBACK, PUBREC, PUBREL or PUBCOMP
+	 */
+	auto GetPublishAckPacket() const noexcept
+	{
+		return std::get_if<MQTTPublishAckPacket>(&mContents);
+	}
+
+	auto GetSubscribePacket() const noexcept
+	{
+		return std::get_if<MQTTSubscribePacket>(&mContents);
+	}
+
+	auto GetUnsubscribePacket() const noexcept
+	{
+		return std::get_if<MQTTUnsubscribePacket>(&mContents);
+	}
+
 	auto GetSubAckPacket() const noexcept
 	{
 		return std::get_if<MQTTSubackPacket>(&mContents);
@@ -540,42 +1908,36 @@ public:
 		return std::get_if<MQTTUnsubackPacket>(&mContents);
 	}
 
-	std::variant<MQTTConnectPacket
+	std::variant<std::monostate
+				,MQTTConnectPacket
+				,MQTTConnackPacket
 				,MQTTPublishPacket
+				,MQTTPublishAckPacket
 				,MQTTDisconnectPacket
 				,MQTTSubscribePacket
+				,MQTTUnsubscribePacket
 				,MQTTSubackPacket
 				,MQTTUnsubackPacket
 				,MQTTPingRequestPacket
 				,MQTTPingResponsePacket> mContents;
 	MQTTFixedHeader mFixedHeader;
-};
-
-class MQTTConnackPacket
-{
-public:
-	MQTTConnackPacket(MQTTConnectPacket incConn, bool sessionPresent)
-		: mMessage({
-				static_cast<char>((static_cast<std::uint8_t>(MQTTPacketType::CONNACK) << 4 | 0 )),
-				0b0010,
-				static_cast<char>(sessionPresent ? 1 : 0),
-				//static_cast<char>(return_code)
-				0
-				})
-	{}
 
-	const char* GetMessage() const
-	{
-		return mMessage.data();
-	}
+private:
+	bool mValid = false;
 
-	std::size_t GetSize() const
+	/**
+	 * @brief Keep @p packet when it parsed
+	 */
+	template<typename Packet>
+	bool SetContents(Packet&& packet)
 	{
-		return mMessage.size();
+		if(!packet.IsValid())
+		{
+			return false;
+		}
+		mContents = std::forward<Packet>(packet);
+		return true;
 	}
-
-private:
-	std::array<char, 4> mMessage;
 };
 
 }
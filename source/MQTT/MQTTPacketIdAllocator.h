@@ -0,0 +1,110 @@
+#ifndef MQTTPACKETIDALLOCATOR_H
+#define MQTTPACKETIDALLOCATOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace MQTT {
+
+/**
+ * @brief Hands out the packet identifiers of one connection, 1 to 65535, each until it is released
+ *
+ * A bit per identifier, with two levels of summary bits above it marking the 64 bit words that are full, so
+ * finding a free identifier is three count trailing zeros, no matter how many are in use. The lowest free
+ * identifier is returned.
+ */
+class MQTTPacketIdAllocator
+{
+public:
+	MQTTPacketIdAllocator() noexcept
+	{
+		Clear();
+	}
+
+	/**
+	 * @return A free packet identifier, 0 when all 65535 are in use.
+	 */
+	std::uint16_t Allocate() noexcept
+	{
+		if(mTop == FullTop)
+		{
+			return 0;
+		}
+		const unsigned summary = __builtin_ctz(~mTop);
+		const unsigned word = summary * 64 + __builtin_ctzll(~mSummary[summary]);
+		const unsigned bit = __builtin_ctzll(~mBits[word]);
+		Set(word, bit);
+		++mInUse;
+		return static_cast<std::uint16_t>(word * 64 + bit);
+	}
+
+	/**
+	 * @brief Make @p id available again, ignored when it is not in use
+	 */
+	void Release(std::uint16_t id) noexcept
+	{
+		if(id == 0 || !IsInUse(id))
+		{
+			return;
+		}
+		const unsigned word = id / 64;
+		mBits[word] &= ~(std::uint64_t(1) << (id % 64));
+		mSummary[word / 64] &= ~(std::uint64_t(1) << (word % 64));
+		mTop &= ~(1u << (word / 64));
+		--mInUse;
+	}
+
+	bool IsInUse(std::uint16_t id) const noexcept
+	{
+		return mBits[id / 64] & (std::uint64_t(1) << (id % 64));
+	}
+
+	/**
+	 * @brief Number of identifiers handed out and not yet released
+	 */
+	std::size_t GetInUse() const noexcept
+	{
+		return mInUse;
+	}
+
+	void Clear() noexcept
+	{
+		mBits.fill(0);
+		mSummary.fill(0);
+		mTop = 0;
+		mInUse = 0;
+		// 0 is not a valid packet identifier
+		Set(0, 0);
+	}
+
+private:
+	static constexpr unsigned Words = 65536 / 64;
+	static constexpr unsigned SummaryWords = Words / 64;
+	static constexpr unsigned FullTop = (1u << SummaryWords) - 1;
+
+	void Set(unsigned word, unsigned bit) noexcept
+	{
+		mBits[word] |= std::uint64_t(1) << bit;
+		if(~mBits[word] == 0)
+		{
+			mSummary[word / 64] |= std::uint64_t(1) << (word % 64);
+			if(~mSummary[word / 64] == 0)
+			{
+				mTop |= 1u << (word / 64);
+			}
+		}
+	}
+
+	/// A bit per identifier, set while it is in use
+	std::array<std::uint64_t, Words> mBits;
+	/// A bit per word of mBits, set when all of its identifiers are in use
+	std::array<std::uint64_t, SummaryWords> mSummary;
+	/// A bit per word of mSummary, set when it is full
+	unsigned mTop = 0;
+	std::size_t mInUse = 0;
+};
+
+}
+
+#endif // MQTTPACKETIDALLOCATOR_H
@@ -0,0 +1,184 @@
+#ifndef MQTTPARSER_H
+#define MQTTPARSER_H
+
+#include <algorithm>
+#include <vector>
+
+#include "FramedSocket.h"
+#include "MQTTPacket.h"
+
+namespace MQTT {
+
+/**
+ * @brief Splits a byte stream into MQTT control packets, one instance per connection
+ *
+ * Data can be fed in chunks of any size. Packets that are complete within a chunk are passed on in place,
+ * a packet that continues in a later chunk is assembled in a buffer sized for exactly that packet, so every
+ * byte is copied at most once and bytes of following packets are never buffered with it.
+ * The fixed header of a split packet is parsed one byte at a time as it arrives, nothing is parsed twice.
+ */
+class MQTTParser
+{
+public:
+	static constexpr std::size_t DefaultMaxPacketSize = 16 * 1024 * 1024;
+
+	/**
+	 * @brief Packets larger than @p size are treated as malformed
+	 */
+	void SetMaxPacketSize(std::size_t size) noexcept
+	{
+		mMaxPacketSize = size;
+	}
+
+	/**
+	 * @brief Parse all packets completed by @p data
+	 *
+	 * @p onPacket is called as bool(const char* packet, std::size_t len) with the complete packet including its
+	 * fixed header, only valid for the duration of the call. Returning false stops parsing and drops the rest of
+	 * @p data.
+	 *
+	 * @return Malformed for an invalid Remaining Length or a packet over the maximum size, the parser is reset
+	 * then. Complete when @p onPacket stopped parsing, Incomplete otherwise.
+	 */
+	template<typename Callback>
+	Common::DecodeStatus Feed(const char* data, std::size_t len, Callback&& onPacket)
+	{
+		std::size_t offset = 0;
+		while(offset < len)
+		{
+			if(mState == State::Type)
+			{
+				// Nothing pending, pass on complete packets without copying
+				std::size_t remainingLength = 0;
+				std::size_t lengthSize = 0;
+				const auto status = DecodeRemainingLength(data + offset + 1, len - offset - 1, remainingLength, lengthSize);
+				if(status == RemainingLengthStatus::Malformed)
+				{
+					Clear();
+					return Common::DecodeStatus::Malformed;
+				}
+				if(status == RemainingLengthStatus::Complete)
+				{
+					const std::size_t packetSize = 1 + lengthSize + remainingLength;
+					if(packetSize > mMaxPacketSize)
+					{
+						Clear();
+						return Common::DecodeStatus::Malformed;
+					}
+					if(len - offset >= packetSize)
+					{
+						if(!onPacket(data + offset, packetSize))
+						{
+							return Common::DecodeStatus::Complete;
+						}
+						offset += packetSize;
+						continue;
+					}
+
+					mPacketSize = packetSize;
+					mBuffer.reserve(packetSize);
+					mBuffer.assign(data + offset, data + len);
+					mState = State::Body;
+					return Common::DecodeStatus::Incomplete;
+				}
+
+				// The chunk ends within the Remaining Length
+				mBuffer.assign(data + offset, data + offset + 1);
+				mRemainingLength = 0;
+				mState = State::Length;
+				++offset;
+				continue;
+			}
+
+			if(mState == State::Length)
+			{
+				const auto byte = static_cast<std::uint8_t>(data[offset++]);
+				mRemainingLength |= static_cast<std::size_t>(byte & 0x7F) << (7 * (mBuffer.size() - 1));
+				mBuffer.push_back(static_cast<char>(byte));
+				if((byte & 0x80) != 0)
+				{
+					if(mBuffer.size() == MaxFixedHeaderSize)
+					{
+						Clear();
+						return Common::DecodeStatus::Malformed;
+					}
+					continue;
+				}
+
+				mPacketSize = mBuffer.size() + mRemainingLength;
+				if(mPacketSize > mMaxPacketSize)
+				{
+					Clear();
+					return Common::DecodeStatus::Malformed;
+				}
+				mBuffer.reserve(mPacketSize);
+				mState = State::Body;
+				// A packet without remaining length completes with its last header byte, taking nothing below
+			}
+
+			const std::size_t take = std::min(mPacketSize - mBuffer.size(), len - offset);
+			mBuffer.insert(std::end(mBuffer), data + offset, data + offset + take);
+			offset += take;
+			if(mBuffer.size() == mPacketSize)
+			{
+				mState = State::Type;
+				const bool proceed = onPacket(static_cast<const char*>(mBuffer.data()), mPacketSize);
+				ReleaseBuffer();
+				if(!proceed)
+				{
+					return Common::DecodeStatus::Complete;
+				}
+			}
+		}
+		return Common::DecodeStatus::Incomplete;
+	}
+
+	/**
+	 * @brief Bytes of the partial packet received so far
+	 */
+	std::size_t GetBufferedSize() const noexcept
+	{
+		return mState == State::Type ? 0 : mBuffer.size();
+	}
+
+	/**
+	 * @brief Drop a partial packet, e.g. when the connection was closed
+	 */
+	void Clear() noexcept
+	{
+		mState = State::Type;
+		ReleaseBuffer();
+	}
+
+private:
+	enum class State : std::uint8_t
+	{
+		Type,
+		Length,
+		Body
+	};
+
+	/**
+	 * @brief Keep the buffer for the next split packet unless it was grown for a large one
+	 */
+	void ReleaseBuffer() noexcept
+	{
+		mBuffer.clear();
+		if(mBuffer.capacity() > RetainedBufferSize)
+		{
+			mBuffer.shrink_to_fit();
+		}
+	}
+
+	static constexpr std::size_t RetainedBufferSize = 64 * 1024;
+
+	State mState = State::Type;
+	std::size_t mRemainingLength = 0;
+	std::size_t mPacketSize = 0;
+	std::vector<char> mBuffer;
+	std::size_t mMaxPacketSize = DefaultMaxPacketSize;
+};
+
+}
+
+#endif // MQTTPARSER_H
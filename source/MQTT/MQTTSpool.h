@@ -0,0 +1,340 @@
+#ifndef MQTTSPOOL_H
+#define MQTTSPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include "Common/NonCopyable.h"
+
+namespace MQTT {
+
+/**
+ * @brief Messages waiting for the broker in a memory mapped, append-only file
+ *
+ * The file has a fixed size and keeps two offsets in its header: the first message not acknowledged yet and the
+ * end of the last one appended. A message is copied into the mapping before the end moves past it, so a process
+ * that dies leaves the file consistent and the messages are found again when it is opened the next time. Messages
+ * are read in order and released once acknowledged, the start only moves past released ones. Space is reused when
+ * every message was released, until then Append() fails once the file is full.
+ *
+ * Messages survive the process, not the machine, unless Sync() is called.
+ */
+class MQTTSpool
+	: Common::NonCopyable<MQTTSpool>
+{
+	struct Header
+	{
+		std::uint32_t mMagic;
+		std::uint32_t mVersion;
+		std::uint64_t mCapacity;
+		/// Offset of the first message not released
+		std::atomic<std::uint64_t> mHead;
+		/// Offset after the last message appended
+		std::atomic<std::uint64_t> mTail;
+	};
+
+	static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Spool header needs lock free atomics");
+
+public:
+	static constexpr std::uint32_t Magic = 0x4d515350;
+	static constexpr std::uint32_t Version = 1;
+	static constexpr std::size_t DefaultCapacity = 64 * 1024 * 1024;
+	/// Length, QoS and topic length in front of every message
+	static constexpr std::size_t RecordHeaderSize = 4 + 1 + 2;
+
+	/**
+	 * @brief Open the spool at @p path, or create it with room for @p capacity bytes of messages
+	 *
+	 * An existing spool keeps its size. Messages cut short by a crash while they were appended are dropped.
+	 */
+	explicit MQTTSpool(const std::string& path, std::size_t capacity = DefaultCapacity)
+	{
+		mLogger = spdlog::get("MQTTSpool");
+		if(mLogger == nullptr)
+		{
+			auto spoolLogger = spdlog::stdout_color_mt("MQTTSpool");
+			mLogger = spdlog::get("MQTTSpool");
+		}
+
+		mFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(mFd == -1)
+		{
+			mLogger->critical("Failed to open spool {}, errno:{}", path, errno);
+			throw std::runtime_error("Failed to open spool");
+		}
+
+		struct stat st{};
+		if(::fstat(mFd, &st) == -1)
+		{
+			Fail("Failed to stat spool " + path);
+		}
+		const bool created = st.st_size == 0;
+		if(created)
+		{
+			mCapacity = capacity;
+			if(::ftruncate(mFd, sizeof(Header) + mCapacity) == -1)
+			{
+				Fail("Failed to size spool " + path);
+			}
+		}
+		else if(static_cast<std::size_t>(st.st_size) <= sizeof(Header))
+		{
+			Fail("Spool " + path + " is too small");
+		}
+		else
+		{
+			mCapacity = st.st_size - sizeof(Header);
+		}
+
+		void* addr = ::mmap(nullptr, sizeof(Header) + mCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+		if(addr == MAP_FAILED)
+		{
+			Fail("Failed to map spool " + path);
+		}
+		mHeader = static_cast<Header*>(addr);
+		mData = static_cast<char*>(addr) + sizeof(Header);
+
+		if(created)
+		{
+			mHeader->mMagic = Magic;
+			mHeader->mVersion = Version;
+			mHeader->mCapacity = mCapacity;
+			mHeader->mHead.store(0, std::memory_order_relaxed);
+			mHeader->mTail.store(0, std::memory_order_release);
+		}
+		else if(mHeader->mMagic != Magic || mHeader->mVersion != Version || mHeader->mCapacity != mCapacity)
+		{
+			::munmap(mHeader, sizeof(Header) + mCapacity);
+			Fail("Spool " + path + " has an unknown layout");
+		}
+		else
+		{
+			Recover();
+		}
+		mRead = mHeader->mHead.load(std::memory_order_relaxed);
+	}
+
+	~MQTTSpool()
+	{
+		::munmap(mHeader, sizeof(Header) + mCapacity);
+		::close(mFd);
+	}
+
+	/**
+	 * @brief Append a message
+	 *
+	 * @return False when it doesn't fit, nothing is written then.
+	 */
+	bool Append(std::string_view topic, std::string_view payload, int qos) noexcept
+	{
+		const std::size_t size = RecordHeaderSize + topic.size() + payload.size();
+		if(topic.size() > std::numeric_limits<std::uint16_t>::max() ||
+				size - 4 > std::numeric_limits<std::uint32_t>::max())
+		{
+			return false;
+		}
+		if(mRecords == 0)
+		{
+			Reset();
+		}
+		const std::uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed);
+		if(mCapacity - tail < size)
+		{
+			return false;
+		}
+
+		char* out = mData + tail;
+		const std::uint32_t length = static_cast<std::uint32_t>(size - 4);
+		const std::uint8_t level = static_cast<std::uint8_t>(qos);
+		const std::uint16_t topicSize = static_cast<std::uint16_t>(topic.size());
+		std::memcpy(out, &length, 4);
+		std::memcpy(out + 4, &level, 1);
+		std::memcpy(out + 5, &topicSize, 2);
+		std::memcpy(out + RecordHeaderSize, topic.data(), topic.size());
+		std::memcpy(out + RecordHeaderSize + topic.size(), payload.data(), payload.size());
+		mHeader->mTail.store(tail + size, std::memory_order_release);
+		++mRecords;
+		return true;
+	}
+
+	/**
+	 * @brief Pass the next message not read yet to @p func(std::string_view topic, std::string_view payload,
+	 * int qos, std::uint64_t record), Release() @p record once it was delivered
+	 *
+	 * Topic and payload point into the file and stay valid until the message is released.
+	 *
+	 * @return False when every message was read.
+	 */
+	template<typename Func>
+	bool ReadNext(Func&& func)
+	{
+		if(!HasUnread())
+		{
+			return false;
+		}
+		const std::uint64_t record = mRead;
+		const char* in = mData + record;
+		std::uint32_t length;
+		std::uint8_t qos;
+		std::uint16_t topicSize;
+		std::memcpy(&length, in, 4);
+		std::memcpy(&qos, in + 4, 1);
+		std::memcpy(&topicSize, in + 5, 2);
+		mRead += 4 + length;
+		mUnreleased.emplace_back(record, false);
+
+		const char* topic = in + RecordHeaderSize;
+		func(std::string_view(topic, topicSize),
+				std::string_view(topic + topicSize, length - (RecordHeaderSize - 4) - topicSize),
+				static_cast<int>(qos), record);
+		return true;
+	}
+
+	/**
+	 * @brief Drop a message that was read, it is gone from the file once the ones before it are released as well
+	 */
+	void Release(std::uint64_t record) noexcept
+	{
+		const auto entry = std::lower_bound(mUnreleased.begin(), mUnreleased.end(), record,
+				[](const std::pair<std::uint64_t, bool>& unreleased, std::uint64_t offset) {
+					return unreleased.first < offset;
+				});
+		if(entry == mUnreleased.end() || entry->first != record || entry->second)
+		{
+			return;
+		}
+		entry->second = true;
+		while(!mUnreleased.empty() && mUnreleased.front().second)
+		{
+			mUnreleased.pop_front();
+			--mRecords;
+		}
+		mHeader->mHead.store(mUnreleased.empty() ? mRead : mUnreleased.front().first, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Whether ReadNext() has a message
+	 */
+	bool HasUnread() const noexcept
+	{
+		return mRead != mHeader->mTail.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief Messages in the file, read or not, that were not released
+	 */
+	std::size_t GetCount() const noexcept
+	{
+		return mRecords;
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return mRecords == 0;
+	}
+
+	/**
+	 * @brief Bytes of messages the file holds
+	 */
+	std::size_t GetCapacity() const noexcept
+	{
+		return mCapacity;
+	}
+
+	/**
+	 * @brief Write the messages to disk, so they also survive a crash of the machine
+	 */
+	bool Sync() noexcept
+	{
+		return ::msync(mHeader, sizeof(Header) + mCapacity, MS_SYNC) == 0;
+	}
+
+private:
+	[[noreturn]] void Fail(const std::string& message)
+	{
+		mLogger->critical("{}, errno:{}", message, errno);
+		::close(mFd);
+		throw std::runtime_error(message);
+	}
+
+	/**
+	 * @brief Start at the beginning of the file again, once every message was released
+	 */
+	void Reset() noexcept
+	{
+		// The end first, a crash in between leaves the start past the end, which is read as empty
+		mHeader->mTail.store(0, std::memory_order_release);
+		mHeader->mHead.store(0, std::memory_order_release);
+		mRead = 0;
+		mUnreleased.clear();
+	}
+
+	/**
+	 * @brief Count the messages in an existing file and drop what doesn't parse
+	 */
+	void Recover() noexcept
+	{
+		const std::uint64_t head = mHeader->mHead.load(std::memory_order_relaxed);
+		const std::uint64_t tail = mHeader->mTail.load(std::memory_order_acquire);
+		if(head > tail || tail > mCapacity)
+		{
+			mLogger->warn("Spool offsets {} and {} are out of range, starting empty", head, tail);
+			Reset();
+			return;
+		}
+
+		std::uint64_t offset = head;
+		while(tail - offset >= RecordHeaderSize)
+		{
+			std::uint32_t length;
+			std::uint8_t qos;
+			std::uint16_t topicSize;
+			std::memcpy(&length, mData + offset, 4);
+			std::memcpy(&qos, mData + offset + 4, 1);
+			std::memcpy(&topicSize, mData + offset + 5, 2);
+			// A QoS above 2 would end up in the PUBLISH flags, only a corrupt or foreign file has one
+			if(length < RecordHeaderSize - 4 + topicSize || length > tail - offset - 4 || qos > 2)
+			{
+				break;
+			}
+			offset += 4 + length;
+			++mRecords;
+		}
+		if(offset != tail)
+		{
+			mLogger->warn("Spool has {} bytes after its last message, dropping them", tail - offset);
+			mHeader->mTail.store(offset, std::memory_order_release);
+		}
+	}
+
+	int mFd = -1;
+	std::size_t mCapacity = 0;
+	Header* mHeader = nullptr;
+	char* mData = nullptr;
+	/// Offset of the next message for ReadNext()
+	std::uint64_t mRead = 0;
+	/// Offsets of the messages read and not yet released, true once released out of order
+	std::deque<std::pair<std::uint64_t, bool>> mUnreleased;
+	std::size_t mRecords = 0;
+
+	std::shared_ptr<spdlog::logger> mLogger;
+};
+
+}
+
+#endif // MQTTSPOOL_H
@@ -0,0 +1,491 @@
+#ifndef MQTTSUBSCRIPTIONTRIE_H
+#define MQTTSUBSCRIPTIONTRIE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Common/NonCopyable.h"
+
+namespace MQTT {
+
+/**
+ * @brief The subscribers of a broker by topic filter, matched against topic names level by level
+ *
+ * Every level of a filter is a node, '+' and '#' are children of their own next to the named ones, so a topic is
+ * matched in one walk down the trie as in MQTTTopicTrie. Level names are interned: each distinct name is stored once
+ * and numbered. Names and the named children of all nodes, by parent and number, are kept in open addressing tables,
+ * so a step down the trie is mostly a single cache line. Matching looks up the number of every topic level once.
+ *
+ * Each subscription is a Handle the caller keeps, with the filters of a client by name that is the reverse index
+ * which makes unsubscribing and dropping a client independent of the number of subscriptions of everyone else.
+ * Filters are expected to be valid, see IsValidTopicFilter().
+ */
+template<typename Subscriber>
+class MQTTSubscriptionTrie
+	: Common::NonCopyable<MQTTSubscriptionTrie<Subscriber>>
+{
+	struct Node;
+
+public:
+	/**
+	 * @brief Where a subscription is kept, it must not move while subscribed
+	 */
+	class Handle
+		: Common::NonCopyable<Handle>
+	{
+	public:
+		Handle() = default;
+
+		bool IsSubscribed() const noexcept
+		{
+			return mNode != nullptr;
+		}
+
+	private:
+		friend class MQTTSubscriptionTrie;
+
+		Node* mNode = nullptr;
+		/// Position in the subscribers of the node
+		std::size_t mIndex = 0;
+	};
+
+	/**
+	 * @brief Add @p subscriber to @p filter and keep where in @p handle, which must not be subscribed
+	 */
+	void Subscribe(std::string_view filter, const Subscriber& subscriber, Handle& handle)
+	{
+		Node* node = &mRoot;
+		std::size_t start = 0;
+		while(start != std::string_view::npos)
+		{
+			node = GetOrAddChild(node, NextLevel(filter, start));
+		}
+		handle.mNode = node;
+		handle.mIndex = node->mSubscribers.size();
+		node->mSubscribers.push_back({subscriber, &handle});
+		++mSize;
+	}
+
+	/**
+	 * @brief Remove the subscription of @p handle and the levels only it used
+	 */
+	void Unsubscribe(Handle& handle) noexcept
+	{
+		Node* node = handle.mNode;
+		if(node == nullptr)
+		{
+			return;
+		}
+		// The last subscriber takes the place of the removed one
+		auto& subscribers = node->mSubscribers;
+		subscribers[handle.mIndex] = subscribers.back();
+		subscribers[handle.mIndex].mHandle->mIndex = handle.mIndex;
+		subscribers.pop_back();
+		handle.mNode = nullptr;
+		--mSize;
+
+		while(node != &mRoot && node->IsEmpty())
+		{
+			Node* parent = node->mParent;
+			if(node == parent->mSingleLevel)
+			{
+				parent->mSingleLevel = nullptr;
+			}
+			else if(node == parent->mMultiLevel)
+			{
+				parent->mMultiLevel = nullptr;
+			}
+			else
+			{
+				mChildren.Erase(ChildSlot::Hash(parent, node->mToken), [node](const ChildSlot& child) {
+					return child.mChild == node;
+				});
+				--parent->mChildCount;
+				ReleaseToken(node->mToken);
+			}
+			FreeNode(node);
+			node = parent;
+		}
+	}
+
+	/**
+	 * @brief Call @p func with every subscriber of a filter matching @p topic
+	 *
+	 * A subscriber of several matching filters is passed once for each. @p func must not subscribe or unsubscribe.
+	 */
+	template<typename Func>
+	void Match(std::string_view topic, Func&& func)
+	{
+		mTopicTokens.clear();
+		std::size_t start = 0;
+		while(start != std::string_view::npos)
+		{
+			mTopicTokens.push_back(FindToken(NextLevel(topic, start)));
+		}
+		MatchFrom(mRoot, 0, topic.empty() || topic[0] != '$', func);
+	}
+
+	/**
+	 * @brief Number of subscriptions
+	 */
+	std::size_t GetSize() const noexcept
+	{
+		return mSize;
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return mSize == 0;
+	}
+
+	/**
+	 * @brief Number of distinct level names in the filters
+	 */
+	std::size_t GetTokenCount() const noexcept
+	{
+		return mTokens.size() - mFreeTokens.size();
+	}
+
+private:
+	static constexpr std::uint32_t NoToken = 0xffffffff;
+
+	struct Entry
+	{
+		Subscriber mSubscriber;
+		Handle* mHandle;
+	};
+
+	struct Node
+	{
+		bool IsEmpty() const noexcept
+		{
+			return mSubscribers.empty() && mChildCount == 0 && mSingleLevel == nullptr && mMultiLevel == nullptr;
+		}
+
+		Node* mParent = nullptr;
+		/// The level name of a named child
+		std::uint32_t mToken = NoToken;
+		/// Named children in mChildren
+		std::uint32_t mChildCount = 0;
+		/// The '+' child
+		Node* mSingleLevel = nullptr;
+		/// The '#' child, it has no children
+		Node* mMultiLevel = nullptr;
+		std::vector<Entry> mSubscribers;
+	};
+
+	/**
+	 * @brief Linear probing in a power of two table, at most half full so runs stay short
+	 *
+	 * A default constructed Slot is empty, IsEmpty() tells so and GetHash() gives the hash of what a slot holds.
+	 */
+	template<typename Slot>
+	class ProbingTable
+	{
+	public:
+		template<typename Equal>
+		const Slot* Find(std::size_t hash, Equal&& equal) const noexcept
+		{
+			if(mSlots.empty())
+			{
+				return nullptr;
+			}
+			for(std::size_t i = hash & mMask; !mSlots[i].IsEmpty(); i = (i + 1) & mMask)
+			{
+				if(equal(mSlots[i]))
+				{
+					return &mSlots[i];
+				}
+			}
+			return nullptr;
+		}
+
+		/**
+		 * @brief Add @p slot, which must not be in the table yet
+		 */
+		void Insert(const Slot& slot)
+		{
+			if((mSize + 1) * 2 > mSlots.size())
+			{
+				Grow();
+			}
+			std::size_t i = slot.GetHash() & mMask;
+			while(!mSlots[i].IsEmpty())
+			{
+				i = (i + 1) & mMask;
+			}
+			mSlots[i] = slot;
+			++mSize;
+		}
+
+		/**
+		 * @brief Remove the slot @p equal is true for, which must be in the table
+		 */
+		template<typename Equal>
+		void Erase(std::size_t hash, Equal&& equal) noexcept
+		{
+			std::size_t hole = hash & mMask;
+			while(!equal(mSlots[hole]))
+			{
+				hole = (hole + 1) & mMask;
+			}
+			// Later slots of the run move up into the hole, unless that would put them before their home
+			for(std::size_t i = (hole + 1) & mMask; !mSlots[i].IsEmpty(); i = (i + 1) & mMask)
+			{
+				const std::size_t home = mSlots[i].GetHash() & mMask;
+				if(((i - home) & mMask) >= ((i - hole) & mMask))
+				{
+					mSlots[hole] = mSlots[i];
+					hole = i;
+				}
+			}
+			mSlots[hole] = Slot();
+			--mSize;
+		}
+
+	private:
+		void Grow()
+		{
+			std::vector<Slot> slots(mSlots.empty() ? 64 : mSlots.size() * 2);
+			slots.swap(mSlots);
+			mMask = mSlots.size() - 1;
+			mSize = 0;
+			for(const auto& slot : slots)
+			{
+				if(!slot.IsEmpty())
+				{
+					Insert(slot);
+				}
+			}
+		}
+
+		std::vector<Slot> mSlots;
+		std::size_t mMask = 0;
+		std::size_t mSize = 0;
+	};
+
+	/**
+	 * @brief A named child, by parent and level name
+	 */
+	struct ChildSlot
+	{
+		static std::size_t Hash(const Node* parent, std::uint32_t token) noexcept
+		{
+			const std::uint64_t key = (reinterpret_cast<std::uintptr_t>(parent) ^ (std::uint64_t(token) << 32)) *
+					0x9e3779b97f4a7c15ull;
+			return static_cast<std::size_t>(key >> 32);
+		}
+
+		bool IsEmpty() const noexcept
+		{
+			return mChild == nullptr;
+		}
+
+		std::size_t GetHash() const noexcept
+		{
+			return Hash(mParent, mToken);
+		}
+
+		const Node* mParent = nullptr;
+		Node* mChild = nullptr;
+		std::uint32_t mToken = NoToken;
+	};
+
+	/**
+	 * @brief A level name by its hash, the name itself is in mTokens
+	 */
+	struct TokenSlot
+	{
+		bool IsEmpty() const noexcept
+		{
+			return mToken == NoToken;
+		}
+
+		std::size_t GetHash() const noexcept
+		{
+			return mHash;
+		}
+
+		std::size_t mHash = 0;
+		std::uint32_t mToken = NoToken;
+	};
+
+	struct Token
+	{
+		std::string mName;
+		/// Named children with this level name
+		std::size_t mRefs = 0;
+	};
+
+	/**
+	 * @brief The level of @p name starting at @p start, which is moved to the next one or npos after the last
+	 */
+	static std::string_view NextLevel(std::string_view name, std::size_t& start) noexcept
+	{
+		const std::size_t end = name.find('/', start);
+		const std::string_view level = name.substr(start, end - start);
+		start = end == std::string_view::npos ? end : end + 1;
+		return level;
+	}
+
+	Node* GetOrAddChild(Node* node, std::string_view level)
+	{
+		if(level == "+" || level == "#")
+		{
+			Node*& child = level == "+" ? node->mSingleLevel : node->mMultiLevel;
+			if(child == nullptr)
+			{
+				child = AddNode(node, NoToken);
+			}
+			return child;
+		}
+
+		const std::uint32_t token = AcquireToken(level);
+		if(Node* child = FindChild(node, token))
+		{
+			ReleaseToken(token);
+			return child;
+		}
+		Node* child = AddNode(node, token);
+		mChildren.Insert({node, child, token});
+		++node->mChildCount;
+		return child;
+	}
+
+	Node* AddNode(Node* parent, std::uint32_t token)
+	{
+		Node* node;
+		if(!mFreeNodes.empty())
+		{
+			node = mFreeNodes.back();
+			mFreeNodes.pop_back();
+		}
+		else
+		{
+			node = &mNodes.emplace_back();
+		}
+		node->mParent = parent;
+		node->mToken = token;
+		return node;
+	}
+
+	void FreeNode(Node* node) noexcept
+	{
+		*node = Node();
+		mFreeNodes.push_back(node);
+	}
+
+	Node* FindChild(const Node* parent, std::uint32_t token) const noexcept
+	{
+		const ChildSlot* slot = mChildren.Find(ChildSlot::Hash(parent, token), [parent, token](const ChildSlot& child) {
+			return child.mParent == parent && child.mToken == token;
+		});
+		return slot == nullptr ? nullptr : slot->mChild;
+	}
+
+	std::uint32_t FindToken(std::string_view level) const noexcept
+	{
+		const std::size_t hash = std::hash<std::string_view>()(level);
+		const TokenSlot* slot = mTokenIds.Find(hash, [this, hash, level](const TokenSlot& token) {
+			return token.mHash == hash && mTokens[token.mToken].mName == level;
+		});
+		return slot == nullptr ? NoToken : slot->mToken;
+	}
+
+	/**
+	 * @brief The number of @p level, it counts as used once more
+	 */
+	std::uint32_t AcquireToken(std::string_view level)
+	{
+		const std::uint32_t known = FindToken(level);
+		if(known != NoToken)
+		{
+			++mTokens[known].mRefs;
+			return known;
+		}
+		std::uint32_t token;
+		if(!mFreeTokens.empty())
+		{
+			token = mFreeTokens.back();
+			mFreeTokens.pop_back();
+		}
+		else
+		{
+			token = static_cast<std::uint32_t>(mTokens.size());
+			mTokens.emplace_back();
+		}
+		mTokens[token].mName.assign(level);
+		mTokens[token].mRefs = 1;
+		mTokenIds.Insert({std::hash<std::string_view>()(level), token});
+		return token;
+	}
+
+	void ReleaseToken(std::uint32_t token) noexcept
+	{
+		if(--mTokens[token].mRefs == 0)
+		{
+			mTokenIds.Erase(std::hash<std::string_view>()(mTokens[token].mName), [token](const TokenSlot& slot) {
+				return slot.mToken == token;
+			});
+			mTokens[token].mName.clear();
+			mFreeTokens.push_back(token);
+		}
+	}
+
+	/**
+	 * @param wildcards False in the first level of a topic starting with '$'.
+	 */
+	template<typename Func>
+	void MatchFrom(const Node& node, std::size_t level, bool wildcards, Func& func) const
+	{
+		if(wildcards && node.mMultiLevel != nullptr)
+		{
+			for(const auto& entry : node.mMultiLevel->mSubscribers)
+			{
+				func(entry.mSubscriber);
+			}
+		}
+		if(level == mTopicTokens.size())
+		{
+			for(const auto& entry : node.mSubscribers)
+			{
+				func(entry.mSubscriber);
+			}
+			return;
+		}
+		const std::uint32_t token = mTopicTokens[level];
+		if(token != NoToken && node.mChildCount != 0)
+		{
+			if(const Node* child = FindChild(&node, token))
+			{
+				MatchFrom(*child, level + 1, true, func);
+			}
+		}
+		if(wildcards && node.mSingleLevel != nullptr)
+		{
+			MatchFrom(*node.mSingleLevel, level + 1, true, func);
+		}
+	}
+
+	Node mRoot;
+	std::size_t mSize = 0;
+	/// Every node but the root, the deque doesn't move them
+	std::deque<Node> mNodes;
+	std::vector<Node*> mFreeNodes;
+	ProbingTable<ChildSlot> mChildren;
+	ProbingTable<TokenSlot> mTokenIds;
+	/// Level names by number
+	std::vector<Token> mTokens;
+	std::vector<std::uint32_t> mFreeTokens;
+	/// The level numbers of the topic being matched
+	std::vector<std::uint32_t> mTopicTokens;
+};
+
+}
+
+#endif // MQTTSUBSCRIPTIONTRIE_H
@@ -0,0 +1,288 @@
+#ifndef MQTTTOPICTRIE_H
+#define MQTTTOPICTRIE_H
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace MQTT {
+
+/**
+ * @brief Values stored by MQTT topic filter, matched against topic names level by level
+ *
+ * Every level of a filter is a node. '+' and '#' are kept apart from the named children, so a topic is matched in
+ * one walk down the trie: per level the child of that name and the '+' child are followed, a '#' child matches
+ * whatever is left, including nothing. Levels are looked up as views into the topic, matching doesn't allocate.
+ * Wildcards in the first level don't match topics starting with '$' (MQTT 3.1.1 section 4.7.2).
+ *
+ * Filters are expected to be valid, see IsValidTopicFilter().
+ */
+template<typename Value>
+class MQTTTopicTrie
+{
+public:
+	/**
+	 * @brief The value stored for @p filter, default constructed when there is none yet
+	 */
+	Value& Insert(std::string_view filter)
+	{
+		Node* node = &mRoot;
+		std::size_t start = 0;
+		while(start != std::string_view::npos)
+		{
+			node = &GetOrAddChild(*node, NextLevel(filter, start));
+		}
+		if(!node->mValue)
+		{
+			node->mValue.emplace();
+			++mSize;
+		}
+		return *node->mValue;
+	}
+
+	/**
+	 * @return The value stored for exactly @p filter, nullptr when there is none.
+	 */
+	Value* Find(std::string_view filter) noexcept
+	{
+		Node* node = &mRoot;
+		std::size_t start = 0;
+		while(start != std::string_view::npos)
+		{
+			auto* child = FindChild(*node, NextLevel(filter, start));
+			if(child == nullptr || *child == nullptr)
+			{
+				return nullptr;
+			}
+			node = child->get();
+		}
+		return node->mValue ? &*node->mValue : nullptr;
+	}
+
+	/**
+	 * @brief Remove the value stored for @p filter and the levels only it used
+	 *
+	 * @return False when there was none.
+	 */
+	bool Erase(std::string_view filter)
+	{
+		const bool erased = EraseFrom(mRoot, filter, 0);
+		mSize -= erased;
+		return erased;
+	}
+
+	/**
+	 * @brief Call @p func with the value of every filter matching @p topic, each one once
+	 *
+	 * @p func may insert filters, it must not erase any.
+	 */
+	template<typename Func>
+	void Match(std::string_view topic, Func&& func) const
+	{
+		MatchFrom(mRoot, topic, 0, topic.empty() || topic[0] != '$', func);
+	}
+
+	/**
+	 * @brief Call @p func with every filter that has a value and that value
+	 *
+	 * @p func must not insert or erase filters.
+	 */
+	template<typename Func>
+	void ForEach(Func&& func) const
+	{
+		std::string filter;
+		ForEachFrom(mRoot, filter, true, func);
+	}
+
+	/**
+	 * @brief Number of filters with a value
+	 */
+	std::size_t GetSize() const noexcept
+	{
+		return mSize;
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return mSize == 0;
+	}
+
+	void Clear() noexcept
+	{
+		mRoot = Node();
+		mSize = 0;
+	}
+
+private:
+	struct Node
+	{
+		bool IsEmpty() const noexcept
+		{
+			return !mValue && mChildren.empty() && !mSingleLevel && !mMultiLevel;
+		}
+
+		/// Owns the name the key in the parent's mChildren refers to
+		std::string mLevel;
+		std::unordered_map<std::string_view, std::unique_ptr<Node>> mChildren;
+		/// The '+' child
+		std::unique_ptr<Node> mSingleLevel;
+		/// The '#' child, it has no children
+		std::unique_ptr<Node> mMultiLevel;
+		std::optional<Value> mValue;
+	};
+
+	/**
+	 * @brief The level of @p name starting at @p start, which is moved to the next one or npos after the last
+	 */
+	static std::string_view NextLevel(std::string_view name, std::size_t& start) noexcept
+	{
+		const std::size_t end = name.find('/', start);
+		const std::string_view level = name.substr(start, end - start);
+		start = end == std::string_view::npos ? end : end + 1;
+		return level;
+	}
+
+	/**
+	 * @return Where the child for @p level is kept, nullptr when a named child doesn't exist.
+	 */
+	static const std::unique_ptr<Node>* FindChild(const Node& node, std::string_view level) noexcept
+	{
+		if(level == "+")
+		{
+			return &node.mSingleLevel;
+		}
+		if(level == "#")
+		{
+			return &node.mMultiLevel;
+		}
+		const auto child = node.mChildren.find(level);
+		return child == node.mChildren.end() ? nullptr : &child->second;
+	}
+
+	static std::unique_ptr<Node>* FindChild(Node& node, std::string_view level) noexcept
+	{
+		return const_cast<std::unique_ptr<Node>*>(FindChild(static_cast<const Node&>(node), level));
+	}
+
+	static Node& GetOrAddChild(Node& node, std::string_view level)
+	{
+		if(auto* child = FindChild(node, level))
+		{
+			if(*child == nullptr)
+			{
+				*child = std::make_unique<Node>();
+			}
+			return **child;
+		}
+		auto child = std::make_unique<Node>();
+		child->mLevel.assign(level);
+		Node& added = *child;
+		node.mChildren.emplace(std::string_view(added.mLevel), std::move(child));
+		return added;
+	}
+
+	static bool EraseFrom(Node& node, std::string_view filter, std::size_t start)
+	{
+		if(start == std::string_view::npos)
+		{
+			if(!node.mValue)
+			{
+				return false;
+			}
+			node.mValue.reset();
+			return true;
+		}
+		const std::string_view level = NextLevel(filter, start);
+		auto* child = FindChild(node, level);
+		if(child == nullptr || *child == nullptr || !EraseFrom(**child, filter, start))
+		{
+			return false;
+		}
+		if((*child)->IsEmpty())
+		{
+			if(child == &node.mSingleLevel || child == &node.mMultiLevel)
+			{
+				child->reset();
+			}
+			else
+			{
+				node.mChildren.erase(level);
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @param wildcards False in the first level of a topic starting with '$'.
+	 */
+	template<typename Func>
+	static void MatchFrom(const Node& node, std::string_view topic, std::size_t start, bool wildcards, Func& func)
+	{
+		if(wildcards && node.mMultiLevel && node.mMultiLevel->mValue)
+		{
+			func(*node.mMultiLevel->mValue);
+		}
+		if(start == std::string_view::npos)
+		{
+			if(node.mValue)
+			{
+				func(*node.mValue);
+			}
+			return;
+		}
+		const std::string_view level = NextLevel(topic, start);
+		const auto child = node.mChildren.find(level);
+		if(child != node.mChildren.end())
+		{
+			MatchFrom(*child->second, topic, start, true, func);
+		}
+		if(wildcards && node.mSingleLevel)
+		{
+			MatchFrom(*node.mSingleLevel, topic, start, true, func);
+		}
+	}
+
+	/**
+	 * @param filter The levels up to @p node, each child appends its own and removes it again.
+	 */
+	template<typename Func>
+	static void ForEachFrom(const Node& node, std::string& filter, bool first, Func& func)
+	{
+		if(node.mValue)
+		{
+			func(static_cast<const std::string&>(filter), *node.mValue);
+		}
+		const std::size_t length = filter.size();
+		const auto descend = [&filter, first, length, &func](const Node& child, std::string_view level) {
+			if(!first)
+			{
+				filter += '/';
+			}
+			filter += level;
+			ForEachFrom(child, filter, false, func);
+			filter.resize(length);
+		};
+		for(const auto& [level, child] : node.mChildren)
+		{
+			descend(*child, level);
+		}
+		if(node.mSingleLevel)
+		{
+			descend(*node.mSingleLevel, "+");
+		}
+		if(node.mMultiLevel)
+		{
+			descend(*node.mMultiLevel, "#");
+		}
+	}
+
+	Node mRoot;
+	std::size_t mSize = 0;
+};
+
+}
+
+#endif // MQTTTOPICTRIE_H
@@ -0,0 +1,397 @@
+#ifndef MQTTVALIDATION_H
+#define MQTTVALIDATION_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace MQTT {
+
+/**
+ * @brief Validation of the UTF-8 strings in MQTT packets (MQTT 3.1.1 section 1.5.3 and 4.7)
+ *
+ * Strings must be well-formed UTF-8, which excludes surrogates and overlong encodings, and must not contain
+ * U+0000. Topic names must not contain the wildcards '+' and '#', those may only be used in topic filters as a
+ * whole level, '#' only as the last one.
+ *
+ * On x86-64 the strings are checked 32 or 16 bytes at a time with AVX2 or SSE4.1, picked at runtime. The UTF-8 check
+ * is the lookup table algorithm by Keiser and Lemire, checking every byte together with the one, two and three bytes
+ * before it, wildcards and U+0000 are found by comparisons in the same pass.
+ */
+
+/**
+ * @brief Byte by byte check, used on CPUs without SSE4.1 and as reference
+ *
+ * @return False for malformed UTF-8, U+0000, or with @p rejectWildcards a '+' or '#'.
+ */
+inline bool ValidateStringScalar(const char* data, std::size_t len, bool rejectWildcards) noexcept
+{
+	const auto* bytes = reinterpret_cast<const std::uint8_t*>(data);
+	std::size_t i = 0;
+	while(i < len)
+	{
+		const std::uint8_t byte = bytes[i];
+		if(byte < 0x80)
+		{
+			if(byte == 0 || (rejectWildcards && (byte == '+' || byte == '#')))
+			{
+				return false;
+			}
+			++i;
+			continue;
+		}
+
+		std::size_t size = 0;
+		std::uint8_t low = 0x80;
+		std::uint8_t high = 0xBF;
+		if(byte >= 0xC2 && byte <= 0xDF)
+		{
+			size = 2;
+		}
+		else if(byte >= 0xE0 && byte <= 0xEF)
+		{
+			size = 3;
+			// Overlong and surrogates
+			low = byte == 0xE0 ? 0xA0 : 0x80;
+			high = byte == 0xED ? 0x9F : 0xBF;
+		}
+		else if(byte >= 0xF0 && byte <= 0xF4)
+		{
+			size = 4;
+			// Overlong and above U+10FFFF
+			low = byte == 0xF0 ? 0x90 : 0x80;
+			high = byte == 0xF4 ? 0x8F : 0xBF;
+		}
+		else
+		{
+			return false;
+		}
+
+		if(len - i < size || bytes[i + 1] < low || bytes[i + 1] > high)
+		{
+			return false;
+		}
+		for(std::size_t j = 2; j < size; ++j)
+		{
+			if((bytes[i + j] & 0xC0) != 0x80)
+			{
+				return false;
+			}
+		}
+		i += size;
+	}
+	return true;
+}
+
+#if defined(__x86_64__)
+
+namespace Utf8Tables {
+
+constexpr std::uint8_t TooShort = 1 << 0;
+constexpr std::uint8_t TooLong = 1 << 1;
+constexpr std::uint8_t Overlong3 = 1 << 2;
+constexpr std::uint8_t TooLarge = 1 << 3;
+constexpr std::uint8_t Surrogate = 1 << 4;
+constexpr std::uint8_t Overlong2 = 1 << 5;
+constexpr std::uint8_t TooLarge1000 = 1 << 6;
+constexpr std::uint8_t Overlong4 = 1 << 6;
+constexpr std::uint8_t TwoConts = 1 << 7;
+constexpr std::uint8_t Carry = TooShort | TooLong | TwoConts;
+
+/// Errors possible for the high nibble of the previous byte
+alignas(16) constexpr std::uint8_t Byte1High[16] = {
+	TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+	TwoConts, TwoConts, TwoConts, TwoConts,
+	TooShort | Overlong2,
+	TooShort,
+	TooShort | Overlong3 | Surrogate,
+	TooShort | TooLarge | TooLarge1000 | Overlong4};
+
+/// Errors possible for the low nibble of the previous byte
+alignas(16) constexpr std::uint8_t Byte1Low[16] = {
+	Carry | Overlong3 | Overlong2 | Overlong4,
+	Carry | Overlong2,
+	Carry,
+	Carry,
+	Carry | TooLarge,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000 | Surrogate,
+	Carry | TooLarge | TooLarge1000,
+	Carry | TooLarge | TooLarge1000};
+
+/// Errors possible for the high nibble of the current byte
+alignas(16) constexpr std::uint8_t Byte2High[16] = {
+	TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+	TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+	TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+	TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+	TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+	TooShort, TooShort, TooShort, TooShort};
+
+/// A block ending in these lead bytes continues in the next one
+alignas(16) constexpr std::uint8_t IncompleteMax[16] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xF0 - 1, 0xE0 - 1, 0xC0 - 1};
+
+}
+
+/**
+ * @brief Errors in one 16 byte block given the block before it, zero when valid
+ */
+__attribute__((target("sse4.1"))) inline __m128i CheckUtf8Block(__m128i input, __m128i previous) noexcept
+{
+	using namespace Utf8Tables;
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	const __m128i prev1 = _mm_alignr_epi8(input, previous, 16 - 1);
+
+	const __m128i byte1High = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte1High)),
+			_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+	const __m128i byte1Low = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte1Low)),
+			_mm_and_si128(prev1, nibble));
+	const __m128i byte2High = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte2High)),
+			_mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+	const __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+	// The third and fourth byte of a sequence must be continuations, which the tables cannot see
+	const __m128i prev2 = _mm_alignr_epi8(input, previous, 16 - 2);
+	const __m128i prev3 = _mm_alignr_epi8(input, previous, 16 - 3);
+	const __m128i thirdByte = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	const __m128i fourthByte = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	const __m128i mustBeContinuation = _mm_and_si128(_mm_or_si128(thirdByte, fourthByte), _mm_set1_epi8(static_cast<char>(0x80)));
+	return _mm_xor_si128(mustBeContinuation, special);
+}
+
+/**
+ * @brief Bytes U+0000 and optionally the wildcards, non zero when one is found
+ */
+__attribute__((target("sse4.1"))) inline __m128i FindForbidden(__m128i input, bool rejectWildcards) noexcept
+{
+	__m128i found = _mm_cmpeq_epi8(input, _mm_setzero_si128());
+	if(rejectWildcards)
+	{
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(input, _mm_set1_epi8('+')));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(input, _mm_set1_epi8('#')));
+	}
+	return found;
+}
+
+/**
+ * @brief Check @p data given the errors, last block and incomplete sequence of what came before it
+ */
+__attribute__((target("sse4.1"))) inline bool ContinueValidationSse41(const char* data, std::size_t len, bool rejectWildcards,
+		__m128i error, __m128i previous, __m128i previousIncomplete) noexcept
+{
+	const __m128i incompleteMax = _mm_load_si128(reinterpret_cast<const __m128i*>(Utf8Tables::IncompleteMax));
+	for(std::size_t i = 0; i < len; i += 16)
+	{
+		__m128i input;
+		if(len - i >= 16)
+		{
+			input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		}
+		else
+		{
+			// Padded with spaces, which are valid and end any sequence the string ended in with an error
+			alignas(16) char tail[16];
+			std::memset(tail, ' ', sizeof(tail));
+			std::memcpy(tail, data + i, len - i);
+			input = _mm_load_si128(reinterpret_cast<const __m128i*>(tail));
+		}
+
+		error = _mm_or_si128(error, FindForbidden(input, rejectWildcards));
+		if(_mm_movemask_epi8(input) == 0)
+		{
+			// ASCII only, valid unless the block before ended within a sequence
+			error = _mm_or_si128(error, previousIncomplete);
+		}
+		else
+		{
+			error = _mm_or_si128(error, CheckUtf8Block(input, previous));
+			previousIncomplete = _mm_subs_epu8(input, incompleteMax);
+		}
+		previous = input;
+	}
+	error = _mm_or_si128(error, previousIncomplete);
+	return _mm_testz_si128(error, error);
+}
+
+/**
+ * @brief 16 bytes at a time, needs SSE4.1
+ */
+__attribute__((target("sse4.1"))) inline bool ValidateStringSse41(const char* data, std::size_t len, bool rejectWildcards) noexcept
+{
+	return ContinueValidationSse41(data, len, rejectWildcards, _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128());
+}
+
+/**
+ * @brief Errors in one 32 byte block given the block before it, zero when valid
+ */
+__attribute__((target("avx2"))) inline __m256i CheckUtf8Block(__m256i input, __m256i previous) noexcept
+{
+	using namespace Utf8Tables;
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	// Previous bytes across the 128 bit lanes: the upper half of the last block and the lower half of this one
+	const __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+	const __m256i prev1 = _mm256_alignr_epi8(input, shifted, 16 - 1);
+
+	const __m256i byte1High = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte1High))),
+			_mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+	const __m256i byte1Low = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte1Low))),
+			_mm256_and_si256(prev1, nibble));
+	const __m256i byte2High = _mm256_shuffle_epi8(
+			_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(Byte2High))),
+			_mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+	const __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+	const __m256i prev2 = _mm256_alignr_epi8(input, shifted, 16 - 2);
+	const __m256i prev3 = _mm256_alignr_epi8(input, shifted, 16 - 3);
+	const __m256i thirdByte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	const __m256i fourthByte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	const __m256i mustBeContinuation = _mm256_and_si256(_mm256_or_si256(thirdByte, fourthByte),
+			_mm256_set1_epi8(static_cast<char>(0x80)));
+	return _mm256_xor_si256(mustBeContinuation, special);
+}
+
+__attribute__((target("avx2"))) inline __m256i FindForbidden(__m256i input, bool rejectWildcards) noexcept
+{
+	__m256i found = _mm256_cmpeq_epi8(input, _mm256_setzero_si256());
+	if(rejectWildcards)
+	{
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(input, _mm256_set1_epi8('+')));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(input, _mm256_set1_epi8('#')));
+	}
+	return found;
+}
+
+/**
+ * @brief 32 bytes at a time, needs AVX2
+ *
+ * The last 31 bytes or less are left to the SSE4.1 check, padding them to a whole block costs more than it saves
+ * on short topics.
+ */
+__attribute__((target("avx2"))) inline bool ValidateStringAvx2(const char* data, std::size_t len, bool rejectWildcards) noexcept
+{
+	const __m256i incompleteMax = _mm256_setr_epi8(
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+	__m256i error = _mm256_setzero_si256();
+	__m256i previous = _mm256_setzero_si256();
+	__m256i previousIncomplete = _mm256_setzero_si256();
+
+	std::size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		error = _mm256_or_si256(error, FindForbidden(input, rejectWildcards));
+		if(_mm256_movemask_epi8(input) == 0)
+		{
+			error = _mm256_or_si256(error, previousIncomplete);
+		}
+		else
+		{
+			error = _mm256_or_si256(error, CheckUtf8Block(input, previous));
+			previousIncomplete = _mm256_subs_epu8(input, incompleteMax);
+		}
+		previous = input;
+	}
+
+	if(i < len)
+	{
+		return ContinueValidationSse41(data + i, len - i, rejectWildcards,
+				_mm_or_si128(_mm256_castsi256_si128(error), _mm256_extracti128_si256(error, 1)),
+				_mm256_extracti128_si256(previous, 1),
+				_mm256_extracti128_si256(previousIncomplete, 1));
+	}
+	error = _mm256_or_si256(error, previousIncomplete);
+	return _mm256_testz_si256(error, error);
+}
+
+#endif
+
+using StringValidator = bool (*)(const char*, std::size_t, bool) noexcept;
+
+/**
+ * @brief The fastest validator the CPU supports
+ */
+inline StringValidator SelectStringValidator() noexcept
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		return ValidateStringAvx2;
+	}
+	if(__builtin_cpu_supports("sse4.1"))
+	{
+		return ValidateStringSse41;
+	}
+#endif
+	return ValidateStringScalar;
+}
+
+/**
+ * @brief Check @p len bytes at @p data with the validator selected for this CPU
+ */
+inline bool ValidateString(const char* data, std::size_t len, bool rejectWildcards) noexcept
+{
+	static const StringValidator validator = SelectStringValidator();
+	return validator(data, len, rejectWildcards);
+}
+
+/**
+ * @brief Well-formed UTF-8 without U+0000, as required for every MQTT string
+ */
+inline bool IsValidUtf8String(std::string_view value) noexcept
+{
+	return ValidateString(value.data(), value.size(), false);
+}
+
+/**
+ * @brief A topic name as used in PUBLISH, at least one character and no wildcards
+ */
+inline bool IsValidTopicName(std::string_view topic) noexcept
+{
+	return !topic.empty() && ValidateString(topic.data(), topic.size(), true);
+}
+
+/**
+ * @brief A topic filter as used in SUBSCRIBE and UNSUBSCRIBE
+ *
+ * '+' must be a whole level, '#' a whole level and the last one.
+ */
+inline bool IsValidTopicFilter(std::string_view filter) noexcept
+{
+	if(filter.empty() || !ValidateString(filter.data(), filter.size(), false))
+	{
+		return false;
+	}
+
+	for(std::size_t pos = filter.find_first_of("+#"); pos != std::string_view::npos; pos = filter.find_first_of("+#", pos + 1))
+	{
+		const bool levelStart = pos == 0 || filter[pos - 1] == '/';
+		const bool levelEnd = pos + 1 == filter.size() || filter[pos + 1] == '/';
+		if(!levelStart || !levelEnd || (filter[pos] == '#' && pos + 1 != filter.size()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+#endif // MQTTVALIDATION_H
@@ -21,6 +21,11 @@ void StatWriter::AddFieldToGroup(const std::string& group,
 
 void StatWriter::WriteBatch() noexcept
 {
+	if(!mServer.IsValid())
+	{
+		return;
+	}
+
 	mLogger->info("Writing batches to server");
 	for(const auto& batch : mBatchMeasurements)
 	{
@@ -32,8 +37,9 @@ void StatWriter::WriteBatch() noexcept
 		AddMeasurementsToLine(line, batch.first);
 		const auto data = line.GetLine();
 		mLogger->info("Sending {} to server", data);
-		mSocket.Send(data.c_str(), data.size(), mServerAddress.c_str(), mServerPort);
+		mSocket.Queue(data.c_str(), data.size(), mServer);
 	}
+	mSocket.Flush();
 }
 
 }
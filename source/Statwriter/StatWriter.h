@@ -79,6 +79,11 @@ public:
 	{
 		mServerAddress = addr;
 		mServerPort = port;
+		mServer = Common::UDPEndpoint(addr.c_str(), port);
+		if(!mServer.IsValid())
+		{
+			mLogger->error("Invalid InfluxDB address: {}", addr);
+		}
 	}
 
 	void SetBatchWriting(std::chrono::seconds interval) noexcept
@@ -160,6 +165,7 @@ private:
 	Common::UDPSocket mSocket;
 	std::string mServerAddress;
 	std::uint16_t mServerPort;
+	Common::UDPEndpoint mServer;
 
 	//FIXME
 	//Current implementation doesn't provide ordering for metrics written in line messages.
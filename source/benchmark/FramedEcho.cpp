@@ -0,0 +1,214 @@
+/**
+ * Framed echo over TCP loopback for the FramedSocket codecs.
+ *
+ * The client sends bursts of 64 byte frames and waits until every frame of the burst has been echoed.
+ * Batched cases encode all frames of a burst (and the server all echoes of a read) into one send,
+ * unbatched cases flush after every frame, which is what the protocol handlers did before.
+ */
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "FramedSocket.h"
+#include "StreamSocket.h"
+#include "MQTT/MQTTCodec.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t PayloadSize = 64;
+constexpr std::size_t Burst = 32;
+constexpr std::size_t Rounds = 20000;
+
+template<typename Codec>
+class EchoServer : public Common::IStreamSocketServerHandler
+				 , public Common::IStreamSocketHandler
+{
+public:
+	EchoServer(EventLoop::EventLoop& ev, bool batched, uint16_t port)
+		: mServer(ev, this)
+		, mBatched(batched)
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mServer.SetConnectionOptions(options);
+		mServer.BindAndListen(port);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final
+	{}
+
+	void OnDisconnect(Common::StreamSocket* conn) final
+	{
+		mConnections.erase(conn);
+	}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
+	{
+		auto& connection = mConnections[conn];
+		connection.mReader.Feed(data, len, [&](const Common::Frame& frame) {
+			connection.mWriter.Append(frame.mPayload);
+			if(!mBatched)
+			{
+				connection.mWriter.Flush(*conn);
+			}
+			return true;
+		});
+		connection.mWriter.Flush(*conn);
+	}
+
+private:
+	struct Connection
+	{
+		Common::FrameReader<Codec> mReader;
+		Common::FrameWriter<Codec> mWriter;
+	};
+
+	Common::StreamSocketServer mServer;
+	bool mBatched;
+	std::unordered_map<Common::StreamSocket*, Connection> mConnections;
+};
+
+template<typename Codec>
+class EchoClient : public Common::IFramedSocketHandler<Codec>
+{
+public:
+	EchoClient(EventLoop::EventLoop& ev, bool batched, const std::string& payload)
+		: mEv(ev)
+		, mSocket(ev, this)
+		, mBatched(batched)
+		, mPayload(payload)
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mSocket.GetSocket().SetOptions(options);
+	}
+
+	void Start(uint16_t port)
+	{
+		mSocket.Connect("127.0.0.1", port);
+	}
+
+	void OnConnected() final
+	{
+		mStart = Clock::now();
+		SendBurst();
+	}
+
+	void OnDisconnect(Common::FramedSocket<Codec>* /*conn*/) final
+	{
+		mEv.Stop();
+	}
+
+	void OnIncomingFrame(Common::FramedSocket<Codec>* /*conn*/, const Common::Frame& frame) final
+	{
+		if(frame.mPayload.size() != mPayload.size())
+		{
+			mErrors++;
+		}
+
+		if(++mReceived % Burst != 0)
+		{
+			return;
+		}
+
+		if(mReceived == Burst * Rounds)
+		{
+			mEnd = Clock::now();
+			mSocket.Shutdown();
+			mEv.Stop();
+			return;
+		}
+		SendBurst();
+	}
+
+	void Report(const char* name)
+	{
+		const double seconds = std::chrono::duration<double>(mEnd - mStart).count();
+		std::printf("%-34s %10.0f frames/s %8.2fus/burst%s\n", name,
+				static_cast<double>(mReceived) / seconds,
+				seconds * 1e6 / Rounds,
+				mErrors != 0 ? " (size mismatches!)" : "");
+	}
+
+private:
+	void SendBurst()
+	{
+		for(std::size_t i = 0; i < Burst; ++i)
+		{
+			mSocket.Send(mPayload);
+			if(!mBatched)
+			{
+				mSocket.Flush();
+			}
+		}
+		mSocket.Flush();
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::FramedSocket<Codec> mSocket;
+	bool mBatched;
+	std::string mPayload;
+
+	std::size_t mReceived = 0;
+	std::size_t mErrors = 0;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+};
+
+template<typename Codec>
+void RunCase(const char* name, bool batched, const std::string& payload, uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	EchoServer<Codec> server(loop, batched, port);
+	EchoClient<Codec> client(loop, batched, payload);
+	client.Start(port);
+	loop.Run();
+	client.Report(name);
+}
+
+std::string MakePublishPacket()
+{
+	const std::string topic = "bench/framed";
+	std::string packet;
+	packet.push_back(static_cast<char>(0x30));
+	packet.push_back(static_cast<char>(2 + topic.size() + PayloadSize));
+	packet.push_back(0);
+	packet.push_back(static_cast<char>(topic.size()));
+	packet += topic;
+	packet.append(PayloadSize, 'x');
+	return packet;
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	const std::string payload(PayloadSize, 'x');
+	const std::string publish = MakePublishPacket();
+
+	using LengthPrefix = Common::LengthPrefixCodec<uint32_t>;
+	using Delimiter = Common::DelimiterCodec<'\n'>;
+
+	RunCase<LengthPrefix>("LengthPrefix<uint32_t>", true, payload, 17301);
+	RunCase<Delimiter>("Delimiter<'\\n'>", true, payload, 17302);
+	RunCase<MQTT::MQTTCodec>("MQTT PUBLISH", true, publish, 17303);
+
+	RunCase<LengthPrefix>("LengthPrefix<uint32_t> unbatched", false, payload, 17304);
+	RunCase<Delimiter>("Delimiter<'\\n'> unbatched", false, payload, 17305);
+	RunCase<MQTT::MQTTCodec>("MQTT PUBLISH unbatched", false, publish, 17306);
+
+	return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * Round trip latency and throughput of TCP loopback versus unix domain sockets.
+ *
+ * Latency is a 64 byte ping-pong. Throughput streams 16KiB chunks with a window of four chunks in flight,
+ * the receiver answers every chunk with a single byte. StreamSocket::Send doesn't queue, so the window keeps
+ * the sender from overrunning the socket buffer.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t PingSize = 64;
+constexpr std::size_t PingIterations = 20000;
+
+constexpr std::size_t ChunkSize = 16 * 1024;
+constexpr std::size_t Window = 4;
+constexpr std::size_t TotalBytes = 512 * 1024 * 1024;
+
+enum class Mode
+{
+	Ping,
+	Stream
+};
+
+class Server : public Common::IStreamSocketServerHandler
+			 , public Common::IStreamSocketHandler
+{
+public:
+	Server(EventLoop::EventLoop& ev, Mode mode)
+		: mServer(ev, this)
+		, mMode(mode)
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mServer.SetConnectionOptions(options);
+	}
+
+	void Listen(const std::string& path, uint16_t port)
+	{
+		if(path.empty())
+		{
+			mServer.BindAndListen(port);
+		}
+		else
+		{
+			mServer.BindAndListenUnix(path);
+		}
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final
+	{}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* /*data*/, size_t len) final
+	{
+		const std::size_t unit = (mMode == Mode::Ping) ? PingSize : ChunkSize;
+		mReceived += len;
+		while(mReceived >= unit)
+		{
+			conn->Send(mReply.data(), (mMode == Mode::Ping) ? PingSize : 1);
+			mReceived -= unit;
+		}
+	}
+
+private:
+	Common::StreamSocketServer mServer;
+	Mode mMode;
+	std::size_t mReceived = 0;
+	std::array<char, PingSize> mReply{};
+};
+
+class Client : public Common::IStreamSocketHandler
+{
+public:
+	Client(EventLoop::EventLoop& ev, Mode mode)
+		: mEv(ev)
+		, mSocket(ev, this)
+		, mMode(mode)
+		, mChunk(ChunkSize, 'x')
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mSocket.SetOptions(options);
+		mSamples.reserve(PingIterations);
+	}
+
+	void Start(const std::string& path, uint16_t port)
+	{
+		if(path.empty())
+		{
+			mSocket.Connect("127.0.0.1", port);
+		}
+		else
+		{
+			mSocket.ConnectUnix(path);
+		}
+	}
+
+	void OnConnected() final
+	{
+		mStart = Clock::now();
+		if(mMode == Mode::Ping)
+		{
+			SendPing();
+		}
+		else
+		{
+			for(std::size_t i = 0; i < Window; ++i)
+			{
+				SendChunk();
+			}
+		}
+	}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{
+		mEv.Stop();
+	}
+
+	void OnIncomingData(Common::StreamSocket* /*conn*/, char* /*data*/, size_t len) final
+	{
+		if(mMode == Mode::Ping)
+		{
+			mReceived += len;
+			if(mReceived < PingSize)
+			{
+				return;
+			}
+			mReceived -= PingSize;
+			mSamples.push_back(Clock::now() - mSendTime);
+			if(mSamples.size() == PingIterations)
+			{
+				Finish();
+				return;
+			}
+			SendPing();
+			return;
+		}
+
+		mAcked += len * ChunkSize;
+		if(mAcked >= TotalBytes)
+		{
+			Finish();
+			return;
+		}
+		for(std::size_t i = 0; i < len && mSent < TotalBytes; ++i)
+		{
+			SendChunk();
+		}
+	}
+
+	void Report(const char* name)
+	{
+		if(mMode == Mode::Ping)
+		{
+			std::sort(mSamples.begin(), mSamples.end());
+			const auto us = [](Clock::duration d) {
+				return std::chrono::duration<double, std::micro>(d).count();
+			};
+			std::printf("%-14s round trip p50: %6.1fus p99: %6.1fus\n", name,
+					us(mSamples[mSamples.size() / 2]),
+					us(mSamples[mSamples.size() * 99 / 100]));
+		}
+		else
+		{
+			const double seconds = std::chrono::duration<double>(mEnd - mStart).count();
+			std::printf("%-14s throughput: %8.1f MiB/s\n", name,
+					static_cast<double>(mAcked) / seconds / (1024 * 1024));
+		}
+	}
+
+private:
+	void SendPing()
+	{
+		mSendTime = Clock::now();
+		mSocket.Send(mChunk.data(), PingSize);
+	}
+
+	void SendChunk()
+	{
+		mSocket.Send(mChunk.data(), ChunkSize);
+		mSent += ChunkSize;
+	}
+
+	void Finish()
+	{
+		mEnd = Clock::now();
+		mSocket.Shutdown();
+		mEv.Stop();
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::StreamSocket mSocket;
+	Mode mMode;
+	std::string mChunk;
+
+	std::size_t mReceived = 0;
+	std::size_t mSent = 0;
+	std::size_t mAcked = 0;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+	Clock::time_point mSendTime;
+	std::vector<Clock::duration> mSamples;
+};
+
+void RunCase(const char* name, Mode mode, const std::string& path, uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	Server server(loop, mode);
+	server.Listen(path, port);
+	Client client(loop, mode);
+	client.Start(path, port);
+	loop.Run();
+	client.Report(name);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	RunCase("TCP loopback", Mode::Ping, "", 17101);
+	RunCase("unix", Mode::Ping, "/tmp/commonlibs-bench.sock", 0);
+	RunCase("unix abstract", Mode::Ping, "@commonlibs-bench", 0);
+
+	RunCase("TCP loopback", Mode::Stream, "", 17102);
+	RunCase("unix", Mode::Stream, "/tmp/commonlibs-bench.sock", 0);
+	RunCase("unix abstract", Mode::Stream, "@commonlibs-bench", 0);
+
+	return 0;
+}
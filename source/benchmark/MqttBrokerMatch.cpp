@@ -0,0 +1,197 @@
+/**
+ * Routing in MQTTBroker with 1M subscriptions.
+ *
+ * 10k clients hold 100 subscriptions each, a mix of exact, '+' and '#' filters over 250k devices. First the cost of
+ * adding them to MQTTSubscriptionTrie and the memory it takes, then the time to match a topic against all of them,
+ * compared with MQTTTopicTrie which keeps every level by name in a map of its parent. At last dropping a client:
+ * through the subscriptions it holds, against scanning the subscribers of every filter as the broker did before.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "MQTT/MQTTSubscriptionTrie.h"
+#include "MQTT/MQTTTopicTrie.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Devices = 250000;
+constexpr std::size_t Subscriptions = 4 * Devices;
+constexpr std::size_t Clients = 10000;
+constexpr std::size_t Topics = 1000000;
+constexpr std::size_t Rounds = 3;
+
+using Trie = MQTT::MQTTSubscriptionTrie<int>;
+
+std::string Device(std::size_t device)
+{
+	return "site/building-" + std::to_string(device % 16) + "/device-" + std::to_string(device);
+}
+
+std::vector<std::string> MakeFilters()
+{
+	std::vector<std::string> filters;
+	filters.reserve(Subscriptions);
+	for(std::size_t i = 0; i < Devices; ++i)
+	{
+		const std::string device = Device(i);
+		filters.push_back(device + "/temperature/state");
+		filters.push_back(device + "/humidity/state");
+		filters.push_back(device + "/+/state");
+		filters.push_back(device + "/#");
+	}
+	return filters;
+}
+
+std::vector<std::string> MakeTopics()
+{
+	static constexpr const char* Properties[] = {"temperature", "humidity", "battery", "firmware"};
+	std::mt19937 random(7);
+	std::vector<std::string> topics;
+	topics.reserve(Topics);
+	for(std::size_t i = 0; i < Topics; ++i)
+	{
+		// A fifth of the messages come from devices nobody subscribed to
+		topics.push_back(Device(random() % (Devices + Devices / 4)) + "/" + Properties[random() % 4] + "/state");
+	}
+	return topics;
+}
+
+double ResidentMB()
+{
+	long pages = 0;
+	long resident = 0;
+	if(std::FILE* statm = std::fopen("/proc/self/statm", "r"))
+	{
+		if(std::fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+		{
+			resident = 0;
+		}
+		std::fclose(statm);
+	}
+	return resident * static_cast<double>(::sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+
+template<typename Func>
+double BestNsPerTopic(const std::vector<std::string>& topics, std::size_t& matches, Func&& func)
+{
+	double best = 1e12;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		matches = 0;
+		const auto start = Clock::now();
+		for(const auto& topic : topics)
+		{
+			matches += func(topic);
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		best = std::min(best, ns / topics.size());
+	}
+	return best;
+}
+
+}
+
+int main()
+{
+	const auto filters = MakeFilters();
+	const auto topics = MakeTopics();
+	std::printf("%zu subscriptions of %zu clients, %zu topics\n", Subscriptions, Clients, Topics);
+
+	// Handles by subscription, the client of subscription i is i % Clients
+	double memory = ResidentMB();
+	Trie trie;
+	std::vector<Trie::Handle> handles(Subscriptions);
+	auto start = Clock::now();
+	for(std::size_t i = 0; i < Subscriptions; ++i)
+	{
+		trie.Subscribe(filters[i], static_cast<int>(i % Clients), handles[i]);
+	}
+	std::printf("  %-34s %10.1f ns/subscription %8.0f MB, %zu level names\n", "MQTTSubscriptionTrie subscribe",
+			std::chrono::duration<double, std::nano>(Clock::now() - start).count() / Subscriptions,
+			ResidentMB() - memory, trie.GetTokenCount());
+
+	memory = ResidentMB();
+	MQTT::MQTTTopicTrie<std::vector<int>> namedTrie;
+	start = Clock::now();
+	for(std::size_t i = 0; i < Subscriptions; ++i)
+	{
+		namedTrie.Insert(filters[i]).push_back(static_cast<int>(i % Clients));
+	}
+	std::printf("  %-34s %10.1f ns/subscription %8.0f MB\n", "MQTTTopicTrie insert",
+			std::chrono::duration<double, std::nano>(Clock::now() - start).count() / Subscriptions,
+			ResidentMB() - memory);
+
+	std::size_t internedMatches = 0;
+	const double internedNs = BestNsPerTopic(topics, internedMatches, [&trie](const std::string& topic) {
+		std::size_t count = 0;
+		trie.Match(topic, [&count](int) { ++count; });
+		return count;
+	});
+	std::size_t namedMatches = 0;
+	const double namedNs = BestNsPerTopic(topics, namedMatches, [&namedTrie](const std::string& topic) {
+		std::size_t count = 0;
+		namedTrie.Match(topic, [&count](const std::vector<int>& clients) { count += clients.size(); });
+		return count;
+	});
+	std::printf("Matching, %.2f subscribers per topic\n", static_cast<double>(internedMatches) / Topics);
+	std::printf("  %-34s %10.1f ns/topic\n", "MQTTSubscriptionTrie", internedNs);
+	std::printf("  %-34s %10.1f ns/topic%s\n", "MQTTTopicTrie", namedNs,
+			namedMatches == internedMatches ? "" : "  MISMATCH");
+
+	// The spread of single matches, timing each one adds the clock to every sample
+	std::vector<double> samples;
+	samples.reserve(Topics);
+	for(const auto& topic : topics)
+	{
+		std::size_t count = 0;
+		const auto matchStart = Clock::now();
+		trie.Match(topic, [&count](int) { ++count; });
+		samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - matchStart).count());
+	}
+	std::sort(samples.begin(), samples.end());
+	std::printf("  %-34s p50 %.0f ns  p99 %.0f ns  p99.9 %.0f ns  max %.0f ns\n", "MQTTSubscriptionTrie, each",
+			samples[samples.size() / 2], samples[samples.size() * 99 / 100], samples[samples.size() * 999 / 1000],
+			samples.back());
+
+	// Dropping clients, each one holds Subscriptions / Clients filters
+	std::unordered_map<std::string, std::vector<int>> byFilter;
+	for(std::size_t i = 0; i < Subscriptions; ++i)
+	{
+		byFilter[filters[i]].push_back(static_cast<int>(i % Clients));
+	}
+	constexpr std::size_t Dropped = 1000;
+	start = Clock::now();
+	for(std::size_t client = 0; client < Dropped; ++client)
+	{
+		for(std::size_t i = client; i < Subscriptions; i += Clients)
+		{
+			trie.Unsubscribe(handles[i]);
+		}
+	}
+	const double reverseUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / Dropped;
+	constexpr std::size_t Scanned = 10;
+	start = Clock::now();
+	for(std::size_t client = 0; client < Scanned; ++client)
+	{
+		for(auto& subscribers : byFilter)
+		{
+			auto& clients = subscribers.second;
+			clients.erase(std::remove(clients.begin(), clients.end(), static_cast<int>(client)), clients.end());
+		}
+	}
+	const double scanUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / Scanned;
+	std::printf("Dropping a client with %zu subscriptions\n", Subscriptions / Clients);
+	std::printf("  %-34s %10.1f us/client, %zu subscriptions left\n", "through its subscriptions", reverseUs,
+			trie.GetSize());
+	std::printf("  %-34s %10.1f us/client\n", "scanning every filter", scanUs);
+	return 0;
+}
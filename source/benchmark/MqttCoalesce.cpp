@@ -0,0 +1,208 @@
+/**
+ * Send system calls per PUBLISH with and without MQTTClient::SetCoalescing.
+ *
+ * An MQTTClient publishes bursts of small messages, one burst per timer tick, over TCP loopback to a server that
+ * answers CONNACK and PUBACK like MQTTBroker and counts what it receives. ::send is replaced in this executable to
+ * count the calls made on the client's socket and the time spent in them. For bursts of one message the delay from
+ * Publish() until its send shows that coalescing doesn't hold a lone message back.
+ */
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+#include "MQTT/MQTTClient.h"
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Ticks = 100;
+constexpr std::size_t PayloadSize = 64;
+constexpr char Topic[] = "site/building-1/floor-2/room-3/sensor/temperature";
+
+/// The client sends CONNECT before the server sends anything, the first socket that sends is the client's
+int gClientFd = -1;
+std::size_t gSends = 0;
+Clock::duration gSendTime{};
+Clock::time_point gLastSend;
+
+}
+
+extern "C" ssize_t send(int fd, const void* buf, size_t len, int flags)
+{
+	if(gClientFd == -1)
+	{
+		gClientFd = fd;
+	}
+	const auto start = Clock::now();
+	const ssize_t result = ::syscall(SYS_sendto, fd, buf, len, flags, nullptr, 0);
+	if(fd == gClientFd)
+	{
+		gLastSend = Clock::now();
+		gSendTime += gLastSend - start;
+		++gSends;
+	}
+	return result;
+}
+
+namespace {
+
+/**
+ * @brief Accepts one client, answers CONNACK and PUBACK and counts the PUBLISH packets it receives
+ */
+class CountingServer : public Common::IStreamSocketServerHandler
+					 , public Common::IStreamSocketHandler
+{
+public:
+	CountingServer(EventLoop::EventLoop& ev, std::uint16_t port, std::size_t expected)
+		: mEv(ev)
+		, mServer(ev, this)
+		, mExpected(expected)
+	{
+		mServer.BindAndListen(port);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final {}
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final {}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
+	{
+		mParser.Feed(data, len, [this, conn](const char* packet, std::size_t size) {
+			const MQTT::MQTTPacket decoded(packet, size);
+			if(const auto* connect = decoded.GetConnectPacket())
+			{
+				const auto connack = MQTT::MQTTConnackPacket(*connect, false).GetMessage();
+				conn->Send(connack.data(), connack.size());
+			}
+			else if(const auto* publish = decoded.GetPublishPacket())
+			{
+				if(publish->GetQoS() == 1)
+				{
+					const auto puback = MQTT::MQTTPublishAckPacket(MQTT::MQTTPacketType::PUBACK, publish->GetPacketId()).GetMessage();
+					conn->Send(puback.data(), puback.size());
+				}
+				if(++mPublishes == mExpected)
+				{
+					mEv.Stop();
+				}
+			}
+			return true;
+		});
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::StreamSocketServer mServer;
+	MQTT::MQTTParser mParser;
+	std::size_t mExpected;
+	std::size_t mPublishes = 0;
+};
+
+class NullHandler : public MQTT::IMQTTClientHandler
+{
+public:
+	void OnConnected() final {}
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final {}
+};
+
+void RunCase(std::size_t burst, int qos, bool coalescing, std::uint16_t port)
+{
+	const std::size_t messages = burst * Ticks;
+	EventLoop::EventLoop loop;
+	CountingServer server(loop, port, messages);
+	NullHandler handler;
+	MQTT::MQTTClient client(loop, &handler);
+	client.Initialise("coalesce-benchmark", {});
+	client.SetCoalescing(coalescing);
+	client.SetInFlightWindow(1024);
+	gClientFd = -1;
+	client.Connect("127.0.0.1", port);
+
+	const std::string payload(PayloadSize, 'x');
+	std::size_t sent = 0;
+	std::size_t sendsBefore = 0;
+	Clock::duration sendTimeBefore{};
+	Clock::duration maxDelay{};
+	EventLoop::EventLoop::Timer publisher(1ms, EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		if(!client.IsConnected() || sent == messages)
+		{
+			return;
+		}
+		if(sent == 0)
+		{
+			// CONNECT is not counted
+			sendsBefore = gSends;
+			sendTimeBefore = gSendTime;
+		}
+		const auto published = Clock::now();
+		const std::size_t sendsAtPublish = gSends;
+		for(std::size_t i = 0; i < burst; ++i, ++sent)
+		{
+			client.Publish(Topic, payload, qos);
+		}
+		if(burst == 1)
+		{
+			loop.SheduleForNextCycle([&, published, sendsAtPublish]() {
+				// Runs after the flush the client scheduled, a message that wasn't sent by then is held back
+				maxDelay = std::max(maxDelay, gSends != sendsAtPublish ? gLastSend - published : Clock::duration::max());
+			});
+		}
+	});
+	EventLoop::EventLoop::Timer timeout(30s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+		loop.Stop();
+	});
+	loop.AddTimer(&publisher);
+	loop.AddTimer(&timeout);
+	loop.Run();
+	loop.RemoveTimer(&publisher);
+	loop.RemoveTimer(&timeout);
+
+	const std::size_t sends = gSends - sendsBefore;
+	const double sendNs = std::chrono::duration<double, std::nano>(gSendTime - sendTimeBefore).count();
+	std::printf("  QoS %d  burst %5zu  %-16s %7.3f sends/msg  %8.0f ns/msg in send",
+			qos, burst, coalescing ? "coalescing" : "send per packet",
+			static_cast<double>(sends) / messages,
+			sendNs / messages);
+	if(burst == 1)
+	{
+		std::printf("  %6.1f us max publish to send", std::chrono::duration<double, std::micro>(maxDelay).count());
+	}
+	std::printf("%s\n", server.mPublishes == messages ? "" : "  INCOMPLETE");
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	std::printf("%zu ticks of a burst of %zuB messages per case\n", Ticks, PayloadSize);
+	std::uint16_t port = 18970;
+	for(const int qos : {0, 1})
+	{
+		for(const std::size_t burst : std::initializer_list<std::size_t>{1, 10, 100, 500})
+		{
+			RunCase(burst, qos, false, port++);
+			RunCase(burst, qos, true, port++);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * MQTT packet encoding, heap allocations and time per packet.
+ *
+ * Operator new is counted for the whole process. Each case encodes a million packets: the vector built with
+ * push_back that GetMessage returned before, GetMessage now, Encode into a reused buffer, and for PUBLISH the
+ * static Encode straight from the topic and payload as MQTTClient::Publish does, with and without constructing
+ * the packet per message. Every encoding is compared against GetMessage.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MQTT/MQTTPacket.h"
+
+namespace {
+
+std::atomic<std::size_t> Allocations{0};
+
+}
+
+void* operator new(std::size_t size)
+{
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	if(void* p = std::malloc(size == 0 ? 1 : size))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Iterations = 1000000;
+const std::string Topic = "site/building/floor/room/sensor/metric";
+
+/**
+ * @brief PUBLISH as GetMessage built it before, growing a vector byte by byte
+ */
+std::vector<char> LegacyPublishMessage(const std::string& topic, const std::string& payload)
+{
+	std::vector<char> message;
+	message.push_back(static_cast<char>(static_cast<std::uint8_t>(MQTT::MQTTPacketType::PUBLISH) << 4));
+	std::size_t length = 2 + topic.size() + payload.size();
+	do
+	{
+		char byte = length & 0x7F;
+		length >>= 7;
+		if(length != 0)
+		{
+			byte |= 0x80;
+		}
+		message.push_back(byte);
+	} while(length != 0);
+
+	message.push_back(static_cast<char>(topic.size() >> 8));
+	message.push_back(static_cast<char>(topic.size() & 0xFF));
+	message.insert(std::end(message), std::begin(topic), std::end(topic));
+	message.insert(std::end(message), std::begin(payload), std::end(payload));
+	return message;
+}
+
+/**
+ * @brief Run @p encode, which returns the encoded bytes, and compare its last output with @p expected
+ */
+template<typename Encode>
+void RunCase(const char* name, const std::vector<char>& expected, Encode&& encode)
+{
+	std::size_t checksum = 0;
+	const std::size_t allocationsBefore = Allocations.load();
+	const auto start = Clock::now();
+	const char* last = nullptr;
+	std::size_t lastSize = 0;
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto encoded = encode();
+		last = encoded.first;
+		lastSize = encoded.second;
+		checksum += lastSize + static_cast<std::uint8_t>(last[lastSize - 1]);
+	}
+	const auto elapsed = Clock::now() - start;
+	const std::size_t allocations = Allocations.load() - allocationsBefore;
+
+	const bool valid = lastSize == expected.size() && std::equal(last, last + lastSize, expected.data()) &&
+		checksum != 0;
+	std::printf("  %-34s %8.1f ns/packet  %5.2f allocations/packet  %s\n",
+			name,
+			std::chrono::duration<double, std::nano>(elapsed).count() / Iterations,
+			static_cast<double>(allocations) / Iterations,
+			valid ? "ok" : "MISMATCH");
+}
+
+using Encoded = std::pair<const char*, std::size_t>;
+
+void PublishCases(std::size_t payloadSize)
+{
+	const std::string payload(payloadSize, 'x');
+	const MQTT::MQTTPublishPacket publish(1, Topic, payload, std::nullopt);
+	const auto expected = publish.GetMessage();
+	std::printf("PUBLISH %zuB topic, %zuB payload, %zuB packet\n", Topic.size(), payloadSize, expected.size());
+
+	std::vector<char> message;
+	RunCase("packet + push_back vector (before)", expected, [&]() {
+		const MQTT::MQTTPublishPacket packet(1, Topic, payload, std::nullopt);
+		message = LegacyPublishMessage(packet.GetTopicFilter(), packet.GetTopicPayload());
+		return Encoded(message.data(), message.size());
+	});
+	RunCase("packet + GetMessage", expected, [&]() {
+		message = MQTT::MQTTPublishPacket(1, Topic, payload, std::nullopt).GetMessage();
+		return Encoded(message.data(), message.size());
+	});
+
+	std::vector<char> buffer(expected.size());
+	const Common::Span<char> span(buffer.data(), buffer.size());
+	RunCase("packet + Encode, reused buffer", expected, [&]() {
+		const MQTT::MQTTPublishPacket packet(1, Topic, payload, std::nullopt);
+		return Encoded(buffer.data(), packet.Encode(span));
+	});
+	RunCase("static Encode, reused buffer", expected, [&]() {
+		return Encoded(buffer.data(), MQTT::MQTTPublishPacket::Encode(span, 1, Topic, payload, 0));
+	});
+
+	// A batch of 64 packets per buffer, as a connection would collect them before one send
+	std::vector<char> pool;
+	std::size_t batched = 0;
+	RunCase("AppendMessage, pooled buffer", expected, [&]() {
+		if(batched++ % 64 == 0)
+		{
+			pool.clear();
+		}
+		const std::size_t size = MQTT::AppendMessage(pool, publish);
+		return Encoded(pool.data() + pool.size() - size, size);
+	});
+}
+
+template<typename Packet>
+void PacketCases(const char* name, const Packet& packet)
+{
+	const auto expected = MQTT::MakeMessage(packet);
+	std::printf("%s %zuB\n", name, expected.size());
+
+	std::vector<char> message;
+	RunCase("GetMessage / MakeMessage", expected, [&]() {
+		message = MQTT::MakeMessage(packet);
+		return Encoded(message.data(), message.size());
+	});
+
+	std::vector<char> buffer(expected.size());
+	RunCase("Encode, reused buffer", expected, [&]() {
+		return Encoded(buffer.data(), packet.Encode(Common::Span<char>(buffer.data(), buffer.size())));
+	});
+}
+
+}
+
+int main()
+{
+	for(const std::size_t payloadSize : std::initializer_list<std::size_t>{16, 256, 4096})
+	{
+		PublishCases(payloadSize);
+	}
+
+	PacketCases("CONNECT", MQTT::MQTTConnectPacket(60, "load-generator-client-0001", true));
+	PacketCases("SUBSCRIBE", MQTT::MQTTSubscribePacket(1, Topic));
+
+	// Fixed size packets are built at compile time
+	static constexpr MQTT::MQTTPingRequestPacket ping;
+	static_assert(ping.GetMessage()[0] == static_cast<char>(0xC0));
+	PacketCases("PINGREQ", ping);
+	PacketCases("SUBACK", MQTT::MQTTSubackPacket(7, 0));
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/**
+ * MQTT packets decoded per second, per packet type.
+ *
+ * The corpus is a generated mix of every packet type the decoder handles, with topics and payloads of varied size,
+ * or the files in the directories given as arguments, e.g. the corpus MqttPacketFuzz built. Files are in the fuzz
+ * target's format, the first byte is skipped and the rest is split into packets with MQTTParser.
+ *
+ * The packets of each type are laid out back to back and fed to MQTTParser in 64KiB reads, every packet is then
+ * decoded with MQTTPacket, and PUBLISH also with MQTTPublishView as the client and broker do.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t PacketsPerType = 100000;
+constexpr std::size_t ReadSize = 64 * 1024;
+constexpr std::size_t Rounds = 5;
+
+const char* TypeName(MQTT::MQTTPacketType type)
+{
+	switch(type)
+	{
+		case MQTT::MQTTPacketType::CONNECT: return "CONNECT";
+		case MQTT::MQTTPacketType::CONNACK: return "CONNACK";
+		case MQTT::MQTTPacketType::PUBLISH: return "PUBLISH";
+		case MQTT::MQTTPacketType::PUBACK: return "PUBACK";
+		case MQTT::MQTTPacketType::PUBREC: return "PUBREC";
+		case MQTT::MQTTPacketType::PUBREL: return "PUBREL";
+		case MQTT::MQTTPacketType::PUBCOMP: return "PUBCOMP";
+		case MQTT::MQTTPacketType::SUBSCRIBE: return "SUBSCRIBE";
+		case MQTT::MQTTPacketType::SUBACK: return "SUBACK";
+		case MQTT::MQTTPacketType::UNSUBSCRIBE: return "UNSUBSCRIBE";
+		case MQTT::MQTTPacketType::UNSUBACK: return "UNSUBACK";
+		case MQTT::MQTTPacketType::PINGREQ: return "PINGREQ";
+		case MQTT::MQTTPacketType::PINGRESP: return "PINGRESP";
+		case MQTT::MQTTPacketType::DISCONNECT: return "DISCONNECT";
+	}
+	return "reserved";
+}
+
+struct Corpus
+{
+	std::vector<char> mStream;
+	std::size_t mPackets = 0;
+};
+
+using Corpora = std::map<MQTT::MQTTPacketType, Corpus>;
+
+void Add(Corpora& corpora, const char* packet, std::size_t len)
+{
+	auto& corpus = corpora[static_cast<MQTT::MQTTPacketType>(static_cast<std::uint8_t>(packet[0]) >> 4)];
+	corpus.mStream.insert(std::end(corpus.mStream), packet, packet + len);
+	++corpus.mPackets;
+}
+
+template<typename Packet>
+void Add(Corpora& corpora, const Packet& packet)
+{
+	const auto message = MQTT::MakeMessage(packet);
+	Add(corpora, message.data(), message.size());
+}
+
+std::string RandomTopic(std::mt19937& random)
+{
+	std::string topic;
+	const std::size_t levels = 1 + random() % 6;
+	for(std::size_t level = 0; level < levels; ++level)
+	{
+		topic += (level ? "/" : "") + std::string(1 + random() % 12, static_cast<char>('a' + random() % 26));
+	}
+	return topic;
+}
+
+Corpora GenerateCorpora()
+{
+	std::mt19937 random(42);
+	Corpora corpora;
+	for(std::size_t i = 0; i < PacketsPerType; ++i)
+	{
+		const auto id = static_cast<std::uint16_t>(i);
+		// Mostly small telemetry, every 100th message a larger one
+		const std::string payload(i % 100 == 0 ? 4096 : random() % 256, 'x');
+		Add(corpora, MQTT::MQTTPublishPacket(id, RandomTopic(random), payload, static_cast<int>(i % 3)));
+		Add(corpora, MQTT::MQTTConnectPacket(60, "client-" + std::to_string(i), true));
+		Add(corpora, MQTT::MQTTSubscribePacket(id, RandomTopic(random)));
+		Add(corpora, MQTT::MQTTUnsubscribePacket(id, RandomTopic(random)));
+		Add(corpora, MQTT::MQTTSubackPacket(id, 0));
+		Add(corpora, MQTT::MQTTUnsubackPacket(id));
+		Add(corpora, MQTT::MQTTConnackPacket(false));
+		Add(corpora, MQTT::MQTTPingRequestPacket());
+		Add(corpora, MQTT::MQTTPingResponsePacket());
+		Add(corpora, MQTT::MQTTDisconnectPacket());
+	}
+	return corpora;
+}
+
+Corpora LoadCorpora(int argc, char** argv)
+{
+	Corpora corpora;
+	for(int arg = 1; arg < argc; ++arg)
+	{
+		for(const auto& entry : std::filesystem::directory_iterator(argv[arg]))
+		{
+			std::ifstream file(entry.path(), std::ios::binary);
+			const std::vector<char> input{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+			if(input.size() < 2)
+			{
+				continue;
+			}
+			MQTT::MQTTParser parser;
+			parser.Feed(input.data() + 1, input.size() - 1, [&corpora](const char* packet, std::size_t len) {
+				Add(corpora, packet, len);
+				return true;
+			});
+		}
+	}
+	return corpora;
+}
+
+void RunCase(MQTT::MQTTPacketType type, const Corpus& corpus)
+{
+	Clock::duration best = Clock::duration::max();
+	std::size_t packets = 0;
+	std::size_t valid = 0;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		packets = 0;
+		valid = 0;
+		MQTT::MQTTParser parser;
+		const auto start = Clock::now();
+		for(std::size_t offset = 0; offset < corpus.mStream.size(); offset += ReadSize)
+		{
+			const std::size_t len = std::min(ReadSize, corpus.mStream.size() - offset);
+			parser.Feed(corpus.mStream.data() + offset, len, [&](const char* data, std::size_t size) {
+				++packets;
+				if(type == MQTT::MQTTPacketType::PUBLISH)
+				{
+					valid += MQTT::MQTTPublishView(data, size).IsValid();
+				}
+				else
+				{
+					valid += MQTT::MQTTPacket(data, size).IsValid();
+				}
+				return true;
+			});
+		}
+		best = std::min(best, Clock::now() - start);
+	}
+
+	const double seconds = std::chrono::duration<double>(best).count();
+	std::printf("  %-12s %8zu packets  %6.1fB average  %12.0f packets/s  %8.1f MiB/s  %zu invalid%s\n",
+			TypeName(type),
+			corpus.mPackets,
+			static_cast<double>(corpus.mStream.size()) / corpus.mPackets,
+			packets / seconds,
+			corpus.mStream.size() / seconds / (1024 * 1024),
+			packets - valid,
+			packets == corpus.mPackets ? "" : "  MISMATCH");
+
+	// The full decode with copies for PUBLISH as well, as MQTTPacket did it for every packet before
+	if(type == MQTT::MQTTPacketType::PUBLISH)
+	{
+		MQTT::MQTTParser parser;
+		std::size_t copied = 0;
+		const auto start = Clock::now();
+		for(std::size_t offset = 0; offset < corpus.mStream.size(); offset += ReadSize)
+		{
+			const std::size_t len = std::min(ReadSize, corpus.mStream.size() - offset);
+			parser.Feed(corpus.mStream.data() + offset, len, [&copied](const char* data, std::size_t size) {
+				copied += MQTT::MQTTPacket(data, size).IsValid();
+				return true;
+			});
+		}
+		const double copySeconds = std::chrono::duration<double>(Clock::now() - start).count();
+		std::printf("  %-12s %8zu packets  %6s          %12.0f packets/s  %8.1f MiB/s  (MQTTPacket, copies)\n",
+				"PUBLISH", copied, "",
+				corpus.mPackets / copySeconds,
+				corpus.mStream.size() / copySeconds / (1024 * 1024));
+	}
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	const Corpora corpora = argc > 1 ? LoadCorpora(argc, argv) : GenerateCorpora();
+	std::printf("%s corpus, parsed in %zuB reads\n", argc > 1 ? "Loaded" : "Generated", ReadSize);
+	for(const auto& [type, corpus] : corpora)
+	{
+		RunCase(type, corpus);
+	}
+	return 0;
+}
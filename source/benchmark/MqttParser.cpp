@@ -0,0 +1,119 @@
+/**
+ * MQTT stream parsing at different read sizes.
+ *
+ * A stream of PUBLISH packets, mostly small with every 64th one 100KiB, is fed to MQTTParser in chunks of a fixed
+ * size, from one byte at a time up to the whole stream at once, the way reads of that size would deliver it. Every
+ * packet is checked for its sequence number and size. The FrameReader with MQTTCodec that FramedSocket uses is run
+ * on the same chunks for comparison.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "FramedSocket.h"
+#include "MQTT/MQTTCodec.h"
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Packets = 200000;
+constexpr std::size_t LargeEvery = 64;
+constexpr std::size_t SmallPayload = 48;
+constexpr std::size_t LargePayload = 100 * 1024;
+constexpr std::size_t Rounds = 3;
+const std::string Topic = "sensors/temperature";
+
+/**
+ * @brief The sequence number is the first 4 bytes of the payload
+ */
+std::vector<char> BuildStream(std::vector<std::size_t>& sizes)
+{
+	std::vector<char> stream;
+	for(std::uint32_t i = 0; i < Packets; ++i)
+	{
+		std::string payload(i % LargeEvery == LargeEvery - 1 ? LargePayload : SmallPayload, 'x');
+		std::memcpy(payload.data(), &i, sizeof(i));
+		const auto message = MQTT::MQTTPublishPacket(1, Topic, payload, std::nullopt).GetMessage();
+		sizes.push_back(message.size());
+		stream.insert(std::end(stream), std::begin(message), std::end(message));
+	}
+	return stream;
+}
+
+struct Checker
+{
+	explicit Checker(const std::vector<std::size_t>& sizes)
+		: mSizes(sizes)
+	{}
+
+	bool operator()(const char* packet, std::size_t len)
+	{
+		const MQTT::MQTTFixedHeader header(packet, len);
+		std::uint32_t sequence;
+		std::memcpy(&sequence, packet + header.GetHeaderSize() + 2 + Topic.size(), sizeof(sequence));
+		mErrors += (mPackets >= mSizes.size()) || len != mSizes[mPackets] || sequence != mPackets;
+		++mPackets;
+		return true;
+	}
+
+	const std::vector<std::size_t>& mSizes;
+	std::size_t mPackets = 0;
+	std::size_t mErrors = 0;
+};
+
+template<typename Feed>
+void RunCase(const char* name, std::size_t chunk, const std::vector<char>& stream, const std::vector<std::size_t>& sizes, Feed&& feed)
+{
+	Clock::duration best = Clock::duration::max();
+	std::size_t errors = 0;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		Checker checker(sizes);
+		const auto start = Clock::now();
+		for(std::size_t offset = 0; offset < stream.size(); offset += chunk)
+		{
+			feed(stream.data() + offset, std::min(chunk, stream.size() - offset), checker);
+		}
+		best = std::min(best, Clock::now() - start);
+		errors += checker.mErrors + (checker.mPackets != Packets);
+	}
+
+	const double seconds = std::chrono::duration<double>(best).count();
+	std::printf("%-12s chunk %8zu  %10.0f packets/s  %8.1f MiB/s  errors: %zu\n",
+			name, chunk,
+			Packets / seconds,
+			stream.size() / seconds / (1024 * 1024),
+			errors);
+}
+
+}
+
+int main()
+{
+	std::vector<std::size_t> sizes;
+	const auto stream = BuildStream(sizes);
+	std::printf("%zu packets, %.1f MiB\n", Packets, stream.size() / (1024.0 * 1024.0));
+
+	for(const std::size_t chunk : std::initializer_list<std::size_t>{1, 7, 64, 1500, 16384, 65536, stream.size()})
+	{
+		MQTT::MQTTParser parser;
+		RunCase("MQTTParser", chunk, stream, sizes, [&parser](const char* data, std::size_t len, Checker& checker) {
+			parser.Feed(data, len, checker);
+		});
+
+		Common::FrameReader<MQTT::MQTTCodec> reader;
+		RunCase("FrameReader", chunk, stream, sizes, [&reader](const char* data, std::size_t len, Checker& checker) {
+			reader.Feed(data, len, [&checker](const Common::Frame& frame) {
+				return checker(frame.mFrame.data(), frame.mFrame.size());
+			});
+		});
+	}
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/**
+ * Bytes copied per inbound MQTT message.
+ *
+ * A stream of PUBLISH packets is passed to MQTTClient::OnIncomingData in chunks of the given size, as reads from
+ * the connection would deliver it, with a handler overriding either the string or the view OnPublish overload.
+ * The decode MQTTClient did before, an MQTTPacket with topic and payload returned by value, is run on the same
+ * packets for comparison.
+ *
+ * Copies are counted as the bytes requested from operator new, which covers every std::string made of the topic
+ * or payload as they are longer than the small string buffer, plus the packets the parser had to reassemble
+ * because they were split over two chunks.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTClient.h"
+#include "MQTT/MQTTPacket.h"
+
+namespace {
+
+std::atomic<std::size_t> AllocatedBytes{0};
+
+}
+
+void* operator new(std::size_t size)
+{
+	AllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	if(void* p = std::malloc(size == 0 ? 1 : size))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+// Not inlined, GCC would flag free() on pointers it assumes came from the default operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Messages = 100000;
+const std::string Topic = "site/building/floor/room/sensor/metric";
+
+struct Stream
+{
+	std::vector<char> mData;
+	std::size_t mPayloadSize;
+	std::size_t mPacketSize;
+
+	/**
+	 * @brief Bytes the parser copies to reassemble the packets that cross a chunk boundary
+	 */
+	std::size_t ReassembledBytes(std::size_t chunk) const noexcept
+	{
+		std::size_t bytes = 0;
+		for(std::size_t offset = 0; offset < mData.size(); offset += mPacketSize)
+		{
+			if(offset / chunk != (offset + mPacketSize - 1) / chunk)
+			{
+				bytes += mPacketSize;
+			}
+		}
+		return bytes;
+	}
+};
+
+Stream BuildStream(std::size_t payloadSize)
+{
+	Stream stream{{}, payloadSize, MQTT::MQTTPublishPacket::GetEncodedSize(Topic.size(), payloadSize, 0)};
+	const std::string payload(payloadSize, 'x');
+	for(std::size_t i = 0; i < Messages; ++i)
+	{
+		MQTT::AppendMessage(stream.mData, MQTT::MQTTPublishPacket(1, Topic, payload, std::nullopt));
+	}
+	return stream;
+}
+
+class StringHandler : public MQTT::IMQTTClientHandler
+{
+public:
+	void OnConnected() final {}
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final {}
+
+	void OnPublish(const std::string& topic, const std::string& msg) final
+	{
+		mBytes += topic.size() + msg.size();
+		++mMessages;
+	}
+
+	std::size_t mBytes = 0;
+	std::size_t mMessages = 0;
+};
+
+class ViewHandler : public MQTT::IMQTTClientHandler
+{
+public:
+	void OnConnected() final {}
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final {}
+
+	void OnPublish(std::string_view topic, Common::Span<const char> payload) final
+	{
+		mBytes += topic.size() + payload.size();
+		++mMessages;
+	}
+
+	std::size_t mBytes = 0;
+	std::size_t mMessages = 0;
+};
+
+void Report(const char* name, std::size_t chunk, Clock::duration elapsed, std::size_t copied, std::size_t messages,
+		std::size_t bytes, const Stream& stream)
+{
+	const bool valid = messages == Messages && bytes == Messages * (Topic.size() + stream.mPayloadSize);
+	std::printf("  %-28s chunk %6zu  %8.1f ns/msg  %9.1f bytes copied/msg  %s\n",
+			name, chunk,
+			std::chrono::duration<double, std::nano>(elapsed).count() / Messages,
+			static_cast<double>(copied) / Messages,
+			valid ? "ok" : "MISMATCH");
+}
+
+/**
+ * @brief How MQTTClient decoded a PUBLISH before, fed whole packets as it could not handle split ones
+ */
+void LegacyCase(const Stream& stream)
+{
+	StringHandler handler;
+	const std::size_t allocatedBefore = AllocatedBytes.load();
+	const auto start = Clock::now();
+	for(std::size_t offset = 0; offset < stream.mData.size(); )
+	{
+		const MQTT::MQTTPacket packet(stream.mData.data() + offset, stream.mData.size() - offset);
+		const auto* publish = packet.GetPublishPacket();
+		// The getters returned copies
+		const std::string topic = publish->GetTopicFilter();
+		const std::string payload = publish->GetTopicPayload();
+		handler.OnPublish(topic, payload);
+		offset += packet.mFixedHeader.GetPacketSize();
+	}
+	const auto elapsed = Clock::now() - start;
+	Report("MQTTPacket (before)", 0, elapsed, AllocatedBytes.load() - allocatedBefore, handler.mMessages, handler.mBytes,
+			stream);
+}
+
+template<typename Handler>
+void ClientCase(const char* name, EventLoop::EventLoop& loop, const Stream& stream, std::size_t chunk)
+{
+	Handler handler;
+	MQTT::MQTTClient client(loop, &handler);
+	// Marks the connection as up, the CONNECT it tries to send goes nowhere
+	client.OnConnected();
+
+	const std::size_t allocatedBefore = AllocatedBytes.load();
+	const auto start = Clock::now();
+	for(std::size_t offset = 0; offset < stream.mData.size(); offset += chunk)
+	{
+		const std::size_t len = std::min(chunk, stream.mData.size() - offset);
+		client.OnIncomingData(nullptr, const_cast<char*>(stream.mData.data()) + offset, len);
+	}
+	const auto elapsed = Clock::now() - start;
+	const std::size_t copied = AllocatedBytes.load() - allocatedBefore + stream.ReassembledBytes(chunk);
+	Report(name, chunk, elapsed, copied, handler.mMessages, handler.mBytes, stream);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+	EventLoop::EventLoop loop;
+
+	for(const std::size_t payloadSize : std::initializer_list<std::size_t>{64, 1024, 16384})
+	{
+		const Stream stream = BuildStream(payloadSize);
+		std::printf("PUBLISH %zuB topic, %zuB payload\n", Topic.size(), payloadSize);
+		LegacyCase(stream);
+		for(const std::size_t chunk : std::initializer_list<std::size_t>{1500, 65536})
+		{
+			ClientCase<StringHandler>("MQTTClient, string handler", loop, stream, chunk);
+			ClientCase<ViewHandler>("MQTTClient, view handler", loop, stream, chunk);
+		}
+	}
+
+	return 0;
+}
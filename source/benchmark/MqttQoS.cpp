@@ -0,0 +1,166 @@
+/**
+ * QoS 1 and 2 messages per second through MQTTBroker, by in-flight window.
+ *
+ * A publishing MQTTClient and a subscribing one are connected over TCP loopback to MQTTBroker, all on one event
+ * loop. The publisher keeps its queue topped up and the window decides how many messages wait for their PUBACK
+ * (or PUBREC and PUBCOMP) at once, a window of 1 is a round trip per message. The time runs from the first
+ * publish until the broker acknowledged the last one.
+ */
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Messages = 100000;
+constexpr std::size_t PayloadSize = 64;
+/// Messages published up front, each acknowledgement then publishes another
+constexpr std::size_t Backlog = 1024;
+constexpr char Topic[] = "site/building-1/floor-2/room-3/sensor/temperature";
+
+class Subscriber : public MQTT::IMQTTClientHandler
+{
+public:
+	Subscriber(EventLoop::EventLoop& ev, std::uint16_t port)
+		: mClient(ev, this)
+		, mPort(port)
+	{}
+
+	void OnConnected() final
+	{
+		mClient.Subscribe(Topic);
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final
+	{}
+
+	void OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t /*returnCode*/) final
+	{
+		mPublisher->Connect("127.0.0.1", mPort);
+	}
+
+	void OnPublish(std::string_view /*topic*/, Common::Span<const char> /*payload*/) final
+	{
+		++mReceived;
+	}
+
+	MQTT::MQTTClient mClient;
+	MQTT::MQTTClient* mPublisher = nullptr;
+	std::uint16_t mPort;
+	std::size_t mReceived = 0;
+};
+
+class Publisher : public MQTT::IMQTTClientHandler
+{
+public:
+	Publisher(EventLoop::EventLoop& ev, int qos)
+		: mEv(ev)
+		, mClient(ev, this)
+		, mQoS(qos)
+		, mPayload(PayloadSize, 'x')
+	{}
+
+	void OnConnected() final
+	{
+		mStart = Clock::now();
+		while(mSent < Backlog)
+		{
+			PublishNext();
+		}
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final
+	{}
+
+	void OnPublishComplete(const std::string& /*topic*/) final
+	{
+		if(mSent < Messages)
+		{
+			PublishNext();
+		}
+		if(++mCompleted == Messages)
+		{
+			mEnd = Clock::now();
+			mEv.Stop();
+		}
+	}
+
+	void PublishNext()
+	{
+		mClient.Publish(Topic, mPayload, mQoS);
+		++mSent;
+	}
+
+	EventLoop::EventLoop& mEv;
+	MQTT::MQTTClient mClient;
+	int mQoS;
+	std::string mPayload;
+	std::size_t mSent = 0;
+	std::size_t mCompleted = 0;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+};
+
+void RunCase(int qos, std::uint16_t window, std::uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	MQTTBroker::MQTTBroker broker(loop);
+	broker.Initialise(port);
+	Subscriber subscriber(loop, port);
+	Publisher publisher(loop, qos);
+	subscriber.mPublisher = &publisher.mClient;
+	subscriber.mClient.Initialise("qos-subscriber", {});
+	publisher.mClient.Initialise("qos-publisher", {});
+	publisher.mClient.SetInFlightWindow(window);
+	subscriber.mClient.Connect("127.0.0.1", port);
+
+	EventLoop::EventLoop::Timer timeout(60s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+		loop.Stop();
+	});
+	loop.AddTimer(&timeout);
+	loop.Run();
+	loop.RemoveTimer(&timeout);
+
+	if(publisher.mCompleted != Messages)
+	{
+		std::printf("  QoS %d  window %4u  INCOMPLETE, %zu of %zu acknowledged\n",
+				qos, window, publisher.mCompleted, Messages);
+		return;
+	}
+	const double seconds = std::chrono::duration<double>(publisher.mEnd - publisher.mStart).count();
+	std::printf("  QoS %d  window %4u  %10.0f msg/s  %8.2f us/msg  %zu delivered%s\n",
+			qos, window,
+			Messages / seconds,
+			seconds * 1e6 / Messages,
+			subscriber.mReceived,
+			subscriber.mReceived == Messages ? "" : "  MISMATCH");
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	std::printf("%zu messages of %zuB through MQTTBroker over loopback\n", Messages, PayloadSize);
+	std::uint16_t port = 18950;
+	for(const int qos : {1, 2})
+	{
+		for(const std::uint16_t window : std::initializer_list<std::uint16_t>{1, 16, 256})
+		{
+			RunCase(qos, window, port++);
+		}
+	}
+	return 0;
+}
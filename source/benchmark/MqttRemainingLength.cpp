@@ -0,0 +1,190 @@
+/**
+ * MQTT Remaining Length encoding and decoding.
+ *
+ * Decodes a million lengths of every field size with the word at a time decoder and with the byte by byte loop
+ * MQTTCodec used before, then encodes and parses PUBLISH packets up to the 256MiB protocol maximum. Every
+ * decoded length and parsed payload is checked against what was encoded.
+ */
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTCodec.h"
+#include "MQTT/MQTTPacket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Lengths = 1000000;
+constexpr std::size_t Slot = 8;
+
+/**
+ * @brief The decoder MQTTCodec had, one byte and one branch per iteration
+ */
+bool DecodeByteWise(const char* data, std::size_t len, std::size_t& length, std::size_t& size)
+{
+	length = 0;
+	for(std::size_t i = 0; i < len && i < 4; ++i)
+	{
+		const auto byte = static_cast<std::uint8_t>(data[i]);
+		length |= static_cast<std::size_t>(byte & 0x7F) << (7 * i);
+		if((byte & 0x80) == 0)
+		{
+			size = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+double NanosecondsPer(Clock::duration elapsed, std::size_t count)
+{
+	return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+void DecodeCase(std::size_t fieldSize, std::mt19937_64& random)
+{
+	static constexpr std::size_t Bounds[] = {0, 0, 128, 16384, 2097152, MQTT::MaxRemainingLength + 1};
+	std::uniform_int_distribution<std::size_t> distribution(Bounds[fieldSize], Bounds[fieldSize + 1] - 1);
+
+	std::vector<std::size_t> expected(Lengths);
+	std::vector<char> encoded(Lengths * Slot, 0);
+	for(auto& length : expected)
+	{
+		length = distribution(random);
+	}
+	const auto encodeStart = Clock::now();
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		MQTT::EncodeRemainingLength(&encoded[i * Slot], expected[i]);
+	}
+	const auto encodeTime = Clock::now() - encodeStart;
+
+	std::size_t errors = 0;
+	const auto wordStart = Clock::now();
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		std::size_t length = 0;
+		std::size_t size = 0;
+		MQTT::DecodeRemainingLength(&encoded[i * Slot], Slot, length, size);
+		errors += (length != expected[i]) | (size != fieldSize);
+	}
+	const auto wordTime = Clock::now() - wordStart;
+
+	const auto byteStart = Clock::now();
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		std::size_t length = 0;
+		std::size_t size = 0;
+		DecodeByteWise(&encoded[i * Slot], Slot, length, size);
+		errors += (length != expected[i]) | (size != fieldSize);
+	}
+	const auto byteTime = Clock::now() - byteStart;
+
+	std::printf("%zu byte field  encode: %5.2fns  decode word: %5.2fns  decode byte loop: %5.2fns  errors: %zu\n",
+			fieldSize,
+			NanosecondsPer(encodeTime, Lengths),
+			NanosecondsPer(wordTime, Lengths),
+			NanosecondsPer(byteTime, Lengths),
+			errors);
+}
+
+/**
+ * @brief Field sizes in random order, the byte loop mispredicts on its exit branch
+ */
+void MixedCase(std::mt19937_64& random)
+{
+	std::uniform_int_distribution<std::size_t> bits(0, 27);
+	std::vector<std::size_t> expected(Lengths);
+	std::vector<char> encoded(Lengths * Slot, 0);
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		expected[i] = (std::size_t{1} << bits(random)) - 1;
+		MQTT::EncodeRemainingLength(&encoded[i * Slot], expected[i]);
+	}
+
+	std::size_t errors = 0;
+	const auto wordStart = Clock::now();
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		std::size_t length = 0;
+		std::size_t size = 0;
+		MQTT::DecodeRemainingLength(&encoded[i * Slot], Slot, length, size);
+		errors += length != expected[i];
+	}
+	const auto wordTime = Clock::now() - wordStart;
+
+	const auto byteStart = Clock::now();
+	for(std::size_t i = 0; i < Lengths; ++i)
+	{
+		std::size_t length = 0;
+		std::size_t size = 0;
+		DecodeByteWise(&encoded[i * Slot], Slot, length, size);
+		errors += length != expected[i];
+	}
+	const auto byteTime = Clock::now() - byteStart;
+
+	std::printf("mixed sizes               decode word: %5.2fns  decode byte loop: %5.2fns  errors: %zu\n",
+			NanosecondsPer(wordTime, Lengths),
+			NanosecondsPer(byteTime, Lengths),
+			errors);
+}
+
+void PublishCase(std::size_t payloadSize)
+{
+	const std::string topic = "sensors/temperature";
+	const std::string payload(payloadSize, 'x');
+	const MQTT::MQTTPublishPacket publish(1, topic, payload, std::nullopt);
+
+	const auto encodeStart = Clock::now();
+	const auto message = publish.GetMessage();
+	const auto encodeTime = Clock::now() - encodeStart;
+
+	const auto decodeStart = Clock::now();
+	Common::Frame frame;
+	const auto status = MQTT::MQTTCodec::Decode(message.data(), message.size(), frame);
+	const MQTT::MQTTPacket packet(message.data(), message.size());
+	const auto decodeTime = Clock::now() - decodeStart;
+
+	const auto* parsed = packet.GetPublishPacket();
+	const bool valid = status == Common::DecodeStatus::Complete &&
+		frame.mFrame.size() == message.size() &&
+		packet.mFixedHeader.GetHeaderSize() == 1 + MQTT::RemainingLengthSize(2 + topic.size() + payloadSize) &&
+		parsed != nullptr &&
+		parsed->GetTopicFilter() == topic &&
+		parsed->GetTopicPayload().size() == payloadSize;
+
+	const auto mibPerSecond = [payloadSize](Clock::duration elapsed) {
+		return payloadSize / std::chrono::duration<double>(elapsed).count() / (1024 * 1024);
+	};
+	std::printf("PUBLISH %10zuB  header: %zuB  encode: %8.1f MiB/s  parse: %8.1f MiB/s  %s\n",
+			payloadSize,
+			packet.mFixedHeader.GetHeaderSize(),
+			mibPerSecond(encodeTime),
+			mibPerSecond(decodeTime),
+			valid ? "ok" : "MISMATCH");
+}
+
+}
+
+int main()
+{
+	std::mt19937_64 random(42);
+	for(std::size_t fieldSize = 1; fieldSize <= 4; ++fieldSize)
+	{
+		DecodeCase(fieldSize, random);
+	}
+	MixedCase(random);
+
+	// Every field size, the last one is the largest payload a PUBLISH with this topic can carry
+	for(const std::size_t size : std::initializer_list<std::size_t>{100, 200, 20000, 3000000, 64 * 1024 * 1024, MQTT::MaxRemainingLength - 21})
+	{
+		PublishCase(size);
+	}
+
+	return 0;
+}
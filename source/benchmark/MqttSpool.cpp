@@ -0,0 +1,133 @@
+/**
+ * Spooling messages while disconnected and replaying them after a restart, with MQTTClient::EnableOfflineSpool.
+ *
+ * An MQTTClient without a connection publishes into a fresh spool file, then it is destroyed and a new client opens
+ * the same file, as after a restart. That client connects over TCP loopback to MQTTBroker and sends the spooled
+ * messages with QoS 1, as many in flight as the window allows, with and without SetCoalescing(). The replay time
+ * runs from CONNACK until the broker acknowledged the last message.
+ */
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Messages = 500000;
+constexpr std::size_t PayloadSize = 64;
+constexpr std::size_t SpoolCapacity = 128 * 1024 * 1024;
+constexpr char Topic[] = "site/building-1/floor-2/room-3/sensor/temperature";
+
+class Publisher : public MQTT::IMQTTClientHandler
+{
+public:
+	explicit Publisher(EventLoop::EventLoop& ev)
+		: mEv(ev)
+	{}
+
+	void OnConnected() final
+	{
+		mStart = Clock::now();
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final
+	{}
+
+	void OnPublishComplete(const std::string& /*topic*/) final
+	{
+		if(++mCompleted == Messages)
+		{
+			mEnd = Clock::now();
+			mEv.Stop();
+		}
+	}
+
+	EventLoop::EventLoop& mEv;
+	std::size_t mCompleted = 0;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+};
+
+void RunCase(std::uint16_t window, bool coalescing, const std::string& path, std::uint16_t port)
+{
+	::unlink(path.c_str());
+	EventLoop::EventLoop loop;
+	Publisher handler(loop);
+	const std::string payload(PayloadSize, 'x');
+
+	auto client = std::make_unique<MQTT::MQTTClient>(loop, &handler);
+	client->EnableOfflineSpool(path, SpoolCapacity);
+	const auto appendStart = Clock::now();
+	for(std::size_t i = 0; i < Messages; ++i)
+	{
+		client->Publish(Topic, payload, 1);
+	}
+	const double appendSeconds = std::chrono::duration<double>(Clock::now() - appendStart).count();
+	const std::size_t spooled = client->GetSpooledCount();
+	client.reset();
+
+	// The next run of the process
+	const auto reopenStart = Clock::now();
+	client = std::make_unique<MQTT::MQTTClient>(loop, &handler);
+	client->EnableOfflineSpool(path, SpoolCapacity);
+	const double reopenMs = std::chrono::duration<double, std::milli>(Clock::now() - reopenStart).count();
+	const std::size_t recovered = client->GetSpooledCount();
+
+	MQTTBroker::MQTTBroker broker(loop);
+	broker.Initialise(port);
+	client->Initialise("spool-benchmark", {});
+	client->SetInFlightWindow(window);
+	client->SetCoalescing(coalescing);
+	client->Connect("127.0.0.1", port);
+	EventLoop::EventLoop::Timer timeout(60s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+		loop.Stop();
+	});
+	loop.AddTimer(&timeout);
+	loop.Run();
+	loop.RemoveTimer(&timeout);
+
+	const double replaySeconds = std::chrono::duration<double>(handler.mEnd - handler.mStart).count();
+	const bool complete = spooled == Messages && recovered == Messages && handler.mCompleted == Messages &&
+			client->GetSpooledCount() == 0;
+	std::printf("  window %5u%-12s  append %8.2f M msg/s %7.1f MB/s  reopen %6.2f ms  replay %8.0f msg/s%s\n",
+			window,
+			coalescing ? ", coalescing" : "",
+			Messages / appendSeconds / 1e6,
+			Messages * (PayloadSize + sizeof(Topic) - 1 + MQTT::MQTTSpool::RecordHeaderSize) / appendSeconds / 1e6,
+			reopenMs,
+			complete ? Messages / replaySeconds : 0.0,
+			complete ? "" : "  INCOMPLETE");
+	client.reset();
+	::unlink(path.c_str());
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	const std::string path = "/tmp/mqtt-spool-benchmark-" + std::to_string(::getpid());
+	std::printf("%zu messages of %zuB spooled while disconnected, reopened and replayed with QoS 1\n",
+			Messages, PayloadSize);
+	std::uint16_t port = 18995;
+	for(const std::uint16_t window : std::initializer_list<std::uint16_t>{16, 256, 4096})
+	{
+		RunCase(window, false, path, port++);
+		RunCase(window, true, path, port++);
+	}
+	return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * Time from CONNACK until every subscription of a reconnecting client is acknowledged.
+ *
+ * An MQTTClient connects over TCP loopback to MQTTBroker and, once connected, subscribes to all of its topic filters,
+ * either one SUBSCRIBE per filter as the client did before, or all of them in one Subscribe() call which packs them
+ * into as few SUBSCRIBE packets as MQTTClient::MaxSubscribePacketSize allows. Every round is a new connection, the
+ * time ends with the last SUBACK.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Rounds = 5;
+
+std::vector<std::string> MakeFilters(std::size_t count)
+{
+	std::vector<std::string> filters;
+	for(std::size_t i = 0; i < count; ++i)
+	{
+		filters.push_back("site/building-" + std::to_string(i % 4) + "/device-" + std::to_string(i) + "/+/state");
+	}
+	return filters;
+}
+
+class Subscriber : public MQTT::IMQTTClientHandler
+{
+public:
+	Subscriber(EventLoop::EventLoop& ev, const std::vector<std::string>& filters, bool batched)
+		: mEv(ev)
+		, mFilters(filters)
+		, mBatched(batched)
+		, mClient(ev, this)
+	{}
+
+	void OnConnected() final
+	{
+		mStart = Clock::now();
+		if(mBatched)
+		{
+			mClient.Subscribe(mFilters);
+		}
+		else
+		{
+			for(const auto& filter : mFilters)
+			{
+				mClient.Subscribe(filter);
+			}
+		}
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final
+	{}
+
+	void OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t returnCode) final
+	{
+		mRefused += returnCode >= MQTT::SubackFailure;
+		if(++mAcknowledged == mFilters.size())
+		{
+			mEnd = Clock::now();
+			mEv.Stop();
+		}
+	}
+
+	EventLoop::EventLoop& mEv;
+	const std::vector<std::string>& mFilters;
+	bool mBatched;
+	MQTT::MQTTClient mClient;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+	std::size_t mAcknowledged = 0;
+	std::size_t mRefused = 0;
+};
+
+void RunCase(const char* name, const std::vector<std::string>& filters, bool batched, std::uint16_t& port)
+{
+	Clock::duration best = Clock::duration::max();
+	Clock::duration total{};
+	bool complete = true;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		EventLoop::EventLoop loop;
+		MQTTBroker::MQTTBroker broker(loop);
+		broker.Initialise(port);
+		Subscriber subscriber(loop, filters, batched);
+		subscriber.mClient.Initialise("subscribe-benchmark", {});
+		subscriber.mClient.Connect("127.0.0.1", port++);
+
+		EventLoop::EventLoop::Timer timeout(30s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+			loop.Stop();
+		});
+		loop.AddTimer(&timeout);
+		loop.Run();
+		loop.RemoveTimer(&timeout);
+
+		if(subscriber.mAcknowledged != filters.size() || subscriber.mRefused != 0)
+		{
+			complete = false;
+			break;
+		}
+		const auto elapsed = subscriber.mEnd - subscriber.mStart;
+		best = std::min(best, elapsed);
+		total += elapsed;
+	}
+
+	if(!complete)
+	{
+		std::printf("  %-26s INCOMPLETE\n", name);
+		return;
+	}
+	std::printf("  %-26s %10.3f ms best  %10.3f ms mean  %8.2f us/filter\n",
+			name,
+			std::chrono::duration<double, std::milli>(best).count(),
+			std::chrono::duration<double, std::milli>(total).count() / Rounds,
+			std::chrono::duration<double, std::micro>(best).count() / filters.size());
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	std::uint16_t port = 18900;
+	for(const std::size_t count : std::initializer_list<std::size_t>{10, 100, 2000, 10000})
+	{
+		const auto filters = MakeFilters(count);
+		std::printf("%zu topic filters of about %zuB, best of %zu reconnects\n", count, filters.back().size(), Rounds);
+		RunCase("SUBSCRIBE per filter", filters, false, port);
+		RunCase("Subscribe(list)", filters, true, port);
+	}
+	return 0;
+}
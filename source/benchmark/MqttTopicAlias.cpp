@@ -0,0 +1,214 @@
+/**
+ * Bytes on the wire per PUBLISH with MQTT 3.1.1, MQTT 5 and MQTT 5 topic aliases.
+ *
+ * An MQTTClient publishes small messages over TCP loopback, round robin over a set of long device topics, to a
+ * server that answers CONNACK like MQTTBroker, allowing 64 aliases or none, and records the stream it receives.
+ * The PUBLISH bytes per message are taken from that stream. It is then parsed as the broker does, with MQTTParser
+ * and MQTTPublishView, aliases resolved to their topic, to compare the decode cost per message.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+#include "MQTT/MQTTClient.h"
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Messages = 100000;
+constexpr std::size_t MessagesPerTick = 500;
+constexpr std::uint16_t AliasMaximum = 64;
+constexpr std::size_t ParseRounds = 5;
+
+std::vector<std::string> MakeTopics(std::size_t count)
+{
+	std::vector<std::string> topics;
+	for(std::size_t i = 0; i < count; ++i)
+	{
+		topics.push_back("site/building-" + std::to_string(i % 4) + "/floor-" + std::to_string(i % 8) + "/room-" +
+				std::to_string(i) + "/sensor/temperature");
+	}
+	return topics;
+}
+
+/**
+ * @brief Accepts one client, answers CONNACK and keeps every PUBLISH it receives
+ */
+class RecordingServer : public Common::IStreamSocketServerHandler
+					  , public Common::IStreamSocketHandler
+{
+public:
+	RecordingServer(EventLoop::EventLoop& ev, std::uint16_t port, std::uint16_t aliasMaximum)
+		: mEv(ev)
+		, mServer(ev, this)
+		, mAliasMaximum(aliasMaximum)
+	{
+		mServer.BindAndListen(port);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final {}
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final {}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
+	{
+		mParser.Feed(data, len, [this, conn](const char* packet, std::size_t size) {
+			const MQTT::MQTTPacket decoded(packet, size);
+			if(const auto* connect = decoded.GetConnectPacket())
+			{
+				MQTT::MQTTProperties properties;
+				properties.mTopicAliasMaximum = mAliasMaximum;
+				const auto connack = MQTT::MQTTConnackPacket(*connect, false, properties).GetMessage();
+				conn->Send(connack.data(), connack.size());
+			}
+			else if(static_cast<std::uint8_t>(packet[0]) >> 4 == static_cast<std::uint8_t>(MQTT::MQTTPacketType::PUBLISH))
+			{
+				mStream.insert(mStream.end(), packet, packet + size);
+				if(++mPublishes == Messages)
+				{
+					mEv.Stop();
+				}
+			}
+			return true;
+		});
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::StreamSocketServer mServer;
+	MQTT::MQTTParser mParser;
+	std::uint16_t mAliasMaximum;
+	std::vector<char> mStream;
+	std::size_t mPublishes = 0;
+};
+
+class NullHandler : public MQTT::IMQTTClientHandler
+{
+public:
+	void OnConnected() final {}
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final {}
+};
+
+/**
+ * @brief Parse @p stream as MQTTBroker does and return the best ns per message
+ */
+double ParseStream(const std::vector<char>& stream, MQTT::MQTTVersion version, std::size_t& errors)
+{
+	double best = 1e12;
+	for(std::size_t round = 0; round < ParseRounds; ++round)
+	{
+		MQTT::MQTTParser parser;
+		std::vector<std::string> aliases(AliasMaximum);
+		std::size_t messages = 0;
+		std::size_t topicBytes = 0;
+		errors = 0;
+		const auto start = Clock::now();
+		for(std::size_t offset = 0; offset < stream.size(); offset += 65536)
+		{
+			const std::size_t len = std::min<std::size_t>(65536, stream.size() - offset);
+			parser.Feed(stream.data() + offset, len, [&](const char* packet, std::size_t size) {
+				const MQTT::MQTTPublishView publish(packet, size, version);
+				std::string_view topic = publish.GetTopic();
+				if(const auto alias = publish.GetTopicAlias())
+				{
+					if(topic.empty())
+					{
+						topic = aliases[alias - 1];
+					}
+					else
+					{
+						aliases[alias - 1].assign(topic);
+					}
+				}
+				errors += !publish.IsValid() || topic.empty();
+				topicBytes += topic.size();
+				++messages;
+				return true;
+			});
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		best = std::min(best, ns / messages);
+		errors += messages != Messages || topicBytes == 0;
+	}
+	return best;
+}
+
+void RunCase(const char* name, MQTT::MQTTVersion version, std::uint16_t aliasMaximum,
+		const std::vector<std::string>& topics, std::size_t payloadSize, std::uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	RecordingServer server(loop, port, aliasMaximum);
+	NullHandler handler;
+	MQTT::MQTTClient client(loop, &handler);
+	client.Initialise("wire-benchmark", {}, version);
+	client.Connect("127.0.0.1", port);
+
+	// A batch per tick keeps the socket buffer from filling up
+	const std::string payload(payloadSize, 'x');
+	std::size_t sent = 0;
+	EventLoop::EventLoop::Timer publisher(1ms, EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		if(!client.IsConnected())
+		{
+			return;
+		}
+		for(std::size_t i = 0; i < MessagesPerTick && sent < Messages; ++i, ++sent)
+		{
+			client.Publish(topics[sent % topics.size()], payload);
+		}
+	});
+	EventLoop::EventLoop::Timer timeout(30s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+		loop.Stop();
+	});
+	loop.AddTimer(&publisher);
+	loop.AddTimer(&timeout);
+	loop.Run();
+	loop.RemoveTimer(&publisher);
+	loop.RemoveTimer(&timeout);
+
+	std::size_t errors = server.mPublishes == Messages ? 0 : 1;
+	std::size_t parseErrors = 0;
+	const double parseNs = ParseStream(server.mStream, version, parseErrors);
+	std::printf("  %-24s %8.1f bytes/msg  %6.1f ns/msg parse  %s\n",
+			name,
+			static_cast<double>(server.mStream.size()) / Messages,
+			parseNs,
+			errors + parseErrors == 0 ? "ok" : "MISMATCH");
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	std::uint16_t port = 18830;
+	for(const std::size_t topicCount : std::initializer_list<std::size_t>{16, 256})
+	{
+		const auto topics = MakeTopics(topicCount);
+		for(const std::size_t payloadSize : std::initializer_list<std::size_t>{8, 64})
+		{
+			std::printf("%zu topics of %zuB, %zuB payload, %zu messages\n",
+					topicCount, topics.back().size(), payloadSize, Messages);
+			RunCase("MQTT 3.1.1", MQTT::MQTTVersion::V311, 0, topics, payloadSize, port++);
+			RunCase("MQTT 5", MQTT::MQTTVersion::V5, 0, topics, payloadSize, port++);
+			RunCase("MQTT 5, 64 topic aliases", MQTT::MQTTVersion::V5, AliasMaximum, topics, payloadSize, port++);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,278 @@
+/**
+ * Matching and dispatching messages with 10k topic filters in MQTTClient.
+ *
+ * The filters are a mix of exact topics, '+' and '#' filters over a few thousand devices. First the matching alone:
+ * MQTTTopicTrie against comparing the topic with every filter, as an application handling all messages in one
+ * OnPublish() has to. Then the whole path in MQTTClient: a stream of PUBLISH packets is fed to a client that
+ * subscribed every filter with its own callback, from the read until the callbacks ran.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTTopicTrie.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Filters = 10000;
+constexpr std::size_t Devices = 4000;
+constexpr std::size_t Topics = 100000;
+constexpr std::size_t Rounds = 5;
+
+std::string Device(std::size_t device)
+{
+	return "site/building-" + std::to_string(device % 8) + "/device-" + std::to_string(device);
+}
+
+std::vector<std::string> MakeFilters()
+{
+	std::vector<std::string> filters;
+	for(std::size_t i = 0; filters.size() < Filters; ++i)
+	{
+		const std::string device = Device(i % Devices);
+		switch(i / Devices)
+		{
+			case 0: filters.push_back(device + "/temperature/state"); break;
+			case 1: filters.push_back(device + "/+/state"); break;
+			default: filters.push_back(device + "/#"); break;
+		}
+	}
+	return filters;
+}
+
+std::vector<std::string> MakeTopics()
+{
+	static constexpr const char* Properties[] = {"temperature", "humidity", "battery", "firmware"};
+	std::mt19937 random(7);
+	std::vector<std::string> topics;
+	for(std::size_t i = 0; i < Topics; ++i)
+	{
+		// A quarter of the messages come from devices nobody subscribed to
+		topics.push_back(Device(random() % (Devices + Devices / 3)) + "/" + Properties[random() % 4] + "/state");
+	}
+	return topics;
+}
+
+std::string_view NextLevel(std::string_view name, std::size_t& start)
+{
+	const std::size_t end = name.find('/', start);
+	const std::string_view level = name.substr(start, end - start);
+	start = end == std::string_view::npos ? end : end + 1;
+	return level;
+}
+
+/**
+ * @brief Match @p topic against @p filter level by level, the string comparison the trie replaces
+ */
+bool TopicMatches(std::string_view filter, std::string_view topic)
+{
+	if(topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+	{
+		return false;
+	}
+	std::size_t f = 0;
+	std::size_t t = 0;
+	while(f != std::string_view::npos)
+	{
+		const std::string_view level = NextLevel(filter, f);
+		if(level == "#")
+		{
+			return true;
+		}
+		if(t == std::string_view::npos || (NextLevel(topic, t) != level && level != "+"))
+		{
+			return false;
+		}
+	}
+	return t == std::string_view::npos;
+}
+
+template<typename Func>
+double BestNsPerTopic(const std::vector<std::string>& topics, std::size_t& matches, Func&& func)
+{
+	double best = 1e12;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		matches = 0;
+		const auto start = Clock::now();
+		for(const auto& topic : topics)
+		{
+			matches += func(topic);
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		best = std::min(best, ns / topics.size());
+	}
+	return best;
+}
+
+void RunMatching(const std::vector<std::string>& filters, const std::vector<std::string>& topics)
+{
+	MQTT::MQTTTopicTrie<std::size_t> trie;
+	for(std::size_t i = 0; i < filters.size(); ++i)
+	{
+		trie.Insert(filters[i]) = i;
+	}
+
+	// The linear scan is slow, it gets a tenth of the topics
+	const std::vector<std::string> someTopics(topics.begin(), topics.begin() + topics.size() / 10);
+	std::size_t linearMatches = 0;
+	const double linearNs = BestNsPerTopic(someTopics, linearMatches, [&filters](const std::string& topic) {
+		std::size_t count = 0;
+		for(const auto& filter : filters)
+		{
+			count += TopicMatches(filter, topic);
+		}
+		return count;
+	});
+	std::size_t allMatches = 0;
+	const double trieNs = BestNsPerTopic(topics, allMatches, [&trie](const std::string& topic) {
+		std::size_t count = 0;
+		trie.Match(topic, [&count](std::size_t) { ++count; });
+		return count;
+	});
+	std::size_t trieMatches = 0;
+	for(std::size_t i = 0; i < someTopics.size(); ++i)
+	{
+		trie.Match(someTopics[i], [&trieMatches](std::size_t) { ++trieMatches; });
+	}
+
+	std::printf("Matching %zu topics against %zu filters, %.2f matches per topic\n",
+			topics.size(), filters.size(), static_cast<double>(allMatches) / topics.size());
+	std::printf("  %-28s %12.1f ns/topic\n", "every filter in turn", linearNs);
+	std::printf("  %-28s %12.1f ns/topic%s\n", "MQTTTopicTrie", trieNs,
+			trieMatches == linearMatches ? "" : "  MISMATCH");
+}
+
+class SubscribingHandler : public MQTT::IMQTTClientHandler
+{
+public:
+	SubscribingHandler(EventLoop::EventLoop& ev, const std::vector<std::string>& filters)
+		: mEv(ev)
+		, mFilters(filters)
+		, mClient(ev, this)
+	{}
+
+	void OnConnected() final
+	{
+		for(const auto& filter : mFilters)
+		{
+			mClient.Subscribe(filter, [this](std::string_view /*topic*/, Common::Span<const char> /*payload*/) {
+				++mDispatched;
+			});
+		}
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) final
+	{}
+
+	void OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t returnCode) final
+	{
+		mRefused += returnCode >= MQTT::SubackFailure;
+		if(++mAcknowledged == mFilters.size())
+		{
+			mEv.Stop();
+		}
+	}
+
+	void OnPublish(std::string_view /*topic*/, Common::Span<const char> /*payload*/) final
+	{
+		++mUnmatched;
+	}
+
+	EventLoop::EventLoop& mEv;
+	const std::vector<std::string>& mFilters;
+	MQTT::MQTTClient mClient;
+	std::size_t mAcknowledged = 0;
+	std::size_t mRefused = 0;
+	std::size_t mDispatched = 0;
+	std::size_t mUnmatched = 0;
+};
+
+void RunClient(const std::vector<std::string>& filters, const std::vector<std::string>& topics, std::size_t expected)
+{
+	EventLoop::EventLoop loop;
+	MQTTBroker::MQTTBroker broker(loop);
+	broker.Initialise(18990);
+	SubscribingHandler handler(loop, filters);
+	handler.mClient.Initialise("dispatch-benchmark", {});
+	handler.mClient.Connect("127.0.0.1", 18990);
+
+	EventLoop::EventLoop::Timer timeout(30s, EventLoop::EventLoop::TimerType::Oneshot, [&loop]() {
+		loop.Stop();
+	});
+	loop.AddTimer(&timeout);
+	loop.Run();
+	loop.RemoveTimer(&timeout);
+	if(handler.mAcknowledged != filters.size() || handler.mRefused != 0)
+	{
+		std::printf("  MQTTClient callbacks         INCOMPLETE, %zu subscriptions\n", handler.mAcknowledged);
+		return;
+	}
+
+	// The messages are fed to the client as if read from the socket, in reads of up to 64 KiB
+	const std::string payload(32, 'x');
+	std::vector<char> stream;
+	for(const auto& topic : topics)
+	{
+		const std::size_t size = MQTT::MQTTPublishPacket::GetEncodedSize(topic.size(), payload.size(), 0,
+				MQTT::MQTTVersion::V311, 0);
+		stream.resize(stream.size() + size);
+		MQTT::MQTTPublishPacket::Encode(Common::Span<char>(stream.data() + stream.size() - size, size), 0, topic,
+				payload, 0, MQTT::MQTTVersion::V311, 0);
+	}
+	double best = 1e12;
+	for(std::size_t round = 0; round < Rounds; ++round)
+	{
+		handler.mDispatched = 0;
+		handler.mUnmatched = 0;
+		const auto start = Clock::now();
+		for(std::size_t offset = 0; offset < stream.size(); offset += 65536)
+		{
+			const std::size_t len = std::min<std::size_t>(65536, stream.size() - offset);
+			handler.mClient.OnIncomingData(nullptr, stream.data() + offset, len);
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		best = std::min(best, ns / topics.size());
+	}
+	std::printf("  %-28s %12.1f ns/message, %zu callbacks, %zu to OnPublish%s\n",
+			"MQTTClient callbacks", best, handler.mDispatched, handler.mUnmatched,
+			handler.mDispatched == expected ? "" : "  MISMATCH");
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::off);
+
+	const auto filters = MakeFilters();
+	const auto topics = MakeTopics();
+	RunMatching(filters, topics);
+
+	MQTT::MQTTTopicTrie<bool> trie;
+	for(const auto& filter : filters)
+	{
+		trie.Insert(filter);
+	}
+	std::size_t expected = 0;
+	for(const auto& topic : topics)
+	{
+		trie.Match(topic, [&expected](bool) { ++expected; });
+	}
+	RunClient(filters, topics, expected);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * MQTT string validation throughput per kernel.
+ *
+ * Validates ASCII topics of typical lengths, topics with multi byte characters and a long UTF-8 text with the
+ * scalar, SSE4.1 and AVX2 validators, reporting ns per string and per byte. The kernels the CPU lacks are skipped.
+ * Before timing, all kernels are compared against the scalar one on a million random mutations of valid strings,
+ * which hit every class of malformed UTF-8, U+0000 and wildcards at every block offset.
+ */
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTValidation.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Strings = 1024;
+constexpr std::size_t Rounds = 2000;
+
+struct Kernel
+{
+	const char* mName;
+	MQTT::StringValidator mValidate;
+};
+
+std::vector<Kernel> AvailableKernels()
+{
+	std::vector<Kernel> kernels{{"scalar", MQTT::ValidateStringScalar}};
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1"))
+	{
+		kernels.push_back({"sse4.1", MQTT::ValidateStringSse41});
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernels.push_back({"avx2", MQTT::ValidateStringAvx2});
+	}
+#endif
+	return kernels;
+}
+
+/**
+ * @brief Append code point @p cp as UTF-8
+ */
+void AppendCodePoint(std::string& out, std::uint32_t cp)
+{
+	if(cp < 0x80)
+	{
+		out += static_cast<char>(cp);
+	}
+	else if(cp < 0x800)
+	{
+		out += static_cast<char>(0xC0 | cp >> 6);
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else if(cp < 0x10000)
+	{
+		out += static_cast<char>(0xE0 | cp >> 12);
+		out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else
+	{
+		out += static_cast<char>(0xF0 | cp >> 18);
+		out += static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+		out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+}
+
+/**
+ * @brief Valid UTF-8 of about @p length bytes, levels separated by '/', with a share of non ASCII characters
+ */
+std::string RandomTopic(std::mt19937_64& random, std::size_t length, double nonAscii)
+{
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::uniform_int_distribution<std::uint32_t> ascii('a', 'z');
+	std::uniform_int_distribution<std::uint32_t> twoByte(0x80, 0x7FF);
+	std::uniform_int_distribution<std::uint32_t> threeByte(0xE000, 0xFFFF);
+	std::uniform_int_distribution<std::uint32_t> fourByte(0x10000, 0x10FFFF);
+	std::string topic;
+	while(topic.size() < length)
+	{
+		if(chance(random) < 0.1)
+		{
+			topic += '/';
+		}
+		else if(chance(random) >= nonAscii)
+		{
+			AppendCodePoint(topic, ascii(random));
+		}
+		else
+		{
+			switch(random() % 3)
+			{
+				case 0: AppendCodePoint(topic, twoByte(random)); break;
+				case 1: AppendCodePoint(topic, threeByte(random)); break;
+				default: AppendCodePoint(topic, fourByte(random)); break;
+			}
+		}
+	}
+	return topic;
+}
+
+std::size_t CheckKernels(const std::vector<Kernel>& kernels, std::mt19937_64& random)
+{
+	// Bytes that break UTF-8 or MQTT rules in every way when put in the right place
+	static constexpr std::uint8_t Interesting[] = {0x00, '+', '#', 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1,
+		0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF};
+	std::size_t mismatches = 0;
+	std::size_t invalid = 0;
+	for(std::size_t i = 0; i < 1000000; ++i)
+	{
+		std::string value = RandomTopic(random, 1 + random() % 100, 0.3);
+		const std::size_t mutations = random() % 3;
+		for(std::size_t m = 0; m < mutations; ++m)
+		{
+			value[random() % value.size()] = static_cast<char>(Interesting[random() % sizeof(Interesting)]);
+		}
+		if(random() % 4 == 0)
+		{
+			// Cut within a sequence
+			value.resize(random() % value.size() + 1);
+		}
+
+		const bool rejectWildcards = random() % 2;
+		const bool expected = MQTT::ValidateStringScalar(value.data(), value.size(), rejectWildcards);
+		invalid += !expected;
+		for(const auto& kernel : kernels)
+		{
+			mismatches += kernel.mValidate(value.data(), value.size(), rejectWildcards) != expected;
+		}
+	}
+	std::printf("random strings: %zu of 1000000 invalid, %zu kernel mismatches\n", invalid, mismatches);
+	return mismatches;
+}
+
+void RunCase(const std::vector<Kernel>& kernels, const char* name, const std::vector<std::string>& values)
+{
+	std::size_t bytes = 0;
+	for(const auto& value : values)
+	{
+		bytes += value.size();
+	}
+	std::printf("%s, %.0fB average\n", name, static_cast<double>(bytes) / values.size());
+
+	for(const auto& kernel : kernels)
+	{
+		std::size_t valid = 0;
+		const auto start = Clock::now();
+		for(std::size_t round = 0; round < Rounds; ++round)
+		{
+			for(const auto& value : values)
+			{
+				valid += kernel.mValidate(value.data(), value.size(), true);
+			}
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		std::printf("  %-8s %8.2f ns/string  %6.3f ns/byte  %s\n",
+				kernel.mName,
+				ns / (Rounds * values.size()),
+				ns / (Rounds * bytes),
+				valid == Rounds * values.size() ? "ok" : "REJECTED");
+	}
+}
+
+}
+
+int main()
+{
+	std::mt19937_64 random(42);
+	const auto kernels = AvailableKernels();
+	if(CheckKernels(kernels, random) != 0)
+	{
+		return 1;
+	}
+
+	for(const std::size_t length : {16, 38, 64, 256})
+	{
+		std::vector<std::string> topics;
+		for(std::size_t i = 0; i < Strings; ++i)
+		{
+			topics.push_back(RandomTopic(random, length, 0));
+		}
+		const std::string name = "ASCII topics " + std::to_string(length) + "B";
+		RunCase(kernels, name.c_str(), topics);
+	}
+
+	std::vector<std::string> mixed;
+	for(std::size_t i = 0; i < Strings; ++i)
+	{
+		mixed.push_back(RandomTopic(random, 64, 0.2));
+	}
+	RunCase(kernels, "Topics with 20% multi byte characters", mixed);
+
+	RunCase(kernels, "UTF-8 text 64KiB", {RandomTopic(random, 64 * 1024, 0.5)});
+
+	return 0;
+}
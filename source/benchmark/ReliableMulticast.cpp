@@ -0,0 +1,297 @@
+/**
+ * Reliable multicast throughput and recovery latency with injected loss, on the local host.
+ *
+ * The sender runs in a forked child and multicasts 256 byte messages for 2 seconds at a fixed rate with TTL 0, each
+ * carrying its send time. Unpaced, a sender sharing the core with the receiver overruns the socket buffer by far
+ * more than the retransmit ring holds. A relay in the receiving process drops the given fraction of data datagrams,
+ * including retransmissions, and passes the rest on to the receiver's port, NACKs go back to the sender through it.
+ * The receiver measures send to delivery latency, which includes the hop through the relay. The recovery latency is
+ * that of the message delivered right after a gap was filled, which is the one that went missing.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "ReliableMulticast.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+constexpr std::chrono::seconds Duration{2};
+constexpr std::size_t MessageSize = 256;
+constexpr int ReceiveBufferSize = 8 * 1024 * 1024;
+constexpr const char* Group = "239.2.2.1";
+/// The relay forwards from the port of a case to this one above it
+constexpr uint16_t RelayPortOffset = 100;
+
+class Publisher
+{
+public:
+	Publisher(EventLoop::EventLoop& ev, uint16_t port, std::size_t rate)
+		: mEv(ev)
+		, mSender(ev, Group, port)
+		, mRate(rate)
+		, mMessages(rate * Duration.count())
+	{
+		mSender.GetSocket().SetMulticastTtl(0);
+		mSender.GetSocket().SetMulticastLoop(true);
+	}
+
+	void Start()
+	{
+		mStart = Clock::now();
+		SendBurst();
+	}
+
+	void SendBurst()
+	{
+		const auto elapsed = std::chrono::duration<double>(Clock::now() - mStart).count();
+		const std::size_t target = std::min<std::size_t>(mMessages, elapsed * mRate + 1);
+		std::array<char, MessageSize> message{};
+		for(; mSent < target; ++mSent)
+		{
+			const int64_t now = Clock::now().time_since_epoch().count();
+			std::memcpy(message.data(), &now, sizeof(now));
+			mSender.Send(message.data(), message.size());
+		}
+		if(mSent < mMessages)
+		{
+			mEv.SheduleForNextCycle([this]() { SendBurst(); });
+		}
+	}
+
+private:
+	EventLoop::EventLoop& mEv;
+	Common::ReliableMulticastSender mSender;
+	std::size_t mRate;
+	std::size_t mMessages;
+	Clock::time_point mStart;
+	std::size_t mSent = 0;
+};
+
+/**
+ * @brief Drops data datagrams on their way from the sender to the receiver
+ */
+class LossyRelay : public Common::IUDPSocketHandler
+{
+public:
+	LossyRelay(EventLoop::EventLoop& ev, uint16_t port, double loss)
+		: mSocket(ev, this)
+		, mReceiver(Group, port + RelayPortOffset)
+		, mLoss(loss)
+	{
+		Common::SocketOptions options;
+		options.mReceiveBufferSize = ReceiveBufferSize;
+		mSocket.SetOptions(options);
+		mSocket.StartListening(nullptr, port);
+		mSocket.JoinGroup(Group);
+		mSocket.SetMulticastTtl(0);
+		mSocket.SetMulticastLoop(true);
+	}
+
+	void OnIncomingDatagrams(Common::UDPSocket* /*socket*/, Common::Span<Common::Datagram> datagrams) final
+	{
+		using namespace Common::ReliableMulticastProtocol;
+
+		for(const auto& datagram : datagrams)
+		{
+			if(datagram.mLength == 0)
+			{
+				continue;
+			}
+			const Common::UDPEndpoint source(datagram.GetSource());
+			const auto type = static_cast<Type>(datagram.mData[0]);
+			if(type == Type::Nack)
+			{
+				// The receiver answers the relay, the sender has to see it
+				mSocket.Queue(datagram.mData, datagram.mLength, mSender);
+				continue;
+			}
+			mSender = source;
+			if(type == Type::Data && NextRandom() < mLoss)
+			{
+				continue;
+			}
+			mSocket.Queue(datagram.mData, datagram.mLength, mReceiver);
+		}
+	}
+
+private:
+	double NextRandom() noexcept
+	{
+		mRandom ^= mRandom << 13;
+		mRandom ^= mRandom >> 7;
+		mRandom ^= mRandom << 17;
+		return static_cast<double>(mRandom >> 11) / static_cast<double>(1ull << 53);
+	}
+
+	Common::UDPSocket mSocket;
+	Common::UDPEndpoint mReceiver;
+	Common::UDPEndpoint mSender;
+	double mLoss;
+	uint64_t mRandom = 0x9E3779B97F4A7C15ull;
+};
+
+class Subscriber : public Common::IReliableMulticastHandler
+{
+public:
+	Subscriber(EventLoop::EventLoop& ev, uint16_t port, std::size_t messages, double loss)
+		: mEv(ev)
+		, mRelay(ev, port, loss)
+		, mReceiver(ev, this, Group, port + RelayPortOffset)
+		, mMessages(messages)
+		, mIdleTimer(500ms, EventLoop::EventLoop::TimerType::Repeating, [this](){ CheckIdle(); })
+	{
+		Common::SocketOptions options;
+		options.mReceiveBufferSize = ReceiveBufferSize;
+		mReceiver.GetSocket().SetOptions(options);
+		mLatencies.reserve(mMessages);
+		mEv.AddTimer(&mIdleTimer);
+	}
+
+	~Subscriber()
+	{
+		mEv.RemoveTimer(&mIdleTimer);
+	}
+
+	void OnMessage(Common::ReliableMulticastReceiver* receiver, uint64_t /*sequence*/, const char* data, std::size_t /*len*/) final
+	{
+		int64_t sent;
+		std::memcpy(&sent, data, sizeof(sent));
+		const auto now = Clock::now();
+		const Clock::duration latency(now.time_since_epoch().count() - sent);
+		if(mDelivered++ == 0)
+		{
+			mStart = now;
+		}
+		mLast = now;
+		mLatencies.push_back(latency);
+
+		// Gaps are filled in order, so the first message after the recovered count moved is the repaired one
+		if(receiver->GetRecoveredCount() != mRecovered)
+		{
+			mRecovered = receiver->GetRecoveredCount();
+			mRecoveryLatencies.push_back(latency);
+		}
+		CheckDone();
+	}
+
+	void OnLoss(Common::ReliableMulticastReceiver* /*receiver*/, uint64_t /*from*/, uint64_t count) final
+	{
+		mLost += count;
+		CheckDone();
+	}
+
+	void Report(double loss)
+	{
+		const double seconds = std::chrono::duration<double>(mLast - mStart).count();
+		std::printf("loss %4.1f%% %7.0f msg/s delivered:%zu lost:%zu recovered:%zu nacks:%zu duplicates:%zu\n",
+				loss * 100,
+				mDelivered / seconds,
+				mDelivered, mLost,
+				mReceiver.GetRecoveredCount(), mReceiver.GetNackCount(), mReceiver.GetDuplicateCount());
+		Percentiles("  latency", mLatencies);
+		Percentiles("  recovery", mRecoveryLatencies);
+	}
+
+private:
+	static void Percentiles(const char* name, std::vector<Clock::duration>& samples)
+	{
+		if(samples.empty())
+		{
+			std::printf("%-12s no samples\n", name);
+			return;
+		}
+		std::sort(samples.begin(), samples.end());
+		const auto us = [](Clock::duration d) {
+			return std::chrono::duration<double, std::micro>(d).count();
+		};
+		std::printf("%-12s p50: %9.1fus p99: %9.1fus max: %9.1fus (%zu samples)\n", name,
+				us(samples[samples.size() / 2]),
+				us(samples[samples.size() * 99 / 100]),
+				us(samples.back()),
+				samples.size());
+	}
+
+	void CheckDone()
+	{
+		if(mDelivered + mLost == mMessages)
+		{
+			mEv.Stop();
+		}
+	}
+
+	void CheckIdle()
+	{
+		if(mDelivered != 0 && Clock::now() - mLast > 500ms)
+		{
+			mEv.Stop();
+		}
+	}
+
+	EventLoop::EventLoop& mEv;
+	LossyRelay mRelay;
+	Common::ReliableMulticastReceiver mReceiver;
+	std::size_t mMessages;
+	EventLoop::EventLoop::Timer mIdleTimer;
+
+	std::size_t mDelivered = 0;
+	std::size_t mLost = 0;
+	std::size_t mRecovered = 0;
+	Clock::time_point mStart;
+	Clock::time_point mLast;
+	std::vector<Clock::duration> mLatencies;
+	std::vector<Clock::duration> mRecoveryLatencies;
+};
+
+void RunCase(std::size_t rate, double loss, uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	// Sleep in epoll, a receiver spinning on the same core as the sender delays it by whole time slices
+	loop.ToggleRunHot();
+	Subscriber subscriber(loop, port, rate * Duration.count(), loss);
+
+	const pid_t child = ::fork();
+	if(child == 0)
+	{
+		EventLoop::EventLoop senderLoop;
+		Publisher publisher(senderLoop, port, rate);
+		publisher.Start();
+		senderLoop.Run();
+		::_exit(0);
+	}
+
+	loop.Run();
+	::kill(child, SIGKILL);
+	::waitpid(child, nullptr, 0);
+	subscriber.Report(loss);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::err);
+
+	uint16_t port = 17801;
+	for(const std::size_t rate : {20000, 50000})
+	{
+		for(const double loss : {0.0, 0.001, 0.01, 0.05})
+		{
+			RunCase(rate, loss, port++);
+		}
+	}
+
+	return 0;
+}
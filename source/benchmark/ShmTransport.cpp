@@ -0,0 +1,368 @@
+/**
+ * Shared memory ring versus TCP loopback and unix domain sockets between two processes.
+ *
+ * Latency is a 64 byte ping-pong with the echo side in a forked child. The ring is measured with both loops
+ * running hot (polling, no syscalls at all) and with both loops sleeping in epoll and woken through the eventfd.
+ * Throughput is a one way stream of 64 byte messages, the socket sender makes one send() per message.
+ *
+ * Polling needs a core for each process, on a single core the two spinning loops only hand over at scheduler ticks.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "ShmRing.h"
+#include "StreamSocket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t MessageSize = 64;
+constexpr std::size_t PingIterations = 20000;
+constexpr std::size_t StreamMessages = 5000000;
+constexpr std::size_t RingSize = 1024 * 1024;
+
+constexpr const char* UnixPath = "/tmp/commonlibs-shm-bench.sock";
+
+void ReportLatency(const char* name, std::vector<Clock::duration>& samples)
+{
+	if(samples.empty())
+	{
+		std::printf("%-22s no samples\n", name);
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	const auto us = [](Clock::duration d) {
+		return std::chrono::duration<double, std::micro>(d).count();
+	};
+	std::printf("%-22s round trip p50: %6.2fus p99: %6.2fus\n", name,
+			us(samples[samples.size() / 2]),
+			us(samples[samples.size() * 99 / 100]));
+}
+
+void ReportThroughput(const char* name, Clock::duration elapsed)
+{
+	const double seconds = std::chrono::duration<double>(elapsed).count();
+	std::printf("%-22s throughput: %6.2f Mmsg/s %8.1f MiB/s\n", name,
+			StreamMessages / seconds / 1e6,
+			StreamMessages * MessageSize / seconds / (1024 * 1024));
+}
+
+template<typename Child>
+pid_t Spawn(Child&& child)
+{
+	const pid_t pid = ::fork();
+	if(pid == 0)
+	{
+		child();
+		::_exit(0);
+	}
+	return pid;
+}
+
+void Reap(pid_t pid)
+{
+	::kill(pid, SIGKILL);
+	::waitpid(pid, nullptr, 0);
+}
+
+void WriteSpinning(Common::ShmRing& ring, const char* data, std::size_t len)
+{
+	while(!ring.TryWrite(data, len))
+	{}
+}
+
+class RingEcho : public Common::IShmRingHandler
+{
+public:
+	RingEcho(Common::ShmRing& out)
+		: mOut(out)
+	{}
+
+	void OnIncomingMessage(Common::ShmRingReader* /*reader*/, const char* data, size_t len) final
+	{
+		WriteSpinning(mOut, data, len);
+	}
+
+private:
+	Common::ShmRing& mOut;
+};
+
+class RingPing : public Common::IShmRingHandler
+{
+public:
+	RingPing(EventLoop::EventLoop& ev, Common::ShmRing& out)
+		: mEv(ev)
+		, mOut(out)
+	{
+		mSamples.reserve(PingIterations);
+	}
+
+	void SendPing()
+	{
+		mSendTime = Clock::now();
+		WriteSpinning(mOut, mMessage.data(), mMessage.size());
+	}
+
+	void OnIncomingMessage(Common::ShmRingReader* /*reader*/, const char* /*data*/, size_t /*len*/) final
+	{
+		mSamples.push_back(Clock::now() - mSendTime);
+		if(mSamples.size() == PingIterations)
+		{
+			mEv.Stop();
+			return;
+		}
+		SendPing();
+	}
+
+	std::vector<Clock::duration> mSamples;
+
+private:
+	EventLoop::EventLoop& mEv;
+	Common::ShmRing& mOut;
+	std::array<char, MessageSize> mMessage{};
+	Clock::time_point mSendTime;
+};
+
+class RingCounter : public Common::IShmRingHandler
+{
+public:
+	RingCounter(Common::ShmRing& ack)
+		: mAck(ack)
+	{}
+
+	void OnIncomingMessage(Common::ShmRingReader* /*reader*/, const char* data, size_t /*len*/) final
+	{
+		if(++mCount == StreamMessages)
+		{
+			WriteSpinning(mAck, data, 1);
+		}
+	}
+
+private:
+	Common::ShmRing& mAck;
+	std::size_t mCount = 0;
+};
+
+void RingPingCase(const char* name, bool hot)
+{
+	Common::ShmRing toChild(RingSize);
+	Common::ShmRing toParent(RingSize);
+
+	const pid_t child = Spawn([&]() {
+		EventLoop::EventLoop loop;
+		if(!hot)
+		{
+			loop.ToggleRunHot();
+		}
+		RingEcho echo(toParent);
+		Common::ShmRingReader reader(loop, toChild, &echo);
+		loop.Run();
+	});
+
+	EventLoop::EventLoop loop;
+	if(!hot)
+	{
+		loop.ToggleRunHot();
+	}
+	RingPing ping(loop, toChild);
+	Common::ShmRingReader reader(loop, toParent, &ping);
+	ping.SendPing();
+	loop.Run();
+
+	Reap(child);
+	ReportLatency(name, ping.mSamples);
+}
+
+void RingStreamCase(const char* name, bool hot)
+{
+	Common::ShmRing toChild(RingSize);
+	Common::ShmRing toParent(RingSize);
+
+	const pid_t child = Spawn([&]() {
+		EventLoop::EventLoop loop;
+		if(!hot)
+		{
+			loop.ToggleRunHot();
+		}
+		RingCounter counter(toParent);
+		Common::ShmRingReader reader(loop, toChild, &counter);
+		loop.Run();
+	});
+
+	const std::array<char, MessageSize> message{};
+	const auto start = Clock::now();
+	for(std::size_t i = 0; i < StreamMessages; ++i)
+	{
+		WriteSpinning(toChild, message.data(), message.size());
+	}
+	while(toParent.Read([](const char*, std::size_t) {}) == 0)
+	{}
+	const auto elapsed = Clock::now() - start;
+
+	Reap(child);
+	ReportThroughput(name, elapsed);
+}
+
+class SocketEcho : public Common::IStreamSocketServerHandler
+				 , public Common::IStreamSocketHandler
+{
+public:
+	SocketEcho(EventLoop::EventLoop& ev, bool stream)
+		: mServer(ev, this)
+		, mStream(stream)
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mServer.SetConnectionOptions(options);
+	}
+
+	void Listen(const std::string& path, uint16_t port)
+	{
+		path.empty() ? mServer.BindAndListen(port) : mServer.BindAndListenUnix(path);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final
+	{}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) final
+	{
+		if(!mStream)
+		{
+			conn->Send(data, len);
+			return;
+		}
+		mReceived += len;
+		if(mReceived == StreamMessages * MessageSize)
+		{
+			conn->Send(data, 1);
+		}
+	}
+
+private:
+	Common::StreamSocketServer mServer;
+	bool mStream;
+	std::size_t mReceived = 0;
+};
+
+/**
+ * @brief Blocking client socket, connect is retried until the child is listening
+ */
+int ConnectBlocking(const std::string& path, uint16_t port)
+{
+	for(;;)
+	{
+		int fd;
+		int ret;
+		if(path.empty())
+		{
+			fd = ::socket(AF_INET, SOCK_STREAM, 0);
+			const int one = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(port);
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			ret = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		}
+		else
+		{
+			fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			sockaddr_un addr{};
+			addr.sun_family = AF_UNIX;
+			std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+			ret = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		}
+		if(ret == 0)
+		{
+			return fd;
+		}
+		::close(fd);
+		::usleep(10000);
+	}
+}
+
+void SocketCase(const char* name, const std::string& path, uint16_t port)
+{
+	for(const bool stream : {false, true})
+	{
+		const pid_t child = Spawn([&]() {
+			EventLoop::EventLoop loop;
+			SocketEcho echo(loop, stream);
+			echo.Listen(path, port);
+			loop.Run();
+		});
+
+		const int fd = ConnectBlocking(path, port);
+		std::array<char, MessageSize> message{};
+
+		if(!stream)
+		{
+			std::vector<Clock::duration> samples;
+			samples.reserve(PingIterations);
+			for(std::size_t i = 0; i < PingIterations; ++i)
+			{
+				const auto sendTime = Clock::now();
+				::send(fd, message.data(), message.size(), 0);
+				std::size_t received = 0;
+				while(received < MessageSize)
+				{
+					received += ::recv(fd, message.data() + received, MessageSize - received, 0);
+				}
+				samples.push_back(Clock::now() - sendTime);
+			}
+			ReportLatency(name, samples);
+		}
+		else
+		{
+			const auto start = Clock::now();
+			for(std::size_t i = 0; i < StreamMessages; ++i)
+			{
+				::send(fd, message.data(), message.size(), 0);
+			}
+			::recv(fd, message.data(), 1, 0);
+			ReportThroughput(name, Clock::now() - start);
+		}
+
+		::close(fd);
+		Reap(child);
+	}
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	SocketCase("TCP loopback", "", 17401);
+	SocketCase("unix", UnixPath, 0);
+	RingPingCase("shm ring (eventfd)", false);
+	RingPingCase("shm ring (polling)", true);
+	RingStreamCase("shm ring (eventfd)", false);
+	RingStreamCase("shm ring (polling)", true);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/**
+ * Small request/response latency over TCP loopback.
+ *
+ * Every request is written as a 4 byte header followed by a 60 byte body, the way MQTT packets leave
+ * MQTTClient, and the server answers with a single 64 byte response. That write-write-read pattern is
+ * the one hurt by Nagle's algorithm in combination with delayed acks.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+
+namespace {
+
+constexpr std::size_t HeaderSize = 4;
+constexpr std::size_t MessageSize = 64;
+constexpr std::size_t Iterations = 2000;
+// Nagle stalls every round trip on the delayed ack timer, keep that case short
+constexpr std::size_t NagleIterations = 100;
+
+using Clock = std::chrono::steady_clock;
+
+class EchoServer : public Common::IStreamSocketServerHandler
+				 , public Common::IStreamSocketHandler
+{
+public:
+	EchoServer(EventLoop::EventLoop& ev, const Common::SocketOptions& options, uint16_t port)
+		: mServer(ev, this)
+	{
+		mServer.SetConnectionOptions(options);
+		mServer.BindAndListen(port);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final
+	{}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* /*data*/, size_t len) final
+	{
+		mReceived += len;
+		while(mReceived >= MessageSize)
+		{
+			conn->Send(mResponse.data(), mResponse.size());
+			mReceived -= MessageSize;
+		}
+	}
+
+private:
+	Common::StreamSocketServer mServer;
+	std::size_t mReceived = 0;
+	std::array<char, MessageSize> mResponse{};
+};
+
+class PingClient : public Common::IStreamSocketHandler
+{
+public:
+	PingClient(EventLoop::EventLoop& ev, const Common::SocketOptions& options, std::size_t iterations)
+		: mEv(ev)
+		, mSocket(ev, this, options)
+		, mIterations(iterations)
+	{
+		mSamples.reserve(mIterations);
+	}
+
+	void Start(uint16_t port)
+	{
+		mSocket.Connect("127.0.0.1", port);
+	}
+
+	void OnConnected() final
+	{
+		SendRequest();
+	}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{
+		mEv.Stop();
+	}
+
+	void OnIncomingData(Common::StreamSocket* /*conn*/, char* /*data*/, size_t len) final
+	{
+		mReceived += len;
+		if(mReceived < MessageSize)
+		{
+			return;
+		}
+
+		mReceived -= MessageSize;
+		mSamples.push_back(Clock::now() - mSendTime);
+
+		if(mSamples.size() == mIterations)
+		{
+			mSocket.Shutdown();
+			mEv.Stop();
+			return;
+		}
+
+		SendRequest();
+	}
+
+	std::vector<Clock::duration>& GetSamples() noexcept
+	{
+		return mSamples;
+	}
+
+private:
+	void SendRequest()
+	{
+		mSendTime = Clock::now();
+		mSocket.Send(mRequest.data(), HeaderSize);
+		mSocket.Send(mRequest.data() + HeaderSize, MessageSize - HeaderSize);
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::StreamSocket mSocket;
+	std::array<char, MessageSize> mRequest{};
+	std::size_t mIterations;
+	std::size_t mReceived = 0;
+	Clock::time_point mSendTime;
+	std::vector<Clock::duration> mSamples;
+};
+
+void RunCase(const char* name, const Common::SocketOptions& options, uint16_t port,
+		std::size_t iterations = Iterations)
+{
+	EventLoop::EventLoop loop;
+	EchoServer server(loop, options, port);
+	PingClient client(loop, options, iterations);
+	client.Start(port);
+	loop.Run();
+
+	auto& samples = client.GetSamples();
+	if(samples.empty())
+	{
+		std::printf("%-24s no samples\n", name);
+		return;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	const auto us = [](Clock::duration d) {
+		return std::chrono::duration<double, std::micro>(d).count();
+	};
+	std::printf("%-24s p50: %9.1fus p99: %9.1fus max: %9.1fus (%zu round trips)\n",
+			name,
+			us(samples[samples.size() / 2]),
+			us(samples[samples.size() * 99 / 100]),
+			us(samples.back()),
+			samples.size());
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	Common::SocketOptions nagle;
+	nagle.mNoDelay = false;
+
+	Common::SocketOptions noDelay;
+	noDelay.mNoDelay = true;
+
+	Common::SocketOptions busyPoll;
+	busyPoll.mNoDelay = true;
+	busyPoll.mBusyPoll = 50;
+
+	Common::SocketOptions quickAck;
+	quickAck.mNoDelay = false;
+	quickAck.mQuickAck = true;
+
+	RunCase("default (Nagle)", nagle, 17001, NagleIterations);
+	RunCase("TCP_NODELAY", noDelay, 17002);
+	RunCase("TCP_NODELAY+SO_BUSY_POLL", busyPoll, 17003);
+	RunCase("TCP_QUICKACK", quickAck, 17004);
+
+	return 0;
+}
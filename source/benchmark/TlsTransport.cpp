@@ -0,0 +1,302 @@
+/**
+ * Round trip latency and throughput of plain TCP, userspace TLS and kernel TLS over loopback.
+ *
+ * Same ping-pong and windowed stream as LocalTransport. A self-signed P-256 certificate is generated at startup,
+ * TLS 1.3 negotiates AES-GCM which kTLS supports. Whether the kernel actually took over the crypto depends on the
+ * "tls" module being available, the kTLS case reports what was negotiated and otherwise measures the fallback.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "StreamSocket.h"
+#include "TlsContext.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t PingSize = 64;
+constexpr std::size_t PingIterations = 20000;
+
+constexpr std::size_t ChunkSize = 16 * 1024;
+constexpr std::size_t Window = 4;
+constexpr std::size_t TotalBytes = 512 * 1024 * 1024;
+
+constexpr const char* CertificateFile = "/tmp/commonlibs-bench-cert.pem";
+constexpr const char* KeyFile = "/tmp/commonlibs-bench-key.pem";
+
+enum class Mode
+{
+	Ping,
+	Stream
+};
+
+enum class Security
+{
+	Plain,
+	UserspaceTls,
+	KernelTls
+};
+
+void GenerateCertificate()
+{
+	EVP_PKEY* key = ::EVP_EC_gen("P-256");
+	X509* cert = ::X509_new();
+	::ASN1_INTEGER_set(::X509_get_serialNumber(cert), 1);
+	::X509_gmtime_adj(::X509_getm_notBefore(cert), 0);
+	::X509_gmtime_adj(::X509_getm_notAfter(cert), 24 * 60 * 60);
+	::X509_set_pubkey(cert, key);
+	X509_NAME* name = ::X509_get_subject_name(cert);
+	::X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+	::X509_set_issuer_name(cert, name);
+	::X509_sign(cert, key, ::EVP_sha256());
+
+	FILE* f = std::fopen(CertificateFile, "w");
+	::PEM_write_X509(f, cert);
+	std::fclose(f);
+	f = std::fopen(KeyFile, "w");
+	::PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+	std::fclose(f);
+
+	::X509_free(cert);
+	::EVP_PKEY_free(key);
+}
+
+class Server : public Common::IStreamSocketServerHandler
+			 , public Common::IStreamSocketHandler
+{
+public:
+	Server(EventLoop::EventLoop& ev, Mode mode, Common::TlsContext* tls)
+		: mServer(ev, this)
+		, mMode(mode)
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mServer.SetConnectionOptions(options);
+		if(tls != nullptr)
+		{
+			mServer.EnableTls(*tls);
+		}
+	}
+
+	void Listen(uint16_t port)
+	{
+		mServer.BindAndListen(port);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() final
+	{
+		return this;
+	}
+
+	void OnConnected() final
+	{}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* /*data*/, size_t len) final
+	{
+		const std::size_t unit = (mMode == Mode::Ping) ? PingSize : ChunkSize;
+		mReceived += len;
+		while(mReceived >= unit)
+		{
+			conn->Send(mReply.data(), (mMode == Mode::Ping) ? PingSize : 1);
+			mReceived -= unit;
+		}
+	}
+
+private:
+	Common::StreamSocketServer mServer;
+	Mode mMode;
+	std::size_t mReceived = 0;
+	std::array<char, PingSize> mReply{};
+};
+
+class Client : public Common::IStreamSocketHandler
+{
+public:
+	Client(EventLoop::EventLoop& ev, Mode mode, Common::TlsContext* tls)
+		: mEv(ev)
+		, mSocket(ev, this)
+		, mMode(mode)
+		, mChunk(ChunkSize, 'x')
+	{
+		Common::SocketOptions options;
+		options.mNoDelay = true;
+		mSocket.SetOptions(options);
+		if(tls != nullptr)
+		{
+			mSocket.EnableTls(*tls, "localhost");
+		}
+		mSamples.reserve(PingIterations);
+	}
+
+	void Start(uint16_t port)
+	{
+		mSocket.Connect("127.0.0.1", port);
+	}
+
+	void OnConnected() final
+	{
+		mKernelTls = mSocket.IsKernelTls();
+		mStart = Clock::now();
+		if(mMode == Mode::Ping)
+		{
+			SendPing();
+		}
+		else
+		{
+			for(std::size_t i = 0; i < Window; ++i)
+			{
+				SendChunk();
+			}
+		}
+	}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) final
+	{
+		mEv.Stop();
+	}
+
+	void OnIncomingData(Common::StreamSocket* /*conn*/, char* /*data*/, size_t len) final
+	{
+		if(mMode == Mode::Ping)
+		{
+			mReceived += len;
+			if(mReceived < PingSize)
+			{
+				return;
+			}
+			mReceived -= PingSize;
+			mSamples.push_back(Clock::now() - mSendTime);
+			if(mSamples.size() == PingIterations)
+			{
+				Finish();
+				return;
+			}
+			SendPing();
+			return;
+		}
+
+		mAcked += len * ChunkSize;
+		if(mAcked >= TotalBytes)
+		{
+			Finish();
+			return;
+		}
+		for(std::size_t i = 0; i < len && mSent < TotalBytes; ++i)
+		{
+			SendChunk();
+		}
+	}
+
+	void Report(const char* name)
+	{
+		const char* offload = mKernelTls ? " (kTLS active)" : "";
+		if(mMode == Mode::Ping)
+		{
+			if(mSamples.empty())
+			{
+				std::printf("%-16s no samples\n", name);
+				return;
+			}
+			std::sort(mSamples.begin(), mSamples.end());
+			const auto us = [](Clock::duration d) {
+				return std::chrono::duration<double, std::micro>(d).count();
+			};
+			std::printf("%-16s round trip p50: %6.1fus p99: %6.1fus%s\n", name,
+					us(mSamples[mSamples.size() / 2]),
+					us(mSamples[mSamples.size() * 99 / 100]),
+					offload);
+		}
+		else
+		{
+			const double seconds = std::chrono::duration<double>(mEnd - mStart).count();
+			std::printf("%-16s throughput: %8.1f MiB/s%s\n", name,
+					static_cast<double>(mAcked) / seconds / (1024 * 1024), offload);
+		}
+	}
+
+private:
+	void SendPing()
+	{
+		mSendTime = Clock::now();
+		mSocket.Send(mChunk.data(), PingSize);
+	}
+
+	void SendChunk()
+	{
+		mSocket.Send(mChunk.data(), ChunkSize);
+		mSent += ChunkSize;
+	}
+
+	void Finish()
+	{
+		mEnd = Clock::now();
+		mSocket.Shutdown();
+		mEv.Stop();
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::StreamSocket mSocket;
+	Mode mMode;
+	std::string mChunk;
+	bool mKernelTls = false;
+
+	std::size_t mReceived = 0;
+	std::size_t mSent = 0;
+	std::size_t mAcked = 0;
+	Clock::time_point mStart;
+	Clock::time_point mEnd;
+	Clock::time_point mSendTime;
+	std::vector<Clock::duration> mSamples;
+};
+
+void RunCase(const char* name, Mode mode, Security security, uint16_t port)
+{
+	Common::TlsContext serverTls(Common::TlsContext::Role::Server);
+	serverTls.LoadCertificate(CertificateFile, KeyFile);
+	Common::TlsContext clientTls(Common::TlsContext::Role::Client);
+
+	const bool useTls = (security != Security::Plain);
+	serverTls.SetKernelOffload(security == Security::KernelTls);
+	clientTls.SetKernelOffload(security == Security::KernelTls);
+
+	EventLoop::EventLoop loop;
+	Server server(loop, mode, useTls ? &serverTls : nullptr);
+	server.Listen(port);
+	Client client(loop, mode, useTls ? &clientTls : nullptr);
+	client.Start(port);
+	loop.Run();
+	client.Report(name);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+	GenerateCertificate();
+
+	RunCase("TCP", Mode::Ping, Security::Plain, 17201);
+	RunCase("TLS userspace", Mode::Ping, Security::UserspaceTls, 17202);
+	RunCase("TLS kernel", Mode::Ping, Security::KernelTls, 17203);
+
+	RunCase("TCP", Mode::Stream, Security::Plain, 17204);
+	RunCase("TLS userspace", Mode::Stream, Security::UserspaceTls, 17205);
+	RunCase("TLS kernel", Mode::Stream, Security::KernelTls, 17206);
+
+	return 0;
+}
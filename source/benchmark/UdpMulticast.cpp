@@ -0,0 +1,199 @@
+/**
+ * Multicast fan-in over loopback, several groups received on one socket and split by destination address.
+ *
+ * A forked child sends to the groups round robin with TTL 0, so nothing leaves the host. Every datagram carries
+ * its group index and a per group sequence number, the receiver checks that each handler only sees its own group
+ * and counts gaps (dropped when the socket buffer overflows) and reordering.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "UDPSocket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+constexpr std::size_t Datagrams = 1000000;
+constexpr std::size_t SendBatch = 64;
+constexpr int ReceiveBufferSize = 8 * 1024 * 1024;
+
+struct Header
+{
+	uint32_t mGroup;
+	uint32_t mSequence;
+};
+
+std::string GroupAddress(std::size_t index)
+{
+	return "239.1.1." + std::to_string(index + 1);
+}
+
+void Blast(std::size_t groups, std::size_t size, uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	Common::UDPSocket socket(loop, nullptr);
+	socket.SetMulticastLoop(true);
+	socket.SetMulticastTtl(0);
+
+	std::vector<Common::UDPEndpoint> endpoints;
+	for(std::size_t i = 0; i < groups; ++i)
+	{
+		endpoints.emplace_back(GroupAddress(i).c_str(), port);
+	}
+
+	std::vector<char> payload(size, 'x');
+	std::vector<uint32_t> sequences(groups, 0);
+	for(std::size_t i = 0; i < Datagrams; ++i)
+	{
+		const std::size_t group = i % groups;
+		const Header header{static_cast<uint32_t>(group), sequences[group]++};
+		std::memcpy(payload.data(), &header, sizeof(header));
+		socket.Queue(payload.data(), payload.size(), endpoints[group]);
+		if((i + 1) % SendBatch == 0)
+		{
+			socket.Flush();
+		}
+	}
+	socket.Flush();
+}
+
+class GroupCounter : public Common::IUDPSocketHandler
+{
+public:
+	explicit GroupCounter(uint32_t group)
+		: mGroup(group)
+	{}
+
+	void OnIncomingDatagrams(Common::UDPSocket* /*socket*/, Common::Span<Common::Datagram> datagrams) final
+	{
+		for(const auto& datagram : datagrams)
+		{
+			Header header;
+			std::memcpy(&header, datagram.mData, sizeof(header));
+			if(header.mGroup != mGroup)
+			{
+				++mMisrouted;
+				continue;
+			}
+			if(mReceived != 0 && header.mSequence <= mLastSequence)
+			{
+				++mReordered;
+			}
+			else if(mReceived != 0)
+			{
+				mLost += header.mSequence - mLastSequence - 1;
+			}
+			mLastSequence = header.mSequence;
+			++mReceived;
+		}
+		mLastTime = Clock::now();
+	}
+
+	uint32_t mGroup;
+	std::size_t mReceived = 0;
+	std::size_t mMisrouted = 0;
+	std::size_t mReordered = 0;
+	std::size_t mLost = 0;
+	uint32_t mLastSequence = 0;
+	Clock::time_point mLastTime;
+};
+
+void RunCase(std::size_t groups, std::size_t size, uint16_t port)
+{
+	EventLoop::EventLoop loop;
+	loop.ToggleRunHot();
+
+	Common::UDPDestinationDemux demux;
+	std::vector<GroupCounter> counters;
+	counters.reserve(groups);
+	for(std::size_t i = 0; i < groups; ++i)
+	{
+		counters.emplace_back(i);
+		demux.Add(GroupAddress(i).c_str(), &counters.back());
+	}
+
+	Common::UDPSocket socket(loop, &demux);
+	Common::SocketOptions options;
+	options.mReceiveBufferSize = ReceiveBufferSize;
+	socket.SetOptions(options);
+	socket.SetReceiveBuffers(32, 2048);
+	socket.SetReceiveDestination(true);
+	socket.StartListening(nullptr, port);
+	for(std::size_t i = 0; i < groups; ++i)
+	{
+		socket.JoinGroup(GroupAddress(i).c_str());
+	}
+
+	const auto start = Clock::now();
+	const pid_t child = ::fork();
+	if(child == 0)
+	{
+		Blast(groups, size, port);
+		::_exit(0);
+	}
+
+	// Stop once nothing arrived for 100ms
+	EventLoop::EventLoop::Timer idle(100ms, EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		Clock::time_point last = start;
+		for(const auto& counter : counters)
+		{
+			last = std::max(last, counter.mLastTime);
+		}
+		if(last != start && Clock::now() - last > 100ms)
+		{
+			loop.Stop();
+		}
+	});
+	loop.AddTimer(&idle);
+	loop.Run();
+	loop.RemoveTimer(&idle);
+	::kill(child, SIGKILL);
+	::waitpid(child, nullptr, 0);
+
+	std::size_t received = 0;
+	std::size_t misrouted = 0;
+	std::size_t reordered = 0;
+	std::size_t lost = 0;
+	Clock::time_point last = start;
+	for(const auto& counter : counters)
+	{
+		received += counter.mReceived;
+		misrouted += counter.mMisrouted;
+		reordered += counter.mReordered;
+		lost += counter.mLost;
+		last = std::max(last, counter.mLastTime);
+	}
+	const double seconds = std::chrono::duration<double>(last - start).count();
+	std::printf("%zu group(s) %5zuB %8.0f pps %7.1f MiB/s received:%zu lost:%zu reordered:%zu misrouted:%zu unmatched:%zu\n",
+			groups, size,
+			received / seconds,
+			received * size / seconds / (1024 * 1024),
+			received, lost, reordered, misrouted, demux.GetUnmatched());
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	RunCase(1, 64, 17701);
+	RunCase(4, 64, 17702);
+	RunCase(1, 1400, 17703);
+	RunCase(4, 1400, 17704);
+
+	return 0;
+}
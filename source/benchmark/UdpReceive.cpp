@@ -0,0 +1,263 @@
+/**
+ * UDP receive rate over loopback, recvmmsg batches versus one datagram per syscall.
+ *
+ * A forked child blasts datagrams with sendmmsg, the receiver counts what arrives between the first datagram
+ * and the sender going quiet. The batch size 1 case is the cost of a recvfrom() per datagram.
+ *
+ * When sender and receiver share a core the rate is bound by the sender, the receiver CPU time per datagram
+ * shows the difference then. The receiving loop doesn't run hot so idle time isn't counted.
+ *
+ * The GRO cases send bursts of 64 datagrams with UDP_SEGMENT, on loopback those arrive as a single coalesced
+ * buffer that UDPSocket splits again. With timestamps enabled the wire to handler latency is the time between
+ * the kernel receive timestamp and the handler call.
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <signal.h>
+#include <netinet/udp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "UDPSocket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+constexpr std::size_t Datagrams = 2000000;
+constexpr std::size_t SendBatch = 64;
+constexpr int ReceiveBufferSize = 8 * 1024 * 1024;
+
+void Blast(uint16_t port, std::size_t size, bool segmented)
+{
+	const int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in dst{};
+	dst.sin_family = AF_INET;
+	dst.sin_port = htons(port);
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(segmented)
+	{
+		// One buffer per burst, split into datagrams of size bytes by the kernel, 64 at most and under 64KiB
+		const std::size_t segments = std::min<std::size_t>(SendBatch, 65000 / size);
+		std::vector<char> payload(size * segments, 'x');
+		iovec vector{payload.data(), payload.size()};
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))]{};
+		msghdr header{};
+		header.msg_name = &dst;
+		header.msg_namelen = sizeof(dst);
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		const uint16_t segment = size;
+		std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+
+		for(std::size_t sent = 0; sent < Datagrams; )
+		{
+			if(::sendmsg(fd, &header, 0) > 0)
+			{
+				sent += segments;
+			}
+		}
+		::close(fd);
+		return;
+	}
+
+	std::vector<char> payload(size, 'x');
+	std::array<iovec, SendBatch> vectors;
+	std::array<mmsghdr, SendBatch> headers{};
+	for(std::size_t i = 0; i < SendBatch; ++i)
+	{
+		vectors[i] = iovec{payload.data(), size};
+		headers[i].msg_hdr.msg_name = &dst;
+		headers[i].msg_hdr.msg_namelen = sizeof(dst);
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for(std::size_t sent = 0; sent < Datagrams; )
+	{
+		const int ret = ::sendmmsg(fd, headers.data(), SendBatch, 0);
+		if(ret > 0)
+		{
+			sent += ret;
+		}
+	}
+	::close(fd);
+}
+
+struct Case
+{
+	const char* mName;
+	std::size_t mBatch;
+	std::size_t mSize;
+	uint16_t mPort;
+	bool mOffload;
+	bool mTimestamps;
+};
+
+class Receiver : public Common::IUDPSocketHandler
+{
+public:
+	Receiver(EventLoop::EventLoop& ev, const Case& config)
+		: mEv(ev)
+		, mSocket(ev, this)
+		, mIdleTimer(200ms, EventLoop::EventLoop::TimerType::Repeating, [this](){ CheckIdle(); })
+	{
+		Common::SocketOptions options;
+		options.mReceiveBufferSize = ReceiveBufferSize;
+		mSocket.SetOptions(options);
+		mSocket.SetReceiveBuffers(config.mBatch, 2048);
+		if(config.mOffload)
+		{
+			mSocket.SetReceiveOffload(true);
+		}
+		if(config.mTimestamps)
+		{
+			mSocket.SetReceiveTimestamps(true);
+			mLatencies.reserve(Datagrams);
+		}
+		mSocket.StartListening("127.0.0.1", config.mPort);
+		mEv.AddTimer(&mIdleTimer);
+	}
+
+	~Receiver()
+	{
+		mEv.RemoveTimer(&mIdleTimer);
+	}
+
+	void OnIncomingDatagrams(Common::UDPSocket* /*socket*/, Common::Span<Common::Datagram> datagrams) final
+	{
+		if(mReceived == 0)
+		{
+			mStart = Clock::now();
+			mStartCpu = GetCpuTime();
+		}
+		mLast = Clock::now();
+		mLastCpu = GetCpuTime();
+		mReceived += datagrams.size();
+		++mCalls;
+		const std::chrono::nanoseconds now = GetRealTime();
+		for(const auto& datagram : datagrams)
+		{
+			mBytes += datagram.mLength;
+			if(datagram.mTimestamp.count() != 0)
+			{
+				mLatencies.push_back(now - datagram.mTimestamp);
+			}
+		}
+	}
+
+	void Report(const char* name, std::size_t size)
+	{
+		const double seconds = std::chrono::duration<double>(mLast - mStart).count();
+		const double cpu = std::chrono::duration<double, std::nano>(mLastCpu - mStartCpu).count();
+		std::printf("%-14s %5zuB %8.0f pps %7.1f MiB/s %6.0fns cpu/datagram %5.1f datagrams/syscall (%zu of %zu)\n",
+				name, size,
+				mReceived / seconds,
+				mBytes / seconds / (1024 * 1024),
+				cpu / mReceived,
+				static_cast<double>(mReceived) / mCalls,
+				mReceived, Datagrams);
+		if(!mLatencies.empty())
+		{
+			std::sort(mLatencies.begin(), mLatencies.end());
+			const auto us = [](std::chrono::nanoseconds d) {
+				return std::chrono::duration<double, std::micro>(d).count();
+			};
+			std::printf("%-14s wire to handler p50: %8.2fus p99: %8.2fus\n", "",
+					us(mLatencies[mLatencies.size() / 2]),
+					us(mLatencies[mLatencies.size() * 99 / 100]));
+		}
+	}
+
+private:
+	static std::chrono::microseconds GetCpuTime()
+	{
+		rusage usage{};
+		::getrusage(RUSAGE_SELF, &usage);
+		return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+			std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+	}
+
+	static std::chrono::nanoseconds GetRealTime()
+	{
+		timespec ts;
+		::clock_gettime(CLOCK_REALTIME, &ts);
+		return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+	}
+
+	void CheckIdle()
+	{
+		if(mReceived != 0 && Clock::now() - mLast > 100ms)
+		{
+			mEv.Stop();
+		}
+	}
+
+	EventLoop::EventLoop& mEv;
+	Common::UDPSocket mSocket;
+	EventLoop::EventLoop::Timer mIdleTimer;
+
+	std::size_t mReceived = 0;
+	std::size_t mBytes = 0;
+	std::size_t mCalls = 0;
+	Clock::time_point mStart;
+	Clock::time_point mLast;
+	std::chrono::microseconds mStartCpu{0};
+	std::chrono::microseconds mLastCpu{0};
+	std::vector<std::chrono::nanoseconds> mLatencies;
+};
+
+void RunCase(const Case& config, bool segmented)
+{
+	EventLoop::EventLoop loop;
+	loop.ToggleRunHot();
+	Receiver receiver(loop, config);
+
+	const pid_t child = ::fork();
+	if(child == 0)
+	{
+		Blast(config.mPort, config.mSize, segmented);
+		::_exit(0);
+	}
+
+	loop.Run();
+	::kill(child, SIGKILL);
+	::waitpid(child, nullptr, 0);
+	receiver.Report(config.mName, config.mSize);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	RunCase({"recvmmsg x32", 32, 64, 17501, false, false}, false);
+	RunCase({"recvmmsg x1", 1, 64, 17502, false, false}, false);
+	RunCase({"recvmmsg x32", 32, 1400, 17503, false, false}, false);
+	RunCase({"recvmmsg x1", 1, 1400, 17504, false, false}, false);
+
+	// Bursts sent with UDP_SEGMENT, received as is or coalesced
+	RunCase({"burst", 32, 1400, 17505, false, true}, true);
+	RunCase({"burst+GRO", 32, 1400, 17506, true, true}, true);
+	RunCase({"burst", 32, 64, 17507, false, true}, true);
+	RunCase({"burst+GRO", 32, 64, 17508, true, true}, true);
+
+	return 0;
+}
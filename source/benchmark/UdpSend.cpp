@@ -0,0 +1,103 @@
+/**
+ * UDP send rate over loopback for the different UDPSocket send paths.
+ *
+ * - address string: Send() with the destination as string, parsed on every call, one sendto() per datagram
+ * - endpoint: Send() with a pre-parsed UDPEndpoint, one sendto() per datagram
+ * - sendmmsg: Queue() and Flush() every 64 datagrams, one syscall per batch
+ * - sendmmsg+GSO: as above with UDP_SEGMENT, the kernel splits one buffer per batch into datagrams
+ *
+ * The receiving socket is never read, the datagrams are dropped once its buffer is full.
+ */
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "UDPSocket.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t Datagrams = 1000000;
+constexpr std::size_t Batch = 64;
+constexpr uint16_t Port = 17601;
+
+enum class Path
+{
+	AddressString,
+	Endpoint,
+	Batched,
+	Segmented
+};
+
+void RunCase(const char* name, Path path, std::size_t size)
+{
+	EventLoop::EventLoop loop;
+	Common::IUDPSocketHandler handler;
+	Common::UDPSocket sink(loop, &handler);
+	sink.StartListening("127.0.0.1", Port);
+
+	Common::UDPSocket socket(loop, &handler);
+	socket.SetSegmentation(path == Path::Segmented);
+	const Common::UDPEndpoint endpoint("127.0.0.1", Port);
+	const std::string payload(size, 'x');
+
+	std::size_t sent = 0;
+	const auto start = Clock::now();
+	for(std::size_t i = 0; i < Datagrams; ++i)
+	{
+		switch(path)
+		{
+			case Path::AddressString:
+			{
+				socket.Send(payload.data(), payload.size(), "127.0.0.1", Port);
+				++sent;
+				break;
+			}
+			case Path::Endpoint:
+			{
+				socket.Send(payload.data(), payload.size(), endpoint);
+				++sent;
+				break;
+			}
+			case Path::Batched:
+			case Path::Segmented:
+			{
+				socket.Queue(payload.data(), payload.size(), endpoint);
+				if((i + 1) % Batch == 0)
+				{
+					sent += socket.Flush();
+				}
+				break;
+			}
+		}
+	}
+	sent += socket.Flush();
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::printf("%-16s %5zuB %9.0f pps %8.1f MiB/s %6.0fns/datagram (%zu sent)\n", name, size,
+			sent / seconds,
+			sent * size / seconds / (1024 * 1024),
+			seconds * 1e9 / Datagrams,
+			sent);
+}
+
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::err);
+
+	for(const std::size_t size : {64, 1400})
+	{
+		RunCase("address string", Path::AddressString, size);
+		RunCase("endpoint", Path::Endpoint, size);
+		RunCase("sendmmsg", Path::Batched, size);
+		RunCase("sendmmsg+GSO", Path::Segmented, size);
+	}
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * libFuzzer target for the MQTT decoder.
+ *
+ * The input is fed to MQTTParser in reads of a size taken from its first byte, each packet the parser splits off
+ * is decoded with MQTTPacket and MQTTPublishView, as MQTT 3.1.1 or 5 depending on the top bit of that byte. Packets that decode are encoded again and must come out byte for
+ * byte as they went in, and must decode the same the second time, so both directions are checked.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+namespace {
+
+void Check(bool condition)
+{
+	if(!condition)
+	{
+		std::abort();
+	}
+}
+
+/**
+ * @brief Encode @p packet and compare it with the @p len bytes it was decoded from
+ */
+template<typename Packet>
+void CheckReencoded(const Packet& packet, const char* data, std::size_t len)
+{
+	const auto message = MQTT::MakeMessage(packet);
+	Check(message.size() == len && std::memcmp(message.data(), data, len) == 0);
+}
+
+void DecodePacket(const char* data, std::size_t len, MQTT::MQTTVersion version)
+{
+	// A copy of exactly the packet so reads past its end are caught
+	const std::vector<char> bytes(data, data + len);
+	data = bytes.data();
+
+	const MQTT::MQTTPacket packet(data, len, version);
+	const MQTT::MQTTPublishView view(data, len, version);
+	Check(view.IsValid() == (packet.IsValid() && packet.GetPublishPacket() != nullptr));
+	if(!packet.IsValid())
+	{
+		return;
+	}
+	Check(packet.mFixedHeader.GetPacketSize() <= len);
+
+	// Only packets this side would have encoded the same way can be compared, the Remaining Length may have been
+	// sent with more bytes than needed, and flags and fields not encoded here, e.g. DUP, RETAIN or a will, come
+	// back as zero
+	const auto& header = packet.mFixedHeader;
+	if(header.GetHeaderSize() != 1 + MQTT::RemainingLengthSize(header.GetSize()))
+	{
+		return;
+	}
+	const auto flags = static_cast<std::uint8_t>(data[0]) & 0x0F;
+	if(const auto* publish = packet.GetPublishPacket())
+	{
+		Check(publish->GetTopicFilter() == view.GetTopic());
+		Check(publish->GetTopicPayload().size() == view.GetPayload().size());
+		if((flags & 0b1001) == 0 && len == publish->GetEncodedSize())
+		{
+			CheckReencoded(*publish, data, len);
+		}
+	}
+	else if(const auto* subscribe = packet.GetSubscribePacket())
+	{
+		if(flags == 0b0010 && len == subscribe->GetEncodedSize())
+		{
+			CheckReencoded(*subscribe, data, len);
+		}
+	}
+	else if(const auto* unsubscribe = packet.GetUnsubscribePacket())
+	{
+		if(flags == 0b0010 && len == unsubscribe->GetEncodedSize())
+		{
+			CheckReencoded(*unsubscribe, data, len);
+		}
+	}
+	else if(const auto* suback = packet.GetSubAckPacket())
+	{
+		if(flags == 0 && len == suback->GetEncodedSize())
+		{
+			CheckReencoded(*suback, data, len);
+		}
+	}
+	else if(const auto* unsuback = packet.GetUnSubAckPacket())
+	{
+		if(flags == 0 && len == unsuback->GetEncodedSize())
+		{
+			CheckReencoded(*unsuback, data, len);
+		}
+	}
+	else if(const auto* ack = packet.GetPublishAckPacket())
+	{
+		// PUBREL has flags that are not kept, and a reason code of 0 is not sent
+		const auto expectedFlags = ack->GetType() == MQTT::MQTTPacketType::PUBREL ? 0b0010 : 0;
+		if(flags == expectedFlags && len == ack->GetEncodedSize())
+		{
+			CheckReencoded(*ack, data, len);
+		}
+	}
+	else if(const auto* connect = packet.GetConnectPacket())
+	{
+		const auto again = MQTT::MakeMessage(*connect);
+		const MQTT::MQTTPacket reparsed(again.data(), again.size(), version);
+		Check(reparsed.IsValid() && reparsed.GetConnectPacket() != nullptr);
+		Check(reparsed.GetConnectPacket()->GetClientID() == connect->GetClientID());
+		Check(reparsed.GetConnectPacket()->GetKeepAlive() == connect->GetKeepAlive());
+		Check(reparsed.GetConnectPacket()->GetVersion() == connect->GetVersion());
+	}
+	else if(const auto* connack = packet.GetConnackPacket())
+	{
+		// Properties may come in any order, so compare what is decoded again
+		const auto again = MQTT::MakeMessage(*connack);
+		const MQTT::MQTTPacket reparsed(again.data(), again.size(), version);
+		Check(reparsed.IsValid() && reparsed.GetConnackPacket() != nullptr);
+		const auto& properties = reparsed.GetConnackPacket()->GetProperties();
+		Check(reparsed.GetConnackPacket()->IsSessionPresent() == connack->IsSessionPresent());
+		Check(reparsed.GetConnackPacket()->GetReturnCode() == connack->GetReturnCode());
+		Check(properties.mReceiveMaximum == connack->GetProperties().mReceiveMaximum);
+		Check(properties.mMaximumPacketSize == connack->GetProperties().mMaximumPacketSize);
+		Check(properties.mTopicAliasMaximum == connack->GetProperties().mTopicAliasMaximum);
+	}
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+	if(size == 0)
+	{
+		return 0;
+	}
+	const std::size_t chunk = 1 + (data[0] & 0x7F);
+	const auto version = data[0] & 0x80 ? MQTT::MQTTVersion::V5 : MQTT::MQTTVersion::V311;
+	const char* stream = reinterpret_cast<const char*>(data + 1);
+	const std::size_t streamSize = size - 1;
+
+	MQTT::MQTTParser parser;
+	parser.SetMaxPacketSize(64 * 1024);
+	for(std::size_t offset = 0; offset < streamSize; offset += chunk)
+	{
+		const std::size_t len = std::min(chunk, streamSize - offset);
+		const auto status = parser.Feed(stream + offset, len, [version](const char* packet, std::size_t packetSize) {
+			DecodePacket(packet, packetSize, version);
+			return true;
+		});
+		if(status == Common::DecodeStatus::Malformed)
+		{
+			break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,724 @@
+/**
+ * Load generator for MQTT brokers.
+ *
+ * Publishers and subscribers are MQTTClient instances, spread over one or more EventLoops that each run on a thread
+ * of their own. Every publisher sends to one of the topics at a fixed rate, every subscriber subscribes to one of
+ * them, so a message reaches about subscribers / topics clients. Messages are sent on schedule whether or not the
+ * broker keeps up. The payload starts with the time the message was published, the subscriber takes the difference
+ * when it arrives. The latencies of all loops are reported as a histogram, together with the throughput.
+ *
+ * Without --host an MQTTBroker is started on loopback, on a loop and thread of its own.
+ */
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "EventLoop.h"
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/// The publish time at the start of every payload, in steady clock nanoseconds
+constexpr std::size_t TimestampSize = sizeof(std::int64_t);
+/// Connection attempts in progress per loop, more would overflow the accept queue of the broker
+constexpr std::size_t MaxConnecting = 64;
+constexpr std::chrono::milliseconds PacingInterval = 1ms;
+constexpr std::chrono::milliseconds ConnectTimeout = 60s;
+/// How long subscribers keep receiving after the last message was published
+constexpr std::chrono::milliseconds DrainTime = 2s;
+
+struct Options
+{
+	std::string mHost = "127.0.0.1";
+	std::uint16_t mPort = 1883;
+	/// Without --host the broker is run in this process
+	bool mStartBroker = true;
+	std::size_t mLoops = 1;
+	std::size_t mPublishers = 100;
+	std::size_t mSubscribers = 100;
+	std::size_t mTopics = 10;
+	/// Messages per second of each publisher
+	double mRate = 10;
+	std::size_t mPayloadSize = 64;
+	int mQoS = 0;
+	std::uint16_t mWindow = MQTT::MQTTClient::DefaultInFlightWindow;
+	std::chrono::seconds mDuration = 10s;
+	bool mCoalescing = false;
+	bool mSpin = true;
+	MQTT::MQTTVersion mVersion = MQTT::MQTTVersion::V311;
+	bool mVerbose = false;
+};
+
+std::int64_t Now() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+std::string FormatNs(double ns)
+{
+	char text[32];
+	if(ns < 1e3)
+	{
+		std::snprintf(text, sizeof(text), "%.0fns", ns);
+	}
+	else if(ns < 1e6)
+	{
+		std::snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+	}
+	else if(ns < 1e9)
+	{
+		std::snprintf(text, sizeof(text), "%.2fms", ns / 1e6);
+	}
+	else
+	{
+		std::snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+	}
+	return text;
+}
+
+/**
+ * @brief Latencies counted in buckets of an eighth of a power of two, so percentiles are within 12.5%
+ */
+class LatencyHistogram
+{
+public:
+	void Add(std::uint64_t ns) noexcept
+	{
+		++mCounts[GetBucket(ns)];
+		++mCount;
+		mSum += ns;
+		mMin = std::min(mMin, ns);
+		mMax = std::max(mMax, ns);
+	}
+
+	void Merge(const LatencyHistogram& other) noexcept
+	{
+		for(std::size_t i = 0; i < Buckets; ++i)
+		{
+			mCounts[i] += other.mCounts[i];
+		}
+		mCount += other.mCount;
+		mSum += other.mSum;
+		mMin = std::min(mMin, other.mMin);
+		mMax = std::max(mMax, other.mMax);
+	}
+
+	/**
+	 * @return The upper end of the bucket holding @p fraction of the values, capped at the largest value.
+	 */
+	std::uint64_t GetPercentile(double fraction) const noexcept
+	{
+		const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(fraction * mCount)));
+		std::uint64_t seen = 0;
+		for(std::size_t i = 0; i < Buckets; ++i)
+		{
+			seen += mCounts[i];
+			if(seen >= rank)
+			{
+				return std::min(GetLowerBound(i) + GetWidth(i) - 1, mMax);
+			}
+		}
+		return mMax;
+	}
+
+	void Print() const
+	{
+		if(mCount == 0)
+		{
+			std::printf("  no messages received\n");
+			return;
+		}
+		std::printf("  min %s  p50 %s  p90 %s  p99 %s  p99.9 %s  p99.99 %s  max %s  mean %s\n",
+				FormatNs(mMin).c_str(),
+				FormatNs(GetPercentile(0.5)).c_str(),
+				FormatNs(GetPercentile(0.9)).c_str(),
+				FormatNs(GetPercentile(0.99)).c_str(),
+				FormatNs(GetPercentile(0.999)).c_str(),
+				FormatNs(GetPercentile(0.9999)).c_str(),
+				FormatNs(mMax).c_str(),
+				FormatNs(static_cast<double>(mSum) / mCount).c_str());
+
+		// One row per power of two
+		std::array<std::uint64_t, Buckets / SubBuckets> rows{};
+		for(std::size_t i = 0; i < Buckets; ++i)
+		{
+			rows[i / SubBuckets] += mCounts[i];
+		}
+		const std::size_t first = GetBucket(mMin) / SubBuckets;
+		const std::size_t last = GetBucket(mMax) / SubBuckets;
+		const std::uint64_t largest = *std::max_element(rows.begin(), rows.end());
+		std::uint64_t seen = 0;
+		for(std::size_t row = first; row <= last; ++row)
+		{
+			seen += rows[row];
+			const std::size_t bar = static_cast<std::size_t>(40.0 * rows[row] / largest + 0.5);
+			std::printf("  %9s - %-9s %12llu %8.3f%%  %s\n",
+					FormatNs(GetLowerBound(row * SubBuckets)).c_str(),
+					FormatNs(GetLowerBound(row * SubBuckets + SubBuckets - 1) + GetWidth(row * SubBuckets)).c_str(),
+					static_cast<unsigned long long>(rows[row]),
+					100.0 * seen / mCount,
+					std::string(bar, '#').c_str());
+		}
+	}
+
+private:
+	static constexpr unsigned SubBucketBits = 3;
+	static constexpr std::size_t SubBuckets = 1 << SubBucketBits;
+	static constexpr std::size_t Buckets = (64 - SubBucketBits + 1) * SubBuckets;
+
+	static std::size_t GetBucket(std::uint64_t value) noexcept
+	{
+		if(value < SubBuckets)
+		{
+			return value;
+		}
+		const unsigned msb = 63 - __builtin_clzll(value);
+		return ((msb - SubBucketBits + 1) << SubBucketBits) + ((value >> (msb - SubBucketBits)) & (SubBuckets - 1));
+	}
+
+	static std::uint64_t GetLowerBound(std::size_t bucket) noexcept
+	{
+		if(bucket < SubBuckets)
+		{
+			return bucket;
+		}
+		return (SubBuckets + bucket % SubBuckets) << (bucket / SubBuckets - 1);
+	}
+
+	static std::uint64_t GetWidth(std::size_t bucket) noexcept
+	{
+		return bucket < SubBuckets ? 1 : std::uint64_t(1) << (bucket / SubBuckets - 1);
+	}
+
+	std::array<std::uint64_t, Buckets> mCounts{};
+	std::uint64_t mCount = 0;
+	std::uint64_t mSum = 0;
+	std::uint64_t mMin = std::numeric_limits<std::uint64_t>::max();
+	std::uint64_t mMax = 0;
+};
+
+/**
+ * @brief What the threads share, only through atomics
+ */
+struct SharedState
+{
+	/// Publishers connected and subscribers acknowledged
+	std::atomic<std::size_t> mReady{0};
+	/// When publishing started, 0 until every client is ready
+	std::atomic<std::int64_t> mStart{0};
+	/// Set when a loop stopped early, every other one stops as well
+	std::atomic<bool> mAbort{false};
+	std::atomic<bool> mBrokerStop{false};
+};
+
+class Worker;
+
+class LoadClient : public MQTT::IMQTTClientHandler
+{
+public:
+	LoadClient(Worker& worker, EventLoop::EventLoop& ev, std::size_t topic, bool publisher)
+		: mWorker(worker)
+		, mClient(ev, this)
+		, mTopic(topic)
+		, mTopicName("loadgen/topic-" + std::to_string(topic))
+		, mPublisher(publisher)
+	{}
+
+	void OnConnected() final;
+	void OnDisconnect(MQTT::MQTTClient* conn) final;
+	void OnSubscribed(const std::string& topicFilter, std::uint8_t returnCode) final;
+	void OnPublish(std::string_view topic, Common::Span<const char> payload) final;
+	void OnPublishComplete(const std::string& topic) final;
+
+	Worker& mWorker;
+	MQTT::MQTTClient mClient;
+	const std::size_t mTopic;
+	const std::string mTopicName;
+	const bool mPublisher;
+	bool mConnected = false;
+	/// Where in each period the publisher sends, as a fraction of it
+	double mPhase = 0;
+	std::uint64_t mSent = 0;
+};
+
+/**
+ * @brief One EventLoop and the clients on it, run on a thread of its own
+ */
+class Worker
+{
+public:
+	Worker(const Options& options, SharedState& shared, const std::vector<std::size_t>& fanOut)
+		: mOptions(options)
+		, mShared(shared)
+		, mFanOut(fanOut)
+		, mPayload(options.mPayloadSize, 'x')
+		, mPacingTimer(PacingInterval, EventLoop::EventLoop::TimerType::Repeating, [this]() { Tick(); })
+	{
+		if(!mOptions.mSpin)
+		{
+			mLoop.ToggleRunHot();
+		}
+	}
+
+	void AddClient(const std::string& clientId, std::size_t topic, bool publisher)
+	{
+		auto client = std::make_unique<LoadClient>(*this, mLoop, topic, publisher);
+		client->mClient.Initialise(clientId, std::nullopt, mOptions.mVersion);
+		client->mClient.SetInFlightWindow(mOptions.mWindow);
+		client->mClient.SetCoalescing(mOptions.mCoalescing);
+		if(publisher)
+		{
+			mPublishers.push_back(client.get());
+		}
+		mClients.push_back(std::move(client));
+	}
+
+	/**
+	 * @brief The thread, returns once publishing and draining are over or another loop stopped early
+	 */
+	void Run()
+	{
+		for(std::size_t i = 0; i < mPublishers.size(); ++i)
+		{
+			mPublishers[i]->mPhase = static_cast<double>(i) / mPublishers.size();
+		}
+		mLoop.AddTimer(&mPacingTimer);
+		ConnectNext();
+		mLoop.Run();
+		mLoop.RemoveTimer(&mPacingTimer);
+		if(!mFinished)
+		{
+			mShared.mAbort = true;
+		}
+		// The clients use the loop, they go first
+		mPublishers.clear();
+		mClients.clear();
+	}
+
+	void OnConnected(LoadClient& client)
+	{
+		if(client.mConnected)
+		{
+			return;
+		}
+		client.mConnected = true;
+		--mConnecting;
+		if(client.mPublisher)
+		{
+			++mShared.mReady;
+		}
+		else
+		{
+			client.mClient.Subscribe(client.mTopicName);
+		}
+		ConnectNext();
+	}
+
+	/**
+	 * @brief A client that never connected frees its connect slot, it won't be ready so the run ends
+	 */
+	void OnDisconnect(LoadClient& client)
+	{
+		if(client.mConnected)
+		{
+			return;
+		}
+		--mConnecting;
+		mShared.mAbort = true;
+	}
+
+	void OnSubscribed(std::uint8_t returnCode)
+	{
+		if(returnCode >= MQTT::SubackFailure)
+		{
+			++mRefused;
+			mShared.mAbort = true;
+			return;
+		}
+		++mShared.mReady;
+	}
+
+	void OnMessage(Common::Span<const char> payload)
+	{
+		++mReceived;
+		if(payload.size() < TimestampSize)
+		{
+			return;
+		}
+		std::int64_t published;
+		std::memcpy(&published, payload.data(), TimestampSize);
+		mLatency.Add(static_cast<std::uint64_t>(std::max<std::int64_t>(0, Now() - published)));
+	}
+
+	const Options& mOptions;
+	SharedState& mShared;
+	const std::vector<std::size_t>& mFanOut;
+	EventLoop::EventLoop mLoop;
+	std::vector<std::unique_ptr<LoadClient>> mClients;
+	std::vector<LoadClient*> mPublishers;
+
+	std::uint64_t mPublished = 0;
+	/// Deliveries the published messages should make, by the subscribers of their topics
+	std::uint64_t mExpected = 0;
+	std::uint64_t mReceived = 0;
+	std::uint64_t mCompleted = 0;
+	std::size_t mRefused = 0;
+	LatencyHistogram mLatency;
+
+private:
+	void ConnectNext()
+	{
+		while(mConnecting < MaxConnecting && mNextClient < mClients.size())
+		{
+			++mConnecting;
+			mClients[mNextClient++]->mClient.Connect(mOptions.mHost, mOptions.mPort);
+		}
+	}
+
+	/**
+	 * @brief Publish the messages that are due since the start, so a late timer is made up for
+	 *
+	 * The publishers of the loop are spread over the period instead of sending all at once.
+	 */
+	void Tick()
+	{
+		if(mShared.mAbort)
+		{
+			mLoop.Stop();
+			return;
+		}
+		const std::int64_t start = mShared.mStart.load(std::memory_order_acquire);
+		if(start == 0)
+		{
+			return;
+		}
+		const std::chrono::nanoseconds elapsed(Now() - start);
+		if(elapsed >= mOptions.mDuration + DrainTime)
+		{
+			mFinished = true;
+			mLoop.Stop();
+			return;
+		}
+		if(elapsed >= mOptions.mDuration)
+		{
+			return;
+		}
+		const double periods = std::chrono::duration<double>(elapsed).count() * mOptions.mRate;
+		for(auto* publisher : mPublishers)
+		{
+			for(; publisher->mSent + publisher->mPhase <= periods; ++publisher->mSent)
+			{
+				const std::int64_t now = Now();
+				std::memcpy(mPayload.data(), &now, TimestampSize);
+				publisher->mClient.Publish(publisher->mTopicName, mPayload, mOptions.mQoS);
+				++mPublished;
+				mExpected += mFanOut[publisher->mTopic];
+			}
+		}
+	}
+
+	std::string mPayload;
+	EventLoop::EventLoop::Timer mPacingTimer;
+	std::size_t mNextClient = 0;
+	std::size_t mConnecting = 0;
+	bool mFinished = false;
+};
+
+void LoadClient::OnConnected()
+{
+	mWorker.OnConnected(*this);
+}
+
+void LoadClient::OnDisconnect(MQTT::MQTTClient* /*conn*/)
+{
+	mWorker.OnDisconnect(*this);
+}
+
+void LoadClient::OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t returnCode)
+{
+	mWorker.OnSubscribed(returnCode);
+}
+
+void LoadClient::OnPublish(std::string_view /*topic*/, Common::Span<const char> payload)
+{
+	mWorker.OnMessage(payload);
+}
+
+void LoadClient::OnPublishComplete(const std::string& /*topic*/)
+{
+	++mWorker.mCompleted;
+}
+
+void PrintUsage(const char* name)
+{
+	const Options defaults;
+	std::printf(
+			"Usage: %s [options]\n"
+			"\n"
+			"  -h, --host HOST         broker to load, without it an MQTTBroker is started on 127.0.0.1\n"
+			"  -p, --port PORT         broker port (%u)\n"
+			"  -l, --loops N           event loops, each on a thread of its own (%zu)\n"
+			"  -P, --publishers N      publishing clients (%zu)\n"
+			"  -S, --subscribers N     subscribing clients (%zu)\n"
+			"  -t, --topics N          topics, the subscribers are split over them (%zu)\n"
+			"  -r, --rate N            messages per second of each publisher (%g)\n"
+			"  -s, --size BYTES        payload size, at least %zu for the timestamp (%zu)\n"
+			"  -q, --qos N             QoS of the published messages (%d)\n"
+			"  -w, --window N          QoS 1 and 2 messages in flight per publisher (%u)\n"
+			"  -d, --duration SECONDS  how long to publish (%lld)\n"
+			"  -c, --coalescing        coalesce the packets of a client into one send per loop cycle\n"
+			"  -5, --mqtt5             connect with MQTT 5 instead of 3.1.1\n"
+			"      --no-spin           let the loops sleep in epoll_wait instead of polling\n"
+			"  -v, --verbose           log what the clients and the broker do\n"
+			"      --help              show this text\n",
+			name, defaults.mPort, defaults.mLoops, defaults.mPublishers, defaults.mSubscribers, defaults.mTopics,
+			defaults.mRate, TimestampSize, defaults.mPayloadSize, defaults.mQoS, defaults.mWindow,
+			static_cast<long long>(defaults.mDuration.count()));
+}
+
+/**
+ * @return False when the options are invalid or --help was given, the usage was printed then.
+ */
+bool ParseOptions(int argc, char* argv[], Options& options)
+{
+	enum { NoSpin = 256, Help };
+	static const option longOptions[] = {
+		{"host", required_argument, nullptr, 'h'},
+		{"port", required_argument, nullptr, 'p'},
+		{"loops", required_argument, nullptr, 'l'},
+		{"publishers", required_argument, nullptr, 'P'},
+		{"subscribers", required_argument, nullptr, 'S'},
+		{"topics", required_argument, nullptr, 't'},
+		{"rate", required_argument, nullptr, 'r'},
+		{"size", required_argument, nullptr, 's'},
+		{"qos", required_argument, nullptr, 'q'},
+		{"window", required_argument, nullptr, 'w'},
+		{"duration", required_argument, nullptr, 'd'},
+		{"coalescing", no_argument, nullptr, 'c'},
+		{"mqtt5", no_argument, nullptr, '5'},
+		{"no-spin", no_argument, nullptr, NoSpin},
+		{"verbose", no_argument, nullptr, 'v'},
+		{"help", no_argument, nullptr, Help},
+		{nullptr, 0, nullptr, 0}
+	};
+
+	try
+	{
+		int option;
+		while((option = ::getopt_long(argc, argv, "h:p:l:P:S:t:r:s:q:w:d:c5v", longOptions, nullptr)) != -1)
+		{
+			switch(option)
+			{
+				case 'h': options.mHost = optarg; options.mStartBroker = false; break;
+				case 'p': options.mPort = static_cast<std::uint16_t>(std::stoul(optarg)); break;
+				case 'l': options.mLoops = std::stoul(optarg); break;
+				case 'P': options.mPublishers = std::stoul(optarg); break;
+				case 'S': options.mSubscribers = std::stoul(optarg); break;
+				case 't': options.mTopics = std::stoul(optarg); break;
+				case 'r': options.mRate = std::stod(optarg); break;
+				case 's': options.mPayloadSize = std::stoul(optarg); break;
+				case 'q': options.mQoS = std::stoi(optarg); break;
+				case 'w': options.mWindow = static_cast<std::uint16_t>(std::stoul(optarg)); break;
+				case 'd': options.mDuration = std::chrono::seconds(std::stoul(optarg)); break;
+				case 'c': options.mCoalescing = true; break;
+				case '5': options.mVersion = MQTT::MQTTVersion::V5; break;
+				case NoSpin: options.mSpin = false; break;
+				case 'v': options.mVerbose = true; break;
+				default: PrintUsage(argv[0]); return false;
+			}
+		}
+	}
+	catch(const std::logic_error&)
+	{
+		std::fprintf(stderr, "Invalid value for an option\n");
+		return false;
+	}
+
+	if(optind != argc || options.mLoops == 0 || options.mTopics == 0 || options.mRate <= 0 ||
+			options.mPayloadSize < TimestampSize || options.mQoS < 0 || options.mQoS > 2 || options.mWindow == 0 ||
+			options.mDuration.count() == 0)
+	{
+		PrintUsage(argv[0]);
+		return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if(!ParseOptions(argc, argv, options))
+	{
+		return 1;
+	}
+	spdlog::set_level(options.mVerbose ? spdlog::level::info : spdlog::level::off);
+
+	SharedState shared;
+
+	// Subscribers of each topic
+	std::vector<std::size_t> fanOut(options.mTopics, 0);
+	for(std::size_t i = 0; i < options.mSubscribers; ++i)
+	{
+		++fanOut[i % options.mTopics];
+	}
+
+	// The loops block SIGINT and read it from a signalfd, the threads inherit the mask of this one
+	std::unique_ptr<EventLoop::EventLoop> brokerLoop;
+	std::unique_ptr<MQTTBroker::MQTTBroker> broker;
+	std::unique_ptr<EventLoop::EventLoop::Timer> brokerStopTimer;
+	std::thread brokerThread;
+	if(options.mStartBroker)
+	{
+		brokerLoop = std::make_unique<EventLoop::EventLoop>();
+		broker = std::make_unique<MQTTBroker::MQTTBroker>(*brokerLoop);
+		try
+		{
+			broker->Initialise(options.mPort);
+		}
+		catch(const std::runtime_error& e)
+		{
+			std::fprintf(stderr, "Can't start the broker on port %u: %s\n", options.mPort, e.what());
+			return 1;
+		}
+		if(!options.mSpin)
+		{
+			brokerLoop->ToggleRunHot();
+		}
+		brokerStopTimer = std::make_unique<EventLoop::EventLoop::Timer>(10ms,
+				EventLoop::EventLoop::TimerType::Repeating, [&loop = *brokerLoop, &shared]() {
+					if(shared.mBrokerStop)
+					{
+						loop.Stop();
+					}
+				});
+		brokerLoop->AddTimer(brokerStopTimer.get());
+		brokerThread = std::thread([&loop = *brokerLoop, &shared]() {
+			loop.Run();
+			if(!shared.mBrokerStop)
+			{
+				shared.mAbort = true;
+			}
+		});
+	}
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	for(std::size_t i = 0; i < options.mLoops; ++i)
+	{
+		workers.push_back(std::make_unique<Worker>(options, shared, fanOut));
+	}
+	// Subscribers first, so they are connected before the publishers
+	const std::string prefix = "loadgen-" + std::to_string(::getpid());
+	for(std::size_t i = 0; i < options.mSubscribers; ++i)
+	{
+		workers[i % workers.size()]->AddClient(prefix + "-s" + std::to_string(i), i % options.mTopics, false);
+	}
+	for(std::size_t i = 0; i < options.mPublishers; ++i)
+	{
+		workers[i % workers.size()]->AddClient(prefix + "-p" + std::to_string(i), i % options.mTopics, true);
+	}
+
+	std::printf("%zu publishers at %g msg/s, %zu subscribers on %zu topics, %zuB payload, QoS %d, %zu loop%s\n",
+			options.mPublishers, options.mRate, options.mSubscribers, options.mTopics, options.mPayloadSize,
+			options.mQoS, options.mLoops, options.mLoops == 1 ? "" : "s");
+	std::printf("Broker %s:%u%s\n", options.mHost.c_str(), options.mPort,
+			options.mStartBroker ? ", MQTTBroker in this process" : "");
+
+	std::vector<std::thread> threads;
+	const auto connectStart = Clock::now();
+	for(auto& worker : workers)
+	{
+		threads.emplace_back([&worker]() { worker->Run(); });
+	}
+
+	const std::size_t clients = options.mPublishers + options.mSubscribers;
+	while(shared.mReady < clients && !shared.mAbort && Clock::now() - connectStart < ConnectTimeout)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	const bool ready = shared.mReady == clients && !shared.mAbort;
+	if(ready)
+	{
+		std::printf("Connected %zu clients in %.1f ms, publishing for %lld s\n", clients,
+				std::chrono::duration<double, std::milli>(Clock::now() - connectStart).count(),
+				static_cast<long long>(options.mDuration.count()));
+		shared.mStart.store(Now(), std::memory_order_release);
+	}
+	else
+	{
+		std::fprintf(stderr, "Only %zu of %zu clients connected and subscribed\n", shared.mReady.load(), clients);
+		shared.mAbort = true;
+	}
+
+	for(auto& thread : threads)
+	{
+		thread.join();
+	}
+	if(brokerThread.joinable())
+	{
+		shared.mBrokerStop = true;
+		brokerThread.join();
+		brokerLoop->RemoveTimer(brokerStopTimer.get());
+	}
+	if(!ready)
+	{
+		return 1;
+	}
+
+	LatencyHistogram latency;
+	std::uint64_t published = 0;
+	std::uint64_t expected = 0;
+	std::uint64_t received = 0;
+	std::uint64_t completed = 0;
+	for(const auto& worker : workers)
+	{
+		latency.Merge(worker->mLatency);
+		published += worker->mPublished;
+		expected += worker->mExpected;
+		received += worker->mReceived;
+		completed += worker->mCompleted;
+	}
+
+	const double seconds = std::chrono::duration<double>(options.mDuration).count();
+	std::printf("Published  %12llu msg  %12.0f msg/s  (target %.0f msg/s)\n",
+			static_cast<unsigned long long>(published), published / seconds,
+			options.mPublishers * options.mRate);
+	if(options.mQoS != 0)
+	{
+		std::printf("Completed  %12llu msg  acknowledged by the broker\n", static_cast<unsigned long long>(completed));
+	}
+	std::printf("Delivered  %12llu msg  %12.0f msg/s  (%llu expected, %llu missing)\n",
+			static_cast<unsigned long long>(received), received / seconds,
+			static_cast<unsigned long long>(expected),
+			static_cast<unsigned long long>(expected > received ? expected - received : 0));
+	std::printf("End-to-end latency\n");
+	latency.Print();
+	if(shared.mAbort)
+	{
+		std::printf("Stopped early\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,277 @@
+#include "catch.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTBroker.h"
+#include "MQTT/MQTTClient.h"
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTParser.h"
+
+namespace {
+
+constexpr std::uint16_t BrokerPort = 18870;
+
+/**
+ * @brief Accepts connections and subscriptions, publishes on "a/b" after every SUBACK and UNSUBACK and drops the
+ * first connection right after its first publish. Keeps the topic and alias of the messages it receives.
+ */
+class ScriptedBroker : public Common::IStreamSocketServerHandler
+					 , public Common::IStreamSocketHandler
+{
+public:
+	explicit ScriptedBroker(EventLoop::EventLoop& ev)
+		: mServer(ev, this)
+	{
+		mServer.BindAndListen(BrokerPort);
+	}
+
+	Common::IStreamSocketHandler* OnIncomingConnection() override
+	{
+		mParser.Clear();
+		++mConnections;
+		return this;
+	}
+
+	void OnConnected() override
+	{
+	}
+
+	void OnDisconnect(Common::StreamSocket* /*conn*/) override
+	{
+	}
+
+	void OnIncomingData(Common::StreamSocket* conn, char* data, size_t len) override
+	{
+		mParser.Feed(data, len, [this, conn](const char* packet, std::size_t size) {
+			const MQTT::MQTTPacket incoming(packet, size, mVersion);
+			if(const auto* connect = incoming.GetConnectPacket())
+			{
+				mVersion = connect->GetVersion();
+				Send(conn, MQTT::MQTTConnackPacket(*connect, false, mConnackProperties).GetMessage());
+			}
+			else if(const auto* publish = incoming.GetPublishPacket())
+			{
+				mPublished.emplace_back(publish->GetTopicFilter(), publish->GetTopicAlias());
+			}
+			else if(const auto* subscribe = incoming.GetSubscribePacket())
+			{
+				const auto& filters = subscribe->GetTopicFilters();
+				mSubscribed.insert(mSubscribed.end(), filters.begin(), filters.end());
+				Send(conn, MQTT::MQTTSubackPacket(subscribe->GetPacketId(),
+						std::vector<std::uint8_t>(filters.size(), 0)).GetMessage());
+				Send(conn, MQTT::MQTTPublishPacket(0, "a/b", "message", 0).GetMessage());
+				if(mConnections == 1)
+				{
+					conn->Shutdown();
+					return false;
+				}
+			}
+			else if(const auto* unsubscribe = incoming.GetUnsubscribePacket())
+			{
+				const auto& filters = unsubscribe->GetTopicFilters();
+				mUnsubscribed.insert(mUnsubscribed.end(), filters.begin(), filters.end());
+				Send(conn, MQTT::MQTTUnsubackPacket(unsubscribe->GetPacketId()).GetMessage());
+				Send(conn, MQTT::MQTTPublishPacket(0, "a/b", "message", 0).GetMessage());
+			}
+			return true;
+		});
+	}
+
+	/// The limits sent to MQTT 5 clients
+	MQTT::MQTTProperties mConnackProperties;
+	int mConnections = 0;
+	std::vector<std::pair<std::string, std::uint16_t>> mPublished;
+	std::vector<std::string> mSubscribed;
+	std::vector<std::string> mUnsubscribed;
+
+private:
+	static void Send(Common::StreamSocket* conn, const std::vector<char>& message)
+	{
+		conn->Send(message.data(), message.size());
+	}
+
+	Common::StreamSocketServer mServer;
+	MQTT::MQTTParser mParser;
+	MQTT::MQTTVersion mVersion = MQTT::MQTTVersion::V311;
+};
+
+class Handler : public MQTT::IMQTTClientHandler
+{
+public:
+	void OnConnected() override
+	{
+		++mConnected;
+	}
+
+	void OnDisconnect(MQTT::MQTTClient* /*conn*/) override
+	{
+	}
+
+	void OnSubscribed(const std::string& /*topicFilter*/, std::uint8_t returnCode) override
+	{
+		mSubscribed += returnCode < MQTT::SubackFailure;
+	}
+
+	void OnPublish(std::string_view topic, Common::Span<const char> payload) override
+	{
+		++mUnmatched;
+		mMessages.emplace_back(topic, std::string(payload.data(), payload.size()));
+	}
+
+	int mConnected = 0;
+	int mSubscribed = 0;
+	int mUnmatched = 0;
+	std::vector<std::pair<std::string, std::string>> mMessages;
+};
+
+}
+
+TEST_CASE("MQTTClient subscribes to the filters of its callbacks again after a reconnect", "[mqtt]")
+{
+	EventLoop::EventLoop ev;
+	ScriptedBroker broker(ev);
+	Handler handler;
+	MQTT::MQTTClient client(ev, &handler);
+	client.Initialise("reconnect", {});
+	client.Connect("127.0.0.1", BrokerPort);
+
+	int received = 0;
+	bool subscribed = false;
+	bool reconnected = false;
+	bool unsubscribed = false;
+	EventLoop::EventLoop::Timer step(std::chrono::milliseconds(5), EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		if(!client.IsConnected())
+		{
+			// The handler doesn't subscribe again, the client has to
+			if(received == 1 && !reconnected)
+			{
+				reconnected = true;
+				client.Connect("127.0.0.1", BrokerPort);
+			}
+			return;
+		}
+		if(!subscribed)
+		{
+			subscribed = true;
+			client.Subscribe("a/+", [&received](std::string_view /*topic*/, Common::Span<const char> /*payload*/) {
+				++received;
+			});
+		}
+		if(received == 2 && !unsubscribed)
+		{
+			unsubscribed = true;
+			client.Unsubscribe("a/+");
+		}
+		if(handler.mUnmatched != 0)
+		{
+			ev.Stop();
+		}
+	});
+	EventLoop::EventLoop::Timer timeout(std::chrono::seconds(5), EventLoop::EventLoop::TimerType::Oneshot, [&ev]() {
+		ev.Stop();
+	});
+	ev.AddTimer(&step);
+	ev.AddTimer(&timeout);
+	ev.Run();
+	ev.RemoveTimer(&timeout);
+	ev.RemoveTimer(&step);
+
+	CHECK(broker.mConnections == 2);
+	CHECK(handler.mConnected == 2);
+	CHECK(broker.mSubscribed == std::vector<std::string>{"a/+", "a/+"});
+	CHECK(received == 2);
+	CHECK(broker.mUnsubscribed == std::vector<std::string>{"a/+"});
+	// Unsubscribed, the message the broker publishes after the UNSUBACK is no longer the callback's
+	CHECK(handler.mUnmatched == 1);
+}
+
+TEST_CASE("MQTTClient only sends a topic alias alone after a packet setting it was sent", "[mqtt]")
+{
+	EventLoop::EventLoop ev;
+	ScriptedBroker broker(ev);
+	broker.mConnackProperties.mMaximumPacketSize = 100;
+	broker.mConnackProperties.mTopicAliasMaximum = 4;
+	Handler handler;
+	MQTT::MQTTClient client(ev, &handler);
+	client.Initialise("alias", {}, MQTT::MQTTVersion::V5);
+	client.Connect("127.0.0.1", BrokerPort);
+
+	bool published = false;
+	EventLoop::EventLoop::Timer step(std::chrono::milliseconds(5), EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		if(client.IsConnected() && !published)
+		{
+			published = true;
+			// Over the broker's maximum, dropped before the alias is known to the broker
+			client.Publish("a/b", std::string(200, 'x'));
+			client.Publish("a/b", "first");
+			client.Publish("a/b", "second");
+		}
+		if(broker.mPublished.size() == 2)
+		{
+			ev.Stop();
+		}
+	});
+	EventLoop::EventLoop::Timer timeout(std::chrono::seconds(5), EventLoop::EventLoop::TimerType::Oneshot, [&ev]() {
+		ev.Stop();
+	});
+	ev.AddTimer(&step);
+	ev.AddTimer(&timeout);
+	ev.Run();
+	ev.RemoveTimer(&timeout);
+	ev.RemoveTimer(&step);
+
+	using Published = std::vector<std::pair<std::string, std::uint16_t>>;
+	CHECK(broker.mPublished == Published{{"a/b", 1}, {"", 1}});
+}
+
+TEST_CASE("MQTTBroker only sends a topic alias alone after a packet setting it was delivered", "[mqtt]")
+{
+	EventLoop::EventLoop ev;
+	MQTTBroker::MQTTBroker broker(ev);
+	broker.Initialise(BrokerPort);
+	Handler subscriberHandler;
+	Handler publisherHandler;
+	MQTT::MQTTClient subscriber(ev, &subscriberHandler);
+	MQTT::MQTTClient publisher(ev, &publisherHandler);
+	subscriber.Initialise("subscriber", {}, MQTT::MQTTVersion::V5);
+	subscriber.SetMaximumPacketSize(100);
+	publisher.Initialise("publisher", {}, MQTT::MQTTVersion::V5);
+	subscriber.Connect("127.0.0.1", BrokerPort);
+	publisher.Connect("127.0.0.1", BrokerPort);
+
+	bool subscribed = false;
+	bool published = false;
+	EventLoop::EventLoop::Timer step(std::chrono::milliseconds(5), EventLoop::EventLoop::TimerType::Repeating, [&]() {
+		if(subscriber.IsConnected() && !subscribed)
+		{
+			subscribed = true;
+			subscriber.Subscribe("a/b");
+		}
+		if(subscriberHandler.mSubscribed == 1 && publisher.IsConnected() && !published)
+		{
+			published = true;
+			// Over the subscriber's maximum, the broker drops it before the alias is known to the subscriber
+			publisher.Publish("a/b", std::string(200, 'x'));
+			publisher.Publish("a/b", "first");
+			publisher.Publish("a/b", "second");
+		}
+		if(subscriberHandler.mMessages.size() == 2 || (published && !subscriber.IsConnected()))
+		{
+			ev.Stop();
+		}
+	});
+	EventLoop::EventLoop::Timer timeout(std::chrono::seconds(5), EventLoop::EventLoop::TimerType::Oneshot, [&ev]() {
+		ev.Stop();
+	});
+	ev.AddTimer(&step);
+	ev.AddTimer(&timeout);
+	ev.Run();
+	ev.RemoveTimer(&timeout);
+	ev.RemoveTimer(&step);
+
+	CHECK(subscriber.IsConnected());
+	using Messages = std::vector<std::pair<std::string, std::string>>;
+	CHECK(subscriberHandler.mMessages == Messages{{"a/b", "first"}, {"a/b", "second"}});
+}
@@ -0,0 +1,833 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTPacket.h"
+#include "MQTT/MQTTPacketIdAllocator.h"
+#include "MQTT/MQTTParser.h"
+#include "MQTT/MQTTSpool.h"
+#include "MQTT/MQTTSubscriptionTrie.h"
+#include "MQTT/MQTTTopicTrie.h"
+
+namespace {
+
+constexpr std::size_t Iterations = 2000;
+
+std::string RandomTopic(std::mt19937& random, std::size_t maxLength)
+{
+	static const std::string Characters = "abcdefghijklmnopqrstuvwxyz0123456789_-/";
+	std::string topic(1 + random() % maxLength, 'a');
+	for(auto& c : topic)
+	{
+		c = Characters[random() % Characters.size()];
+	}
+	if(random() % 4 == 0)
+	{
+		// Some multi byte UTF-8 as well, "ü"
+		topic += "\xC3\xBC";
+	}
+	return topic;
+}
+
+std::string RandomPayload(std::mt19937& random)
+{
+	// Sizes around the Remaining Length byte boundaries are the interesting ones
+	static constexpr std::size_t Sizes[] = {0, 1, 100, 123, 124, 125, 126, 127, 128, 16380, 16383, 16384, 70000};
+	std::string payload(Sizes[random() % std::size(Sizes)], '\0');
+	for(auto& c : payload)
+	{
+		c = static_cast<char>(random());
+	}
+	return payload;
+}
+
+MQTT::MQTTPacket Parse(const std::vector<char>& message)
+{
+	return MQTT::MQTTPacket(message.data(), message.size());
+}
+
+/**
+ * @brief Every proper prefix of @p message is invalid, the lengths in it never make the parser read past the end
+ */
+void CheckTruncated(const std::vector<char>& message)
+{
+	for(std::size_t len = 0; len < message.size(); ++len)
+	{
+		// A copy of just the prefix so sanitizers catch reads past it
+		const std::vector<char> prefix(message.begin(), message.begin() + len);
+		REQUIRE_FALSE(MQTT::MQTTPacket(prefix.data(), prefix.size()).IsValid());
+	}
+}
+
+}
+
+TEST_CASE("CONNECT round trip", "[mqtt]")
+{
+	std::mt19937 random(1);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto keepAlive = static_cast<std::uint16_t>(random());
+		const std::string clientId = RandomTopic(random, 64);
+		const auto message = MQTT::MQTTConnectPacket(keepAlive, clientId, true).GetMessage();
+
+		const auto packet = Parse(message);
+		REQUIRE(packet.IsValid());
+		const auto* connect = packet.GetConnectPacket();
+		REQUIRE(connect != nullptr);
+		CHECK(connect->GetKeepAlive() == keepAlive);
+		CHECK(connect->GetClientID() == clientId);
+		CHECK(connect->IsCleanSessionRequest());
+		CHECK(connect->GetMessage() == message);
+	}
+	CheckTruncated(MQTT::MQTTConnectPacket(60, "client", true).GetMessage());
+}
+
+TEST_CASE("PUBLISH round trip", "[mqtt]")
+{
+	std::mt19937 random(2);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto packetId = static_cast<std::uint16_t>(random());
+		const int qos = random() % 3;
+		const std::string topic = RandomTopic(random, 200);
+		const std::string payload = RandomPayload(random);
+		const auto message = MQTT::MQTTPublishPacket(packetId, topic, payload, qos).GetMessage();
+		REQUIRE(message.size() == MQTT::MQTTPublishPacket::GetEncodedSize(topic.size(), payload.size(), qos));
+
+		const auto packet = Parse(message);
+		REQUIRE(packet.IsValid());
+		const auto* publish = packet.GetPublishPacket();
+		REQUIRE(publish != nullptr);
+		CHECK(publish->GetTopicFilter() == topic);
+		CHECK(publish->GetTopicPayload() == payload);
+		CHECK(publish->GetQoS() == qos);
+		CHECK(publish->GetPacketId() == (qos ? packetId : 0));
+		CHECK(publish->GetMessage() == message);
+
+		const MQTT::MQTTPublishView view(message.data(), message.size());
+		REQUIRE(view.IsValid());
+		CHECK(view.GetTopic() == topic);
+		CHECK(std::string(view.GetPayload().data(), view.GetPayload().size()) == payload);
+	}
+	CheckTruncated(MQTT::MQTTPublishPacket(1, "a/b", "payload", 1).GetMessage());
+}
+
+TEST_CASE("SUBSCRIBE and UNSUBSCRIBE round trip", "[mqtt]")
+{
+	std::mt19937 random(3);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto packetId = static_cast<std::uint16_t>(random());
+		const std::string filter = RandomTopic(random, 200);
+
+		const auto subscribeMessage = MQTT::MQTTSubscribePacket(packetId, filter).GetMessage();
+		const auto subscribePacket = Parse(subscribeMessage);
+		REQUIRE(subscribePacket.IsValid());
+		const auto* subscribe = subscribePacket.GetSubscribePacket();
+		REQUIRE(subscribe != nullptr);
+		CHECK(subscribe->GetPacketId() == packetId);
+		CHECK(subscribe->GetTopicFilters() == std::vector<std::string>{filter});
+		CHECK(subscribe->GetMessage() == subscribeMessage);
+
+		const auto unsubscribeMessage = MQTT::MQTTUnsubscribePacket(packetId, filter).GetMessage();
+		const auto unsubscribePacket = Parse(unsubscribeMessage);
+		REQUIRE(unsubscribePacket.IsValid());
+		const auto* unsubscribe = unsubscribePacket.GetUnsubscribePacket();
+		REQUIRE(unsubscribe != nullptr);
+		CHECK(unsubscribe->GetPacketId() == packetId);
+		CHECK(unsubscribe->GetTopicFilters() == std::vector<std::string>{filter});
+		CHECK(unsubscribe->GetMessage() == unsubscribeMessage);
+	}
+	CheckTruncated(MQTT::MQTTSubscribePacket(1, "a/#").GetMessage());
+	CheckTruncated(MQTT::MQTTUnsubscribePacket(1, "a/#").GetMessage());
+}
+
+TEST_CASE("SUBSCRIBE and UNSUBSCRIBE carry many topic filters", "[mqtt]")
+{
+	std::mt19937 random(8);
+	for(const auto version : {MQTT::MQTTVersion::V311, MQTT::MQTTVersion::V5})
+	{
+		for(std::size_t i = 0; i < Iterations / 10; ++i)
+		{
+			const auto packetId = static_cast<std::uint16_t>(random());
+			std::vector<std::string> filters(1 + random() % 50);
+			std::vector<std::uint8_t> codes;
+			for(auto& filter : filters)
+			{
+				filter = RandomTopic(random, 100);
+				codes.push_back(static_cast<std::uint8_t>(random() % 2 ? MQTT::SubackFailure : random() % 3));
+			}
+
+			const auto subscribeMessage = MQTT::MQTTSubscribePacket(packetId, filters, version).GetMessage();
+			const MQTT::MQTTPacket subscribe(subscribeMessage.data(), subscribeMessage.size(), version);
+			REQUIRE(subscribe.IsValid());
+			CHECK(subscribe.GetSubscribePacket()->GetTopicFilters() == filters);
+			CHECK(subscribe.GetSubscribePacket()->GetOptions() == std::vector<std::uint8_t>(filters.size(), 0));
+			CHECK(subscribe.GetSubscribePacket()->GetMessage() == subscribeMessage);
+
+			const auto unsubscribeMessage = MQTT::MQTTUnsubscribePacket(packetId, filters, version).GetMessage();
+			const MQTT::MQTTPacket unsubscribe(unsubscribeMessage.data(), unsubscribeMessage.size(), version);
+			REQUIRE(unsubscribe.IsValid());
+			CHECK(unsubscribe.GetUnsubscribePacket()->GetTopicFilters() == filters);
+			CHECK(unsubscribe.GetUnsubscribePacket()->GetMessage() == unsubscribeMessage);
+
+			const auto subackMessage = MQTT::MQTTSubackPacket(packetId, codes, version).GetMessage();
+			const MQTT::MQTTPacket suback(subackMessage.data(), subackMessage.size(), version);
+			REQUIRE(suback.IsValid());
+			CHECK(suback.GetSubAckPacket()->GetPacketId() == packetId);
+			CHECK(suback.GetSubAckPacket()->GetReturnCodes() == codes);
+
+			// Reason codes only exist in MQTT 5
+			const auto unsubackMessage = MQTT::MQTTUnsubackPacket(packetId, codes, version).GetMessage();
+			const MQTT::MQTTPacket unsuback(unsubackMessage.data(), unsubackMessage.size(), version);
+			REQUIRE(unsuback.IsValid());
+			CHECK(unsuback.GetUnSubAckPacket()->GetReasonCodes() ==
+					(version == MQTT::MQTTVersion::V5 ? codes : std::vector<std::uint8_t>()));
+		}
+	}
+	CheckTruncated(MQTT::MQTTSubscribePacket(1, std::vector<std::string>{"a/#", "b/+/c", "d"}).GetMessage());
+	CheckTruncated(MQTT::MQTTUnsubscribePacket(1, std::vector<std::string>{"a/#", "b/+/c", "d"}).GetMessage());
+
+	// Without any topic filter both are a protocol violation
+	CHECK_FALSE(Parse(MQTT::MQTTSubscribePacket(1, std::vector<std::string>()).GetMessage()).IsValid());
+	CHECK_FALSE(Parse(MQTT::MQTTUnsubscribePacket(1, std::vector<std::string>()).GetMessage()).IsValid());
+}
+
+TEST_CASE("Acknowledgement and header only packets round trip", "[mqtt]")
+{
+	std::mt19937 random(4);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto packetId = static_cast<std::uint16_t>(random());
+		const auto returnCode = static_cast<std::uint8_t>(random() % 2 ? MQTT::SubackFailure : random() % 3);
+
+		const auto suback = Parse(MQTT::MakeMessage(MQTT::MQTTSubackPacket(packetId, returnCode)));
+		REQUIRE(suback.IsValid());
+		REQUIRE(suback.GetSubAckPacket() != nullptr);
+		CHECK(suback.GetSubAckPacket()->GetPacketId() == packetId);
+		CHECK(suback.GetSubAckPacket()->GetReturnCodes() == std::vector<std::uint8_t>{returnCode});
+
+		const auto unsuback = Parse(MQTT::MakeMessage(MQTT::MQTTUnsubackPacket(packetId)));
+		REQUIRE(unsuback.IsValid());
+		REQUIRE(unsuback.GetUnSubAckPacket() != nullptr);
+		CHECK(unsuback.GetUnSubAckPacket()->GetPacketId() == packetId);
+	}
+
+	const auto connack = Parse(MQTT::MakeMessage(MQTT::MQTTConnackPacket(false)));
+	CHECK(connack.IsValid());
+	CHECK(connack.mFixedHeader.mType == MQTT::MQTTPacketType::CONNACK);
+	CHECK(connack.GetConnectPacket() == nullptr);
+
+	for(const auto& message : {MQTT::MakeMessage(MQTT::MQTTPingRequestPacket()),
+			MQTT::MakeMessage(MQTT::MQTTPingResponsePacket()),
+			MQTT::MakeMessage(MQTT::MQTTDisconnectPacket())})
+	{
+		CHECK(Parse(message).IsValid());
+		CheckTruncated(message);
+	}
+	CheckTruncated(MQTT::MakeMessage(MQTT::MQTTSubackPacket(1, 0)));
+	CheckTruncated(MQTT::MakeMessage(MQTT::MQTTUnsubackPacket(1)));
+	CheckTruncated(MQTT::MakeMessage(MQTT::MQTTConnackPacket(true)));
+}
+
+TEST_CASE("PUBACK, PUBREC, PUBREL and PUBCOMP round trip", "[mqtt]")
+{
+	std::mt19937 random(9);
+	for(const auto type : {MQTT::MQTTPacketType::PUBACK, MQTT::MQTTPacketType::PUBREC, MQTT::MQTTPacketType::PUBREL,
+			MQTT::MQTTPacketType::PUBCOMP})
+	{
+		for(std::size_t i = 0; i < Iterations; ++i)
+		{
+			const auto packetId = static_cast<std::uint16_t>(random());
+			const auto message = MQTT::MQTTPublishAckPacket(type, packetId).GetMessage();
+			REQUIRE(message.size() == 4);
+			const auto packet = Parse(message);
+			REQUIRE(packet.IsValid());
+			const auto* ack = packet.GetPublishAckPacket();
+			REQUIRE(ack != nullptr);
+			CHECK(ack->GetType() == type);
+			CHECK(ack->GetPacketId() == packetId);
+			CHECK(ack->GetReasonCode() == 0);
+
+			// A reason code is only sent when it is not success, and only with MQTT 5
+			const auto refused = MQTT::MQTTPublishAckPacket(type, packetId, 0x87).GetMessage();
+			const MQTT::MQTTPacket refusedPacket(refused.data(), refused.size(), MQTT::MQTTVersion::V5);
+			REQUIRE(refusedPacket.IsValid());
+			CHECK(refusedPacket.GetPublishAckPacket()->GetReasonCode() == 0x87);
+			CHECK_FALSE(Parse(refused).IsValid());
+		}
+		CheckTruncated(MQTT::MQTTPublishAckPacket(type, 1).GetMessage());
+	}
+	CHECK((static_cast<std::uint8_t>(MQTT::MQTTPublishAckPacket(MQTT::MQTTPacketType::PUBREL, 1).GetMessage()[0]) & 0x0F) ==
+			0b0010);
+}
+
+TEST_CASE("MQTTPacketIdAllocator hands out every identifier once", "[mqtt]")
+{
+	MQTT::MQTTPacketIdAllocator allocator;
+	// The lowest free identifier, never 0
+	CHECK(allocator.Allocate() == 1);
+	CHECK(allocator.Allocate() == 2);
+	allocator.Release(1);
+	CHECK(allocator.Allocate() == 1);
+	allocator.Release(0);
+	allocator.Release(500);
+	CHECK(allocator.GetInUse() == 2);
+
+	allocator.Clear();
+	std::vector<bool> seen(65536, false);
+	for(std::size_t i = 0; i < 65535; ++i)
+	{
+		const auto id = allocator.Allocate();
+		REQUIRE(id != 0);
+		REQUIRE_FALSE(seen[id]);
+		seen[id] = true;
+	}
+	CHECK(allocator.Allocate() == 0);
+	CHECK(allocator.GetInUse() == 65535);
+
+	// Freed identifiers anywhere in the range are found again
+	std::mt19937 random(10);
+	std::vector<std::uint16_t> released;
+	for(std::size_t i = 0; i < 1000; ++i)
+	{
+		const auto id = static_cast<std::uint16_t>(1 + random() % 65535);
+		if(allocator.IsInUse(id))
+		{
+			allocator.Release(id);
+			released.push_back(id);
+		}
+	}
+	std::sort(released.begin(), released.end());
+	for(const auto id : released)
+	{
+		CHECK(allocator.Allocate() == id);
+	}
+	CHECK(allocator.Allocate() == 0);
+}
+
+TEST_CASE("MQTTTopicTrie matches topics against wildcard filters", "[mqtt]")
+{
+	MQTT::MQTTTopicTrie<std::string> trie;
+	for(const char* filter : {"sport/tennis/player1", "sport/tennis/player1/#", "sport/#", "sport/+", "+/+", "#",
+			"+/tennis/#", "/+", "sport//x", "$SYS/#", "$SYS/+/load"})
+	{
+		trie.Insert(filter) = filter;
+	}
+	CHECK(trie.GetSize() == 11);
+
+	std::vector<std::string> all;
+	trie.ForEach([&all](const std::string& filter, const std::string& value) {
+		CHECK(filter == value);
+		all.push_back(filter);
+	});
+	std::sort(all.begin(), all.end());
+	CHECK(all == std::vector<std::string>{"#", "$SYS/#", "$SYS/+/load", "+/+", "+/tennis/#", "/+", "sport/#", "sport/+",
+			"sport//x", "sport/tennis/player1", "sport/tennis/player1/#"});
+
+	const auto matches = [&trie](std::string_view topic) {
+		std::vector<std::string> found;
+		trie.Match(topic, [&found](const std::string& filter) { found.push_back(filter); });
+		std::sort(found.begin(), found.end());
+		return found;
+	};
+	using Filters = std::vector<std::string>;
+	// '#' also matches its parent level (MQTT 3.1.1 section 4.7.1.2)
+	CHECK(matches("sport/tennis/player1") == Filters{"#", "+/tennis/#", "sport/#", "sport/tennis/player1",
+			"sport/tennis/player1/#"});
+	CHECK(matches("sport") == Filters{"#", "sport/#"});
+	CHECK(matches("sport/") == Filters{"#", "+/+", "sport/#", "sport/+"});
+	CHECK(matches("sport//x") == Filters{"#", "sport/#", "sport//x"});
+	CHECK(matches("/finance") == Filters{"#", "+/+", "/+"});
+	CHECK(matches("other/tennis") == Filters{"#", "+/+", "+/tennis/#"});
+	// Wildcards in the first level don't match '$' topics
+	CHECK(matches("$SYS/broker/load") == Filters{"$SYS/#", "$SYS/+/load"});
+	CHECK(matches("$SYS") == Filters{"$SYS/#"});
+
+	REQUIRE(trie.Find("sport/+") != nullptr);
+	CHECK(*trie.Find("sport/+") == "sport/+");
+	CHECK(trie.Find("sport/tennis") == nullptr);
+	CHECK(trie.Erase("sport/#"));
+	CHECK_FALSE(trie.Erase("sport/#"));
+	CHECK_FALSE(trie.Erase("sport/tennis"));
+	CHECK(trie.Erase("#"));
+	CHECK(matches("sport") == Filters{});
+	CHECK(matches("sport/tennis/player1") == Filters{"+/tennis/#", "sport/tennis/player1", "sport/tennis/player1/#"});
+
+	for(const char* filter : {"sport/tennis/player1", "sport/tennis/player1/#", "sport/+", "+/+", "+/tennis/#", "/+",
+			"sport//x", "$SYS/#", "$SYS/+/load"})
+	{
+		CHECK(trie.Erase(filter));
+	}
+	CHECK(trie.IsEmpty());
+	CHECK(matches("sport/tennis/player1") == Filters{});
+}
+
+TEST_CASE("MQTTSubscriptionTrie matches subscribers and forgets what was unsubscribed", "[mqtt]")
+{
+	using Trie = MQTT::MQTTSubscriptionTrie<int>;
+	Trie trie;
+	// Handles by client and filter, they must not move while subscribed
+	std::map<std::pair<int, std::string>, Trie::Handle> handles;
+	const auto subscribe = [&](int client, const std::string& filter) {
+		auto& handle = handles.try_emplace({client, filter}).first->second;
+		REQUIRE_FALSE(handle.IsSubscribed());
+		trie.Subscribe(filter, client, handle);
+	};
+	const auto unsubscribe = [&](int client, const std::string& filter) {
+		const auto handle = handles.find({client, filter});
+		REQUIRE(handle != handles.end());
+		trie.Unsubscribe(handle->second);
+		CHECK_FALSE(handle->second.IsSubscribed());
+		handles.erase(handle);
+	};
+	const auto matches = [&trie](std::string_view topic) {
+		std::vector<int> found;
+		trie.Match(topic, [&found](int client) { found.push_back(client); });
+		std::sort(found.begin(), found.end());
+		return found;
+	};
+	using Clients = std::vector<int>;
+
+	subscribe(1, "sport/tennis/player1");
+	subscribe(2, "sport/tennis/player1");
+	subscribe(3, "sport/tennis/player1");
+	subscribe(1, "sport/#");
+	subscribe(2, "sport/+/player1");
+	subscribe(4, "#");
+	subscribe(5, "$SYS/+/load");
+	CHECK(trie.GetSize() == 7);
+	CHECK(matches("sport/tennis/player1") == Clients{1, 1, 2, 2, 3, 4});
+	CHECK(matches("sport") == Clients{1, 4});
+	CHECK(matches("sport/tennis") == Clients{1, 4});
+	CHECK(matches("unknown/levels") == Clients{4});
+	CHECK(matches("$SYS/broker/load") == Clients{5});
+
+	// The last subscriber of a filter takes the place of the one removed, its handle has to follow
+	unsubscribe(1, "sport/tennis/player1");
+	CHECK(matches("sport/tennis/player1") == Clients{1, 2, 2, 3, 4});
+	unsubscribe(3, "sport/tennis/player1");
+	unsubscribe(2, "sport/tennis/player1");
+	CHECK(matches("sport/tennis/player1") == Clients{1, 2, 4});
+	unsubscribe(1, "sport/#");
+	unsubscribe(2, "sport/+/player1");
+	unsubscribe(4, "#");
+	unsubscribe(5, "$SYS/+/load");
+	CHECK(trie.IsEmpty());
+	// Levels nobody uses are forgotten
+	CHECK(trie.GetTokenCount() == 0);
+	CHECK(matches("sport/tennis/player1") == Clients{});
+
+	// Against matching every filter in turn
+	const auto topicMatches = [](const std::string& filter, const std::string& topic) {
+		if(topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+		{
+			return false;
+		}
+		std::size_t f = 0;
+		std::size_t t = 0;
+		while(true)
+		{
+			const std::size_t fEnd = std::min(filter.find('/', f), filter.size());
+			const std::string level = filter.substr(f, fEnd - f);
+			if(level == "#")
+			{
+				return true;
+			}
+			if(t > topic.size())
+			{
+				return false;
+			}
+			const std::size_t tEnd = std::min(topic.find('/', t), topic.size());
+			if(level != "+" && level != topic.substr(t, tEnd - t))
+			{
+				return false;
+			}
+			f = fEnd + 1;
+			t = tEnd + 1;
+			if(f > filter.size())
+			{
+				return t > topic.size();
+			}
+		}
+	};
+	std::mt19937 random(11);
+	const auto randomName = [&random](bool wildcards) {
+		static const char* const Levels[] = {"a", "b", "", "$c", "+", "#"};
+		std::string name;
+		const std::size_t depth = 1 + random() % 3;
+		for(std::size_t i = 0; i < depth; ++i)
+		{
+			const char* level = Levels[random() % (wildcards ? 6 : 4)];
+			name += (i == 0 ? "" : "/") + std::string(level);
+			if(level[0] == '#')
+			{
+				break;
+			}
+		}
+		// Names have at least one character
+		return name.empty() ? std::string("a") : name;
+	};
+	for(int round = 0; round < 2000; ++round)
+	{
+		const int client = random() % 8;
+		const std::string filter = randomName(true);
+		if(handles.count({client, filter}) != 0)
+		{
+			unsubscribe(client, filter);
+		}
+		else
+		{
+			subscribe(client, filter);
+		}
+		const std::string topic = randomName(false);
+		Clients expected;
+		for(const auto& handle : handles)
+		{
+			if(topicMatches(handle.first.second, topic))
+			{
+				expected.push_back(handle.first.first);
+			}
+		}
+		std::sort(expected.begin(), expected.end());
+		REQUIRE(matches(topic) == expected);
+	}
+	while(!handles.empty())
+	{
+		const auto first = handles.begin()->first;
+		unsubscribe(first.first, first.second);
+	}
+	CHECK(trie.IsEmpty());
+	CHECK(trie.GetTokenCount() == 0);
+}
+
+TEST_CASE("MQTTSpool keeps messages until they are released, across reopening", "[mqtt]")
+{
+	const std::string path = "/tmp/mqtt-spool-test-" + std::to_string(::getpid());
+	::unlink(path.c_str());
+	struct Message
+	{
+		std::string mTopic;
+		std::string mPayload;
+		int mQoS;
+		std::uint64_t mRecord;
+	};
+	const auto readAll = [](MQTT::MQTTSpool& spool) {
+		std::vector<Message> messages;
+		while(spool.ReadNext([&messages](std::string_view topic, std::string_view payload, int qos, std::uint64_t record) {
+			messages.push_back({std::string(topic), std::string(payload), qos, record});
+		}))
+		{}
+		return messages;
+	};
+
+	{
+		MQTT::MQTTSpool spool(path, 4096);
+		CHECK(spool.IsEmpty());
+		CHECK(spool.Append("a/b", "first", 1));
+		CHECK(spool.Append("a/c", "", 2));
+		CHECK(spool.Append("a/d", std::string(100, 'x'), 0));
+		// Too large for what is left
+		CHECK_FALSE(spool.Append("a/e", std::string(4096, 'x'), 1));
+		CHECK(spool.GetCount() == 3);
+
+		const auto messages = readAll(spool);
+		REQUIRE(messages.size() == 3);
+		CHECK(messages[0].mTopic == "a/b");
+		CHECK(messages[0].mPayload == "first");
+		CHECK(messages[0].mQoS == 1);
+		CHECK(messages[1].mPayload.empty());
+		CHECK(messages[1].mQoS == 2);
+		CHECK(messages[2].mPayload == std::string(100, 'x'));
+		CHECK_FALSE(spool.HasUnread());
+
+		// Released out of order, the first one still holds the start
+		spool.Release(messages[1].mRecord);
+		CHECK(spool.GetCount() == 3);
+		spool.Release(messages[0].mRecord);
+		CHECK(spool.GetCount() == 1);
+	}
+
+	{
+		// The message not released is read again
+		MQTT::MQTTSpool spool(path, 1);
+		CHECK(spool.GetCapacity() == 4096);
+		CHECK(spool.GetCount() == 1);
+		auto messages = readAll(spool);
+		REQUIRE(messages.size() == 1);
+		CHECK(messages[0].mTopic == "a/d");
+		spool.Release(messages[0].mRecord);
+		CHECK(spool.IsEmpty());
+
+		// Once empty the whole file is available again
+		for(int i = 0; i < 30; ++i)
+		{
+			REQUIRE(spool.Append("a/b", std::string(100, 'y'), 1));
+		}
+		messages = readAll(spool);
+		CHECK(messages.size() == 30);
+		for(const auto& message : messages)
+		{
+			spool.Release(message.mRecord);
+		}
+		CHECK(spool.IsEmpty());
+		CHECK(spool.Append("a/b", "after", 1));
+		CHECK(spool.Append("a/b", "cut short", 1));
+	}
+
+	{
+		// A message cut short by a crash while it was appended is dropped, its length points past the end
+		const int fd = ::open(path.c_str(), O_RDWR);
+		REQUIRE(fd != -1);
+		const std::uint32_t length = 1000;
+		// Behind the 32 byte file header and the first message
+		const std::size_t second = 32 + MQTT::MQTTSpool::RecordHeaderSize + 3 + 5;
+		CHECK(::pwrite(fd, &length, sizeof(length), second) == sizeof(length));
+		::close(fd);
+
+		MQTT::MQTTSpool spool(path);
+		const auto messages = readAll(spool);
+		REQUIRE(messages.size() == 1);
+		CHECK(messages[0].mPayload == "after");
+	}
+
+	{
+		// A QoS only a corrupt or foreign file can have drops the message like a bad length
+		const int fd = ::open(path.c_str(), O_RDWR);
+		REQUIRE(fd != -1);
+		const std::uint8_t qos = 3;
+		CHECK(::pwrite(fd, &qos, sizeof(qos), 32 + 4) == sizeof(qos));
+		::close(fd);
+
+		MQTT::MQTTSpool spool(path);
+		CHECK(spool.IsEmpty());
+		CHECK(readAll(spool).empty());
+	}
+	::unlink(path.c_str());
+}
+
+TEST_CASE("Lengths inside a packet are checked against the packet size", "[mqtt]")
+{
+	// Each packet claims a string longer than what follows it
+	auto connect = MQTT::MQTTConnectPacket(60, "client", true).GetMessage();
+	connect[2 + 10 + 1] = 100;
+	CHECK_FALSE(Parse(connect).IsValid());
+
+	auto publish = MQTT::MQTTPublishPacket(1, "a/b", "", 0).GetMessage();
+	publish[3] = 4;
+	CHECK_FALSE(Parse(publish).IsValid());
+
+	auto subscribe = MQTT::MQTTSubscribePacket(1, "a/b").GetMessage();
+	subscribe[5] = 3 + 1;
+	CHECK_FALSE(Parse(subscribe).IsValid());
+
+	auto unsubscribe = MQTT::MQTTUnsubscribePacket(1, "a/b").GetMessage();
+	unsubscribe[4] = static_cast<char>(0xFF);
+	CHECK_FALSE(Parse(unsubscribe).IsValid());
+
+	// Reserved packet types, and a PUBLISH with QoS 3
+	CHECK_FALSE(Parse({0x00, 0x00}).IsValid());
+	CHECK_FALSE(Parse({static_cast<char>(0xF0), 0x00}).IsValid());
+	auto qos3 = MQTT::MQTTPublishPacket(1, "a/b", "x", 1).GetMessage();
+	qos3[0] |= 0x06;
+	CHECK_FALSE(Parse(qos3).IsValid());
+}
+
+TEST_CASE("Random bytes never parse past their end", "[mqtt]")
+{
+	std::mt19937 random(5);
+	std::size_t valid = 0;
+	for(std::size_t i = 0; i < 100 * Iterations; ++i)
+	{
+		std::vector<char> bytes(random() % 32);
+		for(auto& c : bytes)
+		{
+			c = static_cast<char>(random());
+		}
+		if(!bytes.empty() && random() % 2)
+		{
+			// Short Remaining Length so the packet types are hit, not just oversized packets
+			bytes[1 % bytes.size()] = static_cast<char>(random() % bytes.size());
+		}
+		const auto packet = Parse(bytes);
+		if(packet.IsValid())
+		{
+			++valid;
+			CHECK(packet.mFixedHeader.GetPacketSize() <= bytes.size());
+		}
+	}
+	CHECK(valid > 0);
+}
+
+TEST_CASE("MQTTParser splits a stream the same for any read size", "[mqtt]")
+{
+	std::mt19937 random(6);
+	std::vector<char> stream;
+	std::vector<std::vector<char>> messages;
+	for(std::size_t i = 0; i < 200; ++i)
+	{
+		switch(random() % 4)
+		{
+			case 0: messages.push_back(MQTT::MQTTPublishPacket(i, RandomTopic(random, 50), RandomPayload(random), i % 3).GetMessage()); break;
+			case 1: messages.push_back(MQTT::MQTTSubscribePacket(i, RandomTopic(random, 50)).GetMessage()); break;
+			case 2: messages.push_back(MQTT::MQTTConnectPacket(i, RandomTopic(random, 20), true).GetMessage()); break;
+			default: messages.push_back(MQTT::MakeMessage(MQTT::MQTTPingRequestPacket())); break;
+		}
+		stream.insert(stream.end(), messages.back().begin(), messages.back().end());
+	}
+
+	for(const std::size_t chunk : {1, 2, 3, 5, 127, 128, 1500, 65536})
+	{
+		MQTT::MQTTParser parser;
+		std::size_t index = 0;
+		std::size_t mismatches = 0;
+		for(std::size_t offset = 0; offset < stream.size(); offset += chunk)
+		{
+			const std::size_t len = std::min(chunk, stream.size() - offset);
+			const auto status = parser.Feed(stream.data() + offset, len, [&](const char* packet, std::size_t size) {
+				mismatches += index >= messages.size() || !std::equal(packet, packet + size,
+						messages[index].begin(), messages[index].end()) || !MQTT::MQTTPacket(packet, size).IsValid();
+				++index;
+				return true;
+			});
+			REQUIRE(status == Common::DecodeStatus::Incomplete);
+		}
+		CHECK(index == messages.size());
+		CHECK(mismatches == 0);
+		CHECK(parser.GetBufferedSize() == 0);
+	}
+}
+
+TEST_CASE("MQTT 5 properties round trip", "[mqtt]")
+{
+	std::mt19937 random(7);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		MQTT::MQTTProperties properties;
+		if(random() % 2)
+		{
+			properties.mSessionExpiryInterval = static_cast<std::uint32_t>(random());
+		}
+		if(random() % 2)
+		{
+			properties.mReceiveMaximum = static_cast<std::uint16_t>(1 + random() % 65535);
+		}
+		if(random() % 2)
+		{
+			properties.mMaximumPacketSize = static_cast<std::uint32_t>(1 + random() % 0xFFFFFFFE);
+		}
+		if(random() % 2)
+		{
+			properties.mTopicAliasMaximum = static_cast<std::uint16_t>(random());
+		}
+		const auto keepAlive = static_cast<std::uint16_t>(random());
+		const std::string clientId = RandomTopic(random, 64);
+		const auto message = MQTT::MQTTConnectPacket(keepAlive, clientId, true, MQTT::MQTTVersion::V5, properties)
+			.GetMessage();
+
+		const auto packet = Parse(message);
+		REQUIRE(packet.IsValid());
+		const auto* connect = packet.GetConnectPacket();
+		REQUIRE(connect != nullptr);
+		CHECK(connect->GetVersion() == MQTT::MQTTVersion::V5);
+		CHECK(connect->GetKeepAlive() == keepAlive);
+		CHECK(connect->GetClientID() == clientId);
+		CHECK(connect->GetProperties().mSessionExpiryInterval == properties.mSessionExpiryInterval);
+		CHECK(connect->GetProperties().mReceiveMaximum == properties.mReceiveMaximum);
+		CHECK(connect->GetProperties().mMaximumPacketSize == properties.mMaximumPacketSize);
+		CHECK(connect->GetProperties().mTopicAliasMaximum == properties.mTopicAliasMaximum);
+		CHECK(connect->GetMessage() == message);
+		CheckTruncated(message);
+
+		const auto connackMessage = MQTT::MQTTConnackPacket(true, MQTT::MQTTVersion::V5, properties).GetMessage();
+		const MQTT::MQTTPacket connackPacket(connackMessage.data(), connackMessage.size(), MQTT::MQTTVersion::V5);
+		REQUIRE(connackPacket.IsValid());
+		const auto* connack = connackPacket.GetConnackPacket();
+		REQUIRE(connack != nullptr);
+		CHECK(connack->IsSessionPresent());
+		CHECK(connack->GetReturnCode() == 0);
+		CHECK(connack->GetProperties().mMaximumPacketSize == properties.mMaximumPacketSize);
+		CHECK(connack->GetMessage() == connackMessage);
+	}
+}
+
+TEST_CASE("MQTT 5 properties are checked", "[mqtt]")
+{
+	std::size_t size = 0;
+	MQTT::MQTTProperties properties;
+
+	const char empty[] = {0x00};
+	CHECK(properties.Decode(empty, sizeof(empty), size));
+	CHECK(size == 1);
+
+	// Properties not kept are skipped: user property, content type and a subscription identifier
+	const char skipped[] = {0x11, 0x26, 0x00, 0x01, 'a', 0x00, 0x01, 'b', 0x03, 0x00, 0x01, 'c', 0x0B, static_cast<char>(0x80), 0x01,
+		0x23, 0x00, 0x05};
+	REQUIRE(properties.Decode(skipped, sizeof(skipped), size));
+	CHECK(size == sizeof(skipped));
+	CHECK(properties.mTopicAlias == 5);
+
+	const char repeated[] = {0x06, 0x23, 0x00, 0x01, 0x23, 0x00, 0x02};
+	CHECK_FALSE(properties.Decode(repeated, sizeof(repeated), size));
+	const char zeroAlias[] = {0x03, 0x23, 0x00, 0x00};
+	CHECK_FALSE(properties.Decode(zeroAlias, sizeof(zeroAlias), size));
+	const char unknown[] = {0x02, 0x7F, 0x00};
+	CHECK_FALSE(properties.Decode(unknown, sizeof(unknown), size));
+	const char overlong[] = {0x05, 0x23, 0x00, 0x01};
+	CHECK_FALSE(properties.Decode(overlong, sizeof(overlong), size));
+	const char truncatedString[] = {0x03, 0x03, 0x00, 0x05};
+	CHECK_FALSE(properties.Decode(truncatedString, sizeof(truncatedString), size));
+}
+
+TEST_CASE("MQTT 5 packets round trip", "[mqtt]")
+{
+	constexpr auto V5 = MQTT::MQTTVersion::V5;
+	const auto parse = [](const std::vector<char>& message) {
+		return MQTT::MQTTPacket(message.data(), message.size(), V5);
+	};
+	std::mt19937 random(8);
+	for(std::size_t i = 0; i < Iterations; ++i)
+	{
+		const auto packetId = static_cast<std::uint16_t>(random());
+		const int qos = random() % 3;
+		const auto alias = static_cast<std::uint16_t>(random() % 3 ? 0 : 1 + random() % 100);
+		// With an alias the topic is left out after the first message
+		const std::string topic = alias && random() % 2 ? std::string() : RandomTopic(random, 100);
+		const std::string payload = RandomPayload(random);
+
+		const auto message = MQTT::MQTTPublishPacket(packetId, topic, payload, qos, V5, alias).GetMessage();
+		REQUIRE(message.size() == MQTT::MQTTPublishPacket::GetEncodedSize(topic.size(), payload.size(), qos, V5, alias));
+		const MQTT::MQTTPublishView view(message.data(), message.size(), V5);
+		REQUIRE(view.IsValid());
+		CHECK(view.GetTopic() == topic);
+		CHECK(view.GetTopicAlias() == alias);
+		CHECK(std::string(view.GetPayload().data(), view.GetPayload().size()) == payload);
+		const auto packet = parse(message);
+		REQUIRE(packet.IsValid());
+		CHECK(packet.GetPublishPacket()->GetMessage() == message);
+
+		const std::string filter = RandomTopic(random, 100);
+		const auto subscribe = parse(MQTT::MQTTSubscribePacket(packetId, filter, V5).GetMessage());
+		REQUIRE(subscribe.IsValid());
+		CHECK(subscribe.GetSubscribePacket()->GetTopicFilters() == std::vector<std::string>{filter});
+		const auto unsubscribe = parse(MQTT::MQTTUnsubscribePacket(packetId, filter, V5).GetMessage());
+		REQUIRE(unsubscribe.IsValid());
+		CHECK(unsubscribe.GetUnsubscribePacket()->GetTopicFilters() == std::vector<std::string>{filter});
+		const auto suback = parse(MQTT::MQTTSubackPacket(packetId, 0, V5).GetMessage());
+		REQUIRE(suback.IsValid());
+		CHECK(suback.GetSubAckPacket()->GetPacketId() == packetId);
+		const auto unsuback = parse(MQTT::MQTTUnsubackPacket(packetId, V5).GetMessage());
+		REQUIRE(unsuback.IsValid());
+		CHECK(unsuback.GetUnSubAckPacket()->GetPacketId() == packetId);
+	}
+
+	// An empty topic without an alias, and a 3.1.1 PUBLISH read as MQTT 5, have nothing to go by
+	const auto noTopic = MQTT::MQTTPublishPacket(1, "", "x", 0, V5).GetMessage();
+	CHECK_FALSE(MQTT::MQTTPublishView(noTopic.data(), noTopic.size(), V5).IsValid());
+	const auto v311 = MQTT::MQTTPublishPacket(1, "a/b", "", 0).GetMessage();
+	CHECK_FALSE(MQTT::MQTTPublishView(v311.data(), v311.size(), V5).IsValid());
+}
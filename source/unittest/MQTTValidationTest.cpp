@@ -0,0 +1,207 @@
+#include "catch.hpp"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTT/MQTTValidation.h"
+
+namespace {
+
+struct Kernel
+{
+	const char* mName;
+	MQTT::StringValidator mValidate;
+};
+
+/**
+ * @brief The scalar reference and every vector kernel this CPU can run
+ */
+std::vector<Kernel> AvailableKernels()
+{
+	std::vector<Kernel> kernels{{"scalar", MQTT::ValidateStringScalar}};
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1"))
+	{
+		kernels.push_back({"sse4.1", MQTT::ValidateStringSse41});
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernels.push_back({"avx2", MQTT::ValidateStringAvx2});
+	}
+#endif
+	return kernels;
+}
+
+/**
+ * @brief Check @p value with every kernel
+ */
+void CheckAll(const std::string& value, bool rejectWildcards, bool expected)
+{
+	for(const auto& kernel : AvailableKernels())
+	{
+		INFO(kernel.mName << " on " << value.size() << " bytes");
+		CHECK(kernel.mValidate(value.data(), value.size(), rejectWildcards) == expected);
+	}
+}
+
+void AppendCodePoint(std::string& out, std::uint32_t cp)
+{
+	if(cp < 0x80)
+	{
+		out += static_cast<char>(cp);
+	}
+	else if(cp < 0x800)
+	{
+		out += static_cast<char>(0xC0 | cp >> 6);
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else if(cp < 0x10000)
+	{
+		out += static_cast<char>(0xE0 | cp >> 12);
+		out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	else
+	{
+		out += static_cast<char>(0xF0 | cp >> 18);
+		out += static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+		out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+		out += static_cast<char>(0x80 | (cp & 0x3F));
+	}
+}
+
+/**
+ * @brief Valid UTF-8 of about @p length bytes, levels separated by '/', about a third of it non ASCII
+ */
+std::string RandomText(std::mt19937_64& random, std::size_t length)
+{
+	std::uniform_int_distribution<std::uint32_t> ascii('a', 'z');
+	std::uniform_int_distribution<std::uint32_t> twoByte(0x80, 0x7FF);
+	std::uniform_int_distribution<std::uint32_t> threeByte(0xE000, 0xFFFF);
+	std::uniform_int_distribution<std::uint32_t> fourByte(0x10000, 0x10FFFF);
+	std::string text;
+	while(text.size() < length)
+	{
+		switch(random() % 10)
+		{
+			case 0: text += '/'; break;
+			case 1: AppendCodePoint(text, twoByte(random)); break;
+			case 2: AppendCodePoint(text, threeByte(random)); break;
+			case 3: AppendCodePoint(text, fourByte(random)); break;
+			default: AppendCodePoint(text, ascii(random)); break;
+		}
+	}
+	return text;
+}
+
+}
+
+TEST_CASE("String validators reject malformed UTF-8 anywhere in a block", "[mqtt]")
+{
+	// Surrogate, overlong '/' in two and three bytes, above U+10FFFF, stray continuations, bytes never valid
+	for(const char* bad : {"\xED\xA0\x80", "\xC0\xAF", "\xE0\x80\xAF", "\xF4\x90\x80\x80", "\x80", "\xBF", "\xF5\x80\x80\x80",
+			"\xFF"})
+	{
+		// Around the 16 and 32 byte block edges of the SSE4.1 and AVX2 kernels
+		for(const std::size_t prefix : {0, 1, 13, 14, 15, 16, 29, 30, 31, 32})
+		{
+			CheckAll(std::string(prefix, 'a') + bad + "bc", false, false);
+		}
+	}
+
+	// The code points next to the excluded ranges are fine
+	for(const char* good : {"\xC2\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xF4\x8F\xBF\xBF", "\xF0\x90\x80\x80"})
+	{
+		for(const std::size_t prefix : {0, 14, 15, 30, 31})
+		{
+			CheckAll(std::string(prefix, 'a') + good + "b", true, true);
+		}
+	}
+
+	// Sequences crossing the block edges are fine whole, and malformed when cut there or followed by ASCII
+	for(const std::string sequence : {"\xC3\xBC", "\xE2\x82\xAC", "\xF0\x9F\x98\x80"})
+	{
+		for(const std::size_t prefix : {13, 14, 15, 29, 30, 31})
+		{
+			const std::string text(prefix, 'a');
+			CheckAll(text + sequence + "b", false, true);
+			for(std::size_t cut = 1; cut < sequence.size(); ++cut)
+			{
+				CheckAll(text + sequence.substr(0, cut), false, false);
+				CheckAll(text + sequence.substr(0, cut) + "b", false, false);
+			}
+		}
+	}
+}
+
+TEST_CASE("String validators reject U+0000 and wildcards when asked to", "[mqtt]")
+{
+	for(const std::size_t prefix : {0, 15, 16, 31, 32})
+	{
+		const std::string text(prefix, 'a');
+		CheckAll(text + std::string(1, '\0') + "b", false, false);
+		CheckAll(text + "+b", true, false);
+		CheckAll(text + "#", true, false);
+		CheckAll(text + "+b", false, true);
+		CheckAll(text + "#", false, true);
+	}
+
+	CHECK(MQTT::IsValidTopicName("sport/tennis"));
+	CHECK_FALSE(MQTT::IsValidTopicName(""));
+	CHECK_FALSE(MQTT::IsValidTopicName("sport/+"));
+	CHECK_FALSE(MQTT::IsValidTopicName("sport/#"));
+	CHECK_FALSE(MQTT::IsValidTopicName(std::string_view("a\0b", 3)));
+	CHECK_FALSE(MQTT::IsValidUtf8String(std::string_view("a\0b", 3)));
+}
+
+TEST_CASE("IsValidTopicFilter only allows wildcards as whole levels, '#' as the last one", "[mqtt]")
+{
+	for(const char* valid : {"+", "#", "a/+/#", "+/+", "/#", "a/+", "sport/tennis/#", "a//b"})
+	{
+		INFO(valid);
+		CHECK(MQTT::IsValidTopicFilter(valid));
+	}
+	for(const char* invalid : {"", "a+", "#/a", "a/#/b", "a#", "+a", "a/b#", "a/++", "##"})
+	{
+		INFO(invalid);
+		CHECK_FALSE(MQTT::IsValidTopicFilter(invalid));
+	}
+}
+
+TEST_CASE("Every kernel the CPU supports agrees with the scalar validator", "[mqtt]")
+{
+	// Bytes that break UTF-8 or MQTT rules in every way when put in the right place
+	static constexpr std::uint8_t Interesting[] = {0x00, '+', '#', 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1,
+		0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF};
+	const auto kernels = AvailableKernels();
+	std::mt19937_64 random(7);
+	std::size_t invalid = 0;
+	std::size_t mismatches = 0;
+	for(std::size_t i = 0; i < 100000; ++i)
+	{
+		std::string value = RandomText(random, 1 + random() % 100);
+		for(std::size_t mutations = random() % 3; mutations != 0; --mutations)
+		{
+			value[random() % value.size()] = static_cast<char>(Interesting[random() % sizeof(Interesting)]);
+		}
+		if(random() % 4 == 0)
+		{
+			// Cut within a sequence
+			value.resize(random() % value.size() + 1);
+		}
+
+		const bool rejectWildcards = random() % 2;
+		const bool expected = MQTT::ValidateStringScalar(value.data(), value.size(), rejectWildcards);
+		invalid += !expected;
+		for(const auto& kernel : kernels)
+		{
+			mismatches += kernel.mValidate(value.data(), value.size(), rejectWildcards) != expected;
+		}
+	}
+	CHECK(mismatches == 0);
+	// Both outcomes are covered
+	CHECK(invalid > 10000);
+	CHECK(invalid < 90000);
+}
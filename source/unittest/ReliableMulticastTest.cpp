@@ -0,0 +1,67 @@
+#include "catch.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Common/ReliableMulticast.h"
+
+namespace {
+
+constexpr const char* Group = "239.2.2.3";
+constexpr std::uint16_t Port = 18871;
+
+class Handler : public Common::IReliableMulticastHandler
+{
+public:
+	void OnMessage(Common::ReliableMulticastReceiver* /*receiver*/, uint64_t sequence, const char* data,
+			std::size_t len) override
+	{
+		mSequences.push_back(sequence);
+		mMessages.emplace_back(data, len);
+	}
+
+	std::vector<uint64_t> mSequences;
+	std::vector<std::string> mMessages;
+};
+
+std::string DataDatagram(uint64_t sequence, const std::string& message)
+{
+	std::string datagram(Common::ReliableMulticastProtocol::HeaderSize, '\0');
+	Common::ReliableMulticastProtocol::WriteHeader(datagram.data(), Common::ReliableMulticastProtocol::Type::Data,
+			sequence);
+	return datagram + message;
+}
+
+}
+
+TEST_CASE("ReliableMulticastReceiver drops Data it can't buffer before picking the sender", "[common]")
+{
+	EventLoop::EventLoop ev;
+	Handler handler;
+	// The last slot of the smallest window, an oversized message there would run past the buffer
+	Common::ReliableMulticastReceiver receiver(ev, &handler, Group, Port, nullptr, 4);
+
+	Common::IUDPSocketHandler noHandler;
+	Common::UDPSocket sender(ev, &noHandler);
+	sender.SetMulticastTtl(0);
+	sender.SetMulticastLoop(true);
+	const Common::UDPEndpoint group(Group, Port);
+	// The sender starts at 1, a 0 would sync the receiver one before it
+	for(const auto& datagram : {DataDatagram(0, "stray"), DataDatagram(1, "first"),
+			DataDatagram(3, std::string(Common::ReliableMulticastProtocol::MaxMessageSize + 1, 'x')),
+			DataDatagram(2, "second")})
+	{
+		sender.Send(datagram.data(), datagram.size(), group);
+	}
+
+	EventLoop::EventLoop::Timer stop(std::chrono::milliseconds(200), EventLoop::EventLoop::TimerType::Oneshot,
+			[&ev]() { ev.Stop(); });
+	ev.AddTimer(&stop);
+	ev.Run();
+	ev.RemoveTimer(&stop);
+
+	CHECK(handler.mSequences == std::vector<uint64_t>{1, 2});
+	CHECK(handler.mMessages == std::vector<std::string>{"first", "second"});
+	CHECK(receiver.GetNextSequence() == 3);
+}
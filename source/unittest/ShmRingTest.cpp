@@ -0,0 +1,118 @@
+#include "catch.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Common/ShmRing.h"
+
+namespace {
+
+constexpr std::size_t MessageSize = 100;
+
+bool WriteSequence(Common::ShmRing& ring, std::uint32_t sequence)
+{
+	char message[MessageSize] = {};
+	std::memcpy(message, &sequence, sizeof(sequence));
+	return ring.TryWrite(message, sizeof(message));
+}
+
+std::vector<std::uint32_t> ReadSequences(Common::ShmRing& ring)
+{
+	std::vector<std::uint32_t> sequences;
+	ring.Read([&sequences](const char* data, std::size_t len) {
+		REQUIRE(len == MessageSize);
+		std::uint32_t sequence;
+		std::memcpy(&sequence, data, sizeof(sequence));
+		sequences.push_back(sequence);
+	});
+	return sequences;
+}
+
+}
+
+TEST_CASE("ShmRing keeps messages in order across the end of the ring", "[common]")
+{
+	Common::ShmRing ring(4096);
+	std::uint32_t written = 0;
+	std::uint32_t read = 0;
+	for(std::size_t round = 0; round < 20; ++round)
+	{
+		while(WriteSequence(ring, written))
+		{
+			++written;
+		}
+		for(const auto sequence : ReadSequences(ring))
+		{
+			REQUIRE(sequence == read);
+			++read;
+		}
+		REQUIRE(read == written);
+	}
+	REQUIRE(ring.IsEmpty());
+	REQUIRE_FALSE(ring.TryWrite(nullptr, ring.GetMaxMessageSize() + 1));
+}
+
+TEST_CASE("A producer attaching to a wrapped ring doesn't overwrite unread messages", "[common]")
+{
+	Common::ShmRing ring(4096);
+	std::uint32_t written = 0;
+	// Far past the capacity, then leave some messages unread
+	for(; written < 100; ++written)
+	{
+		REQUIRE(WriteSequence(ring, written));
+		REQUIRE(ReadSequences(ring).size() == 1);
+	}
+	for(; written < 120; ++written)
+	{
+		REQUIRE(WriteSequence(ring, written));
+	}
+
+	Common::ShmRing producer(::dup(ring.GetMemoryFd()), ::dup(ring.GetNotifyFd()));
+	while(WriteSequence(producer, written))
+	{
+		++written;
+	}
+	REQUIRE(written - 100 <= ring.GetCapacity() / MessageSize);
+
+	const auto sequences = ReadSequences(ring);
+	REQUIRE(sequences.size() == written - 100);
+	for(std::size_t i = 0; i < sequences.size(); ++i)
+	{
+		REQUIRE(sequences[i] == 100 + i);
+	}
+}
+
+TEST_CASE("A corrupt record length breaks the ring instead of being read", "[common]")
+{
+	Common::ShmRing ring(4096);
+	REQUIRE(WriteSequence(ring, 0));
+	const std::string message(MessageSize, 'm');
+	REQUIRE(ring.TryWrite(message.data(), message.size()));
+
+	// As another process with the fd could, without knowing the layout, find the message and its length before it
+	struct stat info;
+	REQUIRE(::fstat(ring.GetMemoryFd(), &info) == 0);
+	void* mapped = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.GetMemoryFd(), 0);
+	REQUIRE(mapped != MAP_FAILED);
+	char* memory = static_cast<char*>(mapped);
+	const std::string contents(memory, info.st_size);
+	const auto position = contents.find(message);
+	REQUIRE(position != std::string::npos);
+	const std::uint32_t length = 0x7FFFFFFF;
+	std::memcpy(memory + position - sizeof(length), &length, sizeof(length));
+	::munmap(mapped, info.st_size);
+
+	std::vector<std::size_t> lengths;
+	const auto read = [&ring, &lengths]() {
+		return ring.Read([&lengths](const char* /*data*/, std::size_t len) { lengths.push_back(len); });
+	};
+	CHECK(read() == 1);
+	CHECK(ring.IsBroken());
+	CHECK(read() == 0);
+	CHECK(lengths == std::vector<std::size_t>{MessageSize});
+}